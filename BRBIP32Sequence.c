@@ -27,6 +27,8 @@
 #include "BRBase58.h"
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define BIP32_SEED_KEY "DigiByte seed"
 #define BIP32_XPRV     "\x04\x88\xAD\xE4"
@@ -154,6 +156,82 @@ size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint
     return (! pubKey || sizeof(BRECPoint) <= pubKeyLen) ? sizeof(BRECPoint) : 0;
 }
 
+// returns the extended public key for path N(m/0H/chain), for deriving the keys in that chain with BRBIP32PubKeyRange()
+BRMasterPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain)
+{
+    BRMasterPubKey chainPubKey = mpk;
+    UInt160 hash;
+    
+    assert(memcmp(&mpk, &BR_MASTER_PUBKEY_NONE, sizeof(mpk)) != 0);
+    BRHash160(&hash, mpk.pubKey, sizeof(mpk.pubKey));
+    chainPubKey.fingerPrint = hash.u32[0];
+    _CKDpub((BRECPoint *)chainPubKey.pubKey, &chainPubKey.chainCode, chain); // path N(m/0H/chain)
+    return chainPubKey;
+}
+
+typedef struct {
+    BRECPoint *pubKeys;
+    BRMasterPubKey chainPubKey;
+    uint32_t index;
+    size_t count;
+    size_t next; // next unclaimed position in pubKeys
+    pthread_mutex_t lock;
+} _BRBIP32PubKeyBatch;
+
+static void *_BRBIP32PubKeyBatchWorker(void *arg)
+{
+    _BRBIP32PubKeyBatch *batch = arg;
+    UInt256 chainCode;
+    size_t i, end;
+    
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next;
+        end = (i + BIP32_PUBKEY_BATCH_CHUNK < batch->count) ? i + BIP32_PUBKEY_BATCH_CHUNK : batch->count;
+        batch->next = end;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= end) break;
+        
+        for (; i < end; i++) {
+            chainCode = batch->chainPubKey.chainCode;
+            batch->pubKeys[i] = *(BRECPoint *)batch->chainPubKey.pubKey;
+            _CKDpub(&batch->pubKeys[i], &chainCode, batch->index + (uint32_t)i); // index'th key in chain
+        }
+    }
+    
+    var_clean(&chainCode);
+    return NULL;
+}
+
+// writes the public keys for paths N(m/0H/chain/index) through N(m/0H/chain/index + count - 1) to pubKeys, given the
+// chain's extended public key from BRBIP32ChainPubKey(), on up to threadCount threads (0 for one per cpu)
+void BRBIP32PubKeyRange(BRECPoint pubKeys[], BRMasterPubKey chainPubKey, uint32_t index, size_t count,
+                        size_t threadCount)
+{
+    _BRBIP32PubKeyBatch batch = { .pubKeys = pubKeys, .chainPubKey = chainPubKey, .index = index, .count = count };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i, maxThreads = (count + BIP32_PUBKEY_BATCH_CHUNK - 1)/BIP32_PUBKEY_BATCH_CHUNK;
+    pthread_t threads[BIP32_PUBKEY_BATCH_MAX_THREADS];
+    
+    assert(pubKeys != NULL || count == 0);
+    assert(memcmp(&chainPubKey, &BR_MASTER_PUBKEY_NONE, sizeof(chainPubKey)) != 0);
+    if (threadCount == 0) threadCount = (cpus > 0) ? (size_t)cpus : 1;
+    if (threadCount > BIP32_PUBKEY_BATCH_MAX_THREADS) threadCount = BIP32_PUBKEY_BATCH_MAX_THREADS;
+    if (threadCount > maxThreads) threadCount = maxThreads;
+    pthread_mutex_init(&batch.lock, NULL);
+    
+    // the calling thread is one of the workers, so only threadCount - 1 extra threads are started
+    for (i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, _BRBIP32PubKeyBatchWorker, &batch) != 0) break;
+    }
+    
+    threadCount = i;
+    _BRBIP32PubKeyBatchWorker(&batch);
+    for (i = 1; i < threadCount; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&batch.lock);
+    var_clean(&batch.chainPubKey.chainCode);
+}
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index)
 {
@@ -45,6 +45,9 @@ extern "C" {
 #define SEQUENCE_EXTERNAL_CHAIN     0
 #define SEQUENCE_INTERNAL_CHAIN     1
 
+#define BIP32_PUBKEY_BATCH_CHUNK       32 // number of keys a BRBIP32PubKeyRange() worker derives at a time
+#define BIP32_PUBKEY_BATCH_MAX_THREADS 16 // upper limit for threads used by a single BRBIP32PubKeyRange() call
+
 typedef struct {
     uint32_t fingerPrint;
     UInt256 chainCode;
@@ -61,6 +64,14 @@ BRMasterPubKey BRBIP32MasterPubKey(const void *seed, size_t seedLen);
 // returns number of bytes written, or pubKeyLen needed if pubKey is NULL
 size_t BRBIP32PubKey(uint8_t *pubKey, size_t pubKeyLen, BRMasterPubKey mpk, uint32_t chain, uint32_t index);
 
+// returns the extended public key for path N(m/0H/chain), for deriving the keys in that chain with BRBIP32PubKeyRange()
+BRMasterPubKey BRBIP32ChainPubKey(BRMasterPubKey mpk, uint32_t chain);
+
+// writes the public keys for paths N(m/0H/chain/index) through N(m/0H/chain/index + count - 1) to pubKeys, given the
+// chain's extended public key from BRBIP32ChainPubKey(), on up to threadCount threads (0 for one per cpu)
+void BRBIP32PubKeyRange(BRECPoint pubKeys[], BRMasterPubKey chainPubKey, uint32_t index, size_t count,
+                        size_t threadCount);
+
 // sets the private key for path m/0H/chain/index to key
 void BRBIP32PrivKey(BRKey *key, const void *seed, size_t seedLen, uint32_t chain, uint32_t index);
 
@@ -0,0 +1,358 @@
+//
+//  BRCoinSelection.c
+//  DigiByte
+//
+//  Copyright © 2026 DigiByte Foundation NZ Limited. All rights reserved.
+//
+
+#include "BRCoinSelection.h"
+#include "BRTransaction.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+typedef struct {
+    int64_t value; // amount, or effective value for branch and bound
+    size_t i; // candidate position
+} _BRCoinRef;
+
+// largest value first, then by candidate position so equal values keep the caller's order
+static int _BRCoinRefCompare(const void *a, const void *b)
+{
+    const _BRCoinRef *r1 = a, *r2 = b;
+
+    if (r1->value != r2->value) return (r1->value > r2->value) ? -1 : 1;
+    return (r1->i > r2->i) - (r1->i < r2->i);
+}
+
+// xorshift64*, only used to make the knapsack search repeatable for a given seed
+static uint64_t _BRCoinRand(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state*0x2545f4914f6cdd1dULL;
+}
+
+inline static int _BRCoinIsEligible(const BRCoinCandidate *c, const BRCoinSelectionParams *params)
+{
+    return (! c->isAsset && c->amount > 0 && c->depth >= params->minDepth);
+}
+
+// fills in result for count inputs worth amount with a total vsize of inputsVSize, adding a change output if the
+// excess over the outputs and fee is more than params->minChange, otherwise leaving the excess to the fee
+// returns 1 if the selection covers the outputs and fee, 0 if it doesn't, or -1 if it's over params->maxVSize
+static int _BRCoinSelectionFinish(const BRCoinSelectionParams *params, uint64_t amount, size_t inputsVSize,
+                                  size_t count, BRCoinSelection *result)
+{
+    size_t vsize = params->baseVSize + inputsVSize;
+    uint64_t fee = BRCoinSelectionFee(params->feePerKb, vsize),
+             changeFee = BRCoinSelectionFee(params->feePerKb, vsize + params->changeVSize);
+
+    *result = (BRCoinSelection) { count, amount, fee, 0, vsize };
+
+    if (amount >= params->amount + changeFee && amount - (params->amount + changeFee) > params->minChange) {
+        result->fee = changeFee;
+        result->change = amount - (params->amount + changeFee);
+        result->vsize += params->changeVSize;
+    }
+    else if (amount >= params->amount + fee) result->fee = amount - params->amount;
+    else return 0;
+
+    return (result->vsize <= params->maxVSize) ? 1 : -1;
+}
+
+// fee for a transaction of the given vsize: feePerKb rounded up to the nearest 100 satoshi, and no less than the
+// standard TX_FEE_PER_KB fee
+uint64_t BRCoinSelectionFee(uint64_t feePerKb, size_t vsize)
+{
+    uint64_t standardFee = vsize*TX_FEE_PER_KB/1000, fee = (((vsize*feePerKb/1000) + 99)/100)*100;
+
+    return (fee > standardFee) ? fee : standardFee;
+}
+
+// selects the largest candidates first, using as few inputs as possible
+// on failure, selected and result hold the largest selection that fits within params->maxVSize
+int BRCoinSelectLargestFirst(const BRCoinCandidate candidates[], size_t candidatesCount,
+                             const BRCoinSelectionParams *params, size_t selected[], BRCoinSelection *result)
+{
+    _BRCoinRef *refs = malloc((candidatesCount + 1)*sizeof(*refs));
+    uint64_t amount = 0, total = 0;
+    size_t i, n = 0, refsCount = 0, inputsVSize = 0, totalVSize = 0;
+    int r = 0, tooLarge = 0;
+
+    assert(candidates != NULL || candidatesCount == 0);
+    assert(params != NULL);
+    assert(selected != NULL);
+    assert(result != NULL);
+    assert(refs != NULL);
+
+    for (i = 0; i < candidatesCount; i++) {
+        if (_BRCoinIsEligible(&candidates[i], params)) refs[refsCount++] = (_BRCoinRef) { candidates[i].amount, i };
+    }
+
+    qsort(refs, refsCount, sizeof(*refs), _BRCoinRefCompare);
+
+    for (i = 0; i < refsCount && r != 1; i++) {
+        const BRCoinCandidate *c = &candidates[refs[i].i];
+
+        if (params->baseVSize + inputsVSize + c->inputVSize + params->changeVSize > params->maxVSize) {
+            tooLarge = 1;
+            break;
+        }
+
+        amount += c->amount;
+        inputsVSize += c->inputVSize;
+        selected[n++] = refs[i].i;
+        r = _BRCoinSelectionFinish(params, amount, inputsVSize, n, result);
+    }
+
+    if (n == 0) r = _BRCoinSelectionFinish(params, 0, 0, 0, result);
+
+    if (r != 1 && tooLarge) { // check if all the candidates together would have been enough
+        for (i = 0; i < refsCount; i++) total += candidates[refs[i].i].amount;
+        for (i = 0; i < refsCount; i++) totalVSize += candidates[refs[i].i].inputVSize;
+        if (total >= params->amount + BRCoinSelectionFee(params->feePerKb, params->baseVSize + totalVSize)) r = -1;
+    }
+
+    free(refs);
+    return r;
+}
+
+// searches for a selection that needs no change output, wasting at most params->minChange on the fee
+int BRCoinSelectBranchAndBound(const BRCoinCandidate candidates[], size_t candidatesCount,
+                               const BRCoinSelectionParams *params, size_t selected[], BRCoinSelection *result)
+{
+    // the search runs on effective values, the amount less the input's share of a fee that's linear in vsize, which
+    // is never more than the actual fee, and at most 100 satoshi plus one per input under it
+    uint64_t rate = (params->feePerKb > TX_FEE_PER_KB) ? params->feePerKb : TX_FEE_PER_KB;
+    _BRCoinRef *refs = malloc((candidatesCount + 1)*sizeof(*refs));
+    size_t *cur = malloc((candidatesCount + 1)*sizeof(*cur)), curCount = 0, refsCount = 0, i, tries;
+    int64_t target = (int64_t)(params->amount + params->baseVSize*rate/1000), curValue = 0, available = 0,
+            slack = (int64_t)(params->minChange + params->changeVSize*rate/1000 + 200); // most a changeless tx is over
+    uint64_t curAmount = 0, bestExcess = UINT64_MAX;
+    size_t curVSize = 0;
+    BRCoinSelection sel;
+    int backtrack, r = 0;
+
+    assert(candidates != NULL || candidatesCount == 0);
+    assert(params != NULL);
+    assert(selected != NULL);
+    assert(result != NULL);
+    assert(refs != NULL && cur != NULL);
+
+    for (i = 0; i < candidatesCount; i++) {
+        int64_t value = (int64_t)candidates[i].amount - (int64_t)(candidates[i].inputVSize*rate/1000);
+
+        if (! _BRCoinIsEligible(&candidates[i], params) || value <= 0) continue; // skip uneconomical candidates
+        refs[refsCount++] = (_BRCoinRef) { value, i };
+        available += value;
+    }
+
+    qsort(refs, refsCount, sizeof(*refs), _BRCoinRefCompare);
+
+    // depth first search, including each candidate before excluding it, largest effective value first
+    for (tries = 0, i = 0; tries < COIN_SELECTION_BNB_MAX_TRIES; tries++, i++) {
+        backtrack = 0;
+
+        if (curValue + available < target ||
+            curValue > target + slack + (int64_t)curCount) backtrack = 1; // can't be changeless from here
+        else if (curValue >= target) { // curValue can only overshoot from here, so check this selection and go back
+            if (_BRCoinSelectionFinish(params, curAmount, curVSize, curCount, &sel) == 1 && sel.change == 0 &&
+                sel.fee - BRCoinSelectionFee(params->feePerKb, sel.vsize) < bestExcess) {
+                bestExcess = sel.fee - BRCoinSelectionFee(params->feePerKb, sel.vsize);
+                for (size_t j = 0; j < curCount; j++) selected[j] = refs[cur[j]].i;
+                *result = sel;
+                r = 1;
+                if (bestExcess == 0) break;
+            }
+
+            backtrack = 1;
+        }
+
+        if (backtrack) {
+            if (curCount == 0) break; // the whole tree has been searched
+
+            // give back the excluded candidates after the last included one, then exclude that one instead
+            for (i--; i > cur[curCount - 1]; i--) available += refs[i].value;
+            curCount--;
+            curValue -= refs[i].value;
+            curAmount -= candidates[refs[i].i].amount;
+            curVSize -= candidates[refs[i].i].inputVSize;
+        }
+        else {
+            available -= refs[i].value;
+
+            // excluding a candidate and then including one of the same value gives a selection already tried
+            if (curCount == 0 || i - 1 == cur[curCount - 1] || refs[i].value != refs[i - 1].value ||
+                candidates[refs[i].i].inputVSize != candidates[refs[i - 1].i].inputVSize) {
+                cur[curCount++] = i;
+                curValue += refs[i].value;
+                curAmount += candidates[refs[i].i].amount;
+                curVSize += candidates[refs[i].i].inputVSize;
+            }
+        }
+    }
+
+    free(cur);
+    free(refs);
+    return r;
+}
+
+// finds a subset of values, sorted largest first, whose sum is at least target and as close to it as possible, by
+// including random values and then filling up in order, keeping the best of COIN_SELECTION_KNAPSACK_ROUNDS attempts
+// writes the chosen subset to best and returns its sum, or the sum of all values if none are closer
+static uint64_t _BRCoinApproximateBestSubset(const _BRCoinRef refs[], size_t count, uint64_t total, uint64_t target,
+                                             uint64_t *rng, uint8_t best[])
+{
+    uint8_t *included = malloc(count + 1);
+    uint64_t bestTotal = total, sum;
+    int reached;
+
+    assert(included != NULL);
+    memset(best, 1, count);
+
+    for (size_t round = 0; round < COIN_SELECTION_KNAPSACK_ROUNDS && bestTotal != target; round++) {
+        memset(included, 0, count);
+        sum = 0;
+        reached = 0;
+
+        for (int pass = 0; pass < 2 && ! reached; pass++) {
+            for (size_t i = 0; i < count; i++) {
+                // the first pass picks values at random, the second adds the rest in order until target is reached
+                if (pass == 0 ? (_BRCoinRand(rng) & 1) == 0 : included[i]) continue;
+                sum += (uint64_t)refs[i].value;
+                included[i] = 1;
+
+                if (sum >= target) {
+                    reached = 1;
+
+                    if (sum < bestTotal) {
+                        bestTotal = sum;
+                        memcpy(best, included, count);
+                    }
+
+                    sum -= (uint64_t)refs[i].value;
+                    included[i] = 0;
+                }
+            }
+        }
+    }
+
+    free(included);
+    return bestTotal;
+}
+
+// picks candidates worth at least target, or target + params->minChange when that's closer than an exact match
+// returns the number of candidates written to selected, or 0 if the eligible candidates don't add up to target
+static size_t _BRCoinKnapsack(const BRCoinCandidate candidates[], const size_t eligible[], size_t eligibleCount,
+                              const BRCoinSelectionParams *params, uint64_t target, uint64_t *rng, size_t selected[])
+{
+    _BRCoinRef *lower = malloc((eligibleCount + 1)*sizeof(*lower));
+    uint8_t *best = malloc(eligibleCount + 1);
+    uint64_t totalLower = 0, bestTotal;
+    size_t i, n = 0, lowerCount = 0, larger = SIZE_MAX;
+
+    assert(lower != NULL && best != NULL);
+
+    for (i = 0; i < eligibleCount; i++) {
+        const BRCoinCandidate *c = &candidates[eligible[i]];
+
+        if (c->amount == target) { // exact match
+            selected[n++] = eligible[i];
+            break;
+        }
+        else if (c->amount < target + params->minChange) {
+            lower[lowerCount++] = (_BRCoinRef) { (int64_t)c->amount, eligible[i] };
+            totalLower += c->amount;
+        }
+        else if (larger == SIZE_MAX || c->amount < candidates[larger].amount) larger = eligible[i];
+    }
+
+    if (n == 0 && totalLower == target) { // all the smaller candidates together are an exact match
+        for (i = 0; i < lowerCount; i++) selected[n++] = lower[i].i;
+    }
+    else if (n == 0 && totalLower < target) { // the smallest larger candidate is the only option
+        if (larger != SIZE_MAX) selected[n++] = larger;
+    }
+    else if (n == 0) {
+        qsort(lower, lowerCount, sizeof(*lower), _BRCoinRefCompare);
+        bestTotal = _BRCoinApproximateBestSubset(lower, lowerCount, totalLower, target, rng, best);
+
+        if (bestTotal != target && totalLower >= target + params->minChange) { // aim for a usable change output
+            bestTotal = _BRCoinApproximateBestSubset(lower, lowerCount, totalLower, target + params->minChange, rng,
+                                                     best);
+        }
+
+        // use the larger candidate if the subset isn't exact and would leave dust change, or is worth more
+        if (larger != SIZE_MAX &&
+            ((bestTotal != target && bestTotal < target + params->minChange) ||
+             candidates[larger].amount <= bestTotal)) {
+            selected[n++] = larger;
+        }
+        else {
+            for (i = 0; i < lowerCount; i++) if (best[i]) selected[n++] = lower[i].i;
+        }
+    }
+
+    free(best);
+    free(lower);
+    return n;
+}
+
+// randomized subset sum that aims for params->amount plus fee, or that plus params->minChange if change is needed,
+// falling back to the smallest single candidate that covers the target
+int BRCoinSelectKnapsack(const BRCoinCandidate candidates[], size_t candidatesCount,
+                         const BRCoinSelectionParams *params, size_t selected[], BRCoinSelection *result)
+{
+    size_t *eligible = malloc((candidatesCount + 1)*sizeof(*eligible)), eligibleCount = 0, i, j, n, inputsVSize;
+    uint64_t rng = (params->seed) ? params->seed : 0x9e3779b97f4a7c15ULL, amount,
+             fee = BRCoinSelectionFee(params->feePerKb, params->baseVSize + params->changeVSize);
+    int r = 0;
+
+    assert(candidates != NULL || candidatesCount == 0);
+    assert(params != NULL);
+    assert(selected != NULL);
+    assert(result != NULL);
+    assert(eligible != NULL);
+
+    for (i = 0; i < candidatesCount; i++) {
+        if (_BRCoinIsEligible(&candidates[i], params)) eligible[eligibleCount++] = i;
+    }
+
+    for (i = eligibleCount; i > 1; i--) { // shuffle, so equal amounts aren't always picked in the same order
+        size_t k = eligible[i - 1];
+
+        j = _BRCoinRand(&rng) % i;
+        eligible[i - 1] = eligible[j];
+        eligible[j] = k;
+    }
+
+    // the fee depends on the inputs chosen, so raise the target to the fee of each selection until it's covered
+    for (;;) {
+        n = _BRCoinKnapsack(candidates, eligible, eligibleCount, params, params->amount + fee, &rng, selected);
+        if (n == 0) break;
+
+        for (i = 0, amount = 0, inputsVSize = 0; i < n; i++) {
+            amount += candidates[selected[i]].amount;
+            inputsVSize += candidates[selected[i]].inputVSize;
+        }
+
+        r = _BRCoinSelectionFinish(params, amount, inputsVSize, n, result);
+        if (r != 0) break;
+        fee = BRCoinSelectionFee(params->feePerKb, params->baseVSize + inputsVSize + params->changeVSize); // goes up
+    }
+
+    free(eligible);
+    return r;
+}
+
+// tries branch and bound, then knapsack, then largest first
+// on failure, selected and result are those of the largest first selection
+int BRCoinSelect(const BRCoinCandidate candidates[], size_t candidatesCount, const BRCoinSelectionParams *params,
+                 size_t selected[], BRCoinSelection *result)
+{
+    if (BRCoinSelectBranchAndBound(candidates, candidatesCount, params, selected, result) == 1) return 1;
+    if (BRCoinSelectKnapsack(candidates, candidatesCount, params, selected, result) == 1) return 1;
+    return BRCoinSelectLargestFirst(candidates, candidatesCount, params, selected, result);
+}
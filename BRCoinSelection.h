@@ -0,0 +1,83 @@
+//
+//  BRCoinSelection.h
+//  DigiByte
+//
+//  Copyright © 2026 DigiByte Foundation NZ Limited. All rights reserved.
+//
+
+#ifndef BRCoinSelection_h
+#define BRCoinSelection_h
+
+#include <stddef.h>
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// coin selection picks which unspent outputs fund a transaction, working on a candidate vector that the caller builds
+// once, so no transaction has to be resized while inputs are chosen
+
+#define COIN_SELECTION_BNB_MAX_TRIES      100000 // branch and bound gives up after visiting this many nodes
+#define COIN_SELECTION_KNAPSACK_ROUNDS    1000   // random subsets tried by the knapsack search
+
+typedef struct {
+    uint64_t amount; // output amount
+    size_t inputVSize; // estimated vsize the output adds to a transaction when spent
+    uint32_t depth; // number of confirmations, 0 if unconfirmed
+    int isAsset; // output carries digiassets and is never selected
+} BRCoinCandidate;
+
+typedef struct {
+    uint64_t amount; // total amount of the transaction outputs
+    size_t baseVSize; // estimated vsize of the transaction without inputs or a change output
+    size_t changeVSize; // vsize a change output adds
+    uint64_t feePerKb;
+    uint64_t minChange; // no change output is made for less than this, it goes to the fee instead
+    size_t maxVSize; // largest transaction vsize allowed
+    uint32_t minDepth; // candidates with fewer confirmations aren't selected
+    uint64_t seed; // seed for the knapsack search, the same seed always gives the same selection
+} BRCoinSelectionParams;
+
+typedef struct {
+    size_t count; // number of candidates selected
+    uint64_t amount; // total amount of the selected candidates
+    uint64_t fee;
+    uint64_t change; // change output amount, 0 if the transaction has no change output
+    size_t vsize; // estimated transaction vsize, including any change output
+} BRCoinSelection;
+
+// fee for a transaction of the given vsize: feePerKb rounded up to the nearest 100 satoshi, and no less than the
+// standard TX_FEE_PER_KB fee
+uint64_t BRCoinSelectionFee(uint64_t feePerKb, size_t vsize);
+
+// each selection function writes the positions of the selected candidates to selected, which must have room for
+// candidatesCount entries, and describes the transaction in result
+// returns 1 on success, 0 if the candidates can't cover params->amount plus fee, or -1 if they can, but not within
+// params->maxVSize
+
+// selects the largest candidates first, using as few inputs as possible
+// on failure, selected and result hold the largest selection that fits within params->maxVSize
+int BRCoinSelectLargestFirst(const BRCoinCandidate candidates[], size_t candidatesCount,
+                             const BRCoinSelectionParams *params, size_t selected[], BRCoinSelection *result);
+
+// searches for a selection that needs no change output, leaving as little as possible over the fee, and never enough
+// for a change output of more than params->minChange
+int BRCoinSelectBranchAndBound(const BRCoinCandidate candidates[], size_t candidatesCount,
+                               const BRCoinSelectionParams *params, size_t selected[], BRCoinSelection *result);
+
+// randomized subset sum that aims for params->amount plus fee, or that plus params->minChange if change is needed,
+// falling back to the smallest single candidate that covers the target
+int BRCoinSelectKnapsack(const BRCoinCandidate candidates[], size_t candidatesCount,
+                         const BRCoinSelectionParams *params, size_t selected[], BRCoinSelection *result);
+
+// tries branch and bound, then knapsack, then largest first
+// on failure, selected and result are those of the largest first selection
+int BRCoinSelect(const BRCoinCandidate candidates[], size_t candidatesCount, const BRCoinSelectionParams *params,
+                 size_t selected[], BRCoinSelection *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // BRCoinSelection_h
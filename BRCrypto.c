@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 // endian swapping
 #if __BIG_ENDIAN__ || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
@@ -115,19 +116,24 @@ void BRSHA1(void *md20, const void *data, size_t len)
 #define s2(x) (ror32((x), 7) ^ ror32((x), 18) ^ ((x) >> 3))
 #define s3(x) (ror32((x), 17) ^ ror32((x), 19) ^ ((x) >> 10))
 
+static const uint32_t _BRSHA256K[] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+// sha-256 initial buffer values
+static const uint32_t _BRSHA256IV[] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
 static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
 {
-    static const uint32_t k[] = {
-        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
-        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
-        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
-        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
-        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
-        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
-        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
-        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
-    };
-    
     int i;
     uint32_t a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
     
@@ -135,7 +141,7 @@ static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
     for (; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
     
     for (i = 0; i < 64; i++) {
-        t1 = h + s1(e) + ch(e, f, g) + k[i] + w[i];
+        t1 = h + s1(e) + ch(e, f, g) + _BRSHA256K[i] + w[i];
         t2 = s0(a) + maj(a, b, c);
         h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
     }
@@ -145,6 +151,173 @@ static void _BRSHA256Compress(uint32_t *r, const uint32_t *x)
     mem_clean(w, sizeof(w));
 }
 
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define SHA256_X86 1
+#include "crypto/sha3/sph_types.h"
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define sha256ni_rounds(i, m) do { /* four rounds with message words m */\
+    msg = _mm_add_epi32((m), _mm_loadu_si128((const __m128i *)&_BRSHA256K[4*(i)]));\
+    s1 = _mm_sha256rnds2_epu32(s1, s0, msg);\
+    s0 = _mm_sha256rnds2_epu32(s0, s1, _mm_shuffle_epi32(msg, 0x0e));\
+} while (0)
+
+#define sha256ni_schedule(m0, m1, m2, m3) /* next four message words, m0..m3 are the previous sixteen */\
+    (m0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(m0, m1), _mm_alignr_epi8(m3, m2, 4)), m3))
+
+// _BRSHA256Compress() using the x86 sha extensions, the working state never leaves the xmm registers
+__attribute__((target("sha,sse4.1")))
+static void _BRSHA256CompressSHANI(uint32_t *r, const uint32_t *x)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i s0, s1, t, msg, m0, m1, m2, m3, abef, cdgh;
+    
+    t = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[0]), 0xb1); // cdab
+    s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&r[4]), 0x1b); // efgh
+    s0 = abef = _mm_alignr_epi8(t, s1, 8); // abef
+    s1 = cdgh = _mm_blend_epi16(s1, t, 0xf0); // cdgh
+    
+    m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&x[0]), bswap);
+    m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&x[4]), bswap);
+    m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&x[8]), bswap);
+    m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)&x[12]), bswap);
+    sha256ni_rounds(0, m0);
+    sha256ni_rounds(1, m1);
+    sha256ni_rounds(2, m2);
+    sha256ni_rounds(3, m3);
+    sha256ni_rounds(4, sha256ni_schedule(m0, m1, m2, m3));
+    sha256ni_rounds(5, sha256ni_schedule(m1, m2, m3, m0));
+    sha256ni_rounds(6, sha256ni_schedule(m2, m3, m0, m1));
+    sha256ni_rounds(7, sha256ni_schedule(m3, m0, m1, m2));
+    sha256ni_rounds(8, sha256ni_schedule(m0, m1, m2, m3));
+    sha256ni_rounds(9, sha256ni_schedule(m1, m2, m3, m0));
+    sha256ni_rounds(10, sha256ni_schedule(m2, m3, m0, m1));
+    sha256ni_rounds(11, sha256ni_schedule(m3, m0, m1, m2));
+    sha256ni_rounds(12, sha256ni_schedule(m0, m1, m2, m3));
+    sha256ni_rounds(13, sha256ni_schedule(m1, m2, m3, m0));
+    sha256ni_rounds(14, sha256ni_schedule(m2, m3, m0, m1));
+    sha256ni_rounds(15, sha256ni_schedule(m3, m0, m1, m2));
+    
+    s0 = _mm_add_epi32(s0, abef);
+    s1 = _mm_add_epi32(s1, cdgh);
+    t = _mm_shuffle_epi32(s0, 0x1b); // feba
+    s1 = _mm_shuffle_epi32(s1, 0xb1); // dchg
+    _mm_storeu_si128((__m128i *)&r[0], _mm_blend_epi16(t, s1, 0xf0)); // dcba
+    _mm_storeu_si128((__m128i *)&r[4], _mm_alignr_epi8(s1, t, 8)); // hgfe
+}
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SHA256_LANES 8
+
+// one independent message per vector element, with sse2 or neon each vector op is a pair of 4 lane instructions and
+// with avx2 a single 8 lane one
+typedef uint32_t _BRSHA256Lanes __attribute__((vector_size(SHA256_LANES*sizeof(uint32_t))));
+
+#define ror32_lanes(a, b) (((a) >> (b)) | ((a) << (32 - (b))))
+
+// sha-256 compression of SHA256_LANES independent states r, x holds the 16 message words of each lane in host order
+static inline __attribute__((always_inline)) void _BRSHA256CompressLanesBody(_BRSHA256Lanes r[8],
+                                                                            const _BRSHA256Lanes x[16])
+{
+    _BRSHA256Lanes a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
+    int i;
+    
+    for (i = 0; i < 16; i++) w[i] = x[i];
+    
+    for (; i < 64; i++) {
+        w[i] = (ror32_lanes(w[i - 2], 17) ^ ror32_lanes(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7] +
+               (ror32_lanes(w[i - 15], 7) ^ ror32_lanes(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+    }
+    
+    for (i = 0; i < 64; i++) {
+        t1 = h + (ror32_lanes(e, 6) ^ ror32_lanes(e, 11) ^ ror32_lanes(e, 25)) + ((e & f) ^ (~e & g)) +
+             _BRSHA256K[i] + w[i];
+        t2 = (ror32_lanes(a, 2) ^ ror32_lanes(a, 13) ^ ror32_lanes(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+    }
+    
+    r[0] += a, r[1] += b, r[2] += c, r[3] += d, r[4] += e, r[5] += f, r[6] += g, r[7] += h;
+}
+
+static void _BRSHA256CompressLanes(_BRSHA256Lanes r[8], const _BRSHA256Lanes x[16])
+{
+    _BRSHA256CompressLanesBody(r, x);
+}
+
+#if SHA256_X86
+__attribute__((target("avx2")))
+static void _BRSHA256CompressLanesAVX2(_BRSHA256Lanes r[8], const _BRSHA256Lanes x[16])
+{
+    _BRSHA256CompressLanesBody(r, x);
+}
+#endif
+#endif
+
+// sha-256 backends: 0 portable, 1 simd lanes for batches, 2 avx2 lanes for batches, 3 sha extensions
+static int _BRSHA256Impl = 0;
+static unsigned _BRSHA256Supported = 1; // bit n is set when backend n can run on this cpu
+static pthread_once_t _BRSHA256Once = PTHREAD_ONCE_INIT;
+
+// picks the fastest sha-256 backend the cpu supports
+static void _BRSHA256Init(void)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    _BRSHA256Supported |= 1 << 1;
+#endif
+#if SHA256_X86
+    unsigned eax, ebx, ecx, edx, ecx1;
+    
+    if (sph_cpu_avx2()) _BRSHA256Supported |= 1 << 2;
+    
+    if (__get_cpuid(1, &eax, &ebx, &ecx1, &edx) && __get_cpuid_max(0, NULL) >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if ((ecx1 & bit_SSE4_1) && (ebx & bit_SHA)) _BRSHA256Supported |= 1 << 3;
+    }
+#endif
+    for (_BRSHA256Impl = 3; ! (_BRSHA256Supported & (1 << _BRSHA256Impl)); _BRSHA256Impl--);
+}
+
+int BRSHA256Impl(int impl)
+{
+    pthread_once(&_BRSHA256Once, _BRSHA256Init);
+    for (_BRSHA256Impl = (impl > 3) ? 3 : (impl < 0) ? 0 : impl; ! (_BRSHA256Supported & (1 << _BRSHA256Impl));
+         _BRSHA256Impl--);
+    return _BRSHA256Impl;
+}
+
+#if SHA256_X86
+#define sha256_compress(r, x) ((_BRSHA256Impl == 3) ? _BRSHA256CompressSHANI((r), (x)) : _BRSHA256Compress((r), (x)))
+#else
+#define sha256_compress(r, x) _BRSHA256Compress((r), (x))
+#endif
+
+
+// same as _BRSHA256Compress() but without wiping the stack, only for hashing public data such as block headers
+static void _BRSHA256CompressPublic(uint32_t *r, const uint32_t *x)
+{
+#if SHA256_X86
+    if (_BRSHA256Impl == 3) {
+        _BRSHA256CompressSHANI(r, x);
+        return;
+    }
+#endif
+    int i;
+    uint32_t a = r[0], b = r[1], c = r[2], d = r[3], e = r[4], f = r[5], g = r[6], h = r[7], t1, t2, w[64];
+    
+    for (i = 0; i < 16; i++) w[i] = be32(x[i]);
+    for (; i < 64; i++) w[i] = s3(w[i - 2]) + w[i - 7] + s2(w[i - 15]) + w[i - 16];
+    
+    for (i = 0; i < 64; i++) {
+        t1 = h + s1(e) + ch(e, f, g) + _BRSHA256K[i] + w[i];
+        t2 = s0(a) + maj(a, b, c);
+        h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+    }
+    
+    r[0] += a, r[1] += b, r[2] += c, r[3] += d, r[4] += e, r[5] += f, r[6] += g, r[7] += h;
+}
+
 void BRSHA224(void *md28, const void *data, size_t len) {
     size_t i;
     uint32_t x[16], buf[] = { 0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511,
@@ -152,18 +325,19 @@ void BRSHA224(void *md28, const void *data, size_t len) {
 
     assert(md28 != NULL);
     assert(data != NULL || len == 0);
+    pthread_once(&_BRSHA256Once, _BRSHA256Init);
 
     for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
         memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
         if (i + 64 > len) break;
-        _BRSHA256Compress(buf, x);
+        sha256_compress(buf, x);
     }
 
     memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
     ((uint8_t *)x)[len - i] = 0x80; // append padding
-    if (len - i >= 56) _BRSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
+    if (len - i >= 56) sha256_compress(buf, x), memset(x, 0, 64); // length goes to next block
     x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
-    _BRSHA256Compress(buf, x); // finalize
+    sha256_compress(buf, x); // finalize
     for (i = 0; i < 7; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md28, buf, 28); // write to md
     mem_clean(x, sizeof(x));
@@ -178,18 +352,19 @@ void BRSHA256(void *md32, const void *data, size_t len)
     
     assert(md32 != NULL);
     assert(data != NULL || len == 0);
+    pthread_once(&_BRSHA256Once, _BRSHA256Init);
 
     for (i = 0; i < len; i += 64) { // process data in 64 byte blocks
         memcpy(x, (const uint8_t *)data + i, (i + 64 < len) ? 64 : len - i);
         if (i + 64 > len) break;
-        _BRSHA256Compress(buf, x);
+        sha256_compress(buf, x);
     }
     
     memset((uint8_t *)x + (len - i), 0, 64 - (len - i)); // clear remainder of x
     ((uint8_t *)x)[len - i] = 0x80; // append padding
-    if (len - i >= 56) _BRSHA256Compress(buf, x), memset(x, 0, 64); // length goes to next block
+    if (len - i >= 56) sha256_compress(buf, x), memset(x, 0, 64); // length goes to next block
     x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3)); // append length in bits
-    _BRSHA256Compress(buf, x); // finalize
+    sha256_compress(buf, x); // finalize
     for (i = 0; i < 8; i++) buf[i] = be32(buf[i]); // endian swap
     memcpy(md32, buf, 32); // write to md
     mem_clean(x, sizeof(x));
@@ -207,6 +382,160 @@ void BRSHA256_2(void *md32, const void *data, size_t len)
     BRSHA256(md32, t, sizeof(t));
 }
 
+void BRSHA256Init(BRSHA256Context *ctx)
+{
+    assert(ctx != NULL);
+    pthread_once(&_BRSHA256Once, _BRSHA256Init);
+    memcpy(ctx->buf, _BRSHA256IV, sizeof(ctx->buf));
+    ctx->len = 0;
+}
+
+void BRSHA256Update(BRSHA256Context *ctx, const void *data, size_t len)
+{
+    size_t i = 0, off;
+    
+    assert(ctx != NULL);
+    assert(data != NULL || len == 0);
+    off = (size_t)(ctx->len % 64);
+    ctx->len += len;
+    
+    if (off > 0) { // fill the pending partial block first
+        i = (len < 64 - off) ? len : 64 - off;
+        memcpy((uint8_t *)ctx->x + off, data, i);
+        if (off + i < 64) return;
+        sha256_compress(ctx->buf, ctx->x);
+    }
+    
+    for (; i + 64 <= len; i += 64) { // process data in 64 byte blocks
+        memcpy(ctx->x, (const uint8_t *)data + i, 64);
+        sha256_compress(ctx->buf, ctx->x);
+    }
+    
+    if (i < len) memcpy(ctx->x, (const uint8_t *)data + i, len - i); // keep the remainder for the next call
+}
+
+void BRSHA256Final(void *md32, BRSHA256Context *ctx)
+{
+    size_t i, off;
+    
+    assert(md32 != NULL);
+    assert(ctx != NULL);
+    off = (size_t)(ctx->len % 64);
+    memset((uint8_t *)ctx->x + off, 0, 64 - off); // clear remainder of x
+    ((uint8_t *)ctx->x)[off] = 0x80; // append padding
+    if (off >= 56) sha256_compress(ctx->buf, ctx->x), memset(ctx->x, 0, 64); // length goes to next block
+    ctx->x[14] = be32((uint32_t)(ctx->len >> 29)), ctx->x[15] = be32((uint32_t)(ctx->len << 3)); // length in bits
+    sha256_compress(ctx->buf, ctx->x); // finalize
+    for (i = 0; i < 8; i++) ctx->buf[i] = be32(ctx->buf[i]); // endian swap
+    memcpy(md32, ctx->buf, 32); // write to md
+    mem_clean(ctx, sizeof(*ctx));
+}
+
+// writes block b of the sha-256 padded message data to x, in the same byte order as the message
+static void _BRSHA256PaddedBlock(uint32_t x[16], const uint8_t *data, size_t len, size_t b)
+{
+    size_t off = b*64;
+    
+    if (off + 64 <= len) memcpy(x, &data[off], 64);
+    else {
+        memset(x, 0, 64);
+        if (off < len) memcpy(x, &data[off], len - off);
+        if (off <= len) ((uint8_t *)x)[len - off] = 0x80; // append padding
+        if (b + 1 == (len + 9 + 63)/64) x[14] = be32((uint32_t)(len >> 29)), x[15] = be32((uint32_t)(len << 3));
+    }
+}
+
+// double-sha-256 of public data, one buffer at a time, without wiping intermediate values
+static void _BRSHA256_2Public(uint8_t *md32, const uint8_t *data, size_t len)
+{
+    uint32_t r[8], x[16];
+    size_t i, b, blocks = (len + 9 + 63)/64;
+    
+    memcpy(r, _BRSHA256IV, sizeof(r));
+    
+    for (b = 0; b < blocks; b++) {
+        _BRSHA256PaddedBlock(x, data, len, b);
+        _BRSHA256CompressPublic(r, x);
+    }
+    
+    for (i = 0; i < 8; i++) x[i] = be32(r[i]);
+    memset(&x[8], 0, 32);
+    x[8] = be32(0x80000000), x[15] = be32(32 << 3);
+    memcpy(r, _BRSHA256IV, sizeof(r));
+    _BRSHA256CompressPublic(r, x);
+    for (i = 0; i < 8; i++) r[i] = be32(r[i]);
+    memcpy(md32, r, 32);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+// double-sha-256 of n <= SHA256_LANES buffers side by side, lanes whose message is shorter than the longest keep their
+// state while the others finish
+static void _BRSHA256_2Lanes(uint8_t *md, const void *data[], const size_t len[], size_t n)
+{
+    _BRSHA256Lanes r[8], s[8], x[16], active;
+    uint32_t block[16];
+    size_t i, l, b, blocks[SHA256_LANES], maxBlocks = 0;
+    
+    for (l = 0; l < n; l++) {
+        blocks[l] = (len[l] + 9 + 63)/64;
+        if (blocks[l] > maxBlocks) maxBlocks = blocks[l];
+    }
+    
+    for (i = 0; i < 8; i++) r[i] = (_BRSHA256Lanes){ 0 } + _BRSHA256IV[i];
+    
+    for (b = 0; b < maxBlocks; b++) {
+        for (l = 0; l < SHA256_LANES; l++) {
+            active[l] = (l < n && b < blocks[l]) ? 0xffffffff : 0;
+            if (active[l]) _BRSHA256PaddedBlock(block, data[l], len[l], b);
+            for (i = 0; i < 16; i++) x[i][l] = (active[l]) ? be32(block[i]) : 0;
+        }
+        
+        memcpy(s, r, sizeof(s));
+#if SHA256_X86
+        if (_BRSHA256Impl == 2) _BRSHA256CompressLanesAVX2(r, x);
+        else
+#endif
+        _BRSHA256CompressLanes(r, x);
+        for (i = 0; i < 8; i++) r[i] = (r[i] & active) | (s[i] & ~active);
+    }
+    
+    // the first digest is a single padded block of its own, already in host order
+    for (i = 0; i < 8; i++) x[i] = r[i], r[i] = (_BRSHA256Lanes){ 0 } + _BRSHA256IV[i];
+    for (i = 8; i < 16; i++) x[i] = (_BRSHA256Lanes){ 0 };
+    x[8] += 0x80000000, x[15] += 32 << 3;
+#if SHA256_X86
+    if (_BRSHA256Impl == 2) _BRSHA256CompressLanesAVX2(r, x);
+    else
+#endif
+    _BRSHA256CompressLanes(r, x);
+    
+    for (l = 0; l < n; l++) {
+        for (i = 0; i < 8; i++) block[i] = be32(r[i][l]);
+        memcpy(&md[l*32], block, 32);
+    }
+}
+#endif
+
+void BRSHA256_2_Batch(void *md, const void *data[], const size_t len[], size_t count)
+{
+    size_t i = 0;
+    
+    assert(md != NULL || count == 0);
+    assert(data != NULL || count == 0);
+    assert(len != NULL || count == 0);
+    pthread_once(&_BRSHA256Once, _BRSHA256Init);
+    
+#if defined(__GNUC__) || defined(__clang__)
+    if (_BRSHA256Impl == 1 || _BRSHA256Impl == 2) {
+        for (; i < count; i += SHA256_LANES) {
+            _BRSHA256_2Lanes((uint8_t *)md + i*32, &data[i], &len[i], (count - i < SHA256_LANES) ? count - i : SHA256_LANES);
+        }
+    }
+#endif
+    
+    for (; i < count; i++) _BRSHA256_2Public((uint8_t *)md + i*32, data[i], len[i]);
+}
+
 // bitwise right rotation
 #define ror64(a, b) (((a) >> (b)) | ((a) << (64 - (b))))
 
@@ -1005,6 +1334,300 @@ void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *
     free(v);
 }
 
+// scrypt(n = 1024, r = 1, p = 1) with password and salt set to the same 80 byte block header is a fixed size problem,
+// so the hmac-sha256 states are derived once per header and the scratchpad lives on the stack
+
+typedef struct {
+    uint32_t inner[8], outer[8]; // sha-256 states after hashing the ipad and opad blocks of the hmac key
+} _BRScryptHMAC;
+
+static void _BRScryptHMACInit(_BRScryptHMAC *hmac, const uint8_t *header)
+{
+    uint32_t x[16], key[16];
+    size_t i;
+    
+    pthread_once(&_BRSHA256Once, _BRSHA256Init);
+    
+    // the 80 byte key is longer than the sha-256 block size, so the hmac key is sha-256(header)
+    memcpy(x, _BRSHA256IV, sizeof(_BRSHA256IV));
+    memcpy(key, header, 64);
+    _BRSHA256CompressPublic(x, key);
+    memset(key, 0, sizeof(key));
+    memcpy(key, &header[64], 16);
+    ((uint8_t *)key)[16] = 0x80;
+    key[15] = be32(80 << 3);
+    _BRSHA256CompressPublic(x, key);
+    for (i = 0; i < 8; i++) key[i] = be32(x[i]);
+    memset(&key[8], 0, 32);
+    
+    for (i = 0; i < 16; i++) x[i] = key[i] ^ 0x36363636;
+    memcpy(hmac->inner, _BRSHA256IV, sizeof(_BRSHA256IV));
+    _BRSHA256CompressPublic(hmac->inner, x);
+    for (i = 0; i < 16; i++) x[i] = key[i] ^ 0x5c5c5c5c;
+    memcpy(hmac->outer, _BRSHA256IV, sizeof(_BRSHA256IV));
+    _BRSHA256CompressPublic(hmac->outer, x);
+}
+
+// finishes the hmac given the final inner sha-256 state, writes the 32 byte mac to md32
+static void _BRScryptHMACFinal(const _BRScryptHMAC *hmac, const uint32_t *inner, uint32_t *md32)
+{
+    uint32_t x[16], r[8];
+    size_t i;
+    
+    for (i = 0; i < 8; i++) x[i] = be32(inner[i]);
+    memset(&x[8], 0, 32);
+    ((uint8_t *)x)[32] = 0x80;
+    x[15] = be32((64 + 32) << 3);
+    memcpy(r, hmac->outer, sizeof(r));
+    _BRSHA256CompressPublic(r, x);
+    for (i = 0; i < 8; i++) md32[i] = be32(r[i]);
+}
+
+// pbkdf2-hmac-sha256(header, header, 1 round) with a 128 byte output, the scrypt input block
+static void _BRScryptPBKDF2Header(const _BRScryptHMAC *hmac, const uint8_t *header, uint32_t b[32])
+{
+    uint32_t mid[8], r[8], x[16];
+    
+    memcpy(mid, hmac->inner, sizeof(mid));
+    memcpy(x, header, 64);
+    _BRSHA256CompressPublic(mid, x); // the first 64 bytes of salt are shared by all four output blocks
+    memset(x, 0, sizeof(x));
+    memcpy(x, &header[64], 16);
+    ((uint8_t *)x)[20] = 0x80;
+    x[15] = be32((64 + 84) << 3);
+    
+    for (uint32_t i = 0; i < 4; i++) {
+        x[4] = be32(i + 1);
+        memcpy(r, mid, sizeof(r));
+        _BRSHA256CompressPublic(r, x);
+        _BRScryptHMACFinal(hmac, r, &b[i*8]);
+    }
+}
+
+// pbkdf2-hmac-sha256(header, b, 1 round) with a 32 byte output, the final scrypt digest
+static void _BRScryptPBKDF2Final(const _BRScryptHMAC *hmac, const uint32_t b[32], void *md32)
+{
+    uint32_t r[8], x[16], md[8];
+    
+    memcpy(r, hmac->inner, sizeof(r));
+    _BRSHA256CompressPublic(r, b);
+    _BRSHA256CompressPublic(r, &b[16]);
+    memset(x, 0, sizeof(x));
+    x[0] = be32(1);
+    ((uint8_t *)x)[4] = 0x80;
+    x[15] = be32((64 + 132) << 3);
+    _BRSHA256CompressPublic(r, x);
+    _BRScryptHMACFinal(hmac, r, md);
+    memcpy(md32, md, sizeof(md));
+}
+
+// b ^= bx, followed by salsa20/8 core on b
+static void _BRXorSalsa8(uint32_t b[16], const uint32_t bx[16])
+{
+    uint32_t x0 = (b[0] ^= bx[0]),   x1 = (b[1] ^= bx[1]),   x2 = (b[2] ^= bx[2]),   x3 = (b[3] ^= bx[3]),
+             x4 = (b[4] ^= bx[4]),   x5 = (b[5] ^= bx[5]),   x6 = (b[6] ^= bx[6]),   x7 = (b[7] ^= bx[7]),
+             x8 = (b[8] ^= bx[8]),   x9 = (b[9] ^= bx[9]),   xa = (b[10] ^= bx[10]), xb = (b[11] ^= bx[11]),
+             xc = (b[12] ^= bx[12]), xd = (b[13] ^= bx[13]), xe = (b[14] ^= bx[14]), xf = (b[15] ^= bx[15]);
+    
+    for (unsigned i = 0; i < 8; i += 2) {
+        // operate on columns
+        x4 ^= rol32(x0 + xc, 7), x8 ^= rol32(x4 + x0, 9), xc ^= rol32(x8 + x4, 13), x0 ^= rol32(xc + x8, 18);
+        x9 ^= rol32(x5 + x1, 7), xd ^= rol32(x9 + x5, 9), x1 ^= rol32(xd + x9, 13), x5 ^= rol32(x1 + xd, 18);
+        xe ^= rol32(xa + x6, 7), x2 ^= rol32(xe + xa, 9), x6 ^= rol32(x2 + xe, 13), xa ^= rol32(x6 + x2, 18);
+        x3 ^= rol32(xf + xb, 7), x7 ^= rol32(x3 + xf, 9), xb ^= rol32(x7 + x3, 13), xf ^= rol32(xb + x7, 18);
+        
+        // operate on rows
+        x1 ^= rol32(x0 + x3, 7), x2 ^= rol32(x1 + x0, 9), x3 ^= rol32(x2 + x1, 13), x0 ^= rol32(x3 + x2, 18);
+        x6 ^= rol32(x5 + x4, 7), x7 ^= rol32(x6 + x5, 9), x4 ^= rol32(x7 + x6, 13), x5 ^= rol32(x4 + x7, 18);
+        xb ^= rol32(xa + x9, 7), x8 ^= rol32(xb + xa, 9), x9 ^= rol32(x8 + xb, 13), xa ^= rol32(x9 + x8, 18);
+        xc ^= rol32(xf + xe, 7), xd ^= rol32(xc + xf, 9), xe ^= rol32(xd + xc, 13), xf ^= rol32(xe + xd, 18);
+    }
+    
+    b[0] += x0, b[1] += x1, b[2] += x2,  b[3] += x3,  b[4] += x4,  b[5] += x5,  b[6] += x6,  b[7] += x7;
+    b[8] += x8, b[9] += x9, b[10] += xa, b[11] += xb, b[12] += xc, b[13] += xd, b[14] += xe, b[15] += xf;
+}
+
+// scrypt(pw = salt = header, n = 1024, r = 1, p = 1) of an 80 byte block header, v is the 128k scratchpad
+static void _BRScrypt_1024_1_1(void *md32, const void *header80, uint32_t *v)
+{
+    uint32_t b[32], x[32];
+    _BRScryptHMAC hmac;
+    size_t i, j, k;
+    
+    _BRScryptHMACInit(&hmac, header80);
+    _BRScryptPBKDF2Header(&hmac, header80, b);
+    for (i = 0; i < 32; i++) x[i] = le32(b[i]);
+    
+    for (i = 0; i < 1024; i++) {
+        memcpy(&v[i*32], x, sizeof(x));
+        _BRXorSalsa8(x, &x[16]);
+        _BRXorSalsa8(&x[16], x);
+    }
+    
+    for (i = 0; i < 1024; i++) {
+        j = (x[16] & 1023)*32;
+        for (k = 0; k < 32; k++) x[k] ^= v[j + k];
+        _BRXorSalsa8(x, &x[16]);
+        _BRXorSalsa8(&x[16], x);
+    }
+    
+    for (i = 0; i < 32; i++) b[i] = le32(x[i]);
+    _BRScryptPBKDF2Final(&hmac, b, md32);
+}
+
+// scrypt(pw = salt = header, n = 1024, r = 1, p = 1) of an 80 byte block header, the scrypt proof-of-work hash
+static pthread_key_t _BRScryptScratchKey;
+static pthread_once_t _BRScryptScratchOnce = PTHREAD_ONCE_INIT;
+
+static void _BRScryptScratchInit(void)
+{
+    pthread_key_create(&_BRScryptScratchKey, free); // a thread's scratchpad is freed when the thread exits
+}
+
+void BRScrypt_1024_1_1(void *md32, const void *header80)
+{
+    uint32_t *v;
+    
+    assert(md32 != NULL);
+    assert(header80 != NULL);
+    pthread_once(&_BRScryptScratchOnce, _BRScryptScratchInit);
+    v = pthread_getspecific(_BRScryptScratchKey);
+    
+    if (! v) { // 128k is too much for the stack of a worker thread, so each thread allocates it once and reuses it
+        v = malloc(1024*32*sizeof(*v));
+        assert(v != NULL);
+        pthread_setspecific(_BRScryptScratchKey, v);
+    }
+    
+    _BRScrypt_1024_1_1(md32, header80, v);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+// salsa20/8 on several independent headers at once, each vector element is one header, with sse2 or neon each vector
+// op is a pair of 4 lane instructions and with avx2 a single 8 lane one
+#define SCRYPT_LANES 8
+
+typedef uint32_t _BRScryptLanes __attribute__((vector_size(SCRYPT_LANES*sizeof(uint32_t))));
+
+#define rol32_lanes(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+static inline __attribute__((always_inline)) void _BRXorSalsa8Lanes(_BRScryptLanes b[16], const _BRScryptLanes bx[16])
+{
+    _BRScryptLanes x[16];
+    unsigned i;
+    
+    for (i = 0; i < 16; i++) x[i] = (b[i] ^= bx[i]);
+    
+    for (i = 0; i < 8; i += 2) {
+        // operate on columns
+        x[4] ^= rol32_lanes(x[0] + x[12], 7), x[8] ^= rol32_lanes(x[4] + x[0], 9);
+        x[12] ^= rol32_lanes(x[8] + x[4], 13), x[0] ^= rol32_lanes(x[12] + x[8], 18);
+        x[9] ^= rol32_lanes(x[5] + x[1], 7), x[13] ^= rol32_lanes(x[9] + x[5], 9);
+        x[1] ^= rol32_lanes(x[13] + x[9], 13), x[5] ^= rol32_lanes(x[1] + x[13], 18);
+        x[14] ^= rol32_lanes(x[10] + x[6], 7), x[2] ^= rol32_lanes(x[14] + x[10], 9);
+        x[6] ^= rol32_lanes(x[2] + x[14], 13), x[10] ^= rol32_lanes(x[6] + x[2], 18);
+        x[3] ^= rol32_lanes(x[15] + x[11], 7), x[7] ^= rol32_lanes(x[3] + x[15], 9);
+        x[11] ^= rol32_lanes(x[7] + x[3], 13), x[15] ^= rol32_lanes(x[11] + x[7], 18);
+        
+        // operate on rows
+        x[1] ^= rol32_lanes(x[0] + x[3], 7), x[2] ^= rol32_lanes(x[1] + x[0], 9);
+        x[3] ^= rol32_lanes(x[2] + x[1], 13), x[0] ^= rol32_lanes(x[3] + x[2], 18);
+        x[6] ^= rol32_lanes(x[5] + x[4], 7), x[7] ^= rol32_lanes(x[6] + x[5], 9);
+        x[4] ^= rol32_lanes(x[7] + x[6], 13), x[5] ^= rol32_lanes(x[4] + x[7], 18);
+        x[11] ^= rol32_lanes(x[10] + x[9], 7), x[8] ^= rol32_lanes(x[11] + x[10], 9);
+        x[9] ^= rol32_lanes(x[8] + x[11], 13), x[10] ^= rol32_lanes(x[9] + x[8], 18);
+        x[12] ^= rol32_lanes(x[15] + x[14], 7), x[13] ^= rol32_lanes(x[12] + x[15], 9);
+        x[14] ^= rol32_lanes(x[13] + x[12], 13), x[15] ^= rol32_lanes(x[14] + x[13], 18);
+    }
+    
+    for (i = 0; i < 16; i++) b[i] += x[i];
+}
+
+// scrypt romix on SCRYPT_LANES headers, v must hold 1024*32 lane vectors
+static inline __attribute__((always_inline)) void _BRScryptLanesCoreBody(_BRScryptLanes x[32], _BRScryptLanes *v)
+{
+    size_t i, j, k, l;
+    
+    for (i = 0; i < 1024; i++) {
+        memcpy(&v[i*32], x, 32*sizeof(*x));
+        _BRXorSalsa8Lanes(x, &x[16]);
+        _BRXorSalsa8Lanes(&x[16], x);
+    }
+    
+    for (i = 0; i < 1024; i++) {
+        for (l = 0; l < SCRYPT_LANES; l++) { // each lane reads from its own scratchpad position
+            j = (x[16][l] & 1023)*32;
+            for (k = 0; k < 32; k++) x[k][l] ^= v[j + k][l];
+        }
+        
+        _BRXorSalsa8Lanes(x, &x[16]);
+        _BRXorSalsa8Lanes(&x[16], x);
+    }
+}
+
+static void _BRScryptLanesCore(_BRScryptLanes x[32], _BRScryptLanes *v)
+{
+    _BRScryptLanesCoreBody(x, v);
+}
+
+#if SHA256_X86
+__attribute__((target("avx2")))
+static void _BRScryptLanesCoreAVX2(_BRScryptLanes x[32], _BRScryptLanes *v)
+{
+    _BRScryptLanesCoreBody(x, v);
+}
+#endif
+#endif
+
+// scrypt(n = 1024, r = 1, p = 1) of count consecutive 80 byte headers, writing count consecutive 32 byte digests to md
+// headers are processed several at a time using simd lanes where available, with the avx2 code picked at runtime
+// scratch is either NULL, to allocate a scratchpad for this call, or BR_SCRYPT_BATCH_SCRATCH_SIZE bytes that a thread
+// hashing many batches can allocate once and pass to every call
+void BRScrypt_1024_1_1_Batch(void *md, const void *headers, size_t count, void *scratch)
+{
+    uint8_t *buf = (scratch || count == 0) ? scratch : malloc(BR_SCRYPT_BATCH_SCRATCH_SIZE);
+    void *v = (void *)(((uintptr_t)buf + 63) & ~(uintptr_t)63);
+    size_t i = 0;
+    
+    assert(md != NULL || count == 0);
+    assert(headers != NULL || count == 0);
+    assert(buf != NULL || count == 0);
+    
+#if defined(__GNUC__) || defined(__clang__)
+    if (count >= SCRYPT_LANES) {
+        _BRScryptLanes x[32];
+        _BRScryptHMAC hmac[SCRYPT_LANES];
+        uint32_t b[SCRYPT_LANES][32];
+        size_t j, l;
+        
+        pthread_once(&_BRSHA256Once, _BRSHA256Init);
+        
+        for (; i + SCRYPT_LANES <= count; i += SCRYPT_LANES) {
+            for (l = 0; l < SCRYPT_LANES; l++) {
+                _BRScryptHMACInit(&hmac[l], (const uint8_t *)headers + (i + l)*80);
+                _BRScryptPBKDF2Header(&hmac[l], (const uint8_t *)headers + (i + l)*80, b[l]);
+                for (j = 0; j < 32; j++) x[j][l] = le32(b[l][j]);
+            }
+            
+#if SHA256_X86
+            if (_BRSHA256Supported & (1 << 2)) _BRScryptLanesCoreAVX2(x, v);
+            else
+#endif
+            _BRScryptLanesCore(x, v);
+            
+            for (l = 0; l < SCRYPT_LANES; l++) {
+                for (j = 0; j < 32; j++) b[l][j] = le32(x[j][l]);
+                _BRScryptPBKDF2Final(&hmac[l], b[l], (uint8_t *)md + (i + l)*32);
+            }
+        }
+    }
+#endif
+    
+    for (; i < count; i++) _BRScrypt_1024_1_1((uint8_t *)md + i*32, (const uint8_t *)headers + i*80, v);
+    
+    if (buf != scratch) free(buf);
+}
+
 void BRSkein(const char* input, char* output) {
     skein_hash(input, output);
 }
@@ -1017,6 +1640,18 @@ void BRQubit(const char* input, char* output) {
     qubit_hash(input, output);
 }
 
+void BRSkein_Batch(const char* input, char* output, size_t count) {
+    skein_hash_batch(input, output, count);
+}
+
+void BRGroestl_Batch(const char* input, char* output, size_t count) {
+    groestl_hash_batch(input, output, count);
+}
+
+void BRQubit_Batch(const char* input, char* output, size_t count) {
+    qubit_hash_batch(input, output, count);
+}
+
 /* Odocrypt hashing functions and helpers */
 
 uint32_t OdoKey(uint32_t nTime)
@@ -1025,12 +1660,144 @@ uint32_t OdoKey(uint32_t nTime)
     return nTime - nTime % nOdoShapechangeInterval;
 }
 
+// number of keyed OdoStructs kept around, the key only changes every ODOCRYPT_CHAPECHANGE_INTERVAL so a handful is
+// enough to cover the epoch being synced plus the one on either side of it
+#define ODOCRYPT_CACHE_SIZE 4
+
+typedef struct {
+    OdoStruct *odo;
+    uint32_t key;
+    size_t refCount;
+    uint64_t lastUsed;
+} _BROdoCacheEntry;
+
+static _BROdoCacheEntry _odoCache[ODOCRYPT_CACHE_SIZE];
+static uint64_t _odoCacheTick = 0;
+static pthread_mutex_t _odoCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+// returns an initialized OdoStruct for key that must be handed back with _BROdoCacheRelease()
+static OdoStruct *_BROdoCacheAcquire(uint32_t key)
+{
+    OdoStruct *odo = NULL;
+    size_t i, slot = ODOCRYPT_CACHE_SIZE;
+    
+    pthread_mutex_lock(&_odoCacheLock);
+    
+    for (i = 0; ! odo && i < ODOCRYPT_CACHE_SIZE; i++) {
+        if (! _odoCache[i].odo || _odoCache[i].key != key) continue;
+        _odoCache[i].refCount++;
+        _odoCache[i].lastUsed = ++_odoCacheTick;
+        odo = _odoCache[i].odo;
+    }
+    
+    pthread_mutex_unlock(&_odoCacheLock);
+    if (odo) return odo;
+    
+    // build outside of the lock, generating the s-boxes and p-boxes is the expensive part
+    odo = malloc(sizeof(*odo));
+    assert(odo != NULL);
+    Odocrypt_Init(odo, key);
+    pthread_mutex_lock(&_odoCacheLock);
+    
+    for (i = 0; i < ODOCRYPT_CACHE_SIZE; i++) {
+        if (_odoCache[i].odo && _odoCache[i].key == key) { // another thread built the same key in the meantime
+            free(odo);
+            odo = _odoCache[i].odo;
+            _odoCache[i].refCount++;
+            _odoCache[i].lastUsed = ++_odoCacheTick;
+            slot = i;
+            break;
+        }
+        
+        if (_odoCache[i].refCount > 0) continue;
+        if (slot == ODOCRYPT_CACHE_SIZE || ! _odoCache[i].odo ||
+            (_odoCache[slot].odo && _odoCache[i].lastUsed < _odoCache[slot].lastUsed)) slot = i;
+    }
+    
+    // if every slot is in use, odo stays uncached and is freed on release
+    if (slot < ODOCRYPT_CACHE_SIZE && _odoCache[slot].odo != odo) {
+        if (_odoCache[slot].odo) free(_odoCache[slot].odo);
+        _odoCache[slot] = (_BROdoCacheEntry) { odo, key, 1, ++_odoCacheTick };
+    }
+    
+    pthread_mutex_unlock(&_odoCacheLock);
+    return odo;
+}
+
+static void _BROdoCacheRelease(OdoStruct *odo)
+{
+    size_t i;
+    
+    pthread_mutex_lock(&_odoCacheLock);
+    
+    for (i = 0; i < ODOCRYPT_CACHE_SIZE; i++) {
+        if (_odoCache[i].odo != odo) continue;
+        assert(_odoCache[i].refCount > 0);
+        _odoCache[i].refCount--;
+        break;
+    }
+    
+    pthread_mutex_unlock(&_odoCacheLock);
+    if (i == ODOCRYPT_CACHE_SIZE) free(odo);
+}
+
+// frees any cached OdoStructs that aren't currently in use
+void BROdocryptCacheClear(void)
+{
+    pthread_mutex_lock(&_odoCacheLock);
+    
+    for (size_t i = 0; i < ODOCRYPT_CACHE_SIZE; i++) {
+        if (! _odoCache[i].odo || _odoCache[i].refCount > 0) continue;
+        free(_odoCache[i].odo);
+        _odoCache[i] = (_BROdoCacheEntry) { NULL, 0, 0, 0 };
+    }
+    
+    pthread_mutex_unlock(&_odoCacheLock);
+}
+
 void BROdocrypt(const char* input, const uint32_t nTime, uint8_t* output)
 {
-    OdoStruct odo; // sizeof(OdoStruct) = 167288 => stack safe
+    OdoStruct *odo = _BROdoCacheAcquire(OdoKey(nTime));
     
+    Odocrypt_Hash(odo, input, input + 80, (char*) output);
+    _BROdoCacheRelease(odo);
+}
+
+struct BROdocryptContextStruct {
+    OdoStruct odo;
+    int isKeyed;
+};
+
+// returns a newly allocated odocrypt context that must be freed by calling BROdocryptContextFree()
+BROdocryptContext *BROdocryptContextNew(void)
+{
+    BROdocryptContext *ctx = calloc(1, sizeof(*ctx));
+    
+    assert(ctx != NULL);
+    return ctx;
+}
+
+// hashes the 80 byte input with the odocrypt shape for nTime, the context is only re-keyed when nTime crosses into a
+// different shapechange interval
+void BROdocryptContextHash(BROdocryptContext *ctx, const char *input, uint32_t nTime, uint8_t *output)
+{
     uint32_t key = OdoKey(nTime);
     
-    Odocrypt_Init(&odo, key);
-    Odocrypt_Hash(&odo, input, input + 80, (char*) output);
+    assert(ctx != NULL);
+    assert(input != NULL);
+    assert(output != NULL);
+    
+    if (! ctx->isKeyed || ctx->odo.key != key) {
+        Odocrypt_Init(&ctx->odo, key);
+        ctx->isKeyed = 1;
+    }
+    
+    Odocrypt_Hash(&ctx->odo, input, input + 80, (char *)output);
+}
+
+// frees memory allocated for ctx
+void BROdocryptContextFree(BROdocryptContext *ctx)
+{
+    assert(ctx != NULL);
+    free(ctx);
 }
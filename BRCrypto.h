@@ -48,6 +48,30 @@ void BRSHA224(void *md28, const void *data, size_t len);
 // double-sha-256 = sha-256(sha-256(x))
 void BRSHA256_2(void *md32, const void *data, size_t len);
 
+// incremental sha-256, for input that isn't available in one piece, using the same accelerated backend as BRSHA256()
+typedef struct {
+    uint32_t buf[8];
+    uint32_t x[16]; // pending partial block
+    uint64_t len; // total bytes added so far
+} BRSHA256Context;
+
+void BRSHA256Init(BRSHA256Context *ctx);
+
+void BRSHA256Update(BRSHA256Context *ctx, const void *data, size_t len);
+
+// writes the digest to md32 and wipes ctx
+void BRSHA256Final(void *md32, BRSHA256Context *ctx);
+
+// double-sha-256 of count independent buffers, data[i] being len[i] bytes long, writing count consecutive 32 byte
+// digests to md, the buffers are hashed several at a time in simd lanes, or with the sha extensions when the cpu has them
+// (intermediate values are not wiped, for public data such as block headers and transactions)
+void BRSHA256_2_Batch(void *md, const void *data[], const size_t len[], size_t count);
+
+// caps the sha-256 implementation at impl and returns the one now in use: 0 portable, 1 simd lanes (batches only),
+// 2 avx2 lanes (batches only), 3 x86 sha extensions, the fastest the cpu supports is picked by default
+// (not thread safe, for tests and benchmarks)
+int BRSHA256Impl(int impl);
+
 void BRSHA384(void *md48, const void *data, size_t len);
 
 void BRSHA512(void *md64, const void *data, size_t len);
@@ -100,14 +124,51 @@ void BRPBKDF2(void *dk, size_t dkLen, void (*hash)(void *, const void *, size_t)
 void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen,
               unsigned n, unsigned r, unsigned p);
 
+// scrypt(pw = salt = header, n = 1024, r = 1, p = 1) of an 80 byte block header, the scrypt proof-of-work hash
+// (intermediate values are not wiped since block headers are public, and the 128k scratchpad is kept per thread)
+void BRScrypt_1024_1_1(void *md32, const void *header80);
+
+#define BR_SCRYPT_BATCH_SCRATCH_SIZE (8*1024*32*sizeof(uint32_t) + 64) // scratchpad for eight simd lanes, plus alignment
+
+// scrypt(n = 1024, r = 1, p = 1) of count consecutive 80 byte headers, writing count consecutive 32 byte digests to md
+// headers are processed several at a time using simd lanes where available
+// scratch is either NULL, or BR_SCRYPT_BATCH_SCRATCH_SIZE bytes a thread can allocate once and reuse for every call
+void BRScrypt_1024_1_1_Batch(void *md, const void *headers, size_t count, void *scratch);
+
 void BRSkein(const char* input, char* output);
 
 void BRGroestl(const char* input, char* output);
 
 void BRQubit(const char* input, char* output);
+
+// skein, groestl and qubit hashes of count consecutive 80 byte headers, writing count consecutive 32 byte hashes to
+// output
+void BRSkein_Batch(const char* input, char* output, size_t count);
+
+void BRGroestl_Batch(const char* input, char* output, size_t count);
+
+void BRQubit_Batch(const char* input, char* output, size_t count);
     
+// odocrypt pow hash of an 80 byte header, the keyed odo state for each shapechange interval is built once and kept in a
+// small thread-safe cache shared by all callers
 void BROdocrypt(const char* input, const uint32_t nTime, uint8_t* output);
 
+// frees any cached odo states that aren't currently in use
+void BROdocryptCacheClear(void);
+
+// caller owned odocrypt state, for threads that hash many headers and don't want to go through the shared cache
+typedef struct BROdocryptContextStruct BROdocryptContext;
+
+// returns a newly allocated odocrypt context that must be freed by calling BROdocryptContextFree()
+BROdocryptContext *BROdocryptContextNew(void);
+
+// hashes the 80 byte input with the odocrypt shape for nTime, re-keying ctx only when nTime crosses into a different
+// shapechange interval (not thread-safe, use one context per thread)
+void BROdocryptContextHash(BROdocryptContext *ctx, const char *input, uint32_t nTime, uint8_t *output);
+
+// frees memory allocated for ctx
+void BROdocryptContextFree(BROdocryptContext *ctx);
+
 // zeros out memory in a way that can't be optimized out by the compiler
 inline static void mem_clean(void *ptr, size_t len)
 {
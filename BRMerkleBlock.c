@@ -30,10 +30,11 @@
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define MAX_PROOF_OF_WORK 0x1e0fffff    // highest value for difficulty target (higher values are less difficult)
 #define TARGET_TIMESPAN (0.10*24*60*60) // the targeted timespan between difficulty target adjustments
-#define BLOCK_VERSION_ALGO (7 << 9)
 
 inline static int _ceil_log2(int x)
 {
@@ -137,52 +138,117 @@ BRMerkleBlock *BRMerkleBlockParse(const uint8_t *buf, size_t bufLen)
         }
         
         BRSHA256_2(&block->blockHash, buf, 80);
-
-	return block;
-
-        switch (block->version & BLOCK_VERSION_ALGO) {
-            case BLOCK_VERSION_SHA256D:
-                // void BRSHA256_2(void *md32, const void *data, size_t len)
-                BRSHA256_2(&block->powHash, buf, 80);
-                break;
-
-            case BLOCK_VERSION_SKEIN:
-                // void BRSkein(const char* input, char* output)
-                BRSkein((const char*) buf, (char*) &block->powHash.u8[0]);
-                break;
-
-            case BLOCK_VERSION_QUBIT:
-                // void BRQubit(const char* input, char* output)
-                BRQubit((const char*) buf, (char*) &block->powHash.u8[0]);
-                break;
-
-            case BLOCK_VERSION_ODO:
-                // void BROdocrypt(const char* input, const uint32_t nTime, uint8_t* output)
-                BROdocrypt((const char*) buf, block->timestamp, &block->powHash.u8[0]);
-                break;
-                
-            case BLOCK_VERSION_GROESTL:
-                // void BRGroestl(const char* input, char* output)
-                BRGroestl((const char*) buf, (char*) &block->powHash.u8[0]);
-                break;
-
-            case BLOCK_VERSION_SCRYPT:
-                // void BRScrypt(void *dk, size_t dkLen, const void *pw, size_t pwLen, const void *salt, size_t saltLen, unsigned n, unsigned r, unsigned p)
-                BRScrypt(&block->powHash, sizeof(block->powHash), buf, 80, buf, 80, 1024, 1, 1);
-                break;
-                
-            default:
-#if DEBUG
-                assert(0 && "Invalid algorithm");
-#else
-                break;
-#endif
-        }
+        // powHash is only filled in by the batch checks, so blocks that are only parsed, such as ones loaded from the
+        // persistent store, never pay for the proof-of-work hash
     }
     
     return block;
 }
 
+// writes the 80 byte serialized header of block to buf
+static void _BRMerkleBlockHeader(const BRMerkleBlock *block, uint8_t *buf)
+{
+    UInt32SetLE(&buf[0], block->version);
+    UInt256Set(&buf[4], block->prevBlock);
+    UInt256Set(&buf[36], block->merkleRoot);
+    UInt32SetLE(&buf[68], block->timestamp);
+    UInt32SetLE(&buf[72], block->target);
+    UInt32SetLE(&buf[76], block->nonce);
+}
+
+static void _BRPoWScrypt(const uint8_t *header, UInt256 *md)
+{
+    BRScrypt_1024_1_1(md, header);
+}
+
+static void _BRPoWSHA256D(const uint8_t *header, UInt256 *md)
+{
+    BRSHA256_2(md, header, 80);
+}
+
+static void _BRPoWGroestl(const uint8_t *header, UInt256 *md)
+{
+    BRGroestl((const char *)header, (char *)md->u8);
+}
+
+static void _BRPoWSkein(const uint8_t *header, UInt256 *md)
+{
+    BRSkein((const char *)header, (char *)md->u8);
+}
+
+static void _BRPoWQubit(const uint8_t *header, UInt256 *md)
+{
+    BRQubit((const char *)header, (char *)md->u8);
+}
+
+static void _BRPoWOdo(const uint8_t *header, UInt256 *md)
+{
+    // the odo shape depends on the header timestamp, keyed states are shared through the BROdocrypt() cache
+    BROdocrypt((const char *)header, UInt32GetLE(&header[68]), md->u8);
+}
+
+static void _BRPoWSHA256DBatch(const uint8_t *headers, UInt256 *md, size_t count)
+{
+    const void *data[64];
+    size_t i, j, len[64];
+    
+    for (i = 0; i < count; i += j) {
+        for (j = 0; j < 64 && i + j < count; j++) data[j] = &headers[(i + j)*80], len[j] = 80;
+        BRSHA256_2_Batch(&md[i], data, len, j);
+    }
+}
+
+static void _BRPoWGroestlBatch(const uint8_t *headers, UInt256 *md, size_t count)
+{
+    BRGroestl_Batch((const char *)headers, (char *)md, count);
+}
+
+static void _BRPoWSkeinBatch(const uint8_t *headers, UInt256 *md, size_t count)
+{
+    BRSkein_Batch((const char *)headers, (char *)md, count);
+}
+
+static void _BRPoWQubitBatch(const uint8_t *headers, UInt256 *md, size_t count)
+{
+    BRQubit_Batch((const char *)headers, (char *)md, count);
+}
+
+typedef struct {
+    const char *name;
+    void (*hash)(const uint8_t *header, UInt256 *md);
+    void (*batch)(const uint8_t *headers, UInt256 *md, size_t count); // optional, hashes consecutive 80 byte headers
+} _BRPoWAlgo;
+
+// indexed by (version & BLOCK_VERSION_ALGO) >> 8
+static const _BRPoWAlgo _BRPoWAlgos[(BLOCK_VERSION_ALGO >> 8) + 1] = {
+    [BLOCK_VERSION_SCRYPT >> 8]  = { "scrypt", _BRPoWScrypt, NULL }, // batched with a per-worker scratchpad
+    [BLOCK_VERSION_SHA256D >> 8] = { "sha256d", _BRPoWSHA256D, _BRPoWSHA256DBatch },
+    [BLOCK_VERSION_GROESTL >> 8] = { "groestl", _BRPoWGroestl, _BRPoWGroestlBatch },
+    [BLOCK_VERSION_SKEIN >> 8]   = { "skein", _BRPoWSkein, _BRPoWSkeinBatch },
+    [BLOCK_VERSION_QUBIT >> 8]   = { "qubit", _BRPoWQubit, _BRPoWQubitBatch },
+    [BLOCK_VERSION_ODO >> 8]     = { "odo", _BRPoWOdo, NULL }
+};
+
+// name of the proof-of-work algorithm selected by the BLOCK_VERSION_ALGO bits of version, or NULL if unknown
+const char *BRPoWAlgoName(uint32_t version)
+{
+    return _BRPoWAlgos[(version & BLOCK_VERSION_ALGO) >> 8].name;
+}
+
+// writes the proof-of-work hash of an 80 byte serialized header to powHash, using the algorithm selected by the
+// BLOCK_VERSION_ALGO bits of version
+// returns true on success, or false if the algorithm is unknown
+int BRPoWHash(uint32_t version, const uint8_t *header, UInt256 *powHash)
+{
+    const _BRPoWAlgo *algo = &_BRPoWAlgos[(version & BLOCK_VERSION_ALGO) >> 8];
+    
+    assert(header != NULL);
+    assert(powHash != NULL);
+    if (! algo->hash) return 0;
+    algo->hash(header, powHash);
+    return 1;
+}
+
 // returns number of bytes written to buf, or total bufLen needed if buf is NULL (block->height is not serialized)
 size_t BRMerkleBlockSerialize(const BRMerkleBlock *block, uint8_t *buf, size_t bufLen)
 {
@@ -305,19 +371,16 @@ static UInt256 _BRMerkleBlockRootR(const BRMerkleBlock *block, size_t *hashIdx,
     return md;
 }
 
-// true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
-// NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
-// target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
-int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
+// true if merkle tree and timestamp are valid and the difficulty target is in range, these are the cheap checks that
+// don't need the proof-of-work hash, t is set to the expanded target
+static int _BRMerkleBlockCheckHeader(const BRMerkleBlock *block, uint32_t currentTime, UInt256 *t)
 {
-    assert(block != NULL);
-    
     // target is in "compact" format, where the most significant byte is the size of resulting value in bytes, the next
     // bit is the sign, and the remaining 23bits is the value after having been right shifted by (size - 3)*8 bits
     static const uint32_t maxsize = MAX_PROOF_OF_WORK >> 24, maxtarget = MAX_PROOF_OF_WORK & 0x00ffffff;
     const uint32_t size = block->target >> 24, target = block->target & 0x00ffffff;
     size_t hashIdx = 0, flagIdx = 0;
-    UInt256 merkleRoot = _BRMerkleBlockRootR(block, &hashIdx, &flagIdx, 0), t = UINT256_ZERO;
+    UInt256 merkleRoot = _BRMerkleBlockRootR(block, &hashIdx, &flagIdx, 0);
     int r = 1;
     
     // check if merkle root is correct
@@ -341,21 +404,190 @@ int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
         digi_log("target is out of range: %x - %x - %x - %x", target, maxtarget, size, maxsize);
     }
     
-    if (size > 3) UInt32SetLE(&t.u8[size - 3], target);
-    else UInt32SetLE(t.u8, target >> (3 - size)*8);
+    // an out of range size would write past the end of t, so only expand the target once the range check passed
+    *t = UINT256_ZERO;
+    if (r && size > 3) UInt32SetLE(&t->u8[size - 3], target);
+    else if (r) UInt32SetLE(t->u8, target >> (3 - size)*8);
+    return r;
+}
+
+// true if powHash is at or below the expanded target t, a zero powHash is computed into a local first
+static int _BRMerkleBlockCheckPoW(const BRMerkleBlock *block, UInt256 powHash, UInt256 t)
+{
+    int r = 1;
+    
+    if (UInt256IsZero(powHash)) {
+        uint8_t header[80];
+        
+        _BRMerkleBlockHeader(block, header);
+        
+        if (! BRPoWHash(block->version, header, &powHash)) {
+            r = 0;
+
+            digi_log("unknown proof-of-work algorithm: %x, %s", block->version & BLOCK_VERSION_ALGO,
+                     log_u256_hex_encode(block->blockHash));
+        }
+    }
 
     for (int i = sizeof(t) - 1; r && i >= 0; i--) { // check proof-of-work
-        if (block->powHash.u8[i] < t.u8[i]) break;
-        if (block->powHash.u8[i] > t.u8[i]) {
+        if (powHash.u8[i] < t.u8[i]) break;
+        if (powHash.u8[i] > t.u8[i]) {
             r = 0;
 
-            digi_log("invalid blockHash[%d]: %x - %x, %s", i, block->powHash.u8[i], t.u8[i], log_u256_hex_encode(block->blockHash));
+            digi_log("invalid blockHash[%d]: %x - %x, %s", i, powHash.u8[i], t.u8[i], log_u256_hex_encode(block->blockHash));
         }
     }
 
     return r;
 }
 
+// true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
+// NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
+// target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
+int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime)
+{
+    UInt256 t;
+    
+    assert(block != NULL);
+    // a powHash already filled in by a batch check is used as is, otherwise it's computed into a local once the
+    // cheaper checks have passed, block is const so nothing is cached here
+    return (_BRMerkleBlockCheckHeader(block, currentTime, &t) && _BRMerkleBlockCheckPoW(block, block->powHash, t));
+}
+
+typedef struct {
+    const uint8_t *buf;
+    size_t headerLen;
+    BRMerkleBlock **blocks;
+    int *valid;
+    size_t count, next, validCount;
+    uint32_t currentTime;
+    pthread_mutex_t lock;
+} _BRMerkleBlockBatch;
+
+// computes powHash for the blocks in a chunk that passed the cheap checks, grouped by algorithm for those that have a
+// batch hash and one by one for the rest, scratch is the worker's scrypt scratchpad, allocated on first use
+static void _BRMerkleBlockPoWChunk(BRMerkleBlock *blocks[], const int valid[], size_t count, void **scratch)
+{
+    uint8_t headers[MERKLE_BLOCK_BATCH_CHUNK*80];
+    UInt256 md[MERKLE_BLOCK_BATCH_CHUNK];
+    size_t i, j, idx[MERKLE_BLOCK_BATCH_CHUNK];
+    uint32_t algo;
+    
+    for (algo = 0; algo <= BLOCK_VERSION_ALGO; algo += (1 << 8)) {
+        for (i = 0, j = 0; i < count && j < MERKLE_BLOCK_BATCH_CHUNK; i++) {
+            if (! valid[i] || (blocks[i]->version & BLOCK_VERSION_ALGO) != algo ||
+                ! UInt256IsZero(blocks[i]->powHash)) continue;
+            _BRMerkleBlockHeader(blocks[i], &headers[j*80]);
+            idx[j++] = i;
+        }
+        
+        if (j == 0 || ! _BRPoWAlgos[algo >> 8].hash) continue; // unknown algorithms fail in _BRMerkleBlockCheckPoW()
+        
+        if (algo == BLOCK_VERSION_SCRYPT) {
+            if (! *scratch) *scratch = malloc(BR_SCRYPT_BATCH_SCRATCH_SIZE);
+            assert(*scratch != NULL);
+            BRScrypt_1024_1_1_Batch(md, headers, j, *scratch);
+        }
+        else if (_BRPoWAlgos[algo >> 8].batch) _BRPoWAlgos[algo >> 8].batch(headers, md, j);
+        else for (i = 0; i < j; i++) _BRPoWAlgos[algo >> 8].hash(&headers[i*80], &md[i]);
+        
+        for (i = 0; i < j; i++) blocks[idx[i]]->powHash = md[i];
+    }
+}
+
+static void *_BRMerkleBlockBatchWorker(void *arg)
+{
+    _BRMerkleBlockBatch *batch = arg;
+    UInt256 t[MERKLE_BLOCK_BATCH_CHUNK];
+    size_t i, j, end, validCount = 0;
+    void *scratch = NULL;
+    
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next;
+        end = (i + MERKLE_BLOCK_BATCH_CHUNK < batch->count) ? i + MERKLE_BLOCK_BATCH_CHUNK : batch->count;
+        batch->next = end;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= end) break;
+        
+        for (j = i; batch->buf && j < end; j++) {
+            batch->blocks[j] = BRMerkleBlockParse(&batch->buf[batch->headerLen*j], batch->headerLen);
+        }
+        
+        // the proof-of-work hash is by far the most expensive check, so only headers that pass the others are hashed
+        for (j = i; j < end; j++) {
+            batch->valid[j] = (batch->blocks[j] && _BRMerkleBlockCheckHeader(batch->blocks[j], batch->currentTime,
+                                                                              &t[j - i]));
+        }
+        
+        _BRMerkleBlockPoWChunk(&batch->blocks[i], &batch->valid[i], end - i, &scratch);
+        
+        for (j = i; j < end; j++) {
+            if (batch->valid[j]) batch->valid[j] = _BRMerkleBlockCheckPoW(batch->blocks[j], batch->blocks[j]->powHash,
+                                                                          t[j - i]);
+            if (batch->valid[j]) validCount++;
+        }
+    }
+    
+    if (scratch) free(scratch);
+    pthread_mutex_lock(&batch->lock);
+    batch->validCount += validCount;
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+static size_t _BRMerkleBlockBatchRun(_BRMerkleBlockBatch *batch, size_t threadCount)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i, maxThreads = (batch->count + MERKLE_BLOCK_BATCH_THREAD_MIN - 1)/MERKLE_BLOCK_BATCH_THREAD_MIN;
+    pthread_t threads[MERKLE_BLOCK_BATCH_MAX_THREADS];
+    
+    if (threadCount == 0) threadCount = (cpus > 0) ? (size_t)cpus : 1;
+    if (threadCount > MERKLE_BLOCK_BATCH_MAX_THREADS) threadCount = MERKLE_BLOCK_BATCH_MAX_THREADS;
+    if (threadCount > maxThreads) threadCount = maxThreads; // small batches run on the calling thread alone
+    pthread_mutex_init(&batch->lock, NULL);
+    
+    // the calling thread is one of the workers, so only threadCount - 1 extra threads are started
+    for (i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, _BRMerkleBlockBatchWorker, batch) != 0) break;
+    }
+    
+    threadCount = i;
+    _BRMerkleBlockBatchWorker(batch);
+    for (i = 1; i < threadCount; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&batch->lock);
+    return batch->validCount;
+}
+
+// parses headersCount consecutive serialized headers, each headerLen bytes long, and checks them with
+// BRMerkleBlockIsValid() on up to threadCount threads (0 for one per cpu)
+// blocks[i] and valid[i] are set for the i-th header in buf, so results keep the order of the headers in the message
+// returns the number of valid headers, any blocks returned must be freed by calling BRMerkleBlockFree()
+size_t BRMerkleBlockParseBatch(BRMerkleBlock *blocks[], int valid[], const uint8_t *buf, size_t headerLen,
+                               size_t headersCount, uint32_t currentTime, size_t threadCount)
+{
+    _BRMerkleBlockBatch batch = { .buf = buf, .headerLen = headerLen, .blocks = blocks, .valid = valid,
+                                  .count = headersCount, .currentTime = currentTime };
+    
+    assert(blocks != NULL || headersCount == 0);
+    assert(valid != NULL || headersCount == 0);
+    assert(buf != NULL || headersCount == 0);
+    assert(headerLen >= 80);
+    return _BRMerkleBlockBatchRun(&batch, threadCount);
+}
+
+// checks already parsed blocks with BRMerkleBlockIsValid() on up to threadCount threads (0 for one per cpu)
+// valid[i] is set to the result for blocks[i], returns the number of valid blocks
+size_t BRMerkleBlockVerifyPoWBatch(BRMerkleBlock *blocks[], int valid[], size_t blocksCount, uint32_t currentTime,
+                                   size_t threadCount)
+{
+    _BRMerkleBlockBatch batch = { .blocks = blocks, .valid = valid, .count = blocksCount, .currentTime = currentTime };
+    
+    assert(blocks != NULL || blocksCount == 0);
+    assert(valid != NULL || blocksCount == 0);
+    return _BRMerkleBlockBatchRun(&batch, threadCount);
+}
+
 // true if the given tx hash is known to be included in the block
 int BRMerkleBlockContainsTxHash(const BRMerkleBlock *block, UInt256 txHash)
 {
@@ -48,6 +48,10 @@ extern "C" {
 #define BLOCK_UNKNOWN_HEIGHT      INT32_MAX
 #define BLOCK_MAX_TIME_DRIFT      (2*60*60) // the furthest in the future a block is allowed to be timestamped
 
+#define MERKLE_BLOCK_BATCH_CHUNK       16 // number of headers a batch worker claims at a time
+#define MERKLE_BLOCK_BATCH_MAX_THREADS 16 // upper limit for threads used by a single batch
+#define MERKLE_BLOCK_BATCH_THREAD_MIN  64 // headers per thread, smaller batches don't make up for starting a thread
+
 typedef struct {
     UInt256 blockHash;
     UInt256 powHash;
@@ -106,11 +110,32 @@ size_t BRMerkleBlockTxHashes(const BRMerkleBlock *block, UInt256 *txHashes, size
 void BRMerkleBlockSetTxHashes(BRMerkleBlock *block, const UInt256 hashes[], size_t hashesCount,
                               const uint8_t *flags, size_t flagsLen);
 
+// name of the proof-of-work algorithm selected by the BLOCK_VERSION_ALGO bits of version, or NULL if unknown
+const char *BRPoWAlgoName(uint32_t version);
+
+// writes the proof-of-work hash of an 80 byte serialized header to powHash, using the algorithm selected by the
+// BLOCK_VERSION_ALGO bits of version
+// returns true on success, or false if the algorithm is unknown
+int BRPoWHash(uint32_t version, const uint8_t *header, UInt256 *powHash);
+
 // true if merkle tree and timestamp are valid, and proof-of-work matches the stated difficulty target
+// a non-zero block->powHash is trusted as already computed, otherwise it is hashed on each call without being cached
 // NOTE: this only checks if the block difficulty matches the difficulty target in the header, it does not check if the
 // target is correct for the block's height in the chain - use BRMerkleBlockVerifyDifficulty() for that
 int BRMerkleBlockIsValid(const BRMerkleBlock *block, uint32_t currentTime);
 
+// parses headersCount consecutive serialized headers, each headerLen bytes long, and checks them with
+// BRMerkleBlockIsValid() on up to threadCount threads (0 for one per cpu), filling in powHash for the blocks it hashes
+// blocks[i] and valid[i] are set for the i-th header in buf, so results keep the order of the headers in the message
+// returns the number of valid headers, any blocks returned must be freed by calling BRMerkleBlockFree()
+size_t BRMerkleBlockParseBatch(BRMerkleBlock *blocks[], int valid[], const uint8_t *buf, size_t headerLen,
+                               size_t headersCount, uint32_t currentTime, size_t threadCount);
+
+// checks already parsed blocks with BRMerkleBlockIsValid() on up to threadCount threads (0 for one per cpu), filling in
+// powHash for the blocks it hashes, valid[i] is set to the result for blocks[i], returns the number of valid blocks
+size_t BRMerkleBlockVerifyPoWBatch(BRMerkleBlock *blocks[], int valid[], size_t blocksCount, uint32_t currentTime,
+                                   size_t threadCount);
+
 // true if the given tx hash is known to be included in the block
 int BRMerkleBlockContainsTxHash(const BRMerkleBlock *block, UInt256 txHash);
 
@@ -38,11 +38,17 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <netdb.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h> 
 #include <arpa/inet.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
 #define HEADER_LENGTH      24
 #define MAX_MSG_LENGTH     0x02000000u
 #define MAX_GETDATA_HASHES 50000
@@ -53,6 +59,27 @@
 #define CONNECT_TIMEOUT    10.0
 #define MESSAGE_TIMEOUT    10.0
 
+#define PEER_REACTOR_MAX_THREADS 16   // upper limit for event loop threads in a BRPeerReactor
+#define PEER_REACTOR_TICK        0.25 // seconds covered by each timer wheel slot
+#define PEER_REACTOR_SLOTS       64   // timer wheel slots, later deadlines are rechecked once per revolution
+#define PEER_REACTOR_EVENTS      64   // most socket events an event loop handles per wait
+#define PEER_REACTOR_READ_MAX    0x10000 // most bytes read from one socket per event, so busy peers can't starve others
+
+#ifndef MSG_NOSIGNAL   // linux based systems have a MSG_NOSIGNAL send flag, useful for supressing SIGPIPE signals
+#define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
+#endif
+
+#define PEER_SEND_QUEUE_MAX    0x100000 // senders off the event loop wait for the socket once this much is queued
+#define PEER_SEND_COALESCE_MAX 0x400    // smaller messages sent while servicing a peer are held and sent together
+#define PEER_SEND_IOV_MAX      64       // most queued messages gathered into one sendmsg() call
+
+#define PEER_FRAMER_SIZE     0x10000 // initial size of the buffer a peer's incoming messages are framed in
+#define PEER_FRAMER_READ_MIN 0x1000  // the framer buffer is compacted or grown when less than this is free for a read
+
+#define PEER_IO_IDLE       0 // not attached to a reactor event loop
+#define PEER_IO_CONNECTING 1 // waiting for the socket to connect
+#define PEER_IO_OPEN       2 // reading messages
+
 // the standard blockchain download protocol works as follows (for SPV mode):
 // - local peer sends getblocks
 // - remote peer reponds with inv containing up to 500 block hashes
@@ -88,6 +115,21 @@ typedef enum {
     inv_filtered_block = 3
 } inv_type;
 
+typedef struct _BRPeerLoop _BRPeerLoop;
+
+// buffers incoming bytes so each read() takes as much as the socket has, and messages are handed on as views into
+// the buffer rather than copies, the data between start and end is kept contiguous so a message never wraps
+typedef struct {
+    uint8_t *buf;
+    size_t start, end, capacity;
+} _BRPeerFramer;
+
+// a message, or what's left of it, waiting in a peer's outbound queue
+typedef struct {
+    uint8_t *buf; // header followed by payload
+    size_t len, off; // off is the number of bytes already sent
+} _BRPeerOutMsg;
+
 typedef struct {
     BRPeer peer; // superstruct on top of BRPeer
     uint32_t magicNumber;
@@ -114,6 +156,8 @@ typedef struct {
     void (*hasTx)(void *info, UInt256 txHash);
     void (*rejectedTx)(void *info, UInt256 txHash, uint8_t code);
     void (*relayedBlock)(void *info, BRMerkleBlock *block);
+    void (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount);
+    void (*relayedHeaders)(void *info, size_t headersCount);
     void (*notfound)(void *info, const UInt256 txHashes[], size_t txCount, const UInt256 blockHashes[],
                      size_t blockCount);
     void (*setFeePerKb)(void *info, uint64_t feePerKb);
@@ -125,6 +169,19 @@ typedef struct {
     void *volatile mempoolInfo;
     void (*volatile mempoolCallback)(void *info, int success);
     pthread_t thread;
+    pthread_mutex_t outLock; // guards outQueue and outBytes
+    _BRPeerOutMsg *outQueue; // messages waiting to be sent, in order
+    size_t outBytes; // unsent bytes in outQueue
+    int coalesce, inService, watchingOut, flushQueued;
+    pthread_t ioThread; // thread servicing the socket while inService is set
+    BRPeerReactor *reactor; // services the socket when set, instead of a thread per peer
+    _BRPeerLoop *volatile loop; // reactor event loop the peer is attached to
+    int fd, ioState, queued; // fd is owned by the event loop, socket is set to -1 when a disconnect is requested
+    _BRPeerFramer framer;
+    size_t loopIndex;
+    double msgTimeout;
+    uint64_t wheelTick; // timer wheel tick the peer is filed under, 0 if none
+    BRPeer *wheelNext, *wheelPrev;
 } BRPeerContext;
 
 void BRPeerSendVersionMessage(BRPeer *peer);
@@ -373,13 +430,20 @@ static int _BRPeerAcceptInvMessage(BRPeer *peer, const uint8_t *msg, size_t msgL
             }
             
             _BRPeerAddKnownTxHashes(peer, txHashes, j);
-            if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
-    
-            // to improve chain download performance, if we received 500 block hashes, request the next 500 block hashes
-            if (blockCount >= 500) {
-                UInt256 locators[] = { blockHashes[blockCount - 1], blockHashes[0] };
             
-                BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
+            if (ctx->relayedBlockHashes && blockCount > 0) { // the callback requests the blocks and the next hashes
+                if (j > 0) BRPeerSendGetdata(peer, txHashes, j, NULL, 0);
+                ctx->relayedBlockHashes(ctx->info, blockHashes, blockCount);
+            }
+            else {
+                if (j > 0 || blockCount > 0) BRPeerSendGetdata(peer, txHashes, j, blockHashes, blockCount);
+                
+                // to improve chain download performance, if we received 500 block hashes, request the next 500
+                if (blockCount >= 500) {
+                    UInt256 locators[] = { blockHashes[blockCount - 1], blockHashes[0] };
+                
+                    BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
+                }
             }
             
             if (txCount > 0 && ctx->mempoolCallback) {
@@ -454,17 +518,22 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
     
         // To improve chain download performance, if this message contains 2000 headers then request the next 2000
         // headers immediately, and switch to requesting blocks when we receive a header newer than earliestKeyTime
+        // (a relayedHeaders callback requests both instead, and then any number of headers can end the header chain)
         uint32_t timestamp = (count > 0) ? UInt32GetLE(&msg[off + 81*(count - 1) + 68]) : 0;
 
-        if (count >= 2000 || (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
+        if (count >= 2000 || ctx->relayedHeaders ||
+            (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime)) {
             size_t last = 0;
             time_t now = time(NULL);
             UInt256 locators[2];
             
-            BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
-            BRSHA256_2(&locators[1], &msg[off], 80);
+            if (count > 0) {
+                BRSHA256_2(&locators[0], &msg[off + 81*(count - 1)], 80);
+                BRSHA256_2(&locators[1], &msg[off], 80);
+            }
 
-            if (timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
+            if (! ctx->relayedHeaders &&
+                timestamp > 0 && timestamp + 7*24*60*60 + BLOCK_MAX_TIME_DRIFT >= ctx->earliestKeyTime) {
                 // request blocks for the remainder of the chain
                 timestamp = (++last < count) ? UInt32GetLE(&msg[off + 81*last + 68]) : 0;
 
@@ -475,21 +544,48 @@ static int _BRPeerAcceptHeadersMessage(BRPeer *peer, const uint8_t *msg, size_t
                 BRSHA256_2(&locators[0], &msg[off + 81*(last - 1)], 80);
                 BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
             }
-            else BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
+            else if (! ctx->relayedHeaders) BRPeerSendGetheaders(peer, locators, 2, UINT256_ZERO);
 
-            for (size_t i = 0; r && i < count; i++) {
-                BRMerkleBlock *block = BRMerkleBlockParse(&msg[off + 81*i], 81);
-                
-                if (! BRMerkleBlockIsValid(block, (uint32_t)now)) {
-                    peer_log(peer, "invalid block header: %s ", log_u256_hex_encode(block->blockHash));
-                    BRMerkleBlockFree(block);
+            // proof-of-work checks are done in parallel, blocks are still relayed in the order they were received
+            BRMerkleBlock **blocks = calloc(count, sizeof(*blocks));
+            int *valid = calloc(count, sizeof(*valid));
+            
+            assert(blocks != NULL || count == 0);
+            assert(valid != NULL || count == 0);
+#if defined(TARGET_OS_MAC) || defined(__ANDROID__) || defined(DEBUG) // only time the batch when peer_log() is built in
+            struct timeval tv;
+            double start, elapsed;
+            size_t validCount;
+            
+            gettimeofday(&tv, NULL);
+            start = tv.tv_sec + (double)tv.tv_usec/1000000;
+            validCount = BRMerkleBlockParseBatch(blocks, valid, &msg[off], 81, count, (uint32_t)now, 0);
+            gettimeofday(&tv, NULL);
+            elapsed = tv.tv_sec + (double)tv.tv_usec/1000000 - start;
+            peer_log(peer, "verified %zu of %zu header(s) in %.3fs, %.0f headers/s", validCount, count, elapsed,
+                     (elapsed > 0) ? count/elapsed : 0.0);
+#else
+            BRMerkleBlockParseBatch(blocks, valid, &msg[off], 81, count, (uint32_t)now, 0);
+#endif
+
+            for (size_t i = 0; i < count; i++) {
+                if (! r) {
+                    if (blocks[i]) BRMerkleBlockFree(blocks[i]);
+                }
+                else if (! valid[i]) {
+                    peer_log(peer, "invalid block header: %s ", log_u256_hex_encode(blocks[i]->blockHash));
+                    BRMerkleBlockFree(blocks[i]);
                     r = 0;
                 }
                 else if (ctx->relayedBlock) {
-                    ctx->relayedBlock(ctx->info, block);
+                    ctx->relayedBlock(ctx->info, blocks[i]);
                 }
-                else BRMerkleBlockFree(block);
+                else BRMerkleBlockFree(blocks[i]);
             }
+            
+            if (blocks) free(blocks);
+            if (valid) free(valid);
+            if (r && ctx->relayedHeaders) ctx->relayedHeaders(ctx->info, count);
         }
         else {
             peer_log(peer, "non-standard headers message, %zu is fewer header(s) than expected", count);
@@ -839,6 +935,25 @@ static int _BRPeerAcceptMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen,
     return r;
 }
 
+// fills in addr for connecting to peer from a socket in the given domain, and returns the address length
+static socklen_t _BRPeerSockAddr(const BRPeer *peer, int domain, struct sockaddr_storage *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    
+    if (domain == PF_INET6) {
+        ((struct sockaddr_in6 *)addr)->sin6_family = AF_INET6;
+        ((struct sockaddr_in6 *)addr)->sin6_addr = *(struct in6_addr *)&peer->address;
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(peer->port);
+        return sizeof(struct sockaddr_in6);
+    }
+    else {
+        ((struct sockaddr_in *)addr)->sin_family = AF_INET;
+        ((struct sockaddr_in *)addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
+        ((struct sockaddr_in *)addr)->sin_port = htons(peer->port);
+        return sizeof(struct sockaddr_in);
+    }
+}
+
 static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *error)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
@@ -869,21 +984,7 @@ static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *erro
     }
 
     if (r) {
-        memset(&addr, 0, sizeof(addr));
-        
-        if (domain == PF_INET6) {
-            ((struct sockaddr_in6 *)&addr)->sin6_family = AF_INET6;
-            ((struct sockaddr_in6 *)&addr)->sin6_addr = *(struct in6_addr *)&peer->address;
-            ((struct sockaddr_in6 *)&addr)->sin6_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in6);
-        }
-        else {
-            ((struct sockaddr_in *)&addr)->sin_family = AF_INET;
-            ((struct sockaddr_in *)&addr)->sin_addr = *(struct in_addr *)&peer->address.u32[3];
-            ((struct sockaddr_in *)&addr)->sin_port = htons(peer->port);
-            addrLen = sizeof(struct sockaddr_in);
-        }
-        
+        addrLen = _BRPeerSockAddr(peer, domain, &addr);
         if (connect(ctx->socket, (struct sockaddr *)&addr, addrLen) < 0) err = errno;
         
         if (err == EINPROGRESS) {
@@ -915,6 +1016,249 @@ static int _BRPeerOpenSocket(BRPeer *peer, int domain, double timeout, int *erro
     return r;
 }
 
+
+// checks the disconnect and mempool deadlines, returns ETIMEDOUT if the peer should be disconnected, 0 otherwise
+static int _BRPeerCheckTimers(BRPeer *peer, double time)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    if (time >= ctx->disconnectTime) return ETIMEDOUT;
+    
+    if (time >= ctx->mempoolTime) {
+        peer_log(peer, "done waiting for mempool response");
+        BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
+        ctx->mempoolCallback = NULL;
+        ctx->mempoolTime = DBL_MAX;
+    }
+    
+    return 0;
+}
+
+// checks a complete message header, returns EPROTO if the message can't be read, 0 otherwise
+static int _BRPeerCheckHeader(BRPeer *peer, const uint8_t *header)
+{
+    uint32_t msgLen = UInt32GetLE(&header[16]);
+    
+    (void)peer; // only used by peer_log(), which may be compiled out
+    
+    if (header[15] != 0) { // verify header type field is NULL terminated
+        peer_log(peer, "malformed message header: type not NULL terminated");
+        return EPROTO;
+    }
+    
+    if (msgLen > MAX_MSG_LENGTH) { // check message length
+        peer_log(peer, "error reading %s, message length %"PRIu32" is too long", (const char *)(&header[4]), msgLen);
+        return EPROTO;
+    }
+    
+    return 0;
+}
+
+// makes room in the framer buffer for len contiguous bytes from framer->start
+static void _BRPeerFramerReserve(_BRPeerFramer *framer, size_t len)
+{
+    if (framer->capacity - framer->start < len && framer->start > 0) { // move the buffered data to the front
+        memmove(framer->buf, &framer->buf[framer->start], framer->end - framer->start);
+        framer->end -= framer->start;
+        framer->start = 0;
+    }
+    
+    if (framer->capacity < len) {
+        framer->buf = realloc(framer->buf, (framer->capacity = len));
+        assert(framer->buf != NULL);
+    }
+}
+
+// reads as much as the socket has and the framer buffer can take in one call, returns the read() result
+static ssize_t _BRPeerFramerRead(_BRPeerFramer *framer, int socket)
+{
+    ssize_t n;
+    
+    if (framer->start == framer->end) framer->start = framer->end = 0;
+    
+    if (framer->capacity - framer->end < PEER_FRAMER_READ_MIN) {
+        _BRPeerFramerReserve(framer, framer->end - framer->start + PEER_FRAMER_READ_MIN);
+    }
+    
+    n = read(socket, &framer->buf[framer->end], framer->capacity - framer->end);
+    if (n > 0) framer->end += n;
+    return n;
+}
+
+// finds the next complete message in the framer buffer, skipping any bytes before the magic number, returns 1 and
+// points header and payload at it, 0 if more data is needed, or -1 with error set if the message can't be read
+// header and payload stay valid until the next _BRPeerFramerRead()
+static int _BRPeerFramerNext(BRPeer *peer, _BRPeerFramer *framer, const uint8_t **header, const uint8_t **payload,
+                             int *error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    const uint8_t *p;
+    uint32_t msgLen;
+    
+    while (framer->end - framer->start >= sizeof(uint32_t) &&
+           UInt32GetLE(&framer->buf[framer->start]) != ctx->magicNumber) {
+        p = memchr(&framer->buf[framer->start + 1], ctx->magicNumber & 0xff, framer->end - framer->start - 1);
+        framer->start = (p) ? (size_t)(p - framer->buf) : framer->end; // skip ahead to the next possible magic number
+    }
+    
+    if (framer->end - framer->start < HEADER_LENGTH) return 0;
+    *error = _BRPeerCheckHeader(peer, &framer->buf[framer->start]);
+    if (*error) return -1;
+    msgLen = UInt32GetLE(&framer->buf[framer->start + 16]);
+    
+    if (framer->end - framer->start < HEADER_LENGTH + msgLen) {
+        _BRPeerFramerReserve(framer, HEADER_LENGTH + msgLen);
+        return 0;
+    }
+    
+    *header = &framer->buf[framer->start];
+    *payload = &framer->buf[framer->start + HEADER_LENGTH];
+    framer->start += HEADER_LENGTH + msgLen;
+    return 1;
+}
+
+// verifies the payload checksum and processes the message, returns EPROTO if it's rejected, 0 otherwise
+static int _BRPeerReadMessage(BRPeer *peer, const uint8_t *header, const uint8_t *payload)
+{
+    const char *type = (const char *)(&header[4]);
+    uint32_t msgLen = UInt32GetLE(&header[16]), checksum = UInt32GetLE(&header[20]);
+    UInt256 hash;
+    
+    BRSHA256_2(&hash, payload, msgLen);
+    
+    if (UInt32GetLE(&hash) != checksum) { // verify checksum
+        peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32", SHA256_2:%s",
+                 type, UInt32GetLE(&hash), checksum, msgLen, log_u256_hex_encode(hash));
+        return EPROTO;
+    }
+    
+    return (_BRPeerAcceptMessage(peer, payload, msgLen, type)) ? 0 : EPROTO;
+}
+
+// true if messages sent to peer on the calling thread should be held in the outbound queue, and sent together with
+// any others once the thread is done servicing the peer
+static int _BRPeerDefersSend(BRPeerContext *ctx, size_t len)
+{
+    return (ctx->coalesce && len <= PEER_SEND_COALESCE_MAX && ctx->inService &&
+            pthread_equal(ctx->ioThread, pthread_self()));
+}
+
+// queues what's left of a message once sent bytes have gone out, call with outLock held
+static void _BRPeerSendQueueAdd(BRPeerContext *ctx, const uint8_t *header, const uint8_t *msg, size_t msgLen,
+                                size_t sent)
+{
+    _BRPeerOutMsg out = { NULL, HEADER_LENGTH + msgLen - sent, 0 };
+    
+    out.buf = malloc(out.len);
+    assert(out.buf != NULL);
+    
+    if (sent < HEADER_LENGTH) {
+        memcpy(out.buf, &header[sent], HEADER_LENGTH - sent);
+        if (msgLen > 0) memcpy(&out.buf[HEADER_LENGTH - sent], msg, msgLen);
+    }
+    else memcpy(out.buf, &msg[sent - HEADER_LENGTH], out.len);
+    
+    array_add(ctx->outQueue, out);
+    ctx->outBytes += out.len;
+}
+
+// sends as much of the outbound queue as the socket takes without blocking, gathering up to PEER_SEND_IOV_MAX
+// messages per sendmsg() call, returns an errno.h code on failure, call with outLock held
+static int _BRPeerSendQueued(BRPeerContext *ctx, int socket)
+{
+    struct iovec iov[PEER_SEND_IOV_MAX];
+    struct msghdr hdr;
+    size_t i, count, len;
+    ssize_t n;
+    
+    while (array_count(ctx->outQueue) > 0) {
+        count = (array_count(ctx->outQueue) < PEER_SEND_IOV_MAX) ? array_count(ctx->outQueue) : PEER_SEND_IOV_MAX;
+        
+        for (i = 0; i < count; i++) {
+            iov[i].iov_base = &ctx->outQueue[i].buf[ctx->outQueue[i].off];
+            iov[i].iov_len = ctx->outQueue[i].len - ctx->outQueue[i].off;
+        }
+        
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = iov;
+        hdr.msg_iovlen = (int)count;
+        n = sendmsg(socket, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) return (errno == EWOULDBLOCK || errno == EAGAIN || errno == EINTR) ? 0 : errno;
+        ctx->outBytes -= n;
+        
+        for (i = 0; i < count && n > 0; i++) {
+            len = ctx->outQueue[i].len - ctx->outQueue[i].off;
+            if (len > (size_t)n) len = n;
+            ctx->outQueue[i].off += len;
+            n -= len;
+            if (ctx->outQueue[i].off == ctx->outQueue[i].len) free(ctx->outQueue[i].buf);
+        }
+        
+        if (i > 0 && ctx->outQueue[i - 1].off < ctx->outQueue[i - 1].len) i--; // last one was only partly sent
+        array_rm_range(ctx->outQueue, 0, i);
+        if (i < count) break; // the socket buffer is full
+    }
+    
+    return 0;
+}
+
+// sends the outbound queue, waiting for the socket to take all of it, or with a reactor, until less than
+// PEER_SEND_QUEUE_MAX is left, returns an errno.h code on failure, call with outLock held and never from an event loop
+// thread, which would stall every other peer on the loop
+static int _BRPeerSendFlush(BRPeer *peer, int socket)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct timeval tv;
+    int error = _BRPeerSendQueued(ctx, socket);
+    
+    while (! error && ctx->socket == socket && array_count(ctx->outQueue) > 0 &&
+           (! ctx->reactor || ctx->outBytes > PEER_SEND_QUEUE_MAX)) {
+        struct pollfd fds = { socket, POLLOUT, 0 };
+        
+        poll(&fds, 1, 1000); // wait for room in the send buffer rather than spinning on a non-blocking socket
+        error = _BRPeerSendQueued(ctx, socket);
+        gettimeofday(&tv, NULL);
+        if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
+    }
+    
+    return error;
+}
+
+static void _BRPeerSendQueueClear(BRPeerContext *ctx)
+{
+    pthread_mutex_lock(&ctx->outLock);
+    for (size_t i = 0; i < array_count(ctx->outQueue); i++) free(ctx->outQueue[i].buf);
+    array_clear(ctx->outQueue);
+    ctx->outBytes = 0;
+    pthread_mutex_unlock(&ctx->outLock);
+}
+
+// closes socket and notifies the peer's callbacks that it disconnected, after which peer may have been freed
+static void _BRPeerDidDisconnect(BRPeer *peer, int socket, int error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    ctx->socket = -1;
+    ctx->status = BRPeerStatusDisconnected;
+    ctx->inService = 0;
+    if (socket >= 0) close(socket);
+    _BRPeerSendQueueClear(ctx);
+    peer_log(peer, "disconnected");
+    
+    while (array_count(ctx->pongCallback) > 0) {
+        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
+        void *pongInfo = ctx->pongInfo[0];
+        
+        array_rm(ctx->pongCallback, 0);
+        array_rm(ctx->pongInfo, 0);
+        if (pongCallback) pongCallback(pongInfo, 0);
+    }
+
+    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
+    ctx->mempoolCallback = NULL;
+    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
+}
+
 static void *_peerThreadRoutine(void *arg)
 {
     BRPeer *peer = arg;
@@ -925,120 +1269,555 @@ static void *_peerThreadRoutine(void *arg)
     
     if (_BRPeerOpenSocket(peer, PF_INET6, CONNECT_TIMEOUT, &error)) {
         struct timeval tv;
-        double time = 0, msgTimeout;
-        uint8_t header[HEADER_LENGTH], *payload = malloc(0x1000);
-        size_t len = 0, payloadLen = 0x1000;
+        double time = 0, msgTimeout = DBL_MAX;
+        _BRPeerFramer framer = { malloc(PEER_FRAMER_SIZE), 0, 0, PEER_FRAMER_SIZE };
+        const uint8_t *header = NULL, *payload = NULL;
         ssize_t n = 0;
 
-        assert(payload != NULL);
+        assert(framer.buf != NULL);
         gettimeofday(&tv, NULL);
         ctx->startTime = tv.tv_sec + (double)tv.tv_usec/1000000;
+        ctx->ioThread = pthread_self();
+        ctx->inService = 1;
         BRPeerSendVersionMessage(peer);
         
         while (ctx->socket >= 0 && ! error) {
-            len = 0;
+            if (_BRPeerFramerNext(peer, &framer, &header, &payload, &error) > 0) {
+                msgTimeout = DBL_MAX;
+                error = _BRPeerReadMessage(peer, header, payload);
+                continue;
+            }
+            
             socket = ctx->socket;
+            if (socket < 0 || error) break;
             
-            while (socket >= 0 && ! error && len < HEADER_LENGTH) {
-                n = read(socket, &header[len], sizeof(header) - len);
-                if (n > 0) len += n;
-                if (n == 0) error = ECONNRESET;
-                if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                gettimeofday(&tv, NULL);
-                time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                if (! error && time >= ctx->disconnectTime) error = ETIMEDOUT;
-
-                if (! error && time >= ctx->mempoolTime) {
-                    peer_log(peer, "done waiting for mempool response");
-                    BRPeerSendPing(peer, ctx->mempoolInfo, ctx->mempoolCallback);
-                    ctx->mempoolCallback = NULL;
-                    ctx->mempoolTime = DBL_MAX;
-                }
+            if (ctx->outBytes > 0) { // send any messages held while processing what was read
+                pthread_mutex_lock(&ctx->outLock);
+                error = _BRPeerSendFlush(peer, socket);
+                pthread_mutex_unlock(&ctx->outLock);
                 
-                while (sizeof(uint32_t) <= len && UInt32GetLE(header) != ctx->magicNumber) {
-                    memmove(header, &header[1], --len); // consume one byte at a time until we find the magic number
+                if (error) {
+                    peer_log(peer, "%s", strerror(error));
+                    break;
                 }
-                
-                socket = ctx->socket;
             }
             
-            if (error) {
-                peer_log(peer, "%s", strerror(error));
+            n = _BRPeerFramerRead(&framer, socket);
+            if (n == 0) error = ECONNRESET;
+            if (n < 0 && errno != EWOULDBLOCK) error = errno;
+            if (ctx->socket < 0) error = 0; // BRPeerDisconnect() was called, so the socket is expected to fail
+            gettimeofday(&tv, NULL);
+            time = tv.tv_sec + (double)tv.tv_usec/1000000;
+            if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT; // a partial message has to keep arriving
+            if (! error) error = _BRPeerCheckTimers(peer, time);
+            if (! error && framer.start < framer.end && time >= msgTimeout) error = ETIMEDOUT;
+            if (error) peer_log(peer, "%s", strerror(error));
+        }
+        
+        free(framer.buf);
+    }
+    
+    _BRPeerDidDisconnect(peer, ctx->socket, error);
+    pthread_cleanup_pop(1);
+    return NULL; // detached threads don't need to return a value
+}
+
+// a BRPeerReactor event loop, one thread waiting on the sockets of all the peers attached to it, with a timer wheel
+// for their deadlines in place of the one second socket timeouts a peer thread polls them with
+struct _BRPeerLoop {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int pollFd, wakeFd[2]; // writing to wakeFd[1] wakes the loop to pick up queued peers
+    BRPeer **queued; // peers with a connect, disconnect or earlier deadline to pick up, guarded by lock
+    BRPeer **pending, **peers; // queued peers being picked up, and peers attached to the loop, loop thread only
+    BRPeer **flush; // peers with messages held to be sent once the loop is idle, loop thread only
+    BRPeer *wheel[PEER_REACTOR_SLOTS];
+    uint64_t tick; // last timer wheel tick handled
+    struct pollfd *pollFds; // only used where epoll isn't available
+    volatile int done;
+};
+
+struct BRPeerReactorStruct {
+    _BRPeerLoop *loops;
+    size_t loopCount, nextLoop;
+    pthread_mutex_t lock;
+};
+
+static void _BRPeerLoopWake(_BRPeerLoop *loop)
+{
+    uint8_t b = 0;
+    
+    while (write(loop->wakeFd[1], &b, 1) < 0 && errno == EINTR);
+}
+
+static void _BRPeerLoopDrain(_BRPeerLoop *loop)
+{
+    uint8_t buf[64];
+    
+    while (read(loop->wakeFd[0], buf, sizeof(buf)) > 0);
+}
+
+#if defined(__linux__)
+
+// registers the peer socket with the loop for the event its ioState waits on
+static int _BRPeerLoopWatch(_BRPeerLoop *loop, BRPeer *peer, int add)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct epoll_event event;
+    
+    event.events = (ctx->ioState != PEER_IO_OPEN) ? EPOLLOUT : (ctx->watchingOut) ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    event.data.ptr = peer;
+    return epoll_ctl(loop->pollFd, (add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, ctx->fd, &event);
+}
+
+static void _BRPeerLoopUnwatch(_BRPeerLoop *loop, BRPeer *peer)
+{
+    struct epoll_event event = { 0 }; // linux before 2.6.9 requires a non-NULL event for EPOLL_CTL_DEL
+    
+    epoll_ctl(loop->pollFd, EPOLL_CTL_DEL, ((BRPeerContext *)peer)->fd, &event);
+}
+
+// waits up to timeout milliseconds (-1 for no limit) for socket events, returns the number of peers written to ready
+static size_t _BRPeerLoopWait(_BRPeerLoop *loop, int timeout, BRPeer *ready[PEER_REACTOR_EVENTS])
+{
+    struct epoll_event events[PEER_REACTOR_EVENTS];
+    int i, n = epoll_wait(loop->pollFd, events, PEER_REACTOR_EVENTS, timeout);
+    size_t count = 0;
+    
+    for (i = 0; i < n; i++) {
+        if (events[i].data.ptr) ready[count++] = events[i].data.ptr;
+        else _BRPeerLoopDrain(loop);
+    }
+    
+    return count;
+}
+
+#else // poll() fallback, the pollfd list is rebuilt from the attached peers on each wait
+
+static int _BRPeerLoopWatch(_BRPeerLoop *loop, BRPeer *peer, int add)
+{
+    return 0;
+}
+
+static void _BRPeerLoopUnwatch(_BRPeerLoop *loop, BRPeer *peer)
+{
+}
+
+// waits up to timeout milliseconds (-1 for no limit) for socket events, returns the number of peers written to ready
+static size_t _BRPeerLoopWait(_BRPeerLoop *loop, int timeout, BRPeer *ready[PEER_REACTOR_EVENTS])
+{
+    size_t i, count = 0, peerCount = array_count(loop->peers);
+    BRPeerContext *ctx;
+    
+    array_set_count(loop->pollFds, peerCount + 1);
+    loop->pollFds[0].fd = loop->wakeFd[0];
+    loop->pollFds[0].events = POLLIN;
+    loop->pollFds[0].revents = 0;
+    
+    for (i = 0; i < peerCount; i++) {
+        ctx = (BRPeerContext *)loop->peers[i];
+        loop->pollFds[i + 1].fd = ctx->fd;
+        loop->pollFds[i + 1].events = (ctx->ioState != PEER_IO_OPEN) ? POLLOUT :
+                                      (ctx->watchingOut) ? POLLIN | POLLOUT : POLLIN;
+        loop->pollFds[i + 1].revents = 0;
+    }
+    
+    if (poll(loop->pollFds, (nfds_t)(peerCount + 1), timeout) > 0) {
+        if (loop->pollFds[0].revents) _BRPeerLoopDrain(loop);
+        
+        for (i = 0; i < peerCount && count < PEER_REACTOR_EVENTS; i++) {
+            if (loop->pollFds[i + 1].revents) ready[count++] = loop->peers[i];
+        }
+    }
+    
+    return count;
+}
+
+#endif
+
+// hands peer to its event loop to pick up a connect, disconnect or earlier deadline, does nothing once it's detached
+static void _BRPeerLoopQueue(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    _BRPeerLoop *loop = ctx->loop;
+    
+    if (loop) {
+        pthread_mutex_lock(&loop->lock);
+        
+        if (ctx->loop == loop && ! ctx->queued) {
+            if (array_count(loop->queued) == 0) _BRPeerLoopWake(loop);
+            array_add(loop->queued, peer);
+            ctx->queued = 1;
+        }
+        
+        pthread_mutex_unlock(&loop->lock);
+    }
+}
+
+static void _BRPeerLoopUnschedule(_BRPeerLoop *loop, BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    if (ctx->wheelTick != 0) {
+        if (ctx->wheelPrev) ((BRPeerContext *)ctx->wheelPrev)->wheelNext = ctx->wheelNext;
+        else loop->wheel[ctx->wheelTick % PEER_REACTOR_SLOTS] = ctx->wheelNext;
+        if (ctx->wheelNext) ((BRPeerContext *)ctx->wheelNext)->wheelPrev = ctx->wheelPrev;
+        ctx->wheelNext = ctx->wheelPrev = NULL;
+        ctx->wheelTick = 0;
+    }
+}
+
+// files peer in the timer wheel slot for its earliest deadline, unless it's already filed under an earlier tick
+// deadlines that move later are left where they are, and refiled when their slot comes up
+static void _BRPeerLoopSchedule(_BRPeerLoop *loop, BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    double deadline = ctx->disconnectTime;
+    uint64_t tick = loop->tick + PEER_REACTOR_SLOTS;
+    size_t slot;
+    
+    if (ctx->mempoolTime < deadline) deadline = ctx->mempoolTime;
+    if (ctx->msgTimeout < deadline) deadline = ctx->msgTimeout;
+    if (deadline == DBL_MAX) return;
+    if (deadline < tick*PEER_REACTOR_TICK) tick = (uint64_t)(deadline/PEER_REACTOR_TICK) + 1;
+    if (tick > loop->tick + PEER_REACTOR_SLOTS) tick = loop->tick + PEER_REACTOR_SLOTS;
+    if (tick <= loop->tick) tick = loop->tick + 1;
+    
+    if (ctx->wheelTick == 0 || ctx->wheelTick > tick) {
+        _BRPeerLoopUnschedule(loop, peer);
+        slot = tick % PEER_REACTOR_SLOTS;
+        ctx->wheelTick = tick;
+        ctx->wheelNext = loop->wheel[slot];
+        if (ctx->wheelNext) ((BRPeerContext *)ctx->wheelNext)->wheelPrev = peer;
+        loop->wheel[slot] = peer;
+    }
+}
+
+// detaches peer from the loop, closes its socket and calls its disconnected and threadCleanup callbacks, the same as a
+// peer thread does before it exits, after which peer may have been freed
+static void _BRPeerLoopClose(_BRPeerLoop *loop, BRPeer *peer, int error)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    void *info = ctx->info;
+    void (*threadCleanup)(void *info) = ctx->threadCleanup;
+    BRPeer *last = loop->peers[array_count(loop->peers) - 1];
+    int fd = ctx->fd;
+    
+    pthread_mutex_lock(&loop->lock);
+    ctx->loop = NULL;
+    
+    for (size_t i = array_count(loop->queued); ctx->queued && i > 0; i--) {
+        if (loop->queued[i - 1] != peer) continue;
+        array_rm(loop->queued, i - 1);
+        ctx->queued = 0;
+    }
+    
+    pthread_mutex_unlock(&loop->lock);
+    
+    for (size_t i = array_count(loop->flush); ctx->flushQueued && i > 0; i--) {
+        if (loop->flush[i - 1] != peer) continue;
+        array_rm(loop->flush, i - 1);
+        ctx->flushQueued = 0;
+    }
+    
+    _BRPeerLoopUnschedule(loop, peer);
+    ((BRPeerContext *)last)->loopIndex = ctx->loopIndex;
+    loop->peers[ctx->loopIndex] = last;
+    array_rm_last(loop->peers);
+    if (fd >= 0) _BRPeerLoopUnwatch(loop, peer);
+    ctx->fd = -1;
+    ctx->ioState = PEER_IO_IDLE;
+    ctx->watchingOut = 0;
+    ctx->framer.start = ctx->framer.end = 0;
+    ctx->msgTimeout = DBL_MAX;
+    _BRPeerDidDisconnect(peer, fd, error);
+    threadCleanup(info);
+}
+
+// starts a non-blocking connect to peer, the loop finishes it once the socket is writable
+static void _BRPeerLoopOpen(_BRPeerLoop *loop, BRPeer *peer, int domain)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    struct sockaddr_storage addr;
+    socklen_t addrLen = _BRPeerSockAddr(peer, domain, &addr);
+    int arg, err = 0, on = 1;
+    
+    ctx->fd = socket(domain, SOCK_STREAM, 0);
+    ctx->socket = ctx->fd;
+    
+    if (ctx->fd < 0) {
+        err = errno;
+    }
+    else {
+        setsockopt(ctx->fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE // BSD based systems have a SO_NOSIGPIPE socket option to supress SIGPIPE signals
+        setsockopt(ctx->fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        arg = fcntl(ctx->fd, F_GETFL, NULL);
+        if (arg < 0 || fcntl(ctx->fd, F_SETFL, arg | O_NONBLOCK) < 0) err = errno;
+        if (! err && connect(ctx->fd, (struct sockaddr *)&addr, addrLen) < 0 && errno != EINPROGRESS) err = errno;
+        if (! err && _BRPeerLoopWatch(loop, peer, 1) < 0) err = errno;
+    }
+    
+    if (err && domain == PF_INET6 && _BRPeerIsIPv4(peer) && ctx->fd >= 0 && ctx->socket == ctx->fd) {
+        close(ctx->fd);
+        _BRPeerLoopOpen(loop, peer, PF_INET); // fallback to IPv4
+    }
+    else if (err) {
+        peer_log(peer, "connect error: %s", strerror(err));
+        _BRPeerLoopClose(loop, peer, err);
+    }
+    else _BRPeerLoopSchedule(loop, peer);
+}
+
+// true if the calling thread is one of the reactor's event loop threads
+static int _BRPeerReactorIsLoopThread(BRPeerReactor *reactor)
+{
+    for (size_t i = 0; i < reactor->loopCount; i++) {
+        if (pthread_equal(reactor->loops[i].thread, pthread_self())) return 1;
+    }
+    
+    return 0;
+}
+
+// sends what the peer's outbound queue holds without blocking, and watches for the socket to become writable while
+// anything is left
+static void _BRPeerLoopFlush(_BRPeerLoop *loop, BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int queued, error = 0;
+    
+    if (ctx->socket >= 0 && pthread_mutex_trylock(&ctx->outLock) == 0) { // if locked, the sender flushes it
+        error = _BRPeerSendQueued(ctx, ctx->fd);
+        queued = (array_count(ctx->outQueue) > 0);
+        pthread_mutex_unlock(&ctx->outLock);
+        
+        if (error) {
+            peer_log(peer, "%s", strerror(error));
+            BRPeerDisconnect(peer);
+        }
+        else if (queued != ctx->watchingOut) {
+            ctx->watchingOut = queued;
+            _BRPeerLoopWatch(loop, peer, 0);
+        }
+    }
+}
+
+// reads and processes the messages that have arrived from peer, returns an errno.h code if the connection failed
+static int _BRPeerLoopRead(BRPeer *peer, double time)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    const uint8_t *header = NULL, *payload = NULL;
+    size_t total = 0;
+    ssize_t n = 0;
+    int error = 0;
+    
+    while (! error && ctx->socket >= 0) {
+        if (_BRPeerFramerNext(peer, &ctx->framer, &header, &payload, &error) > 0) {
+            error = _BRPeerReadMessage(peer, header, payload);
+            continue;
+        }
+        
+        if (error || total >= PEER_REACTOR_READ_MAX) break;
+        n = _BRPeerFramerRead(&ctx->framer, ctx->fd);
+        if (n == 0) error = ECONNRESET;
+        if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) error = errno;
+        if (error) peer_log(peer, "%s", strerror(error));
+        if (n <= 0) break;
+        total += n;
+    }
+    
+    // a partial message has to keep arriving
+    if (ctx->framer.start == ctx->framer.end) ctx->msgTimeout = DBL_MAX;
+    else if (total > 0) ctx->msgTimeout = time + MESSAGE_TIMEOUT;
+    return error;
+}
+
+// handles a socket event for peer
+static void _BRPeerLoopService(_BRPeerLoop *loop, BRPeer *peer, double time)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    socklen_t optLen = sizeof(int);
+    int error = 0;
+    
+    if (ctx->socket < 0) {
+        _BRPeerLoopClose(loop, peer, 0);
+    }
+    else if (ctx->ioState == PEER_IO_CONNECTING) {
+        ctx->ioState = PEER_IO_OPEN;
+        if (getsockopt(ctx->fd, SOL_SOCKET, SO_ERROR, &error, &optLen) < 0) error = errno;
+        if (! error && _BRPeerLoopWatch(loop, peer, 0) < 0) error = errno;
+        
+        if (error) {
+            peer_log(peer, "connect error: %s", strerror(error));
+            _BRPeerLoopClose(loop, peer, error);
+        }
+        else {
+            peer_log(peer, "socket connected");
+            ctx->startTime = time;
+            BRPeerSendVersionMessage(peer);
+        }
+    }
+    else {
+        if (ctx->watchingOut) _BRPeerLoopFlush(loop, peer); // the socket may have room for more of the queue
+        if (ctx->socket >= 0) error = _BRPeerLoopRead(peer, time);
+        
+        if (error || ctx->socket < 0) {
+            _BRPeerLoopClose(loop, peer, error);
+        }
+        else _BRPeerLoopSchedule(loop, peer);
+    }
+}
+
+// picks up queued peers: attaching newly connecting ones, closing those with a disconnect request, and refiling the
+// rest in the timer wheel
+static void _BRPeerLoopDequeue(_BRPeerLoop *loop)
+{
+    BRPeer **pending, *peer;
+    BRPeerContext *ctx;
+    
+    pthread_mutex_lock(&loop->lock);
+    pending = loop->queued;
+    loop->queued = loop->pending;
+    loop->pending = pending;
+    for (size_t i = 0; i < array_count(pending); i++) ((BRPeerContext *)pending[i])->queued = 0;
+    pthread_mutex_unlock(&loop->lock);
+    
+    for (size_t i = 0; i < array_count(pending); i++) {
+        peer = pending[i];
+        ctx = (BRPeerContext *)peer;
+        
+        if (ctx->ioState == PEER_IO_IDLE) {
+            ctx->ioState = PEER_IO_CONNECTING;
+            ctx->ioThread = pthread_self();
+            ctx->inService = 1;
+            ctx->loopIndex = array_count(loop->peers);
+            array_add(loop->peers, peer);
+            
+            if (! ctx->framer.buf) {
+                ctx->framer.buf = malloc((ctx->framer.capacity = PEER_FRAMER_SIZE));
+                assert(ctx->framer.buf != NULL);
             }
-            else if (header[15] != 0) { // verify header type field is NULL terminated
-                peer_log(peer, "malformed message header: type not NULL terminated");
-                error = EPROTO;
+            
+            _BRPeerLoopOpen(loop, peer, PF_INET6);
+        }
+        else if (ctx->socket < 0) {
+            _BRPeerLoopClose(loop, peer, 0);
+        }
+        else {
+            if (ctx->ioState == PEER_IO_OPEN) _BRPeerLoopFlush(loop, peer);
+            _BRPeerLoopSchedule(loop, peer);
+        }
+    }
+    
+    array_clear(pending);
+}
+
+// checks the deadlines of the peers filed under timer wheel ticks up to time
+static void _BRPeerLoopTimers(_BRPeerLoop *loop, double time)
+{
+    uint64_t tick = (uint64_t)(time/PEER_REACTOR_TICK);
+    BRPeer *peer, *next;
+    BRPeerContext *ctx;
+    size_t slot;
+    int error;
+    
+    while (loop->tick < tick) {
+        slot = ++loop->tick % PEER_REACTOR_SLOTS;
+        peer = loop->wheel[slot];
+        loop->wheel[slot] = NULL;
+        
+        for (; peer; peer = next) {
+            ctx = (BRPeerContext *)peer;
+            next = ctx->wheelNext;
+            ctx->wheelNext = ctx->wheelPrev = NULL;
+            ctx->wheelTick = 0;
+            error = _BRPeerCheckTimers(peer, time);
+            if (! error && time >= ctx->msgTimeout) error = ETIMEDOUT;
+            
+            if (ctx->socket < 0) {
+                _BRPeerLoopClose(loop, peer, 0);
             }
-            else if (len == HEADER_LENGTH) {
-                const char *type = (const char *)(&header[4]);
-                uint32_t msgLen = UInt32GetLE(&header[16]);
-                uint32_t checksum = UInt32GetLE(&header[20]);
-                UInt256 hash;
-                
-                if (msgLen > MAX_MSG_LENGTH) { // check message length
-                    peer_log(peer, "error reading %s, message length %"PRIu32" is too long", type, msgLen);
-                    error = EPROTO;
-                }
-                else {
-                    if (msgLen > payloadLen) payload = realloc(payload, (payloadLen = msgLen));
-                    assert(payload != NULL);
-                    len = 0;
-                    socket = ctx->socket;
-                    msgTimeout = time + MESSAGE_TIMEOUT;
-                    
-                    while (socket >= 0 && ! error && len < msgLen) {
-                        n = read(socket, &payload[len], msgLen - len);
-                        if (n > 0) len += n;
-                        if (n == 0) error = ECONNRESET;
-                        if (n < 0 && errno != EWOULDBLOCK) error = errno;
-                        gettimeofday(&tv, NULL);
-                        time = tv.tv_sec + (double)tv.tv_usec/1000000;
-                        if (n > 0) msgTimeout = time + MESSAGE_TIMEOUT;
-                        if (! error && time >= msgTimeout) error = ETIMEDOUT;
-                        socket = ctx->socket;
-                    }
-                    
-                    if (error) {
-                        peer_log(peer, "%s", strerror(error));
-                    }
-                    else if (len == msgLen) {
-                        BRSHA256_2(&hash, payload, msgLen);
-                        
-                        if (UInt32GetLE(&hash) != checksum) { // verify checksum
-                            peer_log(peer, "error reading %s, invalid checksum %x, expected %x, payload length:%"PRIu32
-                                     ", SHA256_2:%s", type, UInt32GetLE(&hash), checksum, msgLen,
-                                     log_u256_hex_encode(hash));
-                            error = EPROTO;
-                        }
-                        else if (! _BRPeerAcceptMessage(peer, payload, msgLen, type)) error = EPROTO;
-                    }
-                }
+            else if (error) {
+                peer_log(peer, "%s", strerror(error));
+                _BRPeerLoopClose(loop, peer, error);
             }
+            else _BRPeerLoopSchedule(loop, peer);
         }
-        
-        free(payload);
     }
+}
+
+static void *_peerLoopRoutine(void *arg)
+{
+    _BRPeerLoop *loop = arg;
+    BRPeer *ready[PEER_REACTOR_EVENTS];
+    struct timeval tv;
+    double time, wait;
+    size_t i, count;
+    int timeout;
     
-    socket = ctx->socket;
-    ctx->socket = -1;
-    ctx->status = BRPeerStatusDisconnected;
-    if (socket >= 0) close(socket);
-    peer_log(peer, "disconnected");
-    
-    while (array_count(ctx->pongCallback) > 0) {
-        void (*pongCallback)(void *, int) = ctx->pongCallback[0];
-        void *pongInfo = ctx->pongInfo[0];
+    while (! loop->done) {
+        for (i = 0; i < array_count(loop->flush); i++) { // send messages held while servicing peers
+            ((BRPeerContext *)loop->flush[i])->flushQueued = 0;
+            _BRPeerLoopFlush(loop, loop->flush[i]);
+        }
         
-        array_rm(ctx->pongCallback, 0);
-        array_rm(ctx->pongInfo, 0);
-        if (pongCallback) pongCallback(pongInfo, 0);
+        array_clear(loop->flush);
+        gettimeofday(&tv, NULL);
+        time = tv.tv_sec + (double)tv.tv_usec/1000000;
+        wait = (loop->tick + 1)*PEER_REACTOR_TICK - time;
+        timeout = (array_count(loop->peers) == 0) ? -1 : (wait > 0) ? (int)(wait*1000) + 1 : 0;
+        count = _BRPeerLoopWait(loop, timeout, ready);
+        gettimeofday(&tv, NULL);
+        time = tv.tv_sec + (double)tv.tv_usec/1000000;
+        for (i = 0; i < count; i++) _BRPeerLoopService(loop, ready[i], time);
+        _BRPeerLoopDequeue(loop);
+        _BRPeerLoopTimers(loop, time);
     }
+    
+    return NULL;
+}
 
-    if (ctx->mempoolCallback) ctx->mempoolCallback(ctx->mempoolInfo, 0);
-    ctx->mempoolCallback = NULL;
-    if (ctx->disconnected) ctx->disconnected(ctx->info, error);
-    pthread_cleanup_pop(1);
-    return NULL; // detached threads don't need to return a value
+static void _BRPeerLoopFree(_BRPeerLoop *loop)
+{
+    if (loop->pollFd >= 0) close(loop->pollFd);
+    if (loop->wakeFd[0] >= 0) close(loop->wakeFd[0]);
+    if (loop->wakeFd[1] >= 0) close(loop->wakeFd[1]);
+    array_free(loop->queued);
+    array_free(loop->pending);
+    array_free(loop->peers);
+    array_free(loop->flush);
+    if (loop->pollFds) array_free(loop->pollFds);
+    pthread_mutex_destroy(&loop->lock);
+}
+
+// sets up the loop and starts its thread, returns true on success
+static int _BRPeerLoopStart(_BRPeerLoop *loop, double time)
+{
+#if defined(__linux__)
+    struct epoll_event event = { EPOLLIN, { NULL } }; // the wake pipe is the only registration without a peer
+#endif
+    int r = 1;
+    
+    pthread_mutex_init(&loop->lock, NULL);
+    array_new(loop->queued, 10);
+    array_new(loop->pending, 10);
+    array_new(loop->peers, 10);
+    array_new(loop->flush, 10);
+    loop->tick = (uint64_t)(time/PEER_REACTOR_TICK);
+    loop->pollFd = loop->wakeFd[0] = loop->wakeFd[1] = -1;
+    if (pipe(loop->wakeFd) < 0) r = 0;
+    if (r && fcntl(loop->wakeFd[0], F_SETFL, fcntl(loop->wakeFd[0], F_GETFL, NULL) | O_NONBLOCK) < 0) r = 0;
+    if (r && fcntl(loop->wakeFd[1], F_SETFL, fcntl(loop->wakeFd[1], F_GETFL, NULL) | O_NONBLOCK) < 0) r = 0;
+#if defined(__linux__)
+    if (r && (loop->pollFd = epoll_create(PEER_REACTOR_EVENTS)) < 0) r = 0;
+    if (r && epoll_ctl(loop->pollFd, EPOLL_CTL_ADD, loop->wakeFd[0], &event) < 0) r = 0;
+#else
+    array_new(loop->pollFds, 11);
+#endif
+    if (r && pthread_create(&loop->thread, NULL, _peerLoopRoutine, loop) != 0) r = 0;
+    if (! r) _BRPeerLoopFree(loop);
+    return r;
 }
 
 static void _dummyThreadCleanup(void *info)
@@ -1063,6 +1842,11 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
     ctx->mempoolTime = DBL_MAX;
     ctx->disconnectTime = DBL_MAX;
     ctx->socket = -1;
+    ctx->fd = -1;
+    ctx->msgTimeout = DBL_MAX;
+    ctx->coalesce = 1;
+    array_new(ctx->outQueue, 10);
+    pthread_mutex_init(&ctx->outLock, NULL);
     ctx->threadCleanup = _dummyThreadCleanup;
     return &ctx->peer;
 }
@@ -1078,7 +1862,8 @@ BRPeer *BRPeerNew(uint32_t magicNumber)
 // void notfound(void *, const UInt256[], size_t, const UInt256[], size_t) - called when "notfound" message is received
 // BRTransaction *requestedTx(void *, UInt256) - called when "getdata" message with a tx hash is received from peer
 // int networkIsReachable(void *) - must return true when networking is available, false otherwise
-// void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup
+// void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup, or when a reactor
+// event loop is done with the peer
 void BRPeerSetCallbacks(BRPeer *peer, void *info,
                         void (*connected)(void *info),
                         void (*disconnected)(void *info, int error),
@@ -1123,6 +1908,29 @@ void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight)
     ((BRPeerContext *)peer)->currentBlockHeight = currentBlockHeight;
 }
 
+// connections opened after this is set are serviced by reactor instead of a thread per peer, NULL to use threads
+// only call this while the peer is disconnected
+void BRPeerSetReactor(BRPeer *peer, BRPeerReactor *reactor)
+{
+    ((BRPeerContext *)peer)->reactor = reactor;
+}
+
+// block hashes from inv messages are passed to relayedBlockHashes instead of being requested from the peer, leaving
+// it to the callback to send getdata for the blocks, and getblocks for the hashes after them, NULL to turn this off
+void BRPeerSetRelayedBlockHashes(BRPeer *peer,
+                                 void (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount))
+{
+    ((BRPeerContext *)peer)->relayedBlockHashes = relayedBlockHashes;
+}
+
+// headers are passed to relayedBlock without requesting more headers or blocks after them, and relayedHeaders is
+// called with the number of headers once a headers message is done, leaving it to the callback to send getheaders for
+// the rest of the header chain and getdata for filtered blocks, NULL to turn this off
+void BRPeerSetRelayedHeaders(BRPeer *peer, void (*relayedHeaders)(void *info, size_t headersCount))
+{
+    ((BRPeerContext *)peer)->relayedHeaders = relayedHeaders;
+}
+
 // current connection status
 BRPeerStatus BRPeerConnectStatus(BRPeer *peer)
 {
@@ -1150,7 +1958,13 @@ void BRPeerConnect(BRPeer *peer)
             gettimeofday(&tv, NULL);
             ctx->disconnectTime = tv.tv_sec + (double)tv.tv_usec/1000000 + CONNECT_TIMEOUT;
 
-            if (pthread_attr_init(&attr) != 0) {
+            if (ctx->reactor) { // hand the peer to the reactor event loops in turn
+                pthread_mutex_lock(&ctx->reactor->lock);
+                ctx->loop = &ctx->reactor->loops[ctx->reactor->nextLoop++ % ctx->reactor->loopCount];
+                pthread_mutex_unlock(&ctx->reactor->lock);
+                _BRPeerLoopQueue(peer);
+            }
+            else if (pthread_attr_init(&attr) != 0) {
                 error = ENOMEM;
                 peer_log(peer, "error creating thread");
                 ctx->status = BRPeerStatusDisconnected;
@@ -1172,12 +1986,13 @@ void BRPeerConnect(BRPeer *peer)
 void BRPeerDisconnect(BRPeer *peer)
 {
     BRPeerContext *ctx = (BRPeerContext *)peer;
+    BRPeerReactor *reactor = ctx->reactor;
     int socket = ctx->socket;
 
     if (socket >= 0) {
         ctx->socket = -1;
         if (shutdown(socket, SHUT_RDWR) < 0) peer_log(peer, "shutdown error: %s", strerror(errno));
-        close(socket);
+        if (! reactor) close(socket); // with a reactor, the shutdown wakes the event loop, which closes the socket
     }
 }
 
@@ -1189,6 +2004,14 @@ void BRPeerScheduleDisconnect(BRPeer *peer, double seconds)
     
     gettimeofday(&tv, NULL);
     ctx->disconnectTime = (seconds < 0) ? DBL_MAX : tv.tv_sec + (double)tv.tv_usec/1000000 + seconds;
+    if (ctx->reactor) _BRPeerLoopQueue(peer); // refile the peer in case the new deadline is earlier
+}
+
+// set to false to send each message as it's made, rather than holding small messages made while the peer's socket is
+// being serviced and sending them together once it's done (on by default)
+void BRPeerSetSendCoalescing(BRPeer *peer, int coalesce)
+{
+    ((BRPeerContext *)peer)->coalesce = coalesce;
 }
 
 // call this when wallet addresses need to be added to bloom filter
@@ -1242,9 +2065,17 @@ uint64_t BRPeerFeePerKb(BRPeer *peer)
     return ((BRPeerContext *)peer)->feePerKb;
 }
 
-#ifndef MSG_NOSIGNAL   // linux based systems have a MSG_NOSIGNAL send flag, useful for supressing SIGPIPE signals
-#define MSG_NOSIGNAL 0 // set to 0 if undefined (BSD has the SO_NOSIGPIPE sockopt, and windows has no signals at all)
-#endif
+// number of bytes queued to be sent to peer
+size_t BRPeerSendQueueSize(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    size_t outBytes;
+    
+    pthread_mutex_lock(&ctx->outLock);
+    outBytes = ctx->outBytes;
+    pthread_mutex_unlock(&ctx->outLock);
+    return outBytes;
+}
 
 // sends a bitcoin protocol message to peer
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
@@ -1254,40 +2085,54 @@ void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const ch
     }
     else {
         BRPeerContext *ctx = (BRPeerContext *)peer;
-        uint8_t buf[HEADER_LENGTH + msgLen], hash[32];
-        size_t off = 0;
+        uint8_t header[HEADER_LENGTH], hash[32];
+        struct iovec iov[2];
+        struct msghdr hdr;
         ssize_t n = 0;
-        struct timeval tv;
-        int socket, error = 0;
+        int socket, defer, queued = 0, error = 0;
         
-        UInt32SetLE(&buf[off], ctx->magicNumber);
-        off += sizeof(uint32_t);
-        strncpy((char *)&buf[off], type, 12);
-        off += 12;
-        UInt32SetLE(&buf[off], (uint32_t)msgLen);
-        off += sizeof(uint32_t);
+        UInt32SetLE(&header[0], ctx->magicNumber);
+        strncpy((char *)&header[4], type, 12);
+        UInt32SetLE(&header[16], (uint32_t)msgLen);
         BRSHA256_2(hash, msg, msgLen);
-        memcpy(&buf[off], hash, sizeof(uint32_t));
-        off += sizeof(uint32_t);
-        memcpy(&buf[off], msg, msgLen);
+        memcpy(&header[20], hash, sizeof(uint32_t));
         peer_log(peer, "sending %s", type);
-        msgLen = 0;
         socket = ctx->socket;
         if (socket < 0) error = ENOTCONN;
+        pthread_mutex_lock(&ctx->outLock);
+        defer = _BRPeerDefersSend(ctx, HEADER_LENGTH + msgLen);
         
-        while (socket >= 0 && ! error && msgLen < sizeof(buf)) {
-            n = send(socket, &buf[msgLen], sizeof(buf) - msgLen, MSG_NOSIGNAL);
-            if (n >= 0) msgLen += n;
-            if (n < 0 && errno != EWOULDBLOCK) error = errno;
-            gettimeofday(&tv, NULL);
-            if (! error && tv.tv_sec + (double)tv.tv_usec/1000000 >= ctx->disconnectTime) error = ETIMEDOUT;
-            socket = ctx->socket;
+        if (! error && ! defer && array_count(ctx->outQueue) == 0) { // nothing queued ahead, send from msg directly
+            iov[0].iov_base = header;
+            iov[0].iov_len = HEADER_LENGTH;
+            iov[1].iov_base = (void *)msg;
+            iov[1].iov_len = msgLen;
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_iov = iov;
+            hdr.msg_iovlen = 2;
+            n = sendmsg(socket, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) error = errno;
+            if (n < 0) n = 0;
         }
         
+        if (! error && (size_t)n < HEADER_LENGTH + msgLen) _BRPeerSendQueueAdd(ctx, header, msg, msgLen, n);
+        // an event loop thread leaves the rest queued for the loop to send as the socket has room, whatever its size
+        if (! error && ! defer && ctx->reactor && _BRPeerReactorIsLoopThread(ctx->reactor)) {
+            error = _BRPeerSendQueued(ctx, socket);
+        }
+        else if (! error && ! defer) error = _BRPeerSendFlush(peer, socket);
+        queued = (array_count(ctx->outQueue) > 0);
+        pthread_mutex_unlock(&ctx->outLock);
+        
         if (error) {
             peer_log(peer, "%s", strerror(error));
             BRPeerDisconnect(peer);
         }
+        else if (queued && defer && ctx->loop && ! ctx->flushQueued) { // the event loop sends it once it's idle
+            array_add(ctx->loop->flush, peer);
+            ctx->flushQueued = 1;
+        }
+        else if (queued && ctx->reactor) _BRPeerLoopQueue(peer); // the event loop sends the rest
     }
 }
 
@@ -1366,6 +2211,7 @@ void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t known
             ctx->mempoolTime = tv.tv_sec + (double)tv.tv_usec/1000000 + 10.0;
             ctx->mempoolInfo = info;
             ctx->mempoolCallback = completionCallback;
+            if (ctx->reactor) _BRPeerLoopQueue(peer);
         }
         
         BRPeerSendMessage(peer, NULL, 0, MSG_MEMPOOL);
@@ -1532,10 +2378,105 @@ void BRPeerFree(BRPeer *peer)
     if (ctx->knownTxHashSet) BRSetFree(ctx->knownTxHashSet);
     if (ctx->pongInfo) array_free(ctx->pongInfo);
     if (ctx->pongCallback) array_free(ctx->pongCallback);
+    if (ctx->framer.buf) free(ctx->framer.buf);
+    _BRPeerSendQueueClear(ctx);
+    array_free(ctx->outQueue);
+    pthread_mutex_destroy(&ctx->outLock);
     free(ctx);
 }
 
+// returns a newly allocated BRPeerReactor that must be freed by calling BRPeerReactorFree(), or NULL if none of its
+// event loop threads could be started
+// the reactor services the sockets of the peers set to use it on threadCount event loop threads (0 for one per cpu)
+BRPeerReactor *BRPeerReactorNew(size_t threadCount)
+{
+    BRPeerReactor *reactor = calloc(1, sizeof(*reactor));
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timeval tv;
+    
+    assert(reactor != NULL);
+    if (threadCount == 0) threadCount = (cpus > 0) ? (size_t)cpus : 1;
+    if (threadCount > PEER_REACTOR_MAX_THREADS) threadCount = PEER_REACTOR_MAX_THREADS;
+    reactor->loops = calloc(threadCount, sizeof(*reactor->loops));
+    assert(reactor->loops != NULL);
+    pthread_mutex_init(&reactor->lock, NULL);
+    gettimeofday(&tv, NULL);
+    
+    while (reactor->loopCount < threadCount &&
+           _BRPeerLoopStart(&reactor->loops[reactor->loopCount], tv.tv_sec + (double)tv.tv_usec/1000000)) {
+        reactor->loopCount++;
+    }
+    
+    if (reactor->loopCount == 0) {
+        peer_log(&BR_PEER_NONE, "error starting reactor");
+        BRPeerReactorFree(reactor);
+        reactor = NULL;
+    }
+    
+    return reactor;
+}
+
+// stops the reactor threads and frees memory, peers using reactor must be disconnected first
+void BRPeerReactorFree(BRPeerReactor *reactor)
+{
+    for (size_t i = 0; i < reactor->loopCount; i++) {
+        reactor->loops[i].done = 1;
+        _BRPeerLoopWake(&reactor->loops[i]);
+        pthread_join(reactor->loops[i].thread, NULL);
+        _BRPeerLoopFree(&reactor->loops[i]);
+    }
+    
+    free(reactor->loops);
+    pthread_mutex_destroy(&reactor->lock);
+    free(reactor);
+}
+
 void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type)
 {
     _BRPeerAcceptMessage(peer, msg, msgLen, type);
 }
+
+void BRPeerSetConnectedTest(BRPeer *peer)
+{
+    ((BRPeerContext *)peer)->status = BRPeerStatusConnected;
+}
+
+void BRPeerAcceptPongTest(BRPeer *peer)
+{
+    uint8_t msg[sizeof(uint64_t)];
+    
+    UInt64SetLE(msg, ((BRPeerContext *)peer)->nonce);
+    _BRPeerAcceptMessage(peer, msg, sizeof(msg), MSG_PONG);
+}
+
+// attaches a connected socket to peer, serviced on the calling thread by BRPeerServiceTest() instead of an event loop
+void BRPeerSetSocketTest(BRPeer *peer, int socket)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    
+    if (! ctx->framer.buf) {
+        ctx->framer.buf = malloc((ctx->framer.capacity = PEER_FRAMER_SIZE));
+        assert(ctx->framer.buf != NULL);
+    }
+    
+    ctx->socket = ctx->fd = socket;
+    ctx->status = BRPeerStatusConnected;
+    ctx->ioThread = pthread_self();
+    ctx->inService = 1;
+}
+
+// reads and processes what the socket has for peer, then sends as much of its outbound queue as the socket takes, the
+// same as an event loop servicing it, returns an errno.h code if the connection failed or a message was rejected
+int BRPeerServiceTest(BRPeer *peer)
+{
+    BRPeerContext *ctx = (BRPeerContext *)peer;
+    int error = _BRPeerLoopRead(peer, 0);
+    
+    if (! error) {
+        pthread_mutex_lock(&ctx->outLock);
+        error = _BRPeerSendQueued(ctx, ctx->fd);
+        pthread_mutex_unlock(&ctx->outLock);
+    }
+    
+    return error;
+}
@@ -125,6 +125,10 @@ typedef struct {
 
 #define BR_PEER_NONE ((BRPeer) { UINT128_ZERO, 0, 0, 0, 0 })
 
+// a reactor services the sockets of many peers on a few event loop threads (epoll on linux, poll() elsewhere), in
+// place of the thread per peer that BRPeerConnect() starts otherwise, with the same callbacks in either case
+typedef struct BRPeerReactorStruct BRPeerReactor;
+
 // NOTE: BRPeer functions are not thread-safe
 
 // returns a newly allocated BRPeer struct that must be freed by calling BRPeerFree()
@@ -141,7 +145,8 @@ BRPeer *BRPeerNew(uint32_t magicNumber);
 // void notfound(void *, const UInt256[], size_t, const UInt256[], size_t) - called when "notfound" message is received
 // BRTransaction *requestedTx(void *, UInt256) - called when "getdata" message with a tx hash is received from peer
 // int networkIsReachable(void *) - must return true when networking is available, false otherwise
-// void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup
+// void threadCleanup(void *) - called before a thread terminates to faciliate any needed cleanup, or when a reactor
+// event loop is done with the peer
 void BRPeerSetCallbacks(BRPeer *peer, void *info,
                         void (*connected)(void *info),
                         void (*disconnected)(void *info, int error),
@@ -157,12 +162,26 @@ void BRPeerSetCallbacks(BRPeer *peer, void *info,
                         int (*networkIsReachable)(void *info),
                         void (*threadCleanup)(void *info));
 
+// block hashes from inv messages are passed to relayedBlockHashes instead of being requested from the peer, leaving
+// it to the callback to send getdata for the blocks, and getblocks for the hashes after them, NULL to turn this off
+void BRPeerSetRelayedBlockHashes(BRPeer *peer,
+                                 void (*relayedBlockHashes)(void *info, const UInt256 blockHashes[], size_t blockCount));
+
+// headers are passed to relayedBlock without requesting more headers or blocks after them, and relayedHeaders is
+// called with the number of headers once a headers message is done, leaving it to the callback to send getheaders for
+// the rest of the header chain and getdata for filtered blocks, NULL to turn this off
+void BRPeerSetRelayedHeaders(BRPeer *peer, void (*relayedHeaders)(void *info, size_t headersCount));
+
 // set earliestKeyTime to wallet creation time in order to speed up initial sync
 void BRPeerSetEarliestKeyTime(BRPeer *peer, uint32_t earliestKeyTime);
 
 // call this when local best block height changes (helps detect tarpit nodes)
 void BRPeerSetCurrentBlockHeight(BRPeer *peer, uint32_t currentBlockHeight);
 
+// connections opened after this is set are serviced by reactor instead of a thread per peer, NULL to use threads
+// only call this while the peer is disconnected
+void BRPeerSetReactor(BRPeer *peer, BRPeerReactor *reactor);
+
 // current connection status
 BRPeerStatus BRPeerConnectStatus(BRPeer *peer);
 
@@ -178,6 +197,10 @@ void BRPeerScheduleDisconnect(BRPeer *peer, double seconds);
 // set this to true when wallet addresses need to be added to bloom filter
 void BRPeerSetNeedsFilterUpdate(BRPeer *peer, int needsFilterUpdate);
 
+// set to false to send each message as it's made, rather than holding small messages made while the peer's socket is
+// being serviced and sending them together once it's done (on by default)
+void BRPeerSetSendCoalescing(BRPeer *peer, int coalesce);
+
 // display name of peer address
 const char *BRPeerHost(BRPeer *peer);
 
@@ -196,7 +219,11 @@ uint64_t BRPeerFeePerKb(BRPeer *peer);
 // average ping time for connected peer
 double BRPeerPingTime(BRPeer *peer);
 
-// sends a bitcoin protocol message to peer
+// number of bytes queued to be sent to peer
+size_t BRPeerSendQueueSize(BRPeer *peer);
+
+// sends a bitcoin protocol message to peer, whatever the socket can't take right away is queued and sent in order
+// the caller waits for the queue to drain, or with a reactor, only while the queue is over its size limit
 void BRPeerSendMessage(BRPeer *peer, const uint8_t *msg, size_t msgLen, const char *type);
 void BRPeerSendFilterload(BRPeer *peer, const uint8_t *filter, size_t filterLen);
 void BRPeerSendMempool(BRPeer *peer, const UInt256 knownTxHashes[], size_t knownTxCount, void *info,
@@ -232,6 +259,14 @@ inline static int BRPeerEq(const void *peer, const void *otherPeer)
 // frees memory allocated for peer
 void BRPeerFree(BRPeer *peer);
 
+// returns a newly allocated BRPeerReactor that must be freed by calling BRPeerReactorFree(), or NULL if none of its
+// event loop threads could be started
+// the reactor services the sockets of the peers set to use it on threadCount event loop threads (0 for one per cpu)
+BRPeerReactor *BRPeerReactorNew(size_t threadCount);
+
+// stops the reactor threads and frees memory, peers using reactor must be disconnected first
+void BRPeerReactorFree(BRPeerReactor *reactor);
+
 #ifdef __cplusplus
 }
 #endif
@@ -43,6 +43,12 @@
 #define MAX_CONNECT_FAILURES  20 // notify user of network problems after this many connect failures in a row
 #define PEER_FLAG_SYNCED      0x01
 #define PEER_FLAG_NEEDSUPDATE 0x02
+#define PEER_FLAG_DOWNLOADING 0x04 // downloading filtered blocks alongside the download peer
+#define PEER_FLAG_STALLED     0x08 // kept the oldest outstanding block waiting too long, gets no more to download
+#define DOWNLOAD_WINDOW       128  // most filtered blocks requested from one peer at a time in parallel download mode
+#define DOWNLOAD_QUEUE_MAX    1000 // most block hashes queued for download at a time
+#define HEADER_CHAIN_MAX      20000 // most verified header hashes kept ahead of the chain, 32 bytes each
+#define DOWNLOAD_STALL_TIME   5    // seconds the oldest outstanding block can take before it's requested elsewhere
 
 #define genesis_block_hash(params) UInt256Reverse((params)->checkpoints[0].hash)
 
@@ -80,6 +86,14 @@ typedef struct {
     BRPeer *peers;
 } BRTxPeerList;
 
+typedef struct {
+    UInt256 blockHash;
+    BRPeer *peer; // peer the block was requested from, NULL until it's requested
+    time_t requestTime;
+    BRMerkleBlock *block; // the block once it arrives, held until the blocks before it have arrived
+    BRPeer *source; // peer the block arrived from, NULL if it has disconnected since
+} BRBlockDownload;
+
 // true if peer is contained in the list of peers associated with txHash
 static int _BRTxPeerListHasPeer(const BRTxPeerList *list, UInt256 txHash, const BRPeer *peer)
 {
@@ -190,6 +204,12 @@ struct BRPeerManagerStruct {
     BRMerkleBlock *lastBlock, *lastOrphan;
     BRMerkleBlock *startSyncFrom;
     BRTxPeerList *txRelays, *txRequests;
+    int parallelDownload, downloadDraining, headersPending, headersMore;
+    BRBlockDownload *downloads; // filtered blocks being downloaded in parallel, in chain order
+    BRPeer **drainedPeers; // peers that disconnected while blocks they sent were being drained, freed after the drain
+    UInt256 *headerHashes; // verified header chain the downloads are queued from, in chain order
+    size_t headerStart, headerQueued; // hashes before headerStart are in the chain, and before headerQueued queued
+    BRMerkleBlock *headerTip; // most recent verified header
     BRPublishedTx *publishedTx;
     UInt256 *publishedTxHashes;
     void *info;
@@ -200,6 +220,7 @@ struct BRPeerManagerStruct {
     void (*savePeers)(void *info, int replace, const BRPeer peers[], size_t peersCount);
     int (*networkIsReachable)(void *info);
     void (*threadCleanup)(void *info);
+    BRPeerReactor *reactor;
     pthread_mutex_t lock;
 };
 
@@ -372,6 +393,219 @@ static void _BRPeerManagerLoadBloomFilter(BRPeerManager *manager, BRPeer *peer)
     BRPeerSendFilterload(peer, data, len);
 }
 
+// true if peer is downloading the chain, either as the download peer or alongside it in parallel download mode
+static int _BRPeerManagerIsDownloading(BRPeerManager *manager, BRPeer *peer)
+{
+    return (peer == manager->downloadPeer || (peer->flags & PEER_FLAG_DOWNLOADING) != 0);
+}
+
+// returns the position of blockHash in the parallel download queue, or SIZE_MAX if it isn't queued
+static size_t _BRPeerManagerDownloadIndex(BRPeerManager *manager, UInt256 blockHash)
+{
+    for (size_t i = 0; i < array_count(manager->downloads); i++) {
+        if (UInt256Eq(manager->downloads[i].blockHash, blockHash)) return i;
+    }
+    
+    return SIZE_MAX;
+}
+
+// drops the parallel download queue, along with any blocks in it that arrived ahead of the ones before them
+static void _BRPeerManagerClearDownloads(BRPeerManager *manager)
+{
+    for (size_t i = array_count(manager->downloads); i > 0; i--) {
+        if (manager->downloads[i - 1].block) BRMerkleBlockFree(manager->downloads[i - 1].block);
+    }
+    
+    array_clear(manager->downloads);
+    manager->headerQueued = manager->headerStart; // blocks still missing are queued again from the header chain
+}
+
+// drops the header chain, along with the downloads queued from it
+static void _BRPeerManagerClearHeaders(BRPeerManager *manager)
+{
+    _BRPeerManagerClearDownloads(manager);
+    array_clear(manager->headerHashes);
+    manager->headerStart = manager->headerQueued = 0;
+    if (manager->headerTip) BRMerkleBlockFree(manager->headerTip);
+    manager->headerTip = NULL;
+    manager->headersPending = manager->headersMore = 0;
+}
+
+// asks the download peer for the headers after the header chain, unless a request is already pending, the last one
+// reached the peer's best block, or the header chain is too far ahead of the chain
+static void _BRPeerManagerRequestHeaders(BRPeerManager *manager)
+{
+    if (! manager->downloadPeer || manager->headersPending || ! manager->headersMore ||
+        array_count(manager->headerHashes) - manager->headerStart + 2000 > HEADER_CHAIN_MAX) return;
+    
+    UInt256 locators[_BRPeerManagerBlockLocators(manager, NULL, 0) + 1];
+    size_t count = 0;
+    
+    if (manager->headerTip) locators[count++] = manager->headerTip->blockHash;
+    count += _BRPeerManagerBlockLocators(manager, &locators[count], sizeof(locators)/sizeof(*locators) - count);
+    manager->headersPending = 1;
+    BRPeerSendGetheaders(manager->downloadPeer, locators, count, UINT256_ZERO);
+}
+
+// queues block hashes from the header chain, hands them out in ranges of up to DOWNLOAD_WINDOW to each peer
+// downloading the chain, and asks the download peer for more headers once the header chain has room for them
+static void _BRPeerManagerRequestBlocks(BRPeerManager *manager)
+{
+    BRBlockDownload *downloads;
+    size_t i, j, n, fewest = 0, count, peerCount = 0;
+    BRPeer *peer, *peers[array_count(manager->connectedPeers) + 1];
+    size_t inFlight[sizeof(peers)/sizeof(*peers)];
+    UInt256 hashes[DOWNLOAD_WINDOW];
+    time_t now = time(NULL);
+    
+    if (! manager->bloomFilter) return; // filter update pending
+    
+    while (manager->headerStart < manager->headerQueued &&
+           BRSetContains(manager->blocks, &manager->headerHashes[manager->headerStart])) manager->headerStart++;
+    
+    if (manager->headerStart > 0 && manager->headerStart >= array_count(manager->headerHashes)/2) {
+        array_rm_range(manager->headerHashes, 0, manager->headerStart);
+        manager->headerQueued -= manager->headerStart;
+        manager->headerStart = 0;
+    }
+    
+    while (array_count(manager->downloads) < DOWNLOAD_QUEUE_MAX &&
+           manager->headerQueued < array_count(manager->headerHashes)) {
+        UInt256 hash = manager->headerHashes[manager->headerQueued++];
+        
+        if (BRSetContains(manager->blocks, &hash)) continue; // also relayed by a peer outside the download queue
+        array_add(manager->downloads, ((BRBlockDownload) { hash, NULL, 0, NULL, NULL }));
+    }
+    
+    downloads = manager->downloads;
+    count = array_count(downloads);
+    
+    for (i = array_count(manager->connectedPeers); i > 0; i--) {
+        peer = manager->connectedPeers[i - 1];
+        if (BRPeerConnectStatus(peer) != BRPeerStatusConnected || ! _BRPeerManagerIsDownloading(manager, peer) ||
+            (peer->flags & (PEER_FLAG_NEEDSUPDATE | PEER_FLAG_STALLED)) != 0) continue;
+        peers[peerCount++] = peer;
+    }
+    
+    for (i = 0; i < count && downloads[i].block; i++);
+    peer = (i < count && downloads[i].requestTime + DOWNLOAD_STALL_TIME < now) ? downloads[i].peer : NULL;
+    
+    for (j = peerCount; peer && j > 0; j--) {
+        if (peers[j - 1] == peer) peers[j - 1] = peers[--peerCount];
+    }
+    
+    for (j = 0; j < peerCount; j++) {
+        for (i = 0, inFlight[j] = 0; i < count; i++) {
+            if (downloads[i].peer == peers[j] && ! downloads[i].block) inFlight[j]++;
+        }
+        
+        if (inFlight[j] < inFlight[fewest]) fewest = j;
+    }
+    
+    // the blocks after the oldest outstanding one can't be used until it arrives, so if its peer is taking too long,
+    // its outstanding blocks go to the peer with the fewest in flight, even past that peer's window
+    if (peer && peerCount > 0) {
+        peer_log(peer, "block download stalled, requesting its blocks from another peer");
+        peer->flags |= PEER_FLAG_STALLED;
+        
+        for (i = 0, n = 0; i < count && n < DOWNLOAD_WINDOW; i++) {
+            if (downloads[i].peer != peer || downloads[i].block) continue;
+            downloads[i].peer = peers[fewest];
+            downloads[i].requestTime = now;
+            hashes[n++] = downloads[i].blockHash;
+        }
+        
+        if (n > 0) BRPeerSendGetdata(peers[fewest], NULL, 0, hashes, n);
+        
+        if (n > 0 && inFlight[fewest] == 0 && peers[fewest] != manager->downloadPeer) {
+            BRPeerScheduleDisconnect(peers[fewest], PROTOCOL_TIMEOUT/2);
+        }
+        
+        inFlight[fewest] += n;
+    }
+    
+    for (j = 0; j < peerCount; j++) {
+        if (inFlight[j] > DOWNLOAD_WINDOW/2) continue; // top up the window once half of it has arrived
+        
+        for (i = 0, n = 0; i < count && inFlight[j] + n < DOWNLOAD_WINDOW; i++) {
+            if (downloads[i].peer || downloads[i].block) continue;
+            downloads[i].peer = peers[j];
+            downloads[i].requestTime = now;
+            hashes[n++] = downloads[i].blockHash;
+        }
+        
+        if (n > 0) BRPeerSendGetdata(peers[j], NULL, 0, hashes, n);
+        
+        // a peer that stops sending blocks is dropped before it can hold up the download peer's sync timeout
+        if (n > 0 && inFlight[j] == 0 && peers[j] != manager->downloadPeer) {
+            BRPeerScheduleDisconnect(peers[j], PROTOCOL_TIMEOUT/2);
+        }
+    }
+    
+    _BRPeerManagerRequestHeaders(manager);
+}
+
+static void _downloadFilterLoadDone(void *info, int success)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    free(info);
+    
+    if (success) { // blocks requested before the new filter was loaded have all arrived by the time of the pong
+        pthread_mutex_lock(&manager->lock);
+        peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
+        _BRPeerManagerRequestBlocks(manager);
+        pthread_mutex_unlock(&manager->lock);
+    }
+}
+
+static void _peerRelayedHeaders(void *info, size_t headersCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    pthread_mutex_lock(&manager->lock);
+    
+    if (peer == manager->downloadPeer && manager->headersPending) {
+        manager->headersPending = 0;
+        manager->headersMore = (headersCount >= 2000); // a headers message holds up to 2000, fewer ends the chain
+        
+        if (headersCount > 0 && manager->lastBlock->height < manager->estimatedHeight) {
+            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+            manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
+        }
+        
+        _BRPeerManagerRequestBlocks(manager);
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
+static void _peerRelayedBlockHashes(void *info, const UInt256 blockHashes[], size_t blockCount)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    
+    pthread_mutex_lock(&manager->lock);
+    
+    if (manager->parallelDownload && peer == manager->downloadPeer) { // new blocks are queued once their headers are
+        manager->headersMore = 1;
+        _BRPeerManagerRequestHeaders(manager);
+    }
+    else { // request the blocks from peer as it would without the callback
+        BRPeerSendGetdata(peer, NULL, 0, blockHashes, blockCount);
+        
+        if (blockCount >= 500) {
+            UInt256 locators[] = { blockHashes[blockCount - 1], blockHashes[0] };
+            
+            BRPeerSendGetblocks(peer, locators, 2, UINT256_ZERO);
+        }
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+}
+
 static void _updateFilterRerequestDone(void *info, int success)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
@@ -406,7 +640,10 @@ static void _updateFilterLoadDone(void *info, int success)
         BRPeerSetNeedsFilterUpdate(peer, 0);
         peer->flags &= ~PEER_FLAG_NEEDSUPDATE;
         
-        if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
+        if (manager->lastBlock->height < manager->estimatedHeight && manager->parallelDownload) {
+            _BRPeerManagerRequestBlocks(manager); // blocks still missing are queued again from the header chain
+        }
+        else if (manager->lastBlock->height < manager->estimatedHeight) { // if syncing, rerequest blocks
             peerInfo = calloc(1, sizeof(*peerInfo));
             assert(peerInfo != NULL);
             peerInfo->peer = peer;
@@ -438,6 +675,18 @@ static void _updateFilterPingDone(void *info, int success)
                 BRPeerSendPing(manager->downloadPeer, info, _updateFilterLoadDone); // wait for pong so filter is loaded
             }
             else free(info);
+            
+            for (size_t i = array_count(manager->connectedPeers); i > 0; i--) { // and peers downloading alongside it
+                BRPeer *p = manager->connectedPeers[i - 1];
+                
+                if (BRPeerConnectStatus(p) != BRPeerStatusConnected || (p->flags & PEER_FLAG_DOWNLOADING) == 0) continue;
+                peerInfo = calloc(1, sizeof(*peerInfo));
+                assert(peerInfo != NULL);
+                peerInfo->peer = p;
+                peerInfo->manager = manager;
+                _BRPeerManagerLoadBloomFilter(manager, p);
+                BRPeerSendPing(p, peerInfo, _downloadFilterLoadDone);
+            }
         }
         else {
             free(info);
@@ -472,6 +721,17 @@ static void _BRPeerManagerUpdateFilter(BRPeerManager *manager)
         info->manager = manager;
         // wait for pong so we're sure to include any tx already sent by the peer in the updated filter
         BRPeerSendPing(manager->downloadPeer, info, _updateFilterPingDone);
+        
+        if (array_count(manager->downloads) > 0) { // blocks already requested in parallel won't match the new filter
+            peer_log(manager->downloadPeer, "dropping %zu parallel block download(s)", array_count(manager->downloads));
+            _BRPeerManagerClearDownloads(manager);
+        }
+        
+        for (size_t i = array_count(manager->connectedPeers); i > 0; i--) {
+            BRPeer *p = manager->connectedPeers[i - 1];
+            
+            if (p->flags & PEER_FLAG_DOWNLOADING) p->flags |= PEER_FLAG_NEEDSUPDATE;
+        }
     }
 }
 
@@ -807,6 +1067,15 @@ static void _peerConnected(void *info)
             peerInfo->manager = manager;
             BRPeerSendPing(peer, peerInfo, _loadBloomFilterDone);
         }
+        else if (manager->parallelDownload) { // help the download peer download the chain
+            peer_log(peer, "downloading blocks alongside the download peer");
+            peer->flags |= PEER_FLAG_DOWNLOADING;
+            
+            // with a filter update pending, the filter is loaded once it's ready
+            if (! manager->bloomFilter) peer->flags |= PEER_FLAG_NEEDSUPDATE;
+            else _BRPeerManagerLoadBloomFilter(manager, peer);
+            _BRPeerManagerRequestBlocks(manager);
+        }
     }
     else { // select the peer with the lowest ping time to download the chain from if we're behind
         // BUG: XXX a malicious peer can report a higher lastblock to make us select them as the download peer, if
@@ -822,6 +1091,14 @@ static void _peerConnected(void *info)
         if (manager->downloadPeer) BRPeerDisconnect(manager->downloadPeer);
         manager->downloadPeer = peer;
         manager->isConnected = 1;
+        _BRPeerManagerClearHeaders(manager); // the new download peer starts over from the last block
+        peer->flags &= ~PEER_FLAG_DOWNLOADING;
+        
+        if (manager->parallelDownload) {
+            BRPeerSetRelayedBlockHashes(peer, _peerRelayedBlockHashes);
+            BRPeerSetRelayedHeaders(peer, _peerRelayedHeaders);
+        }
+        
         manager->estimatedHeight = BRPeerLastBlock(peer);
         _BRPeerManagerLoadBloomFilter(manager, peer);
         BRPeerSetCurrentBlockHeight(peer, manager->lastBlock->height);
@@ -835,7 +1112,11 @@ static void _peerConnected(void *info)
 
             // request just block headers up to a week before earliestKeyTime, and then merkleblocks after that
             // we do not reset connect failure count yet incase this request times out
-            if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
+            if (manager->parallelDownload) { // headers first, with merkleblocks queued as the header chain grows
+                manager->headersMore = 1;
+                _BRPeerManagerRequestHeaders(manager);
+            }
+            else if (manager->lastBlock->timestamp + 7*24*60*60 >= manager->earliestKeyTime) {
                 BRPeerSendGetblocks(peer, locators, count, UINT256_ZERO);
             }
             else BRPeerSendGetheaders(peer, locators, count, UINT256_ZERO);
@@ -890,8 +1171,18 @@ static void _peerDisconnected(void *info, int error)
     if (peer == manager->downloadPeer) { // download peer disconnected
         manager->isConnected = 0;
         manager->downloadPeer = NULL;
+        _BRPeerManagerClearHeaders(manager);
         if (manager->connectFailureCount > MAX_CONNECT_FAILURES) manager->connectFailureCount = MAX_CONNECT_FAILURES;
     }
+    else if (peer->flags & PEER_FLAG_DOWNLOADING) { // request its outstanding blocks from the other peers
+        for (size_t i = array_count(manager->downloads); i > 0; i--) {
+            if (manager->downloads[i - 1].peer == peer) manager->downloads[i - 1].peer = NULL;
+        }
+    }
+    
+    for (size_t i = array_count(manager->downloads); i > 0; i--) {
+        if (manager->downloads[i - 1].source == peer) manager->downloads[i - 1].source = NULL;
+    }
 
     if (! manager->isConnected && manager->connectFailureCount == MAX_CONNECT_FAILURES) {
         _BRPeerManagerSyncStopped(manager);
@@ -923,7 +1214,9 @@ static void _peerDisconnected(void *info, int error)
         break;
     }
 
-    BRPeerFree(peer);
+    if (array_count(manager->downloads) > 0) _BRPeerManagerRequestBlocks(manager);
+    if (manager->downloadDraining) array_add(manager->drainedPeers, peer); // a drain may still add its blocks
+    else BRPeerFree(peer);
     pthread_mutex_unlock(&manager->lock);
     
     for (size_t i = 0; i < txCount; i++) {
@@ -1233,7 +1526,50 @@ static int _BRPeerManagerVerifyBlock(BRPeerManager *manager, BRMerkleBlock *bloc
     return r;
 }
 
-static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+// adds header to the end of the header chain, or starts the header chain over from the header's previous block if
+// that's in the chain instead, as happens after a reorg
+static void _BRPeerManagerAddHeader(BRPeerManager *manager, BRMerkleBlock *header, BRPeer *peer)
+{
+    BRMerkleBlock *prev = manager->headerTip;
+    
+    if (! prev || ! UInt256Eq(header->prevBlock, prev->blockHash)) {
+        prev = BRSetGet(manager->blocks, &header->prevBlock);
+        
+        if (prev && manager->headerStart < array_count(manager->headerHashes)) {
+            peer_log(peer, "header chain fork at height %"PRIu32", dropping %zu header(s)", prev->height,
+                     array_count(manager->headerHashes) - manager->headerStart);
+        }
+        
+        if (prev) {
+            _BRPeerManagerClearDownloads(manager);
+            array_clear(manager->headerHashes);
+            manager->headerStart = manager->headerQueued = 0;
+        }
+    }
+    
+    if (! prev) {
+        peer_log(peer, "relayed header %s that doesn't connect to the header chain",
+                 log_u256_hex_encode(header->blockHash));
+        BRMerkleBlockFree(header);
+    }
+    else {
+        header->height = prev->height + 1;
+        
+        if (! _BRPeerManagerVerifyBlock(manager, header, prev, peer)) {
+            peer_log(peer, "relayed invalid header");
+            BRMerkleBlockFree(header);
+            _BRPeerManagerPeerMisbehavin(manager, peer);
+        }
+        else {
+            array_add(manager->headerHashes, header->blockHash);
+            if (manager->headerTip) BRMerkleBlockFree(manager->headerTip);
+            manager->headerTip = header;
+            if (header->height > manager->estimatedHeight) manager->estimatedHeight = header->height;
+        }
+    }
+}
+
+static void _peerAddBlock(void *info, BRMerkleBlock *block)
 {
     BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
     BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
@@ -1256,7 +1592,7 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
     }
     
     // track the observed bloom filter false positive rate using a low pass filter to smooth out variance
-    if (peer == manager->downloadPeer && block->totalTx > 0) {
+    if (_BRPeerManagerIsDownloading(manager, peer) && block->totalTx > 0) {
         for (i = 0; i < txCount; i++) { // wallet tx are not false-positives
             if (! BRWalletTransactionForHash(manager->wallet, txHashes[i])) fpCount++;
         }
@@ -1268,12 +1604,13 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         manager->fpRate = manager->fpRate*(1.0 - 0.01*block->totalTx/manager->averageTxPerBlock) +
                           0.01*fpCount/manager->averageTxPerBlock;
         
-        // false positive rate sanity check
-        if (BRPeerConnectStatus(peer) == BRPeerStatusConnected &&
+        // false positive rate sanity check, the rate is only reset when the next download peer loads a rebuilt filter,
+        // so drop the download peer rather than whichever downloading peer the block came from
+        if (manager->downloadPeer && BRPeerConnectStatus(manager->downloadPeer) == BRPeerStatusConnected &&
             manager->fpRate > BLOOM_DEFAULT_FALSEPOSITIVE_RATE*10.0) {
-            peer_log(peer, "bloom filter false positive rate %f too high after %"PRIu32" blocks, disconnecting...",
-                     manager->fpRate, manager->lastBlock->height + 1 - manager->filterUpdateHeight);
-            BRPeerDisconnect(peer);
+            peer_log(manager->downloadPeer, "bloom filter false positive rate %f too high after %"PRIu32" blocks, "
+                     "disconnecting...", manager->fpRate, manager->lastBlock->height + 1 - manager->filterUpdateHeight);
+            BRPeerDisconnect(manager->downloadPeer);
         }
         else if (manager->lastBlock->height + 500 < BRPeerLastBlock(peer) &&
                  manager->fpRate > BLOOM_REDUCED_FALSEPOSITIVE_RATE*10.0) {
@@ -1290,8 +1627,9 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         BRMerkleBlockFree(block);
         block = NULL;
 
-        if (peer == manager->downloadPeer && manager->lastBlock->height < manager->estimatedHeight) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        if (_BRPeerManagerIsDownloading(manager, peer) && manager->downloadPeer &&
+            manager->lastBlock->height < manager->estimatedHeight) {
+            BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
     }
@@ -1340,8 +1678,9 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         if (txCount > 0) _BRPeerManagerUpdateTx(manager, txHashes, txCount, block->height, txTime);
         if (manager->downloadPeer) BRPeerSetCurrentBlockHeight(manager->downloadPeer, block->height);
             
-        if (block->height < manager->estimatedHeight && peer == manager->downloadPeer) {
-            BRPeerScheduleDisconnect(peer, PROTOCOL_TIMEOUT); // reschedule sync timeout
+        if (block->height < manager->estimatedHeight && _BRPeerManagerIsDownloading(manager, peer) &&
+            manager->downloadPeer) {
+            BRPeerScheduleDisconnect(manager->downloadPeer, PROTOCOL_TIMEOUT); // reschedule sync timeout
             manager->connectFailureCount = 0; // reset failure count once we know our initial request didn't timeout
         }
         
@@ -1470,7 +1809,73 @@ static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
         manager->txStatusUpdate(manager->info); // notify that transaction confirmations may have changed
     }
     
-    if (next) _peerRelayedBlock(info, next);
+    if (next) _peerAddBlock(info, next);
+}
+
+static void _peerRelayedBlock(void *info, BRMerkleBlock *block)
+{
+    BRPeer *peer = ((BRPeerCallbackInfo *)info)->peer;
+    BRPeerManager *manager = ((BRPeerCallbackInfo *)info)->manager;
+    size_t i = SIZE_MAX, count, inFlight = 0;
+    
+    pthread_mutex_lock(&manager->lock);
+    
+    // in parallel download mode, headers from a week before earliestKeyTime on make up the header chain that filtered
+    // blocks are downloaded for (it's a header if it has 0 totalTx)
+    if (manager->parallelDownload && block->totalTx == 0 && peer == manager->downloadPeer &&
+        (manager->headerTip || block->timestamp + 7*24*60*60 > manager->earliestKeyTime + 2*60*60)) {
+        _BRPeerManagerAddHeader(manager, block, peer);
+        block = NULL;
+    }
+    else if (manager->parallelDownload) i = _BRPeerManagerDownloadIndex(manager, block->blockHash);
+    
+    if (i != SIZE_MAX) { // hold the block until the blocks before it have arrived
+        if (! manager->downloads[i].block) manager->downloads[i].block = block, manager->downloads[i].source = peer;
+        else BRMerkleBlockFree(block); // also arrived from a peer it was requested from after a stall
+        block = NULL;
+        peer->flags &= ~PEER_FLAG_STALLED;
+        
+        if (peer != manager->downloadPeer) { // reschedule the timeout set when the blocks were requested
+            for (i = 0; i < array_count(manager->downloads); i++) {
+                if (manager->downloads[i].peer == peer && ! manager->downloads[i].block) inFlight++;
+            }
+            
+            BRPeerScheduleDisconnect(peer, (inFlight > 0) ? PROTOCOL_TIMEOUT/2 : -1);
+        }
+        
+        _BRPeerManagerRequestBlocks(manager);
+    }
+    else if (manager->parallelDownload && manager->syncStartHeight > 0 && (peer->flags & PEER_FLAG_DOWNLOADING)) {
+        BRMerkleBlockFree(block); // requested before the queue was dropped, and possibly with an outdated filter
+        block = NULL;
+    }
+    
+    // pass on the blocks at the front of the queue in chain order, one thread at a time
+    while (! manager->downloadDraining && array_count(manager->downloads) > 0 && manager->downloads[0].block) {
+        for (count = 0; count < array_count(manager->downloads) && manager->downloads[count].block; count++);
+        
+        BRMerkleBlock *blocks[count];
+        BRPeerCallbackInfo sources[count]; // each block is added on behalf of the peer it arrived from
+        
+        for (i = 0; i < count; i++) {
+            blocks[i] = manager->downloads[i].block;
+            sources[i] = (BRPeerCallbackInfo) { manager->downloads[i].source, manager, UINT256_ZERO };
+            if (! sources[i].peer) sources[i].peer = peer; // source disconnected, keep the block for the chain
+        }
+        
+        array_rm_range(manager->downloads, 0, count);
+        manager->downloadDraining = 1;
+        pthread_mutex_unlock(&manager->lock);
+        for (i = 0; i < count; i++) _peerAddBlock(&sources[i], blocks[i]);
+        pthread_mutex_lock(&manager->lock);
+        manager->downloadDraining = 0;
+        for (i = array_count(manager->drainedPeers); i > 0; i--) BRPeerFree(manager->drainedPeers[i - 1]);
+        array_clear(manager->drainedPeers);
+        _BRPeerManagerRequestBlocks(manager);
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    if (block) _peerAddBlock(info, block);
 }
 
 static void _peerDataNotfound(void *info, const UInt256 txHashes[], size_t txCount,
@@ -1699,6 +2104,9 @@ BRPeerManager *BRPeerManagerNewEx(const BRChainParams *params, BRWallet *wallet,
     
     array_new(manager->txRelays, 10);
     array_new(manager->txRequests, 10);
+    array_new(manager->downloads, DOWNLOAD_QUEUE_MAX);
+    array_new(manager->drainedPeers, PEER_MAX_CONNECTIONS);
+    array_new(manager->headerHashes, 2000);
     array_new(manager->publishedTx, 10);
     array_new(manager->publishedTxHashes, 10);
     pthread_mutex_init(&manager->lock, NULL);
@@ -1737,6 +2145,24 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
     manager->threadCleanup = (threadCleanup) ? threadCleanup : _dummyThreadCleanup;
 }
 
+// services peer connections with reactor event loops instead of a thread per peer, NULL to go back to threads
+// not thread-safe, set this before calling BRPeerManagerConnect(), reactor must outlive the peer connections
+void BRPeerManagerSetReactor(BRPeerManager *manager, BRPeerReactor *reactor)
+{
+    assert(manager != NULL);
+    manager->reactor = reactor;
+}
+
+// syncs headers first, verifying the download peer's block headers into a header chain, and downloads filtered blocks
+// for it from all connected peers at once, each given its own range of the chain, rather than having the download
+// peer switch from headers to filtered blocks at earliestKeyTime and send them all itself (off by default)
+// not thread-safe, set this before calling BRPeerManagerConnect()
+void BRPeerManagerSetParallelDownload(BRPeerManager *manager, int parallelDownload)
+{
+    assert(manager != NULL);
+    manager->parallelDownload = parallelDownload;
+}
+
 // specifies a single fixed peer to use when connecting to the bitcoin network
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port)
@@ -1827,6 +2253,7 @@ void BRPeerManagerConnect(BRPeerManager *manager)
                                    _peerRelayedTx, _peerHasTx, _peerRejectedTx, _peerRelayedBlock, _peerDataNotfound,
                                    _peerSetFeePerKb, _peerRequestedTx, _peerNetworkIsReachable, _peerThreadCleanup);
                 BRPeerSetEarliestKeyTime(info->peer, manager->earliestKeyTime);
+                BRPeerSetReactor(info->peer, manager->reactor);
                 BRPeerConnect(info->peer);
                 
                 if (BRPeerConnectStatus(info->peer) == BRPeerStatusDisconnected) {
@@ -1917,6 +2344,8 @@ void BRPeerManagerRescan(BRPeerManager *manager)
             }
         }
         
+        _BRPeerManagerClearHeaders(manager);
+        
         if (manager->downloadPeer) { // disconnect the current download peer so a new random one will be selected
             for (size_t i = array_count(manager->peers); i > 0; i--) {
                 if (BRPeerEq(&manager->peers[i - 1], manager->downloadPeer)) array_rm(manager->peers, i - 1);
@@ -1969,7 +2398,7 @@ uint32_t BRPeerManagerLastBlockTimestamp(BRPeerManager *manager)
     return timestamp;
 }
 
-// current network sync progress from 0 to 1
+// current network sync progress from 0 to 1, counting the header chain in parallel download mode
 // startHeight is the block height of the most recent fully completed sync
 double  BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight)
 {
@@ -1983,8 +2412,16 @@ double  BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight)
         progress = 0.0;
     }
     else if (! manager->downloadPeer || manager->lastBlock->height < manager->estimatedHeight) {
-        if (manager->lastBlock->height > startHeight && manager->estimatedHeight > startHeight) {
-            progress = 0.001 + 0.999 * (manager->lastBlock->height - startHeight)/(manager->estimatedHeight - startHeight);
+        uint32_t headerHeight = manager->lastBlock->height;
+        
+        if (manager->headerTip && manager->headerTip->height > headerHeight) headerHeight = manager->headerTip->height;
+        
+        if (headerHeight > startHeight && manager->estimatedHeight > startHeight) {
+            // verified headers ahead of the last block count for a tenth of the filtered blocks still to download
+            double blocks = (manager->lastBlock->height > startHeight) ? manager->lastBlock->height - startHeight : 0;
+            
+            progress = 0.001 + 0.999*(0.1*(headerHeight - startHeight) + 0.9*blocks)/
+                       (manager->estimatedHeight - startHeight);
         }
         else progress = 0.001;
     }
@@ -2132,6 +2569,10 @@ void BRPeerManagerFree(BRPeerManager *manager)
     array_free(manager->txRelays);
     for (size_t i = array_count(manager->txRequests); i > 0; i--) array_free(manager->txRequests[i - 1].peers);
     array_free(manager->txRequests);
+    _BRPeerManagerClearHeaders(manager);
+    array_free(manager->downloads);
+    array_free(manager->drainedPeers);
+    array_free(manager->headerHashes);
     array_free(manager->publishedTx);
     array_free(manager->publishedTxHashes);
     pthread_mutex_unlock(&manager->lock);
@@ -2172,3 +2613,97 @@ BRPeerManager *BPPeerManagerTestNetNew(BRWallet *wallet, uint32_t earliestKeyTim
 	return BRPeerManagerNew(&BRTestNetParams, wallet, earliestKeyTime,blocks, blocksCount, peers,peersCount);
 }
 
+
+// adds a peer as the download peer, syncing up to lastBlock, or as a peer downloading alongside it if there already is
+// one, returns the callback info the peer passes its messages on with
+void *BRPeerManagerAddPeerTest(BRPeerManager *manager, BRPeer *peer, uint32_t lastBlock)
+{
+    BRPeerCallbackInfo *info = calloc(1, sizeof(*info));
+    
+    assert(info != NULL);
+    info->peer = peer;
+    info->manager = manager;
+    BRPeerSetCallbacks(peer, info, NULL, _peerDisconnected, NULL, NULL, NULL, NULL, _peerRelayedBlock, NULL, NULL, NULL,
+                       NULL, NULL);
+    pthread_mutex_lock(&manager->lock);
+    array_add(manager->connectedPeers, peer);
+    _BRPeerManagerLoadBloomFilter(manager, peer);
+    
+    if (! manager->downloadPeer) {
+        manager->downloadPeer = peer;
+        manager->isConnected = 1;
+        manager->estimatedHeight = lastBlock;
+        manager->syncStartHeight = manager->lastBlock->height + 1;
+        BRPeerSetRelayedBlockHashes(peer, _peerRelayedBlockHashes);
+        BRPeerSetRelayedHeaders(peer, _peerRelayedHeaders);
+        manager->headersMore = 1;
+        _BRPeerManagerRequestHeaders(manager);
+    }
+    else {
+        peer->flags |= PEER_FLAG_DOWNLOADING;
+        _BRPeerManagerRequestBlocks(manager);
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    return info;
+}
+
+void BRPeerManagerRelayedBlockTest(void *info, BRMerkleBlock *block)
+{
+    _peerRelayedBlock(info, block);
+}
+
+void BRPeerManagerRelayedHeadersTest(void *info, size_t headersCount)
+{
+    _peerRelayedHeaders(info, headersCount);
+}
+
+// updates the bloom filter as it's done once a wallet tx uses up the spare addresses in it
+void BRPeerManagerUpdateFilterTest(BRPeerManager *manager)
+{
+    pthread_mutex_lock(&manager->lock);
+    _BRPeerManagerUpdateFilter(manager);
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// makes the outstanding block requests the given number of seconds older, then hands out the download queue again
+void BRPeerManagerRequestBlocksTest(BRPeerManager *manager, time_t seconds)
+{
+    pthread_mutex_lock(&manager->lock);
+    
+    for (size_t i = 0; i < array_count(manager->downloads); i++) {
+        if (manager->downloads[i].peer) manager->downloads[i].requestTime -= seconds;
+    }
+    
+    _BRPeerManagerRequestBlocks(manager);
+    pthread_mutex_unlock(&manager->lock);
+}
+
+// sets peers[i] to the peer the i-th block in the download queue was requested from, or NULL if it has arrived or
+// hasn't been requested yet, returns the number of blocks in the queue
+size_t BRPeerManagerDownloadsTest(BRPeerManager *manager, BRPeer *peers[], size_t peersCount)
+{
+    size_t count;
+    
+    pthread_mutex_lock(&manager->lock);
+    count = array_count(manager->downloads);
+    
+    for (size_t i = 0; i < count && i < peersCount; i++) {
+        peers[i] = (manager->downloads[i].block) ? NULL : manager->downloads[i].peer;
+    }
+    
+    pthread_mutex_unlock(&manager->lock);
+    return count;
+}
+
+// returns the number of hashes kept in the header chain, and sets start to the number of them already in the chain
+size_t BRPeerManagerHeaderChainTest(BRPeerManager *manager, size_t *start)
+{
+    size_t count;
+    
+    pthread_mutex_lock(&manager->lock);
+    count = array_count(manager->headerHashes);
+    if (start) *start = manager->headerStart;
+    pthread_mutex_unlock(&manager->lock);
+    return count;
+}
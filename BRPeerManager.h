@@ -98,6 +98,16 @@ void BRPeerManagerSetCallbacks(BRPeerManager *manager, void *info,
                                int (*networkIsReachable)(void *info),
                                void (*threadCleanup)(void *info));
 
+// services peer connections with reactor event loops instead of a thread per peer, NULL to go back to threads
+// not thread-safe, set this before calling BRPeerManagerConnect(), reactor must outlive the peer connections
+void BRPeerManagerSetReactor(BRPeerManager *manager, BRPeerReactor *reactor);
+
+// syncs headers first, verifying the download peer's block headers into a header chain, and downloads filtered blocks
+// for it from all connected peers at once, each given its own range of the chain, rather than having the download
+// peer switch from headers to filtered blocks at earliestKeyTime and send them all itself (off by default)
+// not thread-safe, set this before calling BRPeerManagerConnect()
+void BRPeerManagerSetParallelDownload(BRPeerManager *manager, int parallelDownload);
+
 // specifies a single fixed peer to use when connecting to the bitcoin network
 // set address to UINT128_ZERO to revert to default behavior
 void BRPeerManagerSetFixedPeer(BRPeerManager *manager, UInt128 address, uint16_t port);
@@ -127,7 +137,7 @@ uint32_t BRPeerManagerLastBlockHeight(BRPeerManager *manager);
 // current proof-of-work verified best block timestamp (time interval since unix epoch)
 uint32_t BRPeerManagerLastBlockTimestamp(BRPeerManager *manager);
 
-// current network sync progress from 0 to 1
+// current network sync progress from 0 to 1, counting the header chain in parallel download mode
 // startHeight is the block height of the most recent fully completed sync
 double BRPeerManagerSyncProgress(BRPeerManager *manager, uint32_t startHeight);
 
@@ -31,6 +31,7 @@
 #include <limits.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #define TX_VERSION           0x00000001
 #define TX_LOCKTIME          0x00000000
@@ -205,42 +206,70 @@ static size_t _BRTransactionOutputData(const BRTransaction *tx, uint8_t *data, s
     return (! data || off <= dataLen) ? off : 0;
 }
 
+// BIP143 hashPrevouts, hashSequence and hashOutputs for SIGHASH_ALL, the same for every input of a tx
+typedef struct {
+    UInt256 prevouts;
+    UInt256 sequence;
+    UInt256 outputs;
+} _BRWitnessHashes;
+
+static void _BRTransactionWitnessHashes(const BRTransaction *tx, _BRWitnessHashes *hashes)
+{
+    size_t i, outLen = _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX),
+           bufLen = (sizeof(UInt256) + sizeof(uint32_t))*tx->inCount;
+    uint8_t _buf[0x1000], *buf;
+    
+    if (outLen > bufLen) bufLen = outLen;
+    buf = (bufLen <= sizeof(_buf)) ? _buf : malloc(bufLen);
+    assert(buf != NULL);
+    
+    for (i = 0; i < tx->inCount; i++) {
+        UInt256Set(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i], tx->inputs[i].txHash);
+        UInt32SetLE(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i + sizeof(UInt256)], tx->inputs[i].index);
+    }
+    
+    BRSHA256_2(&hashes->prevouts, buf, (sizeof(UInt256) + sizeof(uint32_t))*tx->inCount);
+    for (i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
+    BRSHA256_2(&hashes->sequence, buf, sizeof(uint32_t)*tx->inCount);
+    outLen = _BRTransactionOutputData(tx, buf, outLen, SIZE_MAX);
+    BRSHA256_2(&hashes->outputs, buf, outLen);
+    if (buf != _buf) free(buf);
+}
+
 // writes the BIP143 witness program data that needs to be hashed and signed for the tx input at index
 // https://github.com/bitcoin/bips/blob/master/bip-0143.mediawiki
 // an index of SIZE_MAX will write the entire signed transaction
 // returns number of bytes written, or total len needed if data is NULL
+// hashes may be NULL, or hold the tx's BIP143 hashes so signing every input doesn't recompute them
 static size_t _BRTransactionWitnessData(const BRTransaction *tx, uint8_t *data, size_t dataLen, size_t index,
-                                        int hashType)
+                                        int hashType, const _BRWitnessHashes *hashes)
 {
     BRTxInput input;
     int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f);
-    size_t i, off = 0;
+    size_t off = 0;
     uint8_t scriptCode[] = { OP_DUP, OP_HASH160, 20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
                              0, 0, 0, 0, 0, 0, 0, 0, 0, OP_EQUALVERIFY, OP_CHECKSIG };
+    _BRWitnessHashes h;
 
     if (index >= tx->inCount) return 0;
+    
+    if (data && ! hashes) {
+        _BRTransactionWitnessHashes(tx, &h);
+        hashes = &h;
+    }
+    
     if (data && off + sizeof(uint32_t) <= dataLen) UInt32SetLE(&data[off], tx->version); // tx version
     off += sizeof(uint32_t);
     
     if (! anyoneCanPay) {
-        uint8_t buf[(sizeof(UInt256) + sizeof(uint32_t))*tx->inCount];
-        
-        for (i = 0; i < tx->inCount; i++) {
-            UInt256Set(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i], tx->inputs[i].txHash);
-            UInt32SetLE(&buf[(sizeof(UInt256) + sizeof(uint32_t))*i + sizeof(UInt256)], tx->inputs[i].index);
-        }
-        
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, sizeof(buf)); // inputs hash
+        if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], hashes->prevouts); // inputs hash
     }
     else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO); // anyone-can-pay
     
     off += sizeof(UInt256);
     
     if (! anyoneCanPay && sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        uint8_t buf[sizeof(uint32_t)*tx->inCount];
-        
-        for (i = 0; i < tx->inCount; i++) UInt32SetLE(&buf[sizeof(uint32_t)*i], tx->inputs[i].sequence);
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, sizeof(buf)); // sequence hash
+        if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], hashes->sequence); // sequence hash
     }
     else if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], UINT256_ZERO);
     
@@ -258,12 +287,7 @@ static size_t _BRTransactionWitnessData(const BRTransaction *tx, uint8_t *data,
     off += _BRTxInputData(&input, (data ? &data[off] : NULL), (off <= dataLen ? dataLen - off : 0));
     
     if (sigHash != SIGHASH_SINGLE && sigHash != SIGHASH_NONE) {
-        size_t bufLen = _BRTransactionOutputData(tx, NULL, 0, SIZE_MAX);
-        uint8_t _buf[0x1000], *buf = (bufLen <= 0x1000) ? _buf : malloc(bufLen);
-        
-        bufLen = _BRTransactionOutputData(tx, buf, bufLen, SIZE_MAX);
-        if (data && off + sizeof(UInt256) <= dataLen) BRSHA256_2(&data[off], buf, bufLen); // SIGHASH_ALL outputs hash
-        if (buf != _buf) free(buf);
+        if (data && off + sizeof(UInt256) <= dataLen) UInt256Set(&data[off], hashes->outputs); // SIGHASH_ALL outputs
     }
     else if (sigHash == SIGHASH_SINGLE && index < tx->outCount) {
         uint8_t buf[_BRTransactionOutputData(tx, NULL, 0, index)];
@@ -290,7 +314,7 @@ static size_t _BRTransactionData(const BRTransaction *tx, uint8_t *data, size_t
     int anyoneCanPay = (hashType & SIGHASH_ANYONECANPAY), sigHash = (hashType & 0x1f), witnessFlag = 0;
     size_t i, count, len, woff, off = 0;
     
-    if (hashType & SIGHASH_FORKID) return _BRTransactionWitnessData(tx, data, dataLen, index, hashType);
+    if (hashType & SIGHASH_FORKID) return _BRTransactionWitnessData(tx, data, dataLen, index, hashType, NULL);
     if (anyoneCanPay && index >= tx->inCount) return 0;
     
     for (i = 0; index == SIZE_MAX && ! witnessFlag && i < tx->inCount; i++) {
@@ -602,64 +626,100 @@ void BRTransactionShuffleOutputs(BRTransaction *tx)
     }
 }
 
-// size in bytes if signed, or estimated size assuming compact pubkey sigs
-size_t BRTransactionSize(const BRTransaction *tx)
+// returns the size estimate of tx's inputs and outputs
+BRTxSizeEstimate BRTransactionSizeEstimate(const BRTransaction *tx)
 {
+    BRTxSizeEstimate est = BR_TX_SIZE_ESTIMATE_NONE;
     BRTxInput *input;
-    size_t size, witSize = 0;
-
+    
     assert(tx != NULL);
-    size = (tx) ? 8 + BRVarIntSize(tx->inCount) + BRVarIntSize(tx->outCount) : 0;
     
     for (size_t i = 0; tx && i < tx->inCount; i++) {
         input = &tx->inputs[i];
-        
-        if (input->signature && input->witness) {
-            size += sizeof(UInt256) + sizeof(uint32_t) + BRVarIntSize(input->sigLen) + input->sigLen + sizeof(uint32_t);
-            witSize += input->witLen;
-        }
-        else if (input->script && input->scriptLen > 0 && input->script[0] == OP_0) { // estimated P2WPKH signature size
-            witSize += TX_INPUT_SIZE;
-        }
-        else size += TX_INPUT_SIZE; // estimated P2PKH signature size
+        BRTxSizeEstimateAddInput(&est, input->script, input->scriptLen, input->signature, input->sigLen,
+                                 input->witness, input->witLen);
     }
     
     for (size_t i = 0; tx && i < tx->outCount; i++) {
-        size += sizeof(uint64_t) + BRVarIntSize(tx->outputs[i].scriptLen) + tx->outputs[i].scriptLen;
+        BRTxSizeEstimateAddOutput(&est, tx->outputs[i].scriptLen);
     }
     
-    if (witSize > 0) witSize += 2 + tx->inCount;
-    return size + witSize;
+    return est;
 }
 
-// virtual transaction size as defined by BIP141: https://github.com/bitcoin/bips/blob/master/bip-0141.mediawiki
-size_t BRTransactionVSize(const BRTransaction *tx)
+// adds an input to est, taking the same arguments as BRTransactionAddInput()
+void BRTxSizeEstimateAddInput(BRTxSizeEstimate *est, const uint8_t *script, size_t scriptLen,
+                              const uint8_t *signature, size_t sigLen, const uint8_t *witness, size_t witLen)
 {
-    BRTxInput *input;
-    size_t size, witSize = 0;
-    
-    assert(tx != NULL);
-    size = (tx) ? 8 + BRVarIntSize(tx->inCount) + BRVarIntSize(tx->outCount) : 0;
+    assert(est != NULL);
+    est->inCount++;
     
-    for (size_t i = 0; i < tx->inCount; i++) {
-        input = &tx->inputs[i];
-        
-        if (input->signature && input->witness) {
-            size += sizeof(UInt256) + sizeof(uint32_t) + BRVarIntSize(input->sigLen) + input->sigLen + sizeof(uint32_t);
-            witSize += tx->inputs[i].witLen;
-        }
-        else if (input->script && input->scriptLen > 0 && input->script[0] == OP_0) { // estimated P2WPKH signature size
-            witSize += TX_INPUT_SIZE;
-        }
-        else size += TX_INPUT_SIZE; // estimated P2PKH signature size
+    if (signature && witness) {
+        est->size += sizeof(UInt256) + sizeof(uint32_t) + BRVarIntSize(sigLen) + sigLen + sizeof(uint32_t);
+        est->witSize += witLen;
     }
-    
-    for (size_t i = 0; i < tx->outCount; i++) {
-        size += sizeof(uint64_t) + BRVarIntSize(tx->outputs[i].scriptLen) + tx->outputs[i].scriptLen;
+    else if (script && scriptLen > 0 && script[0] == OP_0) { // estimated P2WPKH signature size
+        est->witSize += TX_INPUT_SIZE;
     }
+    else est->size += TX_INPUT_SIZE; // estimated P2PKH signature size
+}
+
+// adds an output with a scriptPubKey of the given length to est
+void BRTxSizeEstimateAddOutput(BRTxSizeEstimate *est, size_t scriptLen)
+{
+    assert(est != NULL);
+    est->outCount++;
+    est->size += sizeof(uint64_t) + BRVarIntSize(scriptLen) + scriptLen;
+}
+
+// size in bytes, as returned by BRTransactionSize() for a transaction with the same inputs and outputs
+size_t BRTxSizeEstimateSize(const BRTxSizeEstimate *est)
+{
+    assert(est != NULL);
+    return 8 + BRVarIntSize(est->inCount) + BRVarIntSize(est->outCount) + est->size +
+           ((est->witSize > 0) ? est->witSize + 2 + est->inCount : 0);
+}
+
+// virtual size, as returned by BRTransactionVSize() for a transaction with the same inputs and outputs
+size_t BRTxSizeEstimateVSize(const BRTxSizeEstimate *est)
+{
+    size_t size;
     
-    if (witSize > 0) witSize += 2 + tx->inCount;
-    return (size*4 + witSize + 3)/4;
+    assert(est != NULL);
+    size = 8 + BRVarIntSize(est->inCount) + BRVarIntSize(est->outCount) + est->size;
+    return (size*4 + ((est->witSize > 0) ? est->witSize + 2 + est->inCount : 0) + 3)/4;
+}
+
+// vsize an input adds to a transaction, not counting the segwit marker and flag or growth of the input count
+size_t BRTxSizeEstimateInputVSize(const uint8_t *script, size_t scriptLen, const uint8_t *signature, size_t sigLen,
+                                  const uint8_t *witness, size_t witLen)
+{
+    BRTxSizeEstimate est = BR_TX_SIZE_ESTIMATE_NONE;
+    
+    BRTxSizeEstimateAddInput(&est, script, scriptLen, signature, sigLen, witness, witLen);
+    return (est.size*4 + ((est.witSize > 0) ? est.witSize + 1 : 0) + 3)/4;
+}
+
+// size in bytes if signed, or estimated size assuming compact pubkey sigs
+size_t BRTransactionSize(const BRTransaction *tx)
+{
+    BRTxSizeEstimate est;
+    
+    assert(tx != NULL);
+    if (! tx) return 0;
+    est = BRTransactionSizeEstimate(tx);
+    return BRTxSizeEstimateSize(&est);
+}
+
+// virtual transaction size as defined by BIP141: https://github.com/bitcoin/bips/blob/master/bip-0141.mediawiki
+size_t BRTransactionVSize(const BRTransaction *tx)
+{
+    BRTxSizeEstimate est;
+    
+    assert(tx != NULL);
+    if (! tx) return 0;
+    est = BRTransactionSizeEstimate(tx);
+    return BRTxSizeEstimateVSize(&est);
 }
 
 // minimum transaction fee needed for tx to relay across the bitcoin network
@@ -681,76 +741,175 @@ int BRTransactionIsSigned(const BRTransaction *tx)
     return (tx) ? 1 : 0;
 }
 
+typedef struct {
+    UInt160 pkh;
+    size_t i; // position in keys
+} _BRKeyHash;
+
+// orders by hash160, then by position so the first of any duplicate keys is used, as with a linear search
+static int _BRKeyHashCompare(const void *a, const void *b)
+{
+    const _BRKeyHash *h1 = a, *h2 = b;
+    int r = memcmp(&h1->pkh, &h2->pkh, sizeof(UInt160));
+    
+    return (r != 0) ? r : (h1->i > h2->i) - (h1->i < h2->i);
+}
+
+typedef struct {
+    uint8_t script[1 + 73 + 1 + 65]; // scriptSig, or witness for pay-to-witness-pubkey-hash
+    size_t scriptLen;
+    int type; // 0 if the input has no key, SIGN_WITNESS or SIGN_SCRIPT_SIG
+} _BRTxInputSig;
+
+#define SIGN_WITNESS    1
+#define SIGN_SCRIPT_SIG 2
+
+// signs input i of tx into sig without changing tx, so inputs can be signed concurrently
+// pubkeys for all keys must already be computed, BRKeyHash160() does this, so keys are only read
+static void _BRTransactionSignInput(const BRTransaction *tx, int forkId, BRKey keys[], const _BRKeyHash pkh[],
+                                    size_t keysCount, const _BRWitnessHashes *hashes, size_t i, _BRTxInputSig *sig)
+{
+    const BRTxInput *input = &tx->inputs[i];
+    const uint8_t *hash = BRScriptPKH(input->script, input->scriptLen);
+    size_t j, lo = 0, hi = keysCount;
+    
+    sig->type = 0;
+    if (! hash) return;
+    
+    while (lo < hi) { // find the first key with a hash160 not less than the input's
+        j = lo + (hi - lo)/2;
+        if (memcmp(&pkh[j].pkh, hash, sizeof(UInt160)) < 0) lo = j + 1;
+        else hi = j;
+    }
+    
+    if (lo >= keysCount || ! UInt160Eq(pkh[lo].pkh, UInt160Get(hash))) return;
+    j = pkh[lo].i;
+
+    const uint8_t *elems[BRScriptElements(NULL, 0, input->script, input->scriptLen)];
+    size_t elemsCount = BRScriptElements(elems, sizeof(elems)/sizeof(*elems), input->script, input->scriptLen);
+    uint8_t pubKey[65], sigData[73];
+    size_t pkLen = BRKeyPubKey(&keys[j], pubKey, sizeof(pubKey)), sigLen, dataLen;
+    int witness = (elemsCount == 2 && *elems[0] == OP_0 && *elems[1] == 20); // pay-to-witness-pubkey-hash
+    uint8_t _data[0x1000], *data;
+    UInt256 md = UINT256_ZERO;
+    
+    dataLen = (witness) ? _BRTransactionWitnessData(tx, NULL, 0, i, forkId | SIGHASH_ALL, hashes) :
+                          _BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL);
+    data = (dataLen <= sizeof(_data)) ? _data : malloc(dataLen);
+    assert(data != NULL);
+    dataLen = (witness) ? _BRTransactionWitnessData(tx, data, dataLen, i, forkId | SIGHASH_ALL, hashes) :
+                          _BRTransactionData(tx, data, dataLen, i, forkId | SIGHASH_ALL);
+    BRSHA256_2(&md, data, dataLen);
+    if (data != _data) free(data);
+    
+    sigLen = BRKeySign(&keys[j], sigData, sizeof(sigData) - 1, md);
+    sigData[sigLen++] = forkId | SIGHASH_ALL;
+    sig->scriptLen = BRScriptPushData(sig->script, sizeof(sig->script), sigData, sigLen);
+    sig->type = (witness) ? SIGN_WITNESS : SIGN_SCRIPT_SIG;
+    
+    if (witness || (elemsCount >= 2 && *elems[elemsCount - 2] == OP_EQUALVERIFY)) { // pay-to-pubkey-hash
+        sig->scriptLen += BRScriptPushData(&sig->script[sig->scriptLen], sizeof(sig->script) - sig->scriptLen,
+                                           pubKey, pkLen);
+    }
+}
+
+typedef struct {
+    const BRTransaction *tx;
+    int forkId;
+    BRKey *keys;
+    const _BRKeyHash *pkh;
+    size_t keysCount;
+    _BRWitnessHashes hashes; // computed once for all inputs
+    _BRTxInputSig *sigs;
+    size_t next; // next unclaimed input
+    pthread_mutex_t lock;
+} _BRTransactionSignBatch;
+
+static void *_BRTransactionSignWorker(void *arg)
+{
+    _BRTransactionSignBatch *batch = arg;
+    size_t i, end;
+    
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        i = batch->next;
+        end = (i + TX_SIGN_BATCH_CHUNK < batch->tx->inCount) ? i + TX_SIGN_BATCH_CHUNK : batch->tx->inCount;
+        batch->next = end;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= end) break;
+        
+        for (; i < end; i++) {
+            _BRTransactionSignInput(batch->tx, batch->forkId, batch->keys, batch->pkh, batch->keysCount,
+                                    &batch->hashes, i, &batch->sigs[i]);
+        }
+    }
+    
+    return NULL;
+}
+
 // adds signatures to any inputs with NULL signatures that can be signed with any keys
 // forkId is 0 for bitcoin, 0x40 for b-cash, 0x4f for b-gold
 // returns true if tx is signed
 int BRTransactionSign(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCount)
 {
-    UInt160 pkh[keysCount];
-    size_t i, j;
-    int l = 0;
+    return BRTransactionSignBatch(tx, forkId, keys, keysCount, 1);
+}
+
+// same as BRTransactionSign(), but signs inputs on up to threadCount threads (0 for one per cpu)
+// signatures are deterministic (RFC 6979), so the signed tx is identical to the one BRTransactionSign() makes
+int BRTransactionSignBatch(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCount, size_t threadCount)
+{
+    _BRKeyHash pkh[keysCount + 1]; // sorted by hash160, so each input's key is found with a binary search
+    _BRTransactionSignBatch batch = { .tx = tx, .forkId = forkId, .keys = keys, .pkh = pkh, .keysCount = keysCount };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[TX_SIGN_BATCH_MAX_THREADS];
+    size_t i, maxThreads;
     
     assert(tx != NULL);
     assert(keys != NULL || keysCount == 0);
+    if (! tx) return 0;
+    
+    for (i = 0; i < keysCount; i++) {
+        pkh[i] = (_BRKeyHash) { BRKeyHash160(&keys[i]), i };
+    }
     
-    for (i = 0; tx && i < keysCount; i++) {
-        pkh[i] = BRKeyHash160(&keys[i]);
+    qsort(pkh, keysCount, sizeof(*pkh), _BRKeyHashCompare);
+    _BRTransactionWitnessHashes(tx, &batch.hashes);
+    batch.sigs = malloc((tx->inCount + 1)*sizeof(*batch.sigs));
+    assert(batch.sigs != NULL);
+    maxThreads = (tx->inCount + TX_SIGN_BATCH_CHUNK - 1)/TX_SIGN_BATCH_CHUNK;
+    if (threadCount == 0) threadCount = (cpus > 0) ? (size_t)cpus : 1;
+    if (threadCount > TX_SIGN_BATCH_MAX_THREADS) threadCount = TX_SIGN_BATCH_MAX_THREADS;
+    if (threadCount > maxThreads) threadCount = maxThreads;
+    pthread_mutex_init(&batch.lock, NULL);
+    
+    // the calling thread is one of the workers, so only threadCount - 1 extra threads are started
+    for (i = 1; i < threadCount; i++) {
+        if (pthread_create(&threads[i], NULL, _BRTransactionSignWorker, &batch) != 0) break;
     }
     
-    for (i = 0; tx && i < tx->inCount; i++) {
+    threadCount = i;
+    _BRTransactionSignWorker(&batch);
+    for (i = 1; i < threadCount; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&batch.lock);
+    
+    for (i = 0; i < tx->inCount; i++) { // tx is only changed once all sighashes are computed
         BRTxInput *input = &tx->inputs[i];
-
-        const uint8_t *hash = BRScriptPKH(input->script, input->scriptLen);
-        j = 0;
-        while (j < keysCount && (! hash || ! UInt160Eq(pkh[j], UInt160Get(hash)))) j++;
-        if (j >= keysCount) continue;
-
-        const uint8_t *elems[BRScriptElements(NULL, 0, input->script, input->scriptLen)];
-        size_t elemsCount = BRScriptElements(elems, sizeof(elems)/sizeof(*elems), input->script, input->scriptLen);
-        uint8_t pubKey[BRKeyPubKey(&keys[j], NULL, 0)];
-        size_t pkLen = BRKeyPubKey(&keys[j], pubKey, sizeof(pubKey));
-        uint8_t sig[73], script[1 + sizeof(sig) + 1 + sizeof(pubKey)];
-        size_t sigLen, scriptLen;
-        UInt256 md = UINT256_ZERO;        
-
-        if (elemsCount == 2 && *elems[0] == OP_0 && *elems[1] == 20) { // pay-to-witness-pubkey-hash
-            uint8_t data[_BRTransactionWitnessData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionWitnessData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
-            BRTxInputSetSignature(input, script, 0);
-            BRTxInputSetWitness(input, script, scriptLen);
-        }
-        else if (elemsCount >= 2 && *elems[elemsCount - 2] == OP_EQUALVERIFY) { // pay-to-pubkey-hash
-            uint8_t data[_BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-            
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            scriptLen += BRScriptPushData(&script[scriptLen], sizeof(script) - scriptLen, pubKey, pkLen);
-            BRTxInputSetSignature(input, script, scriptLen);
-            BRTxInputSetWitness(input, script, 0);
+        _BRTxInputSig *sig = &batch.sigs[i];
+        
+        if (sig->type == SIGN_WITNESS) {
+            BRTxInputSetSignature(input, sig->script, 0);
+            BRTxInputSetWitness(input, sig->script, sig->scriptLen);
         }
-        else { // pay-to-pubkey
-            uint8_t data[_BRTransactionData(tx, NULL, 0, i, forkId | SIGHASH_ALL)];
-            size_t dataLen = _BRTransactionData(tx, data, sizeof(data), i, forkId | SIGHASH_ALL);
-
-            BRSHA256_2(&md, data, dataLen);
-            sigLen = BRKeySign(&keys[j], sig, sizeof(sig) - 1, md);
-            sig[sigLen++] = forkId | SIGHASH_ALL;
-            scriptLen = BRScriptPushData(script, sizeof(script), sig, sigLen);
-            BRTxInputSetSignature(input, script, scriptLen);
-            BRTxInputSetWitness(input, script, 0);
+        else if (sig->type == SIGN_SCRIPT_SIG) {
+            BRTxInputSetSignature(input, sig->script, sig->scriptLen);
+            BRTxInputSetWitness(input, sig->script, 0);
         }
     }
     
-    if (tx && BRTransactionIsSigned(tx)) {
+    free(batch.sigs);
+    
+    if (BRTransactionIsSigned(tx)) {
         uint8_t data[BRTransactionSerialize(tx, NULL, 0)];
         size_t len = BRTransactionSerialize(tx, data, sizeof(data));
         BRTransaction *t = BRTransactionParse(data, len);
@@ -47,6 +47,9 @@ extern "C" {
 
 #define TXIN_SEQUENCE        UINT32_MAX  // sequence number for a finalized tx input
 
+#define TX_SIGN_BATCH_CHUNK       8  // number of inputs a BRTransactionSignBatch() worker signs at a time
+#define TX_SIGN_BATCH_MAX_THREADS 16 // upper limit for threads used by a single BRTransactionSignBatch() call
+
 #define SATOSHIS             100000000LL
 #define MAX_MONEY            (21000000LL*SATOSHIS) //TODO: This should be 21000000000?
 
@@ -140,6 +143,36 @@ size_t BRTransactionSize(const BRTransaction *tx);
 // virtual transaction size as defined by BIP141: https://github.com/bitcoin/bips/blob/master/bip-0141.mediawiki
 size_t BRTransactionVSize(const BRTransaction *tx);
 
+// running size of a transaction being built, adding an input or output updates it in constant time
+typedef struct {
+    size_t inCount;
+    size_t outCount;
+    size_t size; // non-witness bytes, not counting the version, locktime, or input and output counts
+    size_t witSize; // witness bytes, not counting the segwit marker and flag, or the per input witness counts
+} BRTxSizeEstimate;
+
+#define BR_TX_SIZE_ESTIMATE_NONE ((BRTxSizeEstimate) { 0, 0, 0, 0 })
+
+// returns the size estimate of tx's inputs and outputs
+BRTxSizeEstimate BRTransactionSizeEstimate(const BRTransaction *tx);
+
+// adds an input to est, taking the same arguments as BRTransactionAddInput()
+void BRTxSizeEstimateAddInput(BRTxSizeEstimate *est, const uint8_t *script, size_t scriptLen,
+                              const uint8_t *signature, size_t sigLen, const uint8_t *witness, size_t witLen);
+
+// adds an output with a scriptPubKey of the given length to est
+void BRTxSizeEstimateAddOutput(BRTxSizeEstimate *est, size_t scriptLen);
+
+// size in bytes, as returned by BRTransactionSize() for a transaction with the same inputs and outputs
+size_t BRTxSizeEstimateSize(const BRTxSizeEstimate *est);
+
+// virtual size, as returned by BRTransactionVSize() for a transaction with the same inputs and outputs
+size_t BRTxSizeEstimateVSize(const BRTxSizeEstimate *est);
+
+// vsize an input adds to a transaction, not counting the segwit marker and flag or growth of the input count
+size_t BRTxSizeEstimateInputVSize(const uint8_t *script, size_t scriptLen, const uint8_t *signature, size_t sigLen,
+                                  const uint8_t *witness, size_t witLen);
+
 // minimum transaction fee needed for tx to relay across the bitcoin network
 uint64_t BRTransactionStandardFee(const BRTransaction *tx);
 
@@ -151,6 +184,10 @@ int BRTransactionIsSigned(const BRTransaction *tx);
 // returns true if tx is signed
 int BRTransactionSign(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCount);
 
+// same as BRTransactionSign(), but signs inputs on up to threadCount threads (0 for one per cpu)
+// signatures are deterministic (RFC 6979), so the signed tx is identical to the one BRTransactionSign() makes
+int BRTransactionSignBatch(BRTransaction *tx, int forkId, BRKey keys[], size_t keysCount, size_t threadCount);
+
 // true if tx meets IsStandard() rules: https://bitcoin.org/en/developer-guide#standard-transactions
 int BRTransactionIsStandard(const BRTransaction *tx);
 
@@ -28,6 +28,7 @@
 #include "BRArray.h"
 #include "BRBech32.h"
 #include "BRDigiAsset.h"
+#include "BRCoinSelection.h"
 #include <stdlib.h>
 #include <inttypes.h>
 #include <limits.h>
@@ -35,16 +36,71 @@
 #include <pthread.h>
 #include <assert.h>
 
+// records one change _BRWalletApplyTx() made to the balance state, so it can be rolled back by _BRWalletUndoTx()
+typedef struct {
+    const void *item; // set item that was added, the tx of an added utxo, or the utxo index node that was spent
+    int op;
+} _BRWalletUndo;
+
+#define UNDO_SPENT_OUTPUT 0
+#define UNDO_USED_ADDR    1
+#define UNDO_INVALID_TX   2
+#define UNDO_PENDING_TX   3
+#define UNDO_UTXO_ADD     4
+#define UNDO_UTXO_SPEND   5
+#define UNDO_ASSET_ADD    6
+
+#define UTXO_CHUNK 1024 // utxo index nodes per allocation
+#define ADDR_CHUNK 256  // wallet addresses per allocation
+
+// wallet address, addresses are allocated in chunks and never move, so wallet->allAddrs can hold pointers to them
+typedef struct {
+    BRAddress address; // must be the first member, so BRAddressHash() and BRAddressEq() can be used on entries
+    uint32_t index; // position in its chain
+    uint32_t chain; // SEQUENCE_INTERNAL_CHAIN or SEQUENCE_EXTERNAL_CHAIN
+    int segwit; // true for a native segwit address
+} _BRWalletAddr;
+
+typedef struct {
+    _BRWalletAddr **chunks; // ADDR_CHUNK addresses each, in chain order
+    size_t count;
+} _BRWalletAddrChain;
+
+inline static _BRWalletAddr *_BRWalletAddrAt(const _BRWalletAddrChain *addrChain, size_t i)
+{
+    return &addrChain->chunks[i/ADDR_CHUNK][i % ADDR_CHUNK];
+}
+
+static void _BRWalletAddrChainFree(_BRWalletAddrChain *addrChain)
+{
+    for (size_t i = array_count(addrChain->chunks); i > 0; i--) free(addrChain->chunks[i - 1]);
+    array_free(addrChain->chunks);
+}
+
+// utxo index node, nodes are allocated in chunks and never move, so wallet->utxoSet can hold pointers to them
+typedef struct _BRWalletUTXO {
+    BRUTXO utxo; // must be the first member, so BRUTXOHash() and BRUTXOEq() can be used on nodes
+    BRTransaction *tx; // transaction the output belongs to
+    int isAsset; // output carries a digiasset, and isn't part of the balance
+    struct _BRWalletUTXO *prev, *next; // neighbours in the order utxos were added, next is also the free list link
+} _BRWalletUTXO;
+
 struct BRWalletStruct {
     uint64_t balance, totalSent, totalReceived, feePerKb, *balanceHist;
     uint32_t blockHeight;
-    BRUTXO *utxos;
+    BRUTXO *utxos; // spendable utxos in the order they were added, rebuilt from the utxo index when utxosDirty is set
     BRUTXO *assetUtxos;
+    _BRWalletUTXO **utxoChunks, *utxoHead, *utxoTail, *utxoFree; // utxo index nodes, oldest, newest and free nodes
+    BRSet *utxoSet; // outpoint -> utxo index node, includes outputs carrying digiassets
+    int utxosDirty;
     BRTransaction **transactions;
     BRMasterPubKey masterPubKey;
-    BRAddress *internalChain, *externalChain;
-    BRAddress *internalChainSegwit, *externalChainSegwit;
+    BRMasterPubKey chainPubKey[2]; // extended public keys for the external and internal chains, indexed by chain
+    _BRWalletAddrChain internalChain, externalChain;
+    _BRWalletAddrChain internalChainSegwit, externalChainSegwit;
     BRSet *allTx, *invalidTx, *pendingTx, *spentOutputs, *usedAddrs, *allAddrs;
+    _BRWalletUndo *undo; // changes made to the balance state by each applied tx, in order
+    size_t *undoPos; // undoPos[i] is the length of undo before transactions[i] was applied
     void *callbackInfo;
     void (*balanceChanged)(void *info, uint64_t balance);
     void (*txAdded)(void *info, BRTransaction *tx);
@@ -55,24 +111,53 @@ struct BRWalletStruct {
 
 inline static uint64_t _txFee(uint64_t feePerKb, size_t size)
 {
-    // standard fee based on tx size
-    uint64_t standardFee = size*TX_FEE_PER_KB/1000,
-    // fee using feePerKb, rounded up to nearest 100 satoshi
-    fee = (((size*feePerKb/1000) + 99)/100)*100;
+    return BRCoinSelectionFee(feePerKb, size);
+}
+
+// looks up addr in allAddrs and returns its chain position, setting chain to SEQUENCE_INTERNAL_CHAIN or
+// SEQUENCE_EXTERNAL_CHAIN and segwit to true for a native segwit address
+// returns SIZE_MAX if addr isn't a wallet address
+static size_t _BRWalletAddrIndex(BRWallet *wallet, const char *addr, uint32_t *chain, int *segwit)
+{
+    const _BRWalletAddr *a = BRSetGet(wallet->allAddrs, addr);
     
-    return (fee > standardFee) ? fee : standardFee;
+    if (! a) return SIZE_MAX;
+    if (chain) *chain = a->chain;
+    if (segwit) *segwit = a->segwit;
+    return a->index;
 }
 
-// chain position of first tx output address that appears in chain
-inline static size_t _txChainIndex(const BRTransaction *tx, const BRAddress *addrChain)
+// appends address to addrChain and adds it to allAddrs, earlier addresses in the chain don't move
+static void _BRWalletAddrAdd(BRWallet *wallet, _BRWalletAddrChain *addrChain, BRAddress address, uint32_t chain,
+                             int segwit)
 {
-    for (size_t i = array_count(addrChain); i > 0; i--) {
-        for (size_t j = 0; j < tx->outCount; j++) {
-            if (BRAddressEq(tx->outputs[j].address, &addrChain[i - 1])) return i - 1;
-        }
+    _BRWalletAddr *chunk, *a;
+    
+    if (addrChain->count % ADDR_CHUNK == 0) {
+        chunk = calloc(ADDR_CHUNK, sizeof(*chunk));
+        assert(chunk != NULL);
+        array_add(addrChain->chunks, chunk);
     }
     
-    return SIZE_MAX;
+    a = _BRWalletAddrAt(addrChain, addrChain->count);
+    *a = (_BRWalletAddr) { address, (uint32_t)addrChain->count, chain, segwit };
+    addrChain->count++;
+    BRSetAdd(wallet->allAddrs, a);
+}
+
+// highest position in the given legacy address chain of a tx output address, or SIZE_MAX if none are in the chain
+inline static size_t _txChainIndex(BRWallet *wallet, const BRTransaction *tx, uint32_t chain)
+{
+    size_t idx = SIZE_MAX, i;
+    uint32_t c;
+    int segwit;
+    
+    for (size_t j = 0; j < tx->outCount; j++) {
+        i = _BRWalletAddrIndex(wallet, tx->outputs[j].address, &c, &segwit);
+        if (i != SIZE_MAX && c == chain && ! segwit && (idx == SIZE_MAX || i > idx)) idx = i;
+    }
+    
+    return idx;
 }
 
 inline static int _BRWalletTxIsAscending(BRWallet *wallet, const BRTransaction *tx1, const BRTransaction *tx2)
@@ -102,26 +187,125 @@ inline static int _BRWalletTxCompare(BRWallet *wallet, const BRTransaction *tx1,
 
     if (_BRWalletTxIsAscending(wallet, tx1, tx2)) return 1;
     if (_BRWalletTxIsAscending(wallet, tx2, tx1)) return -1;
-    i = _txChainIndex(tx1, wallet->internalChain);
-    j = _txChainIndex(tx2, (i == SIZE_MAX) ? wallet->externalChain : wallet->internalChain);
-    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex((BRTransaction *)tx1, wallet->externalChain);
+    i = _txChainIndex(wallet, tx1, SEQUENCE_INTERNAL_CHAIN);
+    j = _txChainIndex(wallet, tx2, (i == SIZE_MAX) ? SEQUENCE_EXTERNAL_CHAIN : SEQUENCE_INTERNAL_CHAIN);
+    if (i == SIZE_MAX && j != SIZE_MAX) i = _txChainIndex(wallet, tx1, SEQUENCE_EXTERNAL_CHAIN);
     if (i != SIZE_MAX && j != SIZE_MAX && i != j) return (i > j) ? 1 : -1;
     return 0;
 }
 
-// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first (insertion sort)
-inline static void _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
+// inserts tx into wallet->transactions, keeping wallet->transactions sorted by date, oldest first
+// returns the position tx was inserted at
+inline static size_t _BRWalletInsertTx(BRWallet *wallet, BRTransaction *tx)
 {
-    size_t i = array_count(wallet->transactions);
+    size_t lo = 0, hi = array_count(wallet->transactions), i;
+    
+    // transactions are sorted by blockHeight, so binary search for the end of the run with tx's height, and only
+    // compare ancestry and chain position with the transactions at that height
+    while (lo < hi) {
+        i = lo + (hi - lo)/2;
+        if (wallet->transactions[i]->blockHeight > tx->blockHeight) hi = i;
+        else lo = i + 1;
+    }
+    
+    while (lo > 0 && wallet->transactions[lo - 1]->blockHeight == tx->blockHeight &&
+           _BRWalletTxCompare(wallet, wallet->transactions[lo - 1], tx) > 0) lo--;
     
+    i = array_count(wallet->transactions);
     array_set_count(wallet->transactions, i + 1);
+    memmove(&wallet->transactions[lo + 1], &wallet->transactions[lo], (i - lo)*sizeof(*wallet->transactions));
+    wallet->transactions[lo] = tx;
+    return lo;
+}
+
+typedef struct {
+    UInt256 txHash; // must be the first member, so BRTransactionHash() and BRTransactionEq() can be used on keys
+    BRTransaction *tx;
+    size_t internalIndex; // internal chain index if tx pays change, otherwise SIZE_MAX
+    size_t externalIndex; // external chain index if tx pays to a receive address, otherwise SIZE_MAX
+    size_t pos; // position tx was passed in at
+    size_t parents; // number of same height txs spent by tx that aren't in wallet->transactions yet
+    size_t *children; // sorted positions of the same height txs that spend tx, NULL if there are none
+} _BRWalletTxSortKey;
+
+// compares chain positions in the same order as _BRWalletTxCompare(), the internal chain index when both txs pay
+// change, otherwise the external chain index when both pay to a receive address, ancestry is handled separately
+static int _BRWalletTxSortKeyCompare(const void *key1, const void *key2)
+{
+    const _BRWalletTxSortKey *k1 = key1, *k2 = key2;
     
-    while (i > 0 && _BRWalletTxCompare(wallet, wallet->transactions[i - 1], tx) > 0) {
-        wallet->transactions[i] = wallet->transactions[i - 1];
-        i--;
+    if (k1->tx->blockHeight != k2->tx->blockHeight) return (k1->tx->blockHeight < k2->tx->blockHeight) ? -1 : 1;
+    
+    if (k1->internalIndex != SIZE_MAX && k2->internalIndex != SIZE_MAX) {
+        if (k1->internalIndex != k2->internalIndex) return (k1->internalIndex < k2->internalIndex) ? -1 : 1;
+    }
+    else if (k1->externalIndex != SIZE_MAX && k2->externalIndex != SIZE_MAX) {
+        if (k1->externalIndex != k2->externalIndex) return (k1->externalIndex < k2->externalIndex) ? -1 : 1;
     }
     
-    wallet->transactions[i] = tx;
+    return (k1->pos < k2->pos) ? -1 : (k1->pos > k2->pos);
+}
+
+// appends txs to an empty wallet->transactions in O(n log n), in the order _BRWalletInsertTx() keeps: sorted by
+// blockHeight and address chain position, with each tx held back until the same height txs it spends are appended
+static void _BRWalletLoadTxs(BRWallet *wallet, BRTransaction *txs[], size_t txCount)
+{
+    _BRWalletTxSortKey *keys = calloc(txCount, sizeof(*keys)), *p;
+    BRSet *keySet = BRSetNew(BRTransactionHash, BRTransactionEq, txCount);
+    size_t i, j, k, c, t, *heap; // min-heap of sorted positions whose same height inputs are all appended
+    
+    assert(keys != NULL || txCount == 0);
+    assert(array_count(wallet->transactions) == 0);
+    array_new(heap, txCount);
+    
+    for (i = 0; i < txCount; i++) {
+        keys[i] = (_BRWalletTxSortKey) { txs[i]->txHash, txs[i], _txChainIndex(wallet, txs[i], SEQUENCE_INTERNAL_CHAIN),
+                                         _txChainIndex(wallet, txs[i], SEQUENCE_EXTERNAL_CHAIN), i, 0, NULL };
+    }
+    
+    qsort(keys, txCount, sizeof(*keys), _BRWalletTxSortKeyCompare);
+    for (i = 0; i < txCount; i++) BRSetAdd(keySet, &keys[i]);
+    
+    for (i = 0; i < txCount; i++) {
+        for (j = 0; j < keys[i].tx->inCount; j++) {
+            p = BRSetGet(keySet, &keys[i].tx->inputs[j].txHash);
+            if (! p || p->tx->blockHeight != keys[i].tx->blockHeight) continue;
+            if (! p->children) array_new(p->children, 1);
+            array_add(p->children, i);
+            keys[i].parents++;
+        }
+        
+        if (keys[i].parents == 0) array_add(heap, i); // ascending, so already a valid heap
+    }
+    
+    while (array_count(heap) > 0) {
+        i = heap[0];
+        array_add(wallet->transactions, keys[i].tx);
+        heap[0] = heap[array_count(heap) - 1];
+        array_rm_last(heap);
+        
+        for (j = 0; (c = 2*j + 1) < array_count(heap); j = c) { // sift down
+            if (c + 1 < array_count(heap) && heap[c + 1] < heap[c]) c++;
+            if (heap[j] < heap[c]) break;
+            t = heap[j], heap[j] = heap[c], heap[c] = t;
+        }
+        
+        for (k = 0; keys[i].children && k < array_count(keys[i].children); k++) {
+            if (--keys[keys[i].children[k]].parents > 0) continue;
+            array_add(heap, keys[i].children[k]);
+            
+            for (j = array_count(heap) - 1; j > 0 && heap[(j - 1)/2] > heap[j]; j = (j - 1)/2) { // sift up
+                t = heap[j], heap[j] = heap[(j - 1)/2], heap[(j - 1)/2] = t;
+            }
+        }
+        
+        if (keys[i].children) array_free(keys[i].children);
+    }
+    
+    assert(array_count(wallet->transactions) == txCount);
+    array_free(heap);
+    BRSetFree(keySet);
+    free(keys);
 }
 
 // non-threadsafe version of BRWalletContainsTransaction()
@@ -160,125 +344,256 @@ static int _BRWalletContainsTx(BRWallet *wallet, const BRTransaction *tx)
 //    return r;
 //}
 
-static void _BRWalletUpdateBalance(BRWallet *wallet)
+inline static void _BRWalletUndoAdd(BRWallet *wallet, int op, const void *item)
 {
-    int isInvalid, isPending;
-    uint64_t balance = 0, prevBalance = 0;
-    time_t now = time(NULL);
-    size_t i, j;
-    BRTransaction *tx, *t;
-    BRTxOutput o;
+    array_add(wallet->undo, ((_BRWalletUndo) { item, op }));
+}
+
+// adds item to set and logs the change, unless an equivalent item is already there (so set items always belong to the
+// earliest tx that added them, and are only removed when that tx is rolled back)
+inline static void _BRWalletSetAdd(BRWallet *wallet, BRSet *set, int op, void *item)
+{
+    if (BRSetContains(set, item)) return;
+    BRSetAdd(set, item);
+    _BRWalletUndoAdd(wallet, op, item);
+}
+
+// links an unlinked node in after node->prev, or at the head of the utxo list if prev is NULL
+static void _BRWalletUTXOLink(BRWallet *wallet, _BRWalletUTXO *node)
+{
+    node->next = (node->prev) ? node->prev->next : wallet->utxoHead;
+    if (node->prev) node->prev->next = node;
+    else wallet->utxoHead = node;
+    if (node->next) node->next->prev = node;
+    else wallet->utxoTail = node;
+    BRSetAdd(wallet->utxoSet, node);
+    wallet->utxosDirty = 1;
+}
 
+// adds output n of tx to the end of the utxo index
+static void _BRWalletUTXOAdd(BRWallet *wallet, BRTransaction *tx, uint32_t n, int isAsset)
+{
+    _BRWalletUTXO *node = wallet->utxoFree;
+    
+    if (! node) { // allocate a new chunk of nodes and put them on the free list
+        node = calloc(UTXO_CHUNK, sizeof(*node));
+        assert(node != NULL);
+        array_add(wallet->utxoChunks, node);
+        for (size_t i = 0; i + 1 < UTXO_CHUNK; i++) node[i].next = &node[i + 1];
+    }
+    
+    wallet->utxoFree = node->next;
+    *node = (_BRWalletUTXO) { { tx->txHash, n }, tx, isAsset, wallet->utxoTail, NULL };
+    _BRWalletUTXOLink(wallet, node);
+}
+
+// unlinks node from the utxo index, leaving its contents in place so it can be linked back in at the same position
+static void _BRWalletUTXOUnlink(BRWallet *wallet, _BRWalletUTXO *node)
+{
+    if (node->prev) node->prev->next = node->next;
+    else wallet->utxoHead = node->next;
+    if (node->next) node->next->prev = node->prev;
+    else wallet->utxoTail = node->prev;
+    BRSetRemove(wallet->utxoSet, node);
+    wallet->utxosDirty = 1;
+}
+
+// rebuilds wallet->utxos from the utxo index if it changed, skipping outputs that carry digiassets
+static void _BRWalletUpdateUTXOs(BRWallet *wallet)
+{
+    if (! wallet->utxosDirty) return;
     array_clear(wallet->utxos);
-    array_clear(wallet->assetUtxos);
-    array_clear(wallet->balanceHist);
-    BRSetClear(wallet->spentOutputs);
-    BRSetClear(wallet->invalidTx);
-    BRSetClear(wallet->pendingTx);
-    BRSetClear(wallet->usedAddrs);
-    wallet->totalSent = 0;
-    wallet->totalReceived = 0;
-
-    for (i = 0; i < array_count(wallet->transactions); i++) {
-        tx = wallet->transactions[i];
-
-        // check if any inputs are invalid or already spent
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            for (j = 0, isInvalid = 0; ! isInvalid && j < tx->inCount; j++) {
-                if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
-                    BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash))
-                    isInvalid = 1;
-            }
-        
-            if (isInvalid) {
-                BRSetAdd(wallet->invalidTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
-        }
+    
+    for (_BRWalletUTXO *node = wallet->utxoHead; node; node = node->next) {
+        if (! node->isAsset) array_add(wallet->utxos, node->utxo);
+    }
+    
+    wallet->utxosDirty = 0;
+}
 
-        // add inputs to spent output set
-        for (j = 0; j < tx->inCount; j++) {
-            BRSetAdd(wallet->spentOutputs, &tx->inputs[j]);
-        }
+// removes the wallet utxo spent by input from the utxo index, if there is one, and returns its balance amount
+static uint64_t _BRWalletSpendUTXO(BRWallet *wallet, const BRTxInput *input)
+{
+    _BRWalletUTXO *node = BRSetGet(wallet->utxoSet, input); // BRTxInput starts with the outpoint hash and index
+    
+    if (! node) return 0;
+    _BRWalletUTXOUnlink(wallet, node); // spent nodes aren't reused, the undo log keeps them for rollback
+    _BRWalletUndoAdd(wallet, UNDO_UTXO_SPEND, node);
+    return (node->isAsset) ? 0 : node->tx->outputs[node->utxo.n].amount;
+}
 
-        // check if tx is pending
-        if (tx->blockHeight == TX_UNCONFIRMED) {
-            isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
-            
-            for (j = 0; ! isPending && j < tx->outCount; j++) {
-                if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
-            }
+// applies the next tx in wallet->transactions to the balance state: classifies it as invalid, pending or valid, marks
+// its inputs spent, and adds its wallet outputs to the utxos, logging every change so it can be rolled back
+static void _BRWalletApplyTx(BRWallet *wallet, BRTransaction *tx, time_t now)
+{
+    size_t i = array_count(wallet->balanceHist), j;
+    uint64_t balance = (i > 0) ? wallet->balanceHist[i - 1] : 0, prevBalance = balance;
+    int isInvalid = 0, isPending = 0;
 
-            for (j = 0; ! isPending && j < tx->inCount; j++) {
-                if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
-                    tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
-                if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
-                if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
-            }
-            
-            if (isPending) {
-                BRSetAdd(wallet->pendingTx, tx);
-                array_add(wallet->balanceHist, balance);
-                continue;
-            }
+    array_add(wallet->undoPos, array_count(wallet->undo));
+
+    // check if any inputs are invalid or already spent
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        for (j = 0; ! isInvalid && j < tx->inCount; j++) {
+            if (BRSetContains(wallet->spentOutputs, &tx->inputs[j]) ||
+                BRSetContains(wallet->invalidTx, &tx->inputs[j].txHash)) isInvalid = 1;
         }
+    }
+    
+    if (isInvalid) {
+        _BRWalletSetAdd(wallet, wallet->invalidTx, UNDO_INVALID_TX, tx);
+        array_add(wallet->balanceHist, balance);
+        return;
+    }
+    
+    // add inputs to spent output set, and remove the wallet utxos they spend
+    for (j = 0; j < tx->inCount; j++) {
+        if (BRSetContains(wallet->spentOutputs, &tx->inputs[j])) continue;
+        _BRWalletSetAdd(wallet, wallet->spentOutputs, UNDO_SPENT_OUTPUT, &tx->inputs[j]);
+        balance -= _BRWalletSpendUTXO(wallet, &tx->inputs[j]);
+    }
 
+    // check if tx is pending
+    if (tx->blockHeight == TX_UNCONFIRMED) {
+        isPending = (BRTransactionSize(tx) > TX_MAX_SIZE) ? 1 : 0; // check tx size is under TX_MAX_SIZE
+        
+        for (j = 0; ! isPending && j < tx->outCount; j++) {
+            if (tx->outputs[j].amount < TX_MIN_OUTPUT_AMOUNT) isPending = 1; // check that no outputs are dust
+        }
+        
+        for (j = 0; ! isPending && j < tx->inCount; j++) {
+            if (tx->inputs[j].sequence < UINT32_MAX - 1) isPending = 1; // check for replace-by-fee
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime < TX_MAX_LOCK_HEIGHT &&
+                tx->lockTime > wallet->blockHeight + 1) isPending = 1; // future lockTime
+            if (tx->inputs[j].sequence < UINT32_MAX && tx->lockTime > now) isPending = 1; // future lockTime
+            if (BRSetContains(wallet->pendingTx, &tx->inputs[j].txHash)) isPending = 1; // check for pending inputs
+        }
+    }
+    
+    if (isPending) {
+        _BRWalletSetAdd(wallet, wallet->pendingTx, UNDO_PENDING_TX, tx);
+    }
+    else {
         // add outputs to UTXO set
         // TODO: don't add outputs below TX_MIN_OUTPUT_AMOUNT
         // TODO: don't add coin generation outputs < 100 blocks deep
         // NOTE: balance/UTXOs will then need to be recalculated when last block changes
         for (j = 0; j < tx->outCount; j++) {
-            if (tx->outputs[j].address[0] != '\0') {
-                BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
-                
-                if (BRSetContains(wallet->allAddrs, tx->outputs[j].address)) {
-                    // If the tx contains an asset, we will skip the DUST transactions,
-                    // otherwise there would be a chance of burning the received assets.
-                    // Hence, skip adding the 600 dsatoshi transactions to the utxos.
-#if DEBUG
-                    printf("ASSETS: Checking %s:%d\n", u256hex(UInt256Reverse(tx->txHash)), j);
-#endif
-                    if (BRTxOutputIsAsset(tx, &tx->outputs[j])) {
-                        array_add(wallet->assetUtxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
-                        balance += 0;
-                    } else {
-                        // Add the UTXO to the internal list of utxos and add the balance
-                        array_add(wallet->utxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
-                        balance += tx->outputs[j].amount;
-                    }
-                }
-            } else {
-                balance += 0;
+            int isAsset;
+            
+            if (tx->outputs[j].address[0] == '\0') continue;
+            _BRWalletSetAdd(wallet, wallet->usedAddrs, UNDO_USED_ADDR, tx->outputs[j].address);
+            if (! BRSetContains(wallet->allAddrs, tx->outputs[j].address)) continue;
+            
+            // If the tx contains an asset, we will skip the DUST transactions,
+            // otherwise there would be a chance of burning the received assets.
+            // Hence, asset outputs are indexed but don't count towards the balance or the spendable utxos.
+            isAsset = BRTxOutputIsAsset(tx, &tx->outputs[j]);
+            
+            if (isAsset) {
+                array_add(wallet->assetUtxos, ((BRUTXO) { tx->txHash, (uint32_t)j }));
+                _BRWalletUndoAdd(wallet, UNDO_ASSET_ADD, tx);
             }
-        }
-        // transaction ordering is not guaranteed, so check the entire UTXO set against the entire spent output set
-        for (j = array_count(wallet->utxos); j > 0; j--) {
-            t = BRSetGet(wallet->allTx, &wallet->utxos[j - 1].hash);
-            o = t->outputs[wallet->utxos[j - 1].n];
-            if (BRSetContains(wallet->spentOutputs, &wallet->utxos[j - 1])) {
-                balance -= o.amount;
-                array_rm(wallet->utxos, j - 1);
+            
+            // transaction ordering is not guaranteed, so outputs already spent by an earlier tx aren't added
+            if (! BRSetContains(wallet->spentOutputs, &((BRUTXO) { tx->txHash, (uint32_t)j }))) {
+                _BRWalletUTXOAdd(wallet, tx, (uint32_t)j, isAsset);
+                _BRWalletUndoAdd(wallet, UNDO_UTXO_ADD, tx);
+                if (! isAsset) balance += tx->outputs[j].amount;
             }
         }
+    }
+    
+    if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
+    if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
+    array_add(wallet->balanceHist, balance);
+}
+
+// rolls back the last tx applied by _BRWalletApplyTx()
+static void _BRWalletUndoTx(BRWallet *wallet)
+{
+    size_t i = array_count(wallet->balanceHist) - 1, j;
+    uint64_t balance = wallet->balanceHist[i], prevBalance = (i > 0) ? wallet->balanceHist[i - 1] : 0;
+    const _BRWalletUndo *u;
+    _BRWalletUTXO *node;
+
+    if (prevBalance < balance) wallet->totalReceived -= balance - prevBalance;
+    if (balance < prevBalance) wallet->totalSent -= prevBalance - balance;
+
+    for (j = array_count(wallet->undo); j > wallet->undoPos[i]; j--) {
+        u = &wallet->undo[j - 1];
         
-        if (prevBalance < balance) wallet->totalReceived += balance - prevBalance;
-        if (balance < prevBalance) wallet->totalSent += prevBalance - balance;
-        array_add(wallet->balanceHist, balance);
-        prevBalance = balance;
+        switch (u->op) {
+            case UNDO_SPENT_OUTPUT: BRSetRemove(wallet->spentOutputs, u->item); break;
+            case UNDO_USED_ADDR: BRSetRemove(wallet->usedAddrs, u->item); break;
+            case UNDO_INVALID_TX: BRSetRemove(wallet->invalidTx, u->item); break;
+            case UNDO_PENDING_TX: BRSetRemove(wallet->pendingTx, u->item); break;
+            case UNDO_UTXO_ADD: // outputs are added at the end of the list, so the last one is the one to remove
+                node = wallet->utxoTail;
+                _BRWalletUTXOUnlink(wallet, node);
+                node->next = wallet->utxoFree;
+                wallet->utxoFree = node;
+                break;
+            case UNDO_UTXO_SPEND: _BRWalletUTXOLink(wallet, (_BRWalletUTXO *)u->item); break;
+            case UNDO_ASSET_ADD: array_rm_last(wallet->assetUtxos); break;
+        }
     }
 
-    //No longer applicable, balance is not for all transactions considering assets
+    array_set_count(wallet->undo, wallet->undoPos[i]);
+    array_rm_last(wallet->undoPos);
+    array_rm_last(wallet->balanceHist);
+}
+
+#if DEBUG
+// debug consistency check: rebuilds the balance state from the first transaction and compares it with the
+// incrementally maintained one, now must be the time the update being checked applied its txs with
+static void _BRWalletCheckBalance(BRWallet *wallet, time_t now)
+{
+    size_t i, count = array_count(wallet->transactions), utxoCount = BRSetCount(wallet->utxoSet);
+    uint64_t totalSent = wallet->totalSent, totalReceived = wallet->totalReceived, *balanceHist;
+    BRUTXO *utxos;
+    _BRWalletUTXO *node;
+
+    array_new(balanceHist, count);
+    array_add_array(balanceHist, wallet->balanceHist, count);
+    array_new(utxos, utxoCount);
+    for (node = wallet->utxoHead; node; node = node->next) array_add(utxos, node->utxo);
+    assert(array_count(utxos) == utxoCount);
+    while (array_count(wallet->balanceHist) > 0) _BRWalletUndoTx(wallet);
+    assert(array_count(wallet->undo) == 0 && ! wallet->utxoHead && BRSetCount(wallet->utxoSet) == 0 &&
+           BRSetCount(wallet->spentOutputs) == 0);
+    for (i = 0; i < count; i++) _BRWalletApplyTx(wallet, wallet->transactions[i], now);
+    assert(memcmp(balanceHist, wallet->balanceHist, count*sizeof(*balanceHist)) == 0);
+    for (i = 0, node = wallet->utxoHead; node; node = node->next, i++) assert(BRUTXOEq(&node->utxo, &utxos[i]));
+    assert(i == utxoCount && BRSetCount(wallet->utxoSet) == utxoCount);
+    assert(wallet->totalSent == totalSent && wallet->totalReceived == totalReceived);
+    array_free(utxos);
+    array_free(balanceHist);
+}
+#endif
+
+// brings the balance, balanceHist, utxos, and the spent output, invalid, pending and used address sets up to date after
+// wallet->transactions changed from position i onward, by rolling back the txs applied after i and applying the current
+// ones in order, appending a tx to the end of wallet->transactions only costs applying that one tx
+static void _BRWalletUpdateBalance(BRWallet *wallet, size_t i)
+{
+    time_t now = time(NULL);
+    size_t count = array_count(wallet->transactions);
+    
+    while (array_count(wallet->balanceHist) > i) _BRWalletUndoTx(wallet);
+    for (i = array_count(wallet->balanceHist); i < count; i++) _BRWalletApplyTx(wallet, wallet->transactions[i], now);
     assert(array_count(wallet->balanceHist) == array_count(wallet->transactions));
-    wallet->balance = balance;
+    wallet->balance = (count > 0) ? wallet->balanceHist[count - 1] : 0;
+#if DEBUG
+    _BRWalletCheckBalance(wallet, now);
+#endif
 }
 
 // allocates and populates a BRWallet struct which must be freed by calling BRWalletFree()
 BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPubKey mpk)
 {
     BRWallet *wallet = NULL;
-    BRTransaction *tx;
+    BRTransaction *tx, **txs;
 
     assert(transactions != NULL || txCount == 0);
     wallet = calloc(1, sizeof(*wallet));
@@ -288,11 +603,17 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     array_new(wallet->transactions, txCount + 100);
     wallet->feePerKb = DEFAULT_FEE_PER_KB;
     wallet->masterPubKey = mpk;
-    array_new(wallet->internalChain, 50);
-    array_new(wallet->externalChain, 50);
-    array_new(wallet->internalChainSegwit, 50);
-    array_new(wallet->externalChainSegwit, 50);
+    wallet->chainPubKey[SEQUENCE_EXTERNAL_CHAIN] = BRBIP32ChainPubKey(mpk, SEQUENCE_EXTERNAL_CHAIN);
+    wallet->chainPubKey[SEQUENCE_INTERNAL_CHAIN] = BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
+    array_new(wallet->internalChain.chunks, 1);
+    array_new(wallet->externalChain.chunks, 1);
+    array_new(wallet->internalChainSegwit.chunks, 1);
+    array_new(wallet->externalChainSegwit.chunks, 1);
     array_new(wallet->balanceHist, txCount + 100);
+    array_new(wallet->undo, txCount*4 + 100);
+    array_new(wallet->undoPos, txCount + 100);
+    array_new(wallet->utxoChunks, 10);
+    wallet->utxoSet = BRSetNew(BRUTXOHash, BRUTXOEq, txCount + 100);
     wallet->allTx = BRSetNew(BRTransactionHash, BRTransactionEq, txCount + 100);
     wallet->invalidTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
     wallet->pendingTx = BRSetNew(BRTransactionHash, BRTransactionEq, 10);
@@ -301,11 +622,13 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     wallet->allAddrs = BRSetNew(BRAddressHash, BRAddressEq, txCount + 100);
     pthread_mutex_init(&wallet->lock, NULL);
 
+    array_new(txs, txCount);
+
     for (size_t i = 0; transactions && i < txCount; i++) {
         tx = transactions[i];
         if (! BRTransactionIsSigned(tx) || BRSetContains(wallet->allTx, tx)) continue;
         BRSetAdd(wallet->allTx, tx);
-        _BRWalletInsertTx(wallet, tx);
+        array_add(txs, tx);
 
         for (size_t j = 0; j < tx->outCount; j++) {
             if (tx->outputs[j].address[0] != '\0') BRSetAdd(wallet->usedAddrs, tx->outputs[j].address);
@@ -316,7 +639,10 @@ BRWallet *BRWalletNew(BRTransaction *transactions[], size_t txCount, BRMasterPub
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1, 1);
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_EXTERNAL, 0, 0);
     BRWalletUnusedAddrs(wallet, NULL, SEQUENCE_GAP_LIMIT_INTERNAL, 1, 0);
-    _BRWalletUpdateBalance(wallet);
+    _BRWalletLoadTxs(wallet, txs, array_count(txs)); // sorted once the address chains are known
+    array_free(txs);
+    BRSetClear(wallet->usedAddrs); // rebuilt from valid transactions, along with the balance
+    _BRWalletUpdateBalance(wallet, 0);
 
     if (txCount > 0 && ! _BRWalletContainsTx(wallet, transactions[0])) { // verify transactions match master pubKey
         BRWalletFree(wallet);
@@ -357,8 +683,9 @@ void BRWalletSetCallbacks(BRWallet *wallet, void *info,
 // returns the number addresses written to addrs
 size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimit, int internal, int nativeSegwit)
 {
-    BRAddress *addrChain;
-    size_t i, j = 0, count, startCount;
+    _BRWalletAddrChain *addrChain;
+    BRECPoint *pubKeys = NULL;
+    size_t i, j = 0, k, n, count;
     uint32_t chain = (internal) ? SEQUENCE_INTERNAL_CHAIN : SEQUENCE_EXTERNAL_CHAIN;
 
     assert(wallet != NULL);
@@ -366,90 +693,59 @@ size_t BRWalletUnusedAddrs(BRWallet *wallet, BRAddress addrs[], uint32_t gapLimi
     pthread_mutex_lock(&wallet->lock);
     
     if (nativeSegwit) {
-        addrChain = (internal) ? wallet->internalChainSegwit : wallet->externalChainSegwit;
+        addrChain = (internal) ? &wallet->internalChainSegwit : &wallet->externalChainSegwit;
     } else {
-        addrChain = (internal) ? wallet->internalChain : wallet->externalChain;
+        addrChain = (internal) ? &wallet->internalChain : &wallet->externalChain;
     }
     
-    i = count = startCount = array_count(addrChain);
+    i = count = addrChain->count;
     
     // keep only the trailing contiguous block of addresses with no transactions
-    while (i > 0 && ! BRSetContains(wallet->usedAddrs, &addrChain[i - 1])) i--;
+    while (i > 0 && ! BRSetContains(wallet->usedAddrs, &_BRWalletAddrAt(addrChain, i - 1)->address)) i--;
     
     // YOSHI: To this point we should be good to go
     // The usedAddrs will contain any addresses (in any format)
     
-    while (i + gapLimit > count) { // generate new addresses up to gapLimit
-        BRKey key;
-        BRAddress address = BR_ADDRESS_NONE;
-        
-        // Generate the pubkey from seed and write it into pubKey
-        uint8_t pubKey[BRBIP32PubKey(NULL, 0, wallet->masterPubKey, chain, count)];
-        size_t len = BRBIP32PubKey(pubKey, sizeof(pubKey), wallet->masterPubKey, chain, (uint32_t)count);
+    while (i + gapLimit > count) { // generate new addresses up to gapLimit, deriving the missing keys as one batch
+        n = i + gapLimit - count;
+        pubKeys = realloc(pubKeys, n*sizeof(*pubKeys));
+        assert(pubKeys != NULL);
+        BRBIP32PubKeyRange(pubKeys, wallet->chainPubKey[chain], (uint32_t)count, n, 0);
         
-        // Convert pubKey to internal format
-        if (! BRKeySetPubKey(&key, pubKey, len)) break;
-        
-        if (nativeSegwit) {
-            // Generate the P2WPKH
-            if (!BRKeySegwitAddress(&key, address.s, sizeof(address), OP_0) ||
-                BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
-        } else {
-            // Generate the P2PKH
-            if (!BRKeyAddress(&key, address.s, sizeof(address)) ||
-                BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
+        for (k = 0; k < n; k++) {
+            BRKey key;
+            BRAddress address = BR_ADDRESS_NONE;
+            
+            // Convert pubKey to internal format
+            if (! BRKeySetPubKey(&key, pubKeys[k].p, sizeof(pubKeys[k].p))) break;
+            
+            if (nativeSegwit) {
+                // Generate the P2WPKH
+                if (!BRKeySegwitAddress(&key, address.s, sizeof(address), OP_0) ||
+                    BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
+            } else {
+                // Generate the P2PKH
+                if (!BRKeyAddress(&key, address.s, sizeof(address)) ||
+                    BRAddressEq(&address, &BR_ADDRESS_NONE)) break;
+            }
+            
+            _BRWalletAddrAdd(wallet, addrChain, address, chain, (nativeSegwit != 0));
+            count++;
+            
+            // Address is already used
+            if (BRSetContains(wallet->usedAddrs, &address)) i = count;
         }
         
-        array_add(addrChain, address);
-        count++;
-        
-        // Address is already used
-        if (BRSetContains(wallet->usedAddrs, &address)) i = count;
+        if (k < n) break;
     }
 
     if (addrs && i + gapLimit <= count) {
         for (j = 0; j < gapLimit; j++) {
-            addrs[j] = addrChain[i + j];
+            addrs[j] = _BRWalletAddrAt(addrChain, i + j)->address;
         }
     }
     
-    // was addrChain moved to a new memory location?
-    if (addrChain == (internal ? wallet->internalChain : wallet->externalChain) ||
-        addrChain == (internal ? wallet->internalChainSegwit : wallet->externalChainSegwit)) {
-        for (i = startCount; i < count; i++) {
-            BRSetAdd(wallet->allAddrs, &addrChain[i]);
-        }
-    }
-    else {
-        // Reassign the addressChain, if it got reallocated
-        if (nativeSegwit) {
-            if (internal) wallet->internalChainSegwit = addrChain;
-            if (! internal) wallet->externalChainSegwit = addrChain;
-        } else {
-            if (internal) wallet->internalChain = addrChain;
-            if (! internal) wallet->externalChain = addrChain;
-        }
-        
-        // Clear and rebuild allAddrs
-        BRSetClear(wallet->allAddrs);
-
-        for (i = array_count(wallet->internalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->internalChain[i - 1]);
-        }
-        
-        for (i = array_count(wallet->externalChain); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->externalChain[i - 1]);
-        }
-        
-        for (i = array_count(wallet->internalChainSegwit); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->internalChainSegwit[i - 1]);
-        }
-        
-        for (i = array_count(wallet->externalChainSegwit); i > 0; i--) {
-            BRSetAdd(wallet->allAddrs, &wallet->externalChainSegwit[i - 1]);
-        }
-    }
-
+    if (pubKeys) free(pubKeys);
     pthread_mutex_unlock(&wallet->lock);
     return j;
 }
@@ -471,6 +767,7 @@ size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO *utxos, size_t utxosCount)
 {
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
+    _BRWalletUpdateUTXOs(wallet);
     if (! utxos || array_count(wallet->utxos) < utxosCount) utxosCount = array_count(wallet->utxos);
 
     for (size_t i = 0; utxos && i < utxosCount; i++) {
@@ -542,6 +839,28 @@ uint64_t BRWalletTotalReceived(BRWallet *wallet)
     return totalReceived;
 }
 
+// writes all unspent wallet outputs, including asset outputs, to entries in the order they were received, and returns
+// the number of entries written, or number available if entries is NULL
+size_t BRWalletUTXOSnapshot(BRWallet *wallet, BRUTXOEntry entries[], size_t entriesCount)
+{
+    const _BRWalletUTXO *node;
+    const BRTxOutput *o;
+    size_t i = 0;
+
+    assert(wallet != NULL);
+    pthread_mutex_lock(&wallet->lock);
+    if (! entries || BRSetCount(wallet->utxoSet) < entriesCount) entriesCount = BRSetCount(wallet->utxoSet);
+
+    for (node = wallet->utxoHead; entries && node && i < entriesCount; node = node->next, i++) {
+        o = &node->tx->outputs[node->utxo.n];
+        entries[i] = (BRUTXOEntry) { node->utxo, o->amount, o->script, o->scriptLen, node->tx->blockHeight,
+                                     node->isAsset };
+    }
+
+    pthread_mutex_unlock(&wallet->lock);
+    return entriesCount;
+}
+
 // fee-per-kb of transaction size to use when creating a transaction
 uint64_t BRWalletFeePerKb(BRWallet *wallet)
 {
@@ -591,39 +910,41 @@ size_t BRWalletAllAddrs(BRWallet *wallet, BRAddress addrs[], size_t addrsCount)
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
     
-    internalCountSegwit = (! addrs || array_count(wallet->internalChainSegwit) < rest) ?
-        array_count(wallet->internalChainSegwit) : (addrsCount / 4);
+    internalCountSegwit = (! addrs || wallet->internalChainSegwit.count < rest) ?
+        wallet->internalChainSegwit.count : (addrsCount / 4);
     rest -= internalCountSegwit;
     
-    internalCount = (! addrs || array_count(wallet->internalChain) < rest) ?
-        array_count(wallet->internalChain) : (addrsCount / 4);
+    internalCount = (! addrs || wallet->internalChain.count < rest) ?
+        wallet->internalChain.count : (addrsCount / 4);
     rest -= internalCount;
 
     // Add the segwit addresses first
     for (i = 0; addrs && i < internalCountSegwit; i++)
-        addrs[i] = wallet->internalChainSegwit[i];
+        addrs[i] = _BRWalletAddrAt(&wallet->internalChainSegwit, i)->address;
     
     // Add the legacy addresses second
     // Check: How many addresses will be put in here?
     for (i = 0; addrs && i < internalCount; i++)
-        addrs[i + internalCountSegwit] = wallet->internalChain[i];
+        addrs[i + internalCountSegwit] = _BRWalletAddrAt(&wallet->internalChain, i)->address;
 
-    externalCountSegwit = (! addrs || array_count(wallet->externalChainSegwit) < rest) ?
-        array_count(wallet->externalChainSegwit) : (addrsCount / 4);
+    externalCountSegwit = (! addrs || wallet->externalChainSegwit.count < rest) ?
+        wallet->externalChainSegwit.count : (addrsCount / 4);
     rest -= externalCountSegwit;
     
-    externalCount = (! addrs || array_count(wallet->externalChain) < rest) ?
-                    array_count(wallet->externalChain) : rest;
+    externalCount = (! addrs || wallet->externalChain.count < rest) ?
+                    wallet->externalChain.count : rest;
     rest -= externalCount;
 
     // Add the external segwit addresses first
     for (i = 0; addrs && i < externalCountSegwit; i++)
-        addrs[i + internalCount + internalCountSegwit] = wallet->externalChainSegwit[i];
+        addrs[i + internalCount + internalCountSegwit] =
+            _BRWalletAddrAt(&wallet->externalChainSegwit, i)->address;
     
     // Add the external legacy addresses second
     // Check: How many addresses will be put in here?
     for (i = 0; addrs && i < externalCount; i++)
-        addrs[i + internalCount + internalCountSegwit + externalCountSegwit] = wallet->externalChain[i];
+        addrs[i + internalCount + internalCountSegwit + externalCountSegwit] =
+            _BRWalletAddrAt(&wallet->externalChain, i)->address;
     
     pthread_mutex_unlock(&wallet->lock);
     return internalCount + externalCount + internalCountSegwit + externalCountSegwit;
@@ -669,11 +990,22 @@ BRTransaction *BRWalletCreateTransaction(BRWallet *wallet, uint64_t amount, cons
     return BRWalletCreateTxForOutputs(wallet, &o, 1);
 }
 
+static int _BRSizeCompare(const void *a, const void *b)
+{
+    return (*(const size_t *)a > *(const size_t *)b) - (*(const size_t *)a < *(const size_t *)b);
+}
+
 BRTransaction *BRWalletCreateTxForOutputsEx(BRWallet *wallet, const BRTxOutput outputs[], size_t outCount, int force) {
     BRTransaction *tx, *transaction = BRTransactionNew();
-    uint64_t feeAmount, amount = 0, balance = 0, minAmount;
-    size_t i, j, cpfpSize = 0;
-    BRUTXO *o;
+    BRCoinCandidate *candidates;
+    BRCoinSelectionParams params;
+    BRCoinSelection sel;
+    BRTxSizeEstimate est = BR_TX_SIZE_ESTIMATE_NONE;
+    const BRTxOutput *o;
+    const _BRWalletUTXO *node, **nodes;
+    uint64_t amount = 0, minAmount, extra;
+    size_t i, j, count, *selected;
+    int r;
     BRAddress addr = BR_ADDRESS_NONE;
     
     assert(wallet != NULL);
@@ -683,81 +1015,86 @@ BRTransaction *BRWalletCreateTxForOutputsEx(BRWallet *wallet, const BRTxOutput o
         assert(outputs[i].script != NULL && outputs[i].scriptLen > 0);
         BRTransactionAddOutput(transaction, outputs[i].amount, outputs[i].script,
                                outputs[i].scriptLen);
+        BRTxSizeEstimateAddOutput(&est, outputs[i].scriptLen);
         amount += outputs[i].amount;
     }
     
     minAmount = BRWalletMinOutputAmount(wallet);
     pthread_mutex_lock(&wallet->lock);
-    feeAmount = _txFee(wallet->feePerKb, BRTransactionVSize(transaction) + TX_OUTPUT_SIZE);
+    count = BRSetCount(wallet->utxoSet);
+    candidates = malloc((count + 1)*sizeof(*candidates));
+    nodes = malloc((count + 1)*sizeof(*nodes));
+    selected = malloc((count + 1)*sizeof(*selected));
+    assert(candidates != NULL && nodes != NULL && selected != NULL);
     
     // TODO: use up all UTXOs for all used addresses to avoid leaving funds in addresses whose public key is revealed
     // TODO: avoid combining addresses in a single transaction when possible to reduce information leakage
     // TODO: use up UTXOs received from any of the output scripts that this transaction sends funds to, to mitigate an
     //       attacker double spending and requesting a refund
-    for (i = 0; i < array_count(wallet->utxos); i++) {
-        o = &wallet->utxos[i];
-        tx = BRSetGet(wallet->allTx, o);
-        
-        if (! tx || o->n >= tx->outCount) continue;
-        if (BRWalletUtxoIsAsset(wallet, o)) continue;
-
-        BRTransactionAddInput(transaction, tx->txHash, o->n, tx->outputs[o->n].amount,
-                              tx->outputs[o->n].script, tx->outputs[o->n].scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+    for (i = 0, node = wallet->utxoHead; node; node = node->next, i++) {
+        tx = node->tx;
+        o = &tx->outputs[node->utxo.n];
+        nodes[i] = node;
+        candidates[i].amount = o->amount;
+        candidates[i].inputVSize = BRTxSizeEstimateInputVSize(o->script, o->scriptLen, NULL, 0, NULL, 0);
+        candidates[i].depth = (tx->blockHeight > wallet->blockHeight) ? 0 : wallet->blockHeight - tx->blockHeight + 1;
+        candidates[i].isAsset = node->isAsset; // spending asset outputs as plain coins would burn the assets
+    }
+    
+    // witness marker and flag, and room for the input count to grow to a 3 byte varint
+    params = (BRCoinSelectionParams) { amount, BRTxSizeEstimateVSize(&est) + 1 + 2, TX_OUTPUT_SIZE,
+                                       wallet->feePerKb, minAmount, TX_MAX_SIZE, 0, BRRand(0) };
+    r = BRCoinSelect(candidates, count, &params, selected, &sel);
+    
+    if (r == 1 || (r == 0 && force && sel.vsize <= TX_MAX_SIZE)) {
+        qsort(selected, sel.count, sizeof(*selected), _BRSizeCompare); // spend in the order outputs were received
         
-        if (BRTransactionVSize(transaction) + TX_OUTPUT_SIZE > TX_MAX_SIZE) { // transaction size-in-bytes too large
-            BRTransactionFree(transaction);
-            transaction = NULL;
-            
-            // check for sufficient total funds before building a smaller transaction
-            if (wallet->balance < amount + _txFee(wallet->feePerKb, 10 + array_count(wallet->utxos)*TX_INPUT_SIZE +
-                                                  (outCount + 1)*TX_OUTPUT_SIZE + cpfpSize)) break;
-            pthread_mutex_unlock(&wallet->lock);
-            
-            if (outputs[outCount - 1].amount > amount + feeAmount + minAmount - balance) {
-                BRTxOutput newOutputs[outCount];
-                
-                for (j = 0; j < outCount; j++) {
-                    newOutputs[j] = outputs[j];
-                }
-                
-                newOutputs[outCount - 1].amount -= amount + feeAmount - balance; // reduce last output amount
-                transaction = BRWalletCreateTxForOutputs(wallet, newOutputs, outCount);
-            }
-            else transaction = BRWalletCreateTxForOutputs(wallet, outputs, outCount - 1); // remove last output
-            
-            balance = amount = feeAmount = 0;
-            pthread_mutex_lock(&wallet->lock);
-            break;
+        for (i = 0; i < sel.count; i++) {
+            node = nodes[selected[i]];
+            o = &node->tx->outputs[node->utxo.n];
+            BRTransactionAddInput(transaction, node->tx->txHash, node->utxo.n, o->amount, o->script, o->scriptLen,
+                                  NULL, 0, NULL, 0, TXIN_SEQUENCE);
         }
         
-        balance += tx->outputs[o->n].amount;
-        
-        //        // size of unconfirmed, non-change inputs for child-pays-for-parent fee
-        //        // don't include parent tx with more than 10 inputs or 10 outputs
-        //        if (tx->blockHeight == TX_UNCONFIRMED && tx->inCount <= 10 && tx->outCount <= 10 &&
-        //            ! _BRWalletTxIsSend(wallet, tx)) cpfpSize += BRTransactionSize(tx);
-        
-        // fee amount after adding a change output
-        feeAmount = _txFee(wallet->feePerKb, BRTransactionVSize(transaction) + TX_OUTPUT_SIZE + cpfpSize);
-        
         // increase fee to round off remaining wallet balance to nearest 100 satoshi
-        if (wallet->balance > amount + feeAmount) feeAmount += (wallet->balance - (amount + feeAmount)) % 100;
-        
-        if (balance == amount + feeAmount || balance >= amount + feeAmount + minAmount) break;
+        extra = (wallet->balance > amount + sel.fee) ? (wallet->balance - (amount + sel.fee)) % 100 : 0;
+        if (sel.change > extra + minAmount) sel.change -= extra;
     }
-    
-    pthread_mutex_unlock(&wallet->lock);
-    
-    if (transaction && (outCount < 1 || balance < amount + feeAmount) && !force) { // no outputs/insufficient funds
+    else if (r == -1) { // transaction size-in-bytes too large, build a smaller one
         BRTransactionFree(transaction);
         transaction = NULL;
     }
-    else if (transaction && balance - (amount + feeAmount) > minAmount) { // add change output
+    else { // no outputs/insufficient funds
+        BRTransactionFree(transaction);
+        transaction = NULL;
+        r = 0;
+    }
+    
+    pthread_mutex_unlock(&wallet->lock);
+    free(selected);
+    free(nodes);
+    free(candidates);
+    
+    if (r == -1) {
+        // sel holds the largest selection that fits, reduce the last output by what that selection is short
+        if (outputs[outCount - 1].amount > amount + sel.fee + minAmount - sel.amount) {
+            BRTxOutput newOutputs[outCount];
+            
+            for (j = 0; j < outCount; j++) {
+                newOutputs[j] = outputs[j];
+            }
+            
+            newOutputs[outCount - 1].amount -= amount + sel.fee - sel.amount; // reduce last output amount
+            transaction = BRWalletCreateTxForOutputs(wallet, newOutputs, outCount);
+        }
+        else transaction = BRWalletCreateTxForOutputs(wallet, outputs, outCount - 1); // remove last output
+    }
+    else if (transaction && sel.change > 0) { // add change output
         BRWalletUnusedAddrs(wallet, &addr, 1, 1, 1);
         uint8_t script[BRAddressScriptPubKey(NULL, 0, addr.s)];
         size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), addr.s);
         
-        BRTransactionAddOutput(transaction, balance - (amount + feeAmount), script, scriptLen);
+        BRTransactionAddOutput(transaction, sel.change, script, scriptLen);
         BRTransactionShuffleOutputs(transaction);
     }
     
@@ -780,42 +1117,16 @@ BRTransaction *BRWalletCreateTxForOutputs(BRWallet *wallet, const BRTxOutput out
 int BRWalletGetAddressPrivateKey(BRWallet* wallet, BRKey* key, const char* address, size_t addressLen, const void *seed, size_t seedLen) {
     assert(key != NULL && "Key must not be NULL");
     
-    uint32_t j;
-    uint32_t j1;
+    uint32_t chain, idx;
+    size_t i;
     
-    for (j = (uint32_t)array_count(wallet->internalChainSegwit); j > 0; j--) {
-        j1 = j - 1;
-        if (BRAddressEq(address, &wallet->internalChainSegwit[j1])) {
-            BRBIP32PrivKeyList(key, 1, seed, seedLen, SEQUENCE_INTERNAL_CHAIN, &j1);
-            return 1;
-        }
-    }
-    
-    for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
-        j1 = j - 1;
-        if (BRAddressEq(address, &wallet->internalChain[j1])) {
-            BRBIP32PrivKeyList(key, 1, seed, seedLen, SEQUENCE_INTERNAL_CHAIN, &j1);
-            return 1;
-        }
-    }
-    
-    for (j = (uint32_t)array_count(wallet->externalChainSegwit); j > 0; j--) {
-        j1 = j - 1;
-        if (BRAddressEq(address, &wallet->externalChainSegwit[j1])) {
-            BRBIP32PrivKeyList(key, 1, seed, seedLen, SEQUENCE_EXTERNAL_CHAIN, &j1);
-            return 1;
-        }
-    }
-
-    for (j = (uint32_t)array_count(wallet->externalChain); j > 0; j--) {
-        j1 = j - 1;
-        if (BRAddressEq(address, &wallet->externalChain[j1])) {
-            BRBIP32PrivKeyList(key, 1, seed, seedLen, SEQUENCE_EXTERNAL_CHAIN, &j1);
-            return 1;
-        }
-    }
-    
-    return 0;
+    pthread_mutex_lock(&wallet->lock);
+    i = _BRWalletAddrIndex(wallet, address, &chain, NULL);
+    pthread_mutex_unlock(&wallet->lock);
+    if (i == SIZE_MAX) return 0;
+    idx = (uint32_t)i;
+    BRBIP32PrivKeyList(key, 1, seed, seedLen, chain, &idx);
+    return 1;
 }
 
 // signs any inputs in tx that can be signed using private keys from the wallet
@@ -824,8 +1135,8 @@ int BRWalletGetAddressPrivateKey(BRWallet* wallet, BRKey* key, const char* addre
 // returns true if all inputs were signed, or false if there was an error or not all inputs were able to be signed
 int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, const void *seed, size_t seedLen)
 {
-    uint32_t j, internalIdx[tx->inCount], externalIdx[tx->inCount];
-    size_t i, internalCount = 0, externalCount = 0;
+    uint32_t chain, internalIdx[tx->inCount], externalIdx[tx->inCount];
+    size_t i, j, internalCount = 0, externalCount = 0;
     int r = 0;
     
     assert(wallet != NULL);
@@ -833,21 +1144,10 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, con
     pthread_mutex_lock(&wallet->lock);
     
     for (i = 0; tx && i < tx->inCount; i++) {
-        for (j = (uint32_t)array_count(wallet->internalChainSegwit); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->internalChainSegwit[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-        
-        for (j = (uint32_t)array_count(wallet->internalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->internalChain[j - 1])) internalIdx[internalCount++] = j - 1;
-        }
-        
-        for (j = (uint32_t)array_count(wallet->externalChainSegwit); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->externalChainSegwit[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
-
-        for (j = (uint32_t)array_count(wallet->externalChain); j > 0; j--) {
-            if (BRAddressEq(tx->inputs[i].address, &wallet->externalChain[j - 1])) externalIdx[externalCount++] = j - 1;
-        }
+        j = _BRWalletAddrIndex(wallet, tx->inputs[i].address, &chain, NULL);
+        if (j == SIZE_MAX) continue;
+        if (chain == SEQUENCE_INTERNAL_CHAIN) internalIdx[internalCount++] = (uint32_t)j;
+        else externalIdx[externalCount++] = (uint32_t)j;
     }
 
     pthread_mutex_unlock(&wallet->lock);
@@ -859,7 +1159,7 @@ int BRWalletSignTransaction(BRWallet *wallet, BRTransaction *tx, int forkId, con
         BRBIP32PrivKeyList(&keys[internalCount], externalCount, seed, seedLen, SEQUENCE_EXTERNAL_CHAIN, externalIdx);
         // TODO: XXX wipe seed callback
         seed = NULL;
-        if (tx) r = BRTransactionSign(tx, forkId, keys, internalCount + externalCount);
+        if (tx) r = BRTransactionSignBatch(tx, forkId, keys, internalCount + externalCount, 0);
         for (i = 0; i < internalCount + externalCount; i++) BRKeyClean(&keys[i]);
     }
     else r = -1; // user canceled authentication
@@ -897,8 +1197,7 @@ int BRWalletRegisterTransaction(BRWallet *wallet, BRTransaction *tx)
                 // TODO: handle tx replacement with input sequence numbers
                 //       (for now, replacements appear invalid until confirmation)
                 BRSetAdd(wallet->allTx, tx);
-                _BRWalletInsertTx(wallet, tx);
-                _BRWalletUpdateBalance(wallet);
+                _BRWalletUpdateBalance(wallet, _BRWalletInsertTx(wallet, tx));
                 wasAdded = 1;
             }
             else { // keep track of unconfirmed non-wallet tx for invalid tx checks and child-pays-for-parent fees
@@ -961,15 +1260,16 @@ void BRWalletRemoveTransaction(BRWallet *wallet, UInt256 txHash)
             BRWalletRemoveTransaction(wallet, txHash);
         }
         else {
+            size_t i = array_count(wallet->transactions);
+            
             BRSetRemove(wallet->allTx, tx);
+            while (i > 0 && ! BRTransactionEq(wallet->transactions[i - 1], tx)) i--;
             
-            for (size_t i = array_count(wallet->transactions); i > 0; i--) {
-                if (! BRTransactionEq(wallet->transactions[i - 1], tx)) continue;
+            if (i > 0) {
                 array_rm(wallet->transactions, i - 1);
-                break;
+                _BRWalletUpdateBalance(wallet, i - 1);
             }
             
-            _BRWalletUpdateBalance(wallet);
             pthread_mutex_unlock(&wallet->lock);
             
             // if this is for a transaction we sent, and it wasn't already known to be invalid, notify user
@@ -1113,7 +1413,7 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
     BRTransaction *tx;
     UInt256 hashes[txCount];
     int needsUpdate = 0;
-    size_t i, j, k;
+    size_t i, j, k, first = SIZE_MAX, count;
     
     assert(wallet != NULL);
     assert(txHashes != NULL || txCount == 0);
@@ -1130,7 +1430,9 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
             for (k = array_count(wallet->transactions); k > 0; k--) { // remove and re-insert tx to keep wallet sorted
                 if (! BRTransactionEq(wallet->transactions[k - 1], tx)) continue;
                 array_rm(wallet->transactions, k - 1);
-                _BRWalletInsertTx(wallet, tx);
+                if (k - 1 < first) first = k - 1;
+                k = _BRWalletInsertTx(wallet, tx);
+                if (k < first) first = k;
                 break;
             }
             
@@ -1143,7 +1445,14 @@ void BRWalletUpdateTransactions(BRWallet *wallet, const UInt256 txHashes[], size
         }
     }
     
-    if (needsUpdate) _BRWalletUpdateBalance(wallet);
+    if (needsUpdate) { // pending and invalid status can change for any unconfirmed tx, so re-apply all of them
+        count = array_count(wallet->transactions);
+        while (count > 0 && wallet->transactions[count - 1]->blockHeight == TX_UNCONFIRMED) count--;
+        if (count < first) first = count;
+    }
+    
+    // moved txs change the order the balance history is built in, so it's re-applied from the first one moved
+    if (first != SIZE_MAX) _BRWalletUpdateBalance(wallet, first);
     pthread_mutex_unlock(&wallet->lock);
     if (j > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, j, blockHeight, timestamp);
 }
@@ -1167,7 +1476,7 @@ void BRWalletSetTxUnconfirmedAfter(BRWallet *wallet, uint32_t blockHeight)
         hashes[j] = wallet->transactions[i + j]->txHash;
     }
     
-    if (count > 0) _BRWalletUpdateBalance(wallet);
+    if (count > 0) _BRWalletUpdateBalance(wallet, i);
     pthread_mutex_unlock(&wallet->lock);
     if (count > 0 && wallet->txUpdated) wallet->txUpdated(wallet->callbackInfo, hashes, count, TX_UNCONFIRMED, 0);
 }
@@ -1342,6 +1651,7 @@ uint64_t BRWalletMaxOutputAmount(BRWallet *wallet)
 
     assert(wallet != NULL);
     pthread_mutex_lock(&wallet->lock);
+    _BRWalletUpdateUTXOs(wallet);
 
     for (i = array_count(wallet->utxos); i > 0; i--) {
         o = &wallet->utxos[i - 1];
@@ -1374,11 +1684,16 @@ void BRWalletFree(BRWallet *wallet)
     BRSetFree(wallet->invalidTx);
     BRSetFree(wallet->pendingTx);
     BRSetFree(wallet->spentOutputs);
-    array_free(wallet->internalChain);
-    array_free(wallet->externalChain);
-    array_free(wallet->externalChainSegwit);
-    array_free(wallet->internalChainSegwit);
+    _BRWalletAddrChainFree(&wallet->internalChain);
+    _BRWalletAddrChainFree(&wallet->externalChain);
+    _BRWalletAddrChainFree(&wallet->externalChainSegwit);
+    _BRWalletAddrChainFree(&wallet->internalChainSegwit);
     array_free(wallet->balanceHist);
+    array_free(wallet->undo);
+    array_free(wallet->undoPos);
+    BRSetFree(wallet->utxoSet);
+    for (size_t i = array_count(wallet->utxoChunks); i > 0; i--) free(wallet->utxoChunks[i - 1]);
+    array_free(wallet->utxoChunks);
 
     for (size_t i = array_count(wallet->transactions); i > 0; i--) {
         BRTransactionFree(wallet->transactions[i - 1]);
@@ -1458,6 +1773,9 @@ BRTransaction* BRGetTransactions(BRWallet *wallet)
 
 BRUTXO* BRGetUTXO(BRWallet *wallet)
 {
+    pthread_mutex_lock(&wallet->lock);
+    _BRWalletUpdateUTXOs(wallet);
+    pthread_mutex_unlock(&wallet->lock);
     return wallet->utxos;
 }
 
@@ -1494,6 +1812,8 @@ void BRWalletPrintUtxos(BRWallet* wallet) {
     size_t count;
     
     printf("UTXOS:\n");
+    pthread_mutex_lock(&wallet->lock);
+    _BRWalletUpdateUTXOs(wallet);
     for (size_t j = array_count(wallet->utxos); j > 0; j--) {
         _printUtxo(NULL, &wallet->utxos[j - 1]);
     }
@@ -1505,6 +1825,7 @@ void BRWalletPrintUtxos(BRWallet* wallet) {
     
     printf("SPENT UTXOS:\n");
     BRSetApply(wallet->spentOutputs, NULL, _printUtxo);
+    pthread_mutex_unlock(&wallet->lock);
 #endif
 }
 
@@ -157,6 +157,19 @@ uint64_t BRWalletTotalReceived(BRWallet *wallet);
 // writes unspent outputs to utxos and returns the number of outputs written, or number available if utxos is NULL
 size_t BRWalletUTXOs(BRWallet *wallet, BRUTXO utxos[], size_t utxosCount);
 
+typedef struct {
+    BRUTXO utxo;
+    uint64_t amount;
+    const uint8_t *script; // points into the wallet's copy of the transaction
+    size_t scriptLen;
+    uint32_t blockHeight; // TX_UNCONFIRMED if the transaction isn't in a block yet
+    int isAsset; // output carries digiassets and isn't counted in the balance
+} BRUTXOEntry;
+
+// writes all unspent wallet outputs, including asset outputs, to entries in the order they were received, and returns
+// the number of entries written, or number available if entries is NULL
+size_t BRWalletUTXOSnapshot(BRWallet *wallet, BRUTXOEntry entries[], size_t entriesCount);
+
 // fee-per-kb of transaction size to use when creating a transaction
 uint64_t BRWalletFeePerKb(BRWallet *wallet);
 void BRWalletSetFeePerKb(BRWallet *wallet, uint64_t feePerKb);
@@ -23,4 +23,24 @@ void groestl_hash(const char* input, char* output)
     SHA256_Init(&ctx_sha256);
     SHA256_Update(&ctx_sha256, &temp, 64);
     SHA256_Final((unsigned char*) output, &ctx_sha256);
-}
\ No newline at end of file
+}
+
+void groestl_hash_batch(const char* input, char* output, size_t count)
+{
+    sph_groestl512_context init_groestl, ctx_groestl;
+    SHA256_CTX ctx_sha256;
+    char temp[64];
+    
+    // headers in a chain never share their leading bytes, so only the initial state is reused
+    sph_groestl512_init(&init_groestl);
+    
+    for (size_t i = 0; i < count; i++) {
+        ctx_groestl = init_groestl;
+        sph_groestl512(&ctx_groestl, input + i*80, 80);
+        sph_groestl512_close(&ctx_groestl, &temp);
+        
+        SHA256_Init(&ctx_sha256);
+        SHA256_Update(&ctx_sha256, &temp, 64);
+        SHA256_Final((unsigned char*) output + i*32, &ctx_sha256);
+    }
+}
@@ -6,10 +6,15 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 
 void groestl_hash(const char* input, char* output);
+
+// groestl_hash() of count consecutive 80 byte headers, writing count consecutive 32 byte hashes to output
+void groestl_hash_batch(const char* input, char* output, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
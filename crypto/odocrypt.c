@@ -149,18 +149,118 @@ void Odocrypt_ApplyRoundKey(uint64_t* state, int roundKey)
         state[i] ^= (roundKey >> i) & 1;
 }
 
+// The functions above are the reference description of a round. Odocrypt_Encrypt() below computes the same thing with
+// the ten state words held in locals and every step unrolled. The word shuffle of the pbox becomes a renaming of the
+// locals, so it costs nothing once the compiler has allocated registers.
+
+#define ODO_ROT(x, r) (((x) << (r)) | ((x) >> (64 - (r)))) // 0 < r < 64
+
+#define ODO_MASKED_SWAP(a, b, m) do { \
+    uint64_t swp = (m) & ((a) ^ (b)); \
+    (a) ^= swp; \
+    (b) ^= swp; \
+} while (0)
+
+#define ODO_MASKED_SWAPS(mask) do { \
+    ODO_MASKED_SWAP(s0, s1, (mask)[0]); \
+    ODO_MASKED_SWAP(s2, s3, (mask)[1]); \
+    ODO_MASKED_SWAP(s4, s5, (mask)[2]); \
+    ODO_MASKED_SWAP(s6, s7, (mask)[3]); \
+    ODO_MASKED_SWAP(s8, s9, (mask)[4]); \
+} while (0)
+
+// next[ODOCRYPT_PBOX_M*i % ODOCRYPT_STATE_SIZE] = state[i] with PBOX_M 3 and STATE_SIZE 10, that is s[j] = s[7*j % 10]:
+// words 0 and 5 stay in place, (1 7 9 3) and (2 4 8 6) rotate
+#define ODO_WORD_SHUFFLE() do { \
+    uint64_t t = s1; \
+    s1 = s7, s7 = s9, s9 = s3, s3 = t; \
+    t = s2; \
+    s2 = s4, s4 = s8, s8 = s6, s6 = t; \
+} while (0)
+
+#define ODO_PBOX_ROTATIONS(rotation) do { \
+    s0 = ODO_ROT(s0, (rotation)[0]); \
+    s2 = ODO_ROT(s2, (rotation)[1]); \
+    s4 = ODO_ROT(s4, (rotation)[2]); \
+    s6 = ODO_ROT(s6, (rotation)[3]); \
+    s8 = ODO_ROT(s8, (rotation)[4]); \
+} while (0)
+
+#define ODO_PBOX_SUBROUND(perm, k) do { \
+    ODO_MASKED_SWAPS((perm)->mask[k]); \
+    ODO_WORD_SHUFFLE(); \
+    ODO_PBOX_ROTATIONS((perm)->rotation[k]); \
+} while (0)
+
+#define ODO_PBOX(perm) do { \
+    ODO_PBOX_SUBROUND(perm, 0); \
+    ODO_PBOX_SUBROUND(perm, 1); \
+    ODO_PBOX_SUBROUND(perm, 2); \
+    ODO_PBOX_SUBROUND(perm, 3); \
+    ODO_PBOX_SUBROUND(perm, 4); \
+    ODO_MASKED_SWAPS((perm)->mask[5]); \
+} while (0)
+
+// word i holds four 6-bit fields for small sboxes 4*i..4*i+3 at bits 0, 16, 32 and 48, each followed by a 10-bit field
+// for large sbox i
+#define ODO_SBOX_WORD(x, i) do { \
+    const uint16_t *sbox2 = odo->Sbox2[i]; \
+    (x) = (uint64_t)odo->Sbox1[4*(i)][(x) & 0x3f] | (uint64_t)sbox2[((x) >> 6) & 0x3ff] << 6 | \
+          (uint64_t)odo->Sbox1[4*(i) + 1][((x) >> 16) & 0x3f] << 16 | (uint64_t)sbox2[((x) >> 22) & 0x3ff] << 22 | \
+          (uint64_t)odo->Sbox1[4*(i) + 2][((x) >> 32) & 0x3f] << 32 | (uint64_t)sbox2[((x) >> 38) & 0x3ff] << 38 | \
+          (uint64_t)odo->Sbox1[4*(i) + 3][((x) >> 48) & 0x3f] << 48 | (uint64_t)sbox2[((x) >> 54) & 0x3ff] << 54; \
+} while (0)
+
+#define ODO_MIX(x) (ODO_ROT(x, r0) ^ ODO_ROT(x, r1) ^ ODO_ROT(x, r2) ^ ODO_ROT(x, r3) ^ ODO_ROT(x, r4) ^ ODO_ROT(x, r5))
+
 void Odocrypt_Encrypt(OdoStruct* odo, char* cipher, const char* plain) {
+    assert(ODOCRYPT_STATE_SIZE == 10 && ODOCRYPT_PBOX_M == 3 && ODOCRYPT_PBOX_SUBROUNDS == 6);
+    assert(ODOCRYPT_SMALL_SBOX_WIDTH == 6 && ODOCRYPT_LARGE_SBOX_WIDTH == 10 && ODOCRYPT_ROTATION_COUNT == 6);
+    
     uint64_t state[ODOCRYPT_STATE_SIZE];
+    const int r0 = odo->Rotations[0], r1 = odo->Rotations[1], r2 = odo->Rotations[2],
+              r3 = odo->Rotations[3], r4 = odo->Rotations[4], r5 = odo->Rotations[5];
+    
     Odocrypt_Unpack(&state[0], plain);
     Odocrypt_PreMix(state);
+    
+    uint64_t s0 = state[0], s1 = state[1], s2 = state[2], s3 = state[3], s4 = state[4],
+             s5 = state[5], s6 = state[6], s7 = state[7], s8 = state[8], s9 = state[9];
+    
     for (int round = 0; round < ODOCRYPT_ROUNDS; round++)
     {
-        OdoCrypt_ApplyPbox(state, &odo->Permutation[0]);
-        Odocrypt_ApplySboxes(state, 1 << ODOCRYPT_SMALL_SBOX_WIDTH, 1 << ODOCRYPT_LARGE_SBOX_WIDTH, odo->Sbox1, odo->Sbox2);
-        OdoCrypt_ApplyPbox(state, &odo->Permutation[1]);
-        Odocrypt_ApplyRotations(state, odo->Rotations);
-        Odocrypt_ApplyRoundKey(state, odo->RoundKey[round]);
+        const int roundKey = odo->RoundKey[round];
+        uint64_t n0, n1, n2, n3, n4, n5, n6, n7, n8, n9;
+        
+        ODO_PBOX(&odo->Permutation[0]);
+        ODO_SBOX_WORD(s0, 0);
+        ODO_SBOX_WORD(s1, 1);
+        ODO_SBOX_WORD(s2, 2);
+        ODO_SBOX_WORD(s3, 3);
+        ODO_SBOX_WORD(s4, 4);
+        ODO_SBOX_WORD(s5, 5);
+        ODO_SBOX_WORD(s6, 6);
+        ODO_SBOX_WORD(s7, 7);
+        ODO_SBOX_WORD(s8, 8);
+        ODO_SBOX_WORD(s9, 9);
+        ODO_PBOX(&odo->Permutation[1]);
+        
+        // linear mixing, next[i] = state[i + 1] ^ rotations of state[i], then the round key bits
+        n0 = s1 ^ ODO_MIX(s0) ^ ((roundKey >> 0) & 1);
+        n1 = s2 ^ ODO_MIX(s1) ^ ((roundKey >> 1) & 1);
+        n2 = s3 ^ ODO_MIX(s2) ^ ((roundKey >> 2) & 1);
+        n3 = s4 ^ ODO_MIX(s3) ^ ((roundKey >> 3) & 1);
+        n4 = s5 ^ ODO_MIX(s4) ^ ((roundKey >> 4) & 1);
+        n5 = s6 ^ ODO_MIX(s5) ^ ((roundKey >> 5) & 1);
+        n6 = s7 ^ ODO_MIX(s6) ^ ((roundKey >> 6) & 1);
+        n7 = s8 ^ ODO_MIX(s7) ^ ((roundKey >> 7) & 1);
+        n8 = s9 ^ ODO_MIX(s8) ^ ((roundKey >> 8) & 1);
+        n9 = s0 ^ ODO_MIX(s9) ^ ((roundKey >> 9) & 1);
+        s0 = n0, s1 = n1, s2 = n2, s3 = n3, s4 = n4, s5 = n5, s6 = n6, s7 = n7, s8 = n8, s9 = n9;
     }
+    
+    state[0] = s0, state[1] = s1, state[2] = s2, state[3] = s3, state[4] = s4;
+    state[5] = s5, state[6] = s6, state[7] = s7, state[8] = s8, state[9] = s9;
     OdoCrypt_Pack(state, cipher);
 }
 
@@ -42,4 +42,59 @@ void qubit_hash(const char* input, char* output)
     sph_echo512_close(&ctx_echo, (void*) &hash1); // 6
     
     memcpy(output, &hash1, 32);
-}
\ No newline at end of file
+}
+
+void qubit_hash_batch(const char* input, char* output, size_t count)
+{
+    sph_luffa512_context    ctx_luffa, init_luffa;
+    sph_cubehash512_context ctx_cubehash, init_cubehash;
+    sph_shavite512_context  ctx_shavite, init_shavite;
+    sph_simd512_context     ctx_simd, init_simd;
+    sph_echo512_context     ctx_echo, init_echo;
+    
+    char hash1[QUBIT_BATCH_CHUNK][64];
+    char hash2[QUBIT_BATCH_CHUNK][64];
+    size_t i, j, n;
+    
+    // every stage starts from the same initial state for every header, headers in a chain share nothing else
+    sph_luffa512_init(&init_luffa);
+    sph_cubehash512_init(&init_cubehash);
+    sph_shavite512_init(&init_shavite);
+    sph_simd512_init(&init_simd);
+    sph_echo512_init(&init_echo);
+    
+    for (i = 0; i < count; i += n) {
+        n = (count - i < QUBIT_BATCH_CHUNK) ? count - i : QUBIT_BATCH_CHUNK;
+        
+        for (j = 0; j < n; j++) {
+            ctx_luffa = init_luffa;
+            sph_luffa512(&ctx_luffa, (const void*) (input + (i + j)*80), 80);
+            sph_luffa512_close(&ctx_luffa, (void*) hash1[j]);
+        }
+        
+        for (j = 0; j < n; j++) {
+            ctx_cubehash = init_cubehash;
+            sph_cubehash512(&ctx_cubehash, (const void*) hash1[j], 64);
+            sph_cubehash512_close(&ctx_cubehash, (void*) hash2[j]);
+        }
+        
+        for (j = 0; j < n; j++) {
+            ctx_shavite = init_shavite;
+            sph_shavite512(&ctx_shavite, (const void*) hash2[j], 64);
+            sph_shavite512_close(&ctx_shavite, (void*) hash1[j]);
+        }
+        
+        for (j = 0; j < n; j++) {
+            ctx_simd = init_simd;
+            sph_simd512(&ctx_simd, (const void*) hash1[j], 64);
+            sph_simd512_close(&ctx_simd, (void*) hash2[j]);
+        }
+        
+        for (j = 0; j < n; j++) {
+            ctx_echo = init_echo;
+            sph_echo512(&ctx_echo, (const void*) hash2[j], 64);
+            sph_echo512_close(&ctx_echo, (void*) hash1[j]);
+            memcpy(output + (i + j)*32, hash1[j], 32);
+        }
+    }
+}
@@ -6,11 +6,19 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
+
+// headers taken through each stage of qubit_hash_batch() at a time
+#define QUBIT_BATCH_CHUNK 16
 
 void qubit_hash(const char* input, char* output);
 
+// qubit_hash() of count consecutive 80 byte headers, writing count consecutive 32 byte hashes to output
+// each of the five stages is run over a chunk of headers before moving to the next, keeping its tables in cache
+void qubit_hash_batch(const char* input, char* output, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
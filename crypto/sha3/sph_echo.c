@@ -64,6 +64,23 @@ extern "C"{
 #pragma warning (disable: 4146)
 #endif
 
+/*
+ * The 512-bit and 384-bit compression function has an AES-NI version on
+ * x86 with GCC or Clang. It is compiled in regardless of the -m flags and
+ * selected at runtime from CPUID; define SPH_ECHO_AESNI to 0 to leave it
+ * out.
+ */
+#if !defined SPH_ECHO_AESNI && (defined __x86_64__ || defined __i386__) \
+	&& (defined __GNUC__ || defined __clang__)
+#define SPH_ECHO_AESNI   1
+#endif
+
+#if SPH_ECHO_AESNI
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 #define T32   SPH_T32
 #define C32   SPH_C32
 #if SPH_64
@@ -719,11 +736,150 @@ echo_small_compress(sph_echo_small_context *sc)
 	COMPRESS_SMALL(sc);
 }
 
+#if SPH_ECHO_AESNI
+
+/*
+ * AES-NI version of COMPRESS_BIG: each 128-bit word of the state is kept
+ * in an SSE register, the two AES rounds of BIG_SUB_WORDS are done with
+ * AESENC, BIG_SHIFT_ROWS is a renaming of registers and BIG_MIX_COLUMNS
+ * uses SSE2 byte arithmetic. Output is identical to the portable code.
+ */
+
+#define ECHO_XTIME(x)   _mm_xor_si128(_mm_add_epi8(x, x), \
+		_mm_and_si128(_mm_cmplt_epi8(x, _mm_setzero_si128()), \
+		_mm_set1_epi8(0x1B)))
+
+#define ECHO_MIX_COLUMN(a, b, c, d)   do { \
+		__m128i ab = _mm_xor_si128(W[a], W[b]); \
+		__m128i bc = _mm_xor_si128(W[b], W[c]); \
+		__m128i cd = _mm_xor_si128(W[c], W[d]); \
+		__m128i abx = ECHO_XTIME(ab); \
+		__m128i bcx = ECHO_XTIME(bc); \
+		__m128i cdx = ECHO_XTIME(cd); \
+		__m128i na = _mm_xor_si128(abx, _mm_xor_si128(bc, W[d])); \
+		__m128i nb = _mm_xor_si128(bcx, _mm_xor_si128(W[a], cd)); \
+		__m128i nc = _mm_xor_si128(cdx, _mm_xor_si128(ab, W[d])); \
+		__m128i nd = _mm_xor_si128(_mm_xor_si128(abx, bcx), \
+			_mm_xor_si128(cdx, _mm_xor_si128(ab, W[c]))); \
+		W[a] = na; \
+		W[b] = nb; \
+		W[c] = nc; \
+		W[d] = nd; \
+	} while (0)
+
+#define ECHO_SHIFT_ROW1(a, b, c, d)   do { \
+		__m128i tmp = W[a]; \
+		W[a] = W[b]; \
+		W[b] = W[c]; \
+		W[c] = W[d]; \
+		W[d] = tmp; \
+	} while (0)
+
+#define ECHO_SHIFT_ROW2(a, b, c, d)   do { \
+		__m128i tmp = W[a]; \
+		W[a] = W[c]; \
+		W[c] = tmp; \
+		tmp = W[b]; \
+		W[b] = W[d]; \
+		W[d] = tmp; \
+	} while (0)
+
+__attribute__((target("sse2,aes")))
+static void
+echo_big_compress_aesni(sph_echo_big_context *sc)
+{
+	__m128i W[16];
+	__m128i zero = _mm_setzero_si128();
+	sph_u32 K0 = sc->C0;
+	sph_u32 K1 = sc->C1;
+	sph_u32 K2 = sc->C2;
+	sph_u32 K3 = sc->C3;
+	unsigned u, n;
+
+	for (u = 0; u < 8; u ++) {
+		W[u] = _mm_loadu_si128((const __m128i *)&sc->u.Vs[u][0]);
+		W[u + 8] = _mm_loadu_si128((const __m128i *)(sc->buf + 16 * u));
+	}
+	for (u = 0; u < 10; u ++) {
+		for (n = 0; n < 16; n ++) {
+			__m128i K = _mm_set_epi32((int)K3, (int)K2, (int)K1, (int)K0);
+
+			W[n] = _mm_aesenc_si128(_mm_aesenc_si128(W[n], K), zero);
+			if ((K0 = T32(K0 + 1)) == 0) {
+				if ((K1 = T32(K1 + 1)) == 0)
+					if ((K2 = T32(K2 + 1)) == 0)
+						K3 = T32(K3 + 1);
+			}
+		}
+		ECHO_SHIFT_ROW1(1, 5, 9, 13);
+		ECHO_SHIFT_ROW2(2, 6, 10, 14);
+		ECHO_SHIFT_ROW1(15, 11, 7, 3);
+		ECHO_MIX_COLUMN(0, 1, 2, 3);
+		ECHO_MIX_COLUMN(4, 5, 6, 7);
+		ECHO_MIX_COLUMN(8, 9, 10, 11);
+		ECHO_MIX_COLUMN(12, 13, 14, 15);
+	}
+	for (u = 0; u < 8; u ++) {
+		__m128i V = _mm_loadu_si128((const __m128i *)&sc->u.Vs[u][0]);
+
+		V = _mm_xor_si128(V, _mm_loadu_si128(
+			(const __m128i *)(sc->buf + 16 * u)));
+		V = _mm_xor_si128(V, _mm_xor_si128(W[u], W[u + 8]));
+		_mm_storeu_si128((__m128i *)&sc->u.Vs[u][0], V);
+	}
+}
+
+#undef ECHO_XTIME
+#undef ECHO_MIX_COLUMN
+#undef ECHO_SHIFT_ROW1
+#undef ECHO_SHIFT_ROW2
+
+static int echo_use_aesni = 0;
+
+/* selects the AES-NI code once at startup, when the CPU supports it */
+__attribute__((constructor))
+static void
+echo_aesni_detect(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		echo_use_aesni = (ecx & bit_AES) != 0 && (edx & bit_SSE2) != 0;
+}
+
+/* see sph_echo.h */
+int
+sph_echo_aesni(int enable)
+{
+	echo_aesni_detect();
+	if (!enable)
+		echo_use_aesni = 0;
+	return echo_use_aesni;
+}
+
+#else
+
+/* see sph_echo.h */
+int
+sph_echo_aesni(int enable)
+{
+	(void)enable;
+	return 0;
+}
+
+#endif
+
 static void
 echo_big_compress(sph_echo_big_context *sc)
 {
 	DECL_STATE_BIG
 
+#if SPH_ECHO_AESNI
+	if (echo_use_aesni) {
+		echo_big_compress_aesni(sc);
+		return;
+	}
+#endif
 	COMPRESS_BIG(sc);
 }
 
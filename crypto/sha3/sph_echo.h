@@ -268,6 +268,18 @@ void sph_echo384_close(void *cc, void *dst);
 void sph_echo384_addbits_and_close(
 	void *cc, unsigned ub, unsigned n, void *dst);
 
+/**
+ * Select the compression code used by ECHO-384 and ECHO-512. By default
+ * the AES-NI version is chosen at startup on x86 CPUs that support it.
+ * Passing 0 forces the portable code; a non-zero value restores the AES-NI
+ * version if it is available. This function is not thread-safe and is
+ * meant for tests and benchmarks.
+ *
+ * @param enable   non-zero to allow the AES-NI code
+ * @return  non-zero if the AES-NI code is now in use
+ */
+int sph_echo_aesni(int enable);
+
 /**
  * Initialize an ECHO-512 context. This process performs no memory allocation.
  *
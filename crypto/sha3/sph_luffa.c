@@ -48,6 +48,20 @@ extern "C"{
 #pragma warning (disable: 4146)
 #endif
 
+/*
+ * On x86 with GCC or Clang, the Luffa-512 permutation also has a vector
+ * version, built for SSE2 and for AVX2 and selected at runtime from
+ * CPUID. Define SPH_LUFFA_SIMD to 0 to leave it out.
+ */
+#if !defined SPH_LUFFA_SIMD && (defined __x86_64__ || defined __i386__) \
+	&& (defined __GNUC__ || defined __clang__)
+#define SPH_LUFFA_SIMD   1
+#endif
+
+#if SPH_LUFFA_SIMD
+#include <cpuid.h>
+#endif
+
 static const sph_u32 V_INIT[5][8] = {
 	{
 		SPH_C32(0x6d251e69), SPH_C32(0x44b051e0),
@@ -1055,6 +1069,217 @@ static const sph_u32 RC44[8] = {
 
 #endif
 
+#if SPH_LUFFA_SIMD
+
+/*
+ * Vector version of P5. The 256-bit sub-states are laid out "word major":
+ * vector W[k] holds word k of several sub-states, one per lane. SubCrumb
+ * and MixWord only combine words of the same sub-state at fixed positions,
+ * so the eight rounds of all sub-states run together. With AVX2 the five
+ * sub-states fit in one 8-lane vector (lanes 5 to 7 are unused); with SSE2
+ * sub-states 0 to 3 fill a 4-lane vector and sub-state 4 is done with the
+ * scalar code. MI5 stays scalar and the state is transposed around the
+ * permutation.
+ */
+
+typedef sph_u32 luffa_v4 __attribute__((vector_size(16)));
+typedef sph_u32 luffa_v8 __attribute__((vector_size(32)));
+
+#define LUFFA_ROTL_V(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+#define LUFFA_SUB_CRUMB_V(a0, a1, a2, a3)   do { \
+		__typeof__(a0) tmp; \
+		tmp = (a0); \
+		(a0) |= (a1); \
+		(a2) ^= (a3); \
+		(a1) = ~(a1); \
+		(a0) ^= (a3); \
+		(a3) &= tmp; \
+		(a1) ^= (a3); \
+		(a3) ^= (a2); \
+		(a2) &= (a0); \
+		(a0) = ~(a0); \
+		(a2) ^= (a1); \
+		(a1) |= (a3); \
+		tmp ^= (a1); \
+		(a3) ^= (a2); \
+		(a2) &= (a1); \
+		(a1) ^= (a0); \
+		(a0) = tmp; \
+	} while (0)
+
+#define LUFFA_MIX_WORD_V(u, v)   do { \
+		(v) ^= (u); \
+		(u) = LUFFA_ROTL_V((u), 2) ^ (v); \
+		(v) = LUFFA_ROTL_V((v), 14) ^ (u); \
+		(u) = LUFFA_ROTL_V((u), 10) ^ (v); \
+		(v) = LUFFA_ROTL_V((v), 1); \
+	} while (0)
+
+#define LUFFA_ROUNDS_V(W, rc)   do { \
+		int r; \
+		for (r = 0; r < 8; r ++) { \
+			LUFFA_SUB_CRUMB_V(W[0], W[1], W[2], W[3]); \
+			LUFFA_SUB_CRUMB_V(W[5], W[6], W[7], W[4]); \
+			LUFFA_MIX_WORD_V(W[0], W[4]); \
+			LUFFA_MIX_WORD_V(W[1], W[5]); \
+			LUFFA_MIX_WORD_V(W[2], W[6]); \
+			LUFFA_MIX_WORD_V(W[3], W[7]); \
+			W[0] ^= rc[r][0]; \
+			W[4] ^= rc[r][1]; \
+		} \
+	} while (0)
+
+/* round constants: lane j of luffa_rc_v*[r][0] is RCj0[r], of [r][1] RCj4[r] */
+static luffa_v4 luffa_rc_v4[8][2];
+static luffa_v8 luffa_rc_v8[8][2];
+
+__attribute__((target("sse2")))
+static void
+luffa5_perm_sse2(sph_u32 V[5][8])
+{
+	luffa_v4 W[8];
+	sph_u32 V40, V41, V42, V43, V44, V45, V46, V47;
+	int j, k, r;
+
+	for (k = 0; k < 8; k ++) {
+		luffa_v4 w = { V[0][k], V[1][k], V[2][k], V[3][k] };
+
+		W[k] = w;
+	}
+	for (k = 4; k < 8; k ++) {
+		luffa_v4 w = { W[k][0], SPH_ROTL32(W[k][1], 1),
+			SPH_ROTL32(W[k][2], 2), SPH_ROTL32(W[k][3], 3) };
+
+		W[k] = w;
+	}
+	LUFFA_ROUNDS_V(W, luffa_rc_v4);
+	for (k = 0; k < 8; k ++)
+		for (j = 0; j < 4; j ++)
+			V[j][k] = W[k][j];
+
+	V40 = V[4][0];
+	V41 = V[4][1];
+	V42 = V[4][2];
+	V43 = V[4][3];
+	V44 = SPH_ROTL32(V[4][4], 4);
+	V45 = SPH_ROTL32(V[4][5], 4);
+	V46 = SPH_ROTL32(V[4][6], 4);
+	V47 = SPH_ROTL32(V[4][7], 4);
+	for (r = 0; r < 8; r ++) {
+		SUB_CRUMB(V40, V41, V42, V43);
+		SUB_CRUMB(V45, V46, V47, V44);
+		MIX_WORD(V40, V44);
+		MIX_WORD(V41, V45);
+		MIX_WORD(V42, V46);
+		MIX_WORD(V43, V47);
+		V40 ^= RC40[r];
+		V44 ^= RC44[r];
+	}
+	V[4][0] = V40;
+	V[4][1] = V41;
+	V[4][2] = V42;
+	V[4][3] = V43;
+	V[4][4] = V44;
+	V[4][5] = V45;
+	V[4][6] = V46;
+	V[4][7] = V47;
+}
+
+__attribute__((target("avx2")))
+static void
+luffa5_perm_avx2(sph_u32 V[5][8])
+{
+	const luffa_v8 tl = { 0, 1, 2, 3, 4, 0, 0, 0 };
+	const luffa_v8 tr = { 0, 31, 30, 29, 28, 0, 0, 0 };
+	luffa_v8 W[8];
+	int j, k;
+
+	for (k = 0; k < 8; k ++) {
+		luffa_v8 w = { V[0][k], V[1][k], V[2][k], V[3][k], V[4][k],
+			0, 0, 0 };
+
+		W[k] = w;
+	}
+	for (k = 4; k < 8; k ++)
+		W[k] = (W[k] << tl) | (W[k] >> tr);
+	LUFFA_ROUNDS_V(W, luffa_rc_v8);
+	for (k = 0; k < 8; k ++)
+		for (j = 0; j < 5; j ++)
+			V[j][k] = W[k][j];
+}
+
+static void (*luffa5_perm)(sph_u32 V[5][8]) = 0;
+
+/* selects the vector code once at startup, AVX2 when the CPU and OS support it */
+__attribute__((constructor))
+static void
+luffa_simd_detect(void)
+{
+	static const sph_u32 *const rc[5][2] = {
+		{ RC00, RC04 }, { RC10, RC14 }, { RC20, RC24 },
+		{ RC30, RC34 }, { RC40, RC44 }
+	};
+	unsigned eax, ebx, ecx, edx;
+	int r, j;
+
+	for (r = 0; r < 8; r ++) {
+		for (j = 0; j < 5; j ++) {
+			if (j < 4) {
+				luffa_rc_v4[r][0][j] = rc[j][0][r];
+				luffa_rc_v4[r][1][j] = rc[j][1][r];
+			}
+			luffa_rc_v8[r][0][j] = rc[j][0][r];
+			luffa_rc_v8[r][1][j] = rc[j][1][r];
+		}
+	}
+	luffa5_perm = 0;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & bit_SSE2))
+		return;
+	luffa5_perm = luffa5_perm_sse2;
+	if (sph_cpu_avx2())
+		luffa5_perm = luffa5_perm_avx2;
+}
+
+/* see sph_luffa.h */
+int
+sph_luffa_simd(int enable)
+{
+	luffa_simd_detect();
+	if (enable <= 0)
+		luffa5_perm = 0;
+	else if (enable == 1 && luffa5_perm == luffa5_perm_avx2)
+		luffa5_perm = luffa5_perm_sse2;
+	if (luffa5_perm == luffa5_perm_avx2)
+		return 2;
+	return luffa5_perm != 0;
+}
+
+#define P5_SELECT   do { \
+		if (luffa5_perm) { \
+			struct { sph_u32 V[5][8]; } t; \
+			WRITE_STATE5(&t); \
+			luffa5_perm(t.V); \
+			READ_STATE5(&t); \
+		} else { \
+			P5; \
+		} \
+	} while (0)
+
+#else
+
+/* see sph_luffa.h */
+int
+sph_luffa_simd(int enable)
+{
+	(void)enable;
+	return 0;
+}
+
+#define P5_SELECT   P5
+
+#endif
+
 static void
 luffa3(sph_luffa224_context *sc, const void *data, size_t len)
 {
@@ -1234,7 +1459,7 @@ luffa5(sph_luffa512_context *sc, const void *data, size_t len)
 		len -= clen;
 		if (ptr == sizeof sc->buf) {
 			MI5;
-			P5;
+			P5_SELECT;
 			ptr = 0;
 		}
 	}
@@ -1260,7 +1485,7 @@ luffa5_close(sph_luffa512_context *sc, unsigned ub, unsigned n, void *dst)
 	READ_STATE5(sc);
 	for (i = 0; i < 3; i ++) {
 		MI5;
-		P5;
+		P5_SELECT;
 		switch (i) {
 		case 0:
 			memset(buf, 0, sizeof sc->buf);
@@ -47,6 +47,23 @@ extern "C"{
 #pragma warning (disable: 4146)
 #endif
 
+/*
+ * The 512-bit and 384-bit compression function has an AES-NI version on
+ * x86 with GCC or Clang. It is compiled in regardless of the -m flags and
+ * selected at runtime from CPUID; define SPH_SHAVITE_AESNI to 0 to leave
+ * it out.
+ */
+#if !defined SPH_SHAVITE_AESNI && (defined __x86_64__ || defined __i386__) \
+	&& (defined __GNUC__ || defined __clang__)
+#define SPH_SHAVITE_AESNI   1
+#endif
+
+#if SPH_SHAVITE_AESNI
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 #define C32   SPH_C32
 
 /*
@@ -1550,6 +1567,142 @@ shavite_small_close(sph_shavite_small_context *sc,
 		sph_enc32le((unsigned char *)dst + (u << 2), sc->h[u]);
 }
 
+#if SPH_SHAVITE_AESNI
+
+/*
+ * AES-NI version of c512(), with the 448-word key schedule held as 112
+ * SSE words. AES_ROUND_NOKEY followed by a round key XOR is one AESENC.
+ * Output is identical to the portable code.
+ */
+__attribute__((target("sse2,aes")))
+static void
+c512_aesni(sph_shavite_big_context *sc, const void *msg)
+{
+	__m128i rk[112];
+	__m128i p0, p1, p2, p3, x, t;
+	__m128i zero = _mm_setzero_si128();
+	size_t g;
+	int r, s;
+
+	for (g = 0; g < 8; g ++)
+		rk[g] = _mm_loadu_si128((const __m128i *)msg + g);
+	g = 8;
+	for (;;) {
+		for (s = 0; s < 8; s ++) {
+			x = _mm_shuffle_epi32(rk[g - 8], _MM_SHUFFLE(0, 3, 2, 1));
+			x = _mm_aesenc_si128(x, zero);
+			rk[g] = _mm_xor_si128(x, rk[g - 1]);
+			if (g == 8) {
+				rk[g] = _mm_xor_si128(rk[g], _mm_set_epi32(
+					(int)SPH_T32(~sc->count3), (int)sc->count2,
+					(int)sc->count1, (int)sc->count0));
+			} else if (g == 41) {
+				rk[g] = _mm_xor_si128(rk[g], _mm_set_epi32(
+					(int)SPH_T32(~sc->count0), (int)sc->count1,
+					(int)sc->count2, (int)sc->count3));
+			} else if (g == 79) {
+				rk[g] = _mm_xor_si128(rk[g], _mm_set_epi32(
+					(int)SPH_T32(~sc->count1), (int)sc->count0,
+					(int)sc->count3, (int)sc->count2));
+			} else if (g == 110) {
+				rk[g] = _mm_xor_si128(rk[g], _mm_set_epi32(
+					(int)SPH_T32(~sc->count2), (int)sc->count3,
+					(int)sc->count0, (int)sc->count1));
+			}
+			g ++;
+		}
+		if (g == 112)
+			break;
+		for (s = 0; s < 8; s ++) {
+			t = _mm_or_si128(_mm_srli_si128(rk[g - 2], 4),
+				_mm_slli_si128(rk[g - 1], 12));
+			rk[g] = _mm_xor_si128(rk[g - 8], t);
+			g ++;
+		}
+	}
+
+	p0 = _mm_loadu_si128((const __m128i *)&sc->h[0x0]);
+	p1 = _mm_loadu_si128((const __m128i *)&sc->h[0x4]);
+	p2 = _mm_loadu_si128((const __m128i *)&sc->h[0x8]);
+	p3 = _mm_loadu_si128((const __m128i *)&sc->h[0xC]);
+	g = 0;
+	for (r = 0; r < 14; r ++) {
+		x = _mm_xor_si128(p1, rk[g]);
+		x = _mm_aesenc_si128(x, rk[g + 1]);
+		x = _mm_aesenc_si128(x, rk[g + 2]);
+		x = _mm_aesenc_si128(x, rk[g + 3]);
+		x = _mm_aesenc_si128(x, zero);
+		p0 = _mm_xor_si128(p0, x);
+		x = _mm_xor_si128(p3, rk[g + 4]);
+		x = _mm_aesenc_si128(x, rk[g + 5]);
+		x = _mm_aesenc_si128(x, rk[g + 6]);
+		x = _mm_aesenc_si128(x, rk[g + 7]);
+		x = _mm_aesenc_si128(x, zero);
+		p2 = _mm_xor_si128(p2, x);
+		g += 8;
+		t = p3;
+		p3 = p2;
+		p2 = p1;
+		p1 = p0;
+		p0 = t;
+	}
+	_mm_storeu_si128((__m128i *)&sc->h[0x0], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0x0]), p0));
+	_mm_storeu_si128((__m128i *)&sc->h[0x4], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0x4]), p1));
+	_mm_storeu_si128((__m128i *)&sc->h[0x8], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0x8]), p2));
+	_mm_storeu_si128((__m128i *)&sc->h[0xC], _mm_xor_si128(
+		_mm_loadu_si128((const __m128i *)&sc->h[0xC]), p3));
+}
+
+static int shavite_use_aesni = 0;
+
+/* selects the AES-NI code once at startup, when the CPU supports it */
+__attribute__((constructor))
+static void
+shavite_aesni_detect(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		shavite_use_aesni = (ecx & bit_AES) != 0 && (edx & bit_SSE2) != 0;
+}
+
+/* see sph_shavite.h */
+int
+sph_shavite_aesni(int enable)
+{
+	shavite_aesni_detect();
+	if (!enable)
+		shavite_use_aesni = 0;
+	return shavite_use_aesni;
+}
+
+#else
+
+/* see sph_shavite.h */
+int
+sph_shavite_aesni(int enable)
+{
+	(void)enable;
+	return 0;
+}
+
+#endif
+
+static void
+shavite_big_compress(sph_shavite_big_context *sc, const void *msg)
+{
+#if SPH_SHAVITE_AESNI
+	if (shavite_use_aesni) {
+		c512_aesni(sc, msg);
+		return;
+	}
+#endif
+	c512(sc, msg);
+}
+
 static void
 shavite_big_init(sph_shavite_big_context *sc, const sph_u32 *iv)
 {
@@ -1590,7 +1743,7 @@ shavite_big_core(sph_shavite_big_context *sc, const void *data, size_t len)
 					}
 				}
 			}
-			c512(sc, buf);
+			shavite_big_compress(sc, buf);
 			ptr = 0;
 		}
 	}
@@ -1624,7 +1777,7 @@ shavite_big_close(sph_shavite_big_context *sc,
 	} else {
 		buf[ptr ++] = z;
 		memset(buf + ptr, 0, 128 - ptr);
-		c512(sc, buf);
+		shavite_big_compress(sc, buf);
 		memset(buf, 0, 110);
 		sc->count0 = sc->count1 = sc->count2 = sc->count3 = 0;
 	}
@@ -1634,7 +1787,7 @@ shavite_big_close(sph_shavite_big_context *sc,
 	sph_enc32le(buf + 122, count3);
 	buf[126] = out_size_w32 << 5;
 	buf[127] = out_size_w32 >> 3;
-	c512(sc, buf);
+	shavite_big_compress(sc, buf);
 	for (u = 0; u < out_size_w32; u ++)
 		sph_enc32le((unsigned char *)dst + (u << 2), sc->h[u]);
 }
@@ -48,6 +48,20 @@ extern "C"{
 #pragma warning (disable: 4146)
 #endif
 
+/*
+ * On x86 with GCC or Clang, the SIMD-384 / SIMD-512 compression function
+ * also has a vector version, built for SSE2 and for AVX2 and selected at
+ * runtime from CPUID. Define SPH_SIMD_VECTOR to 0 to leave it out.
+ */
+#if !defined SPH_SIMD_VECTOR && (defined __x86_64__ || defined __i386__) \
+	&& (defined __GNUC__ || defined __clang__)
+#define SPH_SIMD_VECTOR   1
+#endif
+
+#if SPH_SIMD_VECTOR
+#include <cpuid.h>
+#endif
+
 typedef sph_u32 u32;
 typedef sph_s32 s32;
 #define C32     SPH_C32
@@ -1521,6 +1535,262 @@ compress_big(sph_simd_big_context *sc, int last)
 
 #endif
 
+#if SPH_SIMD_VECTOR
+
+/*
+ * Vector version of compress_big(), for SIMD-384 and SIMD-512. The four
+ * state registers A, B, C and D hold eight words each and are kept in
+ * one 8-lane vector apiece, so that every step of the Feistel rounds is
+ * a handful of vector operations; the PP8 permutations all have the form
+ * n -> n ^ k and become lane shuffles. The butterflies of the FFT, the
+ * final reduction and the expansion of W are vectorized as well; the
+ * FFT16 leaves stay scalar. The same code is built for SSE2 (each vector
+ * is a register pair) and for AVX2, and the output is identical to the
+ * portable code.
+ */
+
+typedef s32 simd_v8 __attribute__((vector_size(32), may_alias));
+typedef u32 simd_u8 __attribute__((vector_size(32), may_alias));
+typedef unsigned short simd_h16 __attribute__((vector_size(32), may_alias));
+
+#if defined __clang__
+#define SIMD_PERM(x, k)   __builtin_shufflevector(x, x, \
+	0 ^ (k), 1 ^ (k), 2 ^ (k), 3 ^ (k), 4 ^ (k), 5 ^ (k), 6 ^ (k), 7 ^ (k))
+#else
+#define SIMD_PERM(x, k)   __builtin_shuffle(x, (simd_u8){ \
+	0 ^ (k), 1 ^ (k), 2 ^ (k), 3 ^ (k), 4 ^ (k), 5 ^ (k), 6 ^ (k), 7 ^ (k) })
+#endif
+
+#define SIMD_ROL_V(x, n)   (((x) << (n)) | ((x) >> (32 - (n))))
+
+/*
+ * Twiddle factors of the FFT butterflies: lane j of simd_tw_v[hk][u / 8]
+ * is alpha_tab[(u + j) * (128 / hk)]. The tables are filled at startup,
+ * along with 32-bit copies of the yoff_b_* constants.
+ */
+static simd_v8 simd_tw16_v[2], simd_tw32_v[4], simd_tw64_v[8], simd_tw128_v[16];
+static simd_v8 yoff_b_n_v[32], yoff_b_f_v[32];
+
+/*
+ * FFT_LOOP() on vectors. The first butterfly does not reduce its
+ * product (it is a multiplication by alpha^0), so it is redone in scalar
+ * code afterwards.
+ */
+#define FFT_LOOP_V(q, hk, tw)   do { \
+		s32 m0 = (q)[0]; \
+		s32 n0 = (q)[hk]; \
+		size_t u; \
+		for (u = 0; u < (hk); u += 8) { \
+			simd_v8 m = *(simd_v8 *)((q) + u); \
+			simd_v8 n = *(simd_v8 *)((q) + u + (hk)); \
+			simd_v8 t = n * (tw)[u >> 3]; \
+			t = (t & 0xFFFF) + (t >> 16); \
+			*(simd_v8 *)((q) + u) = m + t; \
+			*(simd_v8 *)((q) + u + (hk)) = m - t; \
+		} \
+		(q)[0] = m0 + n0; \
+		(q)[hk] = m0 - n0; \
+	} while (0)
+
+static inline __attribute__((always_inline)) void
+fft64_vec(unsigned char *x, size_t xs, s32 *q)
+{
+	size_t xd;
+
+	xd = xs << 2;
+	FFT16(0, xd, 0);
+	FFT16(xs << 1, xd, 16);
+	FFT_LOOP_V(q, 16, simd_tw16_v);
+	FFT16(xs, xd, 32);
+	FFT16(xs * 3, xd, 48);
+	FFT_LOOP_V(q + 32, 16, simd_tw16_v);
+	FFT_LOOP_V(q, 32, simd_tw32_v);
+}
+
+/*
+ * W for one step: eight words, each the packing of two 16-bit products
+ * INNER(q[v + 2 * i + o1], q[v + 2 * i + o2], mm). q16[] holds the
+ * reduced q[] values truncated to 16 bits; since only the low 16 bits of
+ * each product are kept, the multiplications are done on 16-bit lanes.
+ */
+#define W_BIG_V(q16, sb, o1, o2, mm)   __extension__ ({ \
+		simd_u8 lo, hi; \
+		memcpy(&lo, (q16) + 16 * (sb) + (o1), sizeof lo); \
+		memcpy(&hi, (q16) + 16 * (sb) + (o2), sizeof hi); \
+		(simd_u8)((simd_h16)((lo & 0xFFFF) | (hi << 16)) * (mm)); \
+	})
+
+#define STEP_BIG_V(w, fun, r, s, pp)   do { \
+		simd_u8 tA = SIMD_ROL_V(A, r); \
+		simd_u8 tt = D + (w) + fun(A, B, C); \
+		A = SIMD_ROL_V(tt, s) + SIMD_PERM(tA, pp); \
+		D = C; \
+		C = B; \
+		B = tA; \
+	} while (0)
+
+#define ONE_ROUND_BIG_V(o1, o2, mm, p0, p1, p2, p3, k0, k1, k2, k3, \
+	k4, k5, k6, k7, s0, s1, s2, s3, s4, s5, s6, s7)   do { \
+		STEP_BIG_V(W_BIG_V(q16, s0, o1, o2, mm), IF,  p0, p1, k0); \
+		STEP_BIG_V(W_BIG_V(q16, s1, o1, o2, mm), IF,  p1, p2, k1); \
+		STEP_BIG_V(W_BIG_V(q16, s2, o1, o2, mm), IF,  p2, p3, k2); \
+		STEP_BIG_V(W_BIG_V(q16, s3, o1, o2, mm), IF,  p3, p0, k3); \
+		STEP_BIG_V(W_BIG_V(q16, s4, o1, o2, mm), MAJ, p0, p1, k4); \
+		STEP_BIG_V(W_BIG_V(q16, s5, o1, o2, mm), MAJ, p1, p2, k5); \
+		STEP_BIG_V(W_BIG_V(q16, s6, o1, o2, mm), MAJ, p2, p3, k6); \
+		STEP_BIG_V(W_BIG_V(q16, s7, o1, o2, mm), MAJ, p3, p0, k7); \
+	} while (0)
+
+static inline __attribute__((always_inline)) void
+compress_big_vec(sph_simd_big_context *sc, int last)
+{
+	unsigned char *x;
+	s32 q[256] __attribute__((aligned(32)));
+	unsigned short q16[256 + 16];
+	const simd_v8 *yoff;
+	simd_u8 A, B, C, D, SA, SB, SC, SD;
+	int i;
+
+	x = sc->buf;
+	fft64_vec(x + 0, 4, q +   0);
+	fft64_vec(x + 2, 4, q +  64);
+	FFT_LOOP_V(q, 64, simd_tw64_v);
+	fft64_vec(x + 1, 4, q + 128);
+	fft64_vec(x + 3, 4, q + 192);
+	FFT_LOOP_V(q + 128, 64, simd_tw64_v);
+	FFT_LOOP_V(q, 128, simd_tw128_v);
+
+	yoff = last ? yoff_b_f_v : yoff_b_n_v;
+	for (i = 0; i < 32; i ++) {
+		simd_v8 tq;
+
+		tq = ((simd_v8 *)q)[i] + yoff[i];
+		tq = (tq & 0xFFFF) + (tq >> 16);
+		tq = (tq & 0xFF) - (tq >> 8);
+		tq = (tq & 0xFF) - (tq >> 8);
+		tq -= (tq > 128) & 257;
+		((simd_v8 *)q)[i] = tq;
+	}
+	for (i = 0; i < 256; i ++)
+		q16[i] = (unsigned short)q[i];
+	memset(q16 + 256, 0, 16 * sizeof q16[0]);
+
+	memcpy(&SA, sc->state +  0, sizeof SA);
+	memcpy(&SB, sc->state +  8, sizeof SB);
+	memcpy(&SC, sc->state + 16, sizeof SC);
+	memcpy(&SD, sc->state + 24, sizeof SD);
+	memcpy(&A, x +  0, sizeof A);
+	memcpy(&B, x + 32, sizeof B);
+	memcpy(&C, x + 64, sizeof C);
+	memcpy(&D, x + 96, sizeof D);
+	A ^= SA;
+	B ^= SB;
+	C ^= SC;
+	D ^= SD;
+
+	ONE_ROUND_BIG_V(0, 1, 185, 3, 23, 17, 27, 1, 6, 2, 3, 5, 7, 4, 1,
+		4, 6, 0, 2, 7, 5, 3, 1);
+	ONE_ROUND_BIG_V(0, 1, 185, 28, 19, 22, 7, 6, 2, 3, 5, 7, 4, 1, 6,
+		15, 11, 12, 8, 9, 13, 10, 14);
+	ONE_ROUND_BIG_V(-256, -128, 233, 29, 9, 15, 5, 2, 3, 5, 7, 4, 1, 6, 2,
+		17, 18, 23, 20, 22, 21, 16, 19);
+	ONE_ROUND_BIG_V(-383, -255, 233, 4, 13, 10, 25, 3, 5, 7, 4, 1, 6, 2, 3,
+		30, 24, 25, 31, 27, 29, 28, 26);
+
+	STEP_BIG_V(SA, IF,  4, 13, 5);
+	STEP_BIG_V(SB, IF, 13, 10, 7);
+	STEP_BIG_V(SC, IF, 10, 25, 4);
+	STEP_BIG_V(SD, IF, 25,  4, 1);
+
+	memcpy(sc->state +  0, &A, sizeof A);
+	memcpy(sc->state +  8, &B, sizeof B);
+	memcpy(sc->state + 16, &C, sizeof C);
+	memcpy(sc->state + 24, &D, sizeof D);
+}
+
+__attribute__((target("sse2")))
+static void
+compress_big_sse2(sph_simd_big_context *sc, int last)
+{
+	compress_big_vec(sc, last);
+}
+
+__attribute__((target("avx2")))
+static void
+compress_big_avx2(sph_simd_big_context *sc, int last)
+{
+	compress_big_vec(sc, last);
+}
+
+static void (*simd_big_vec)(sph_simd_big_context *sc, int last) = 0;
+
+/* selects the vector code once at startup, AVX2 when the CPU and OS support it */
+__attribute__((constructor))
+static void
+simd_vector_detect(void)
+{
+	unsigned eax, ebx, ecx, edx;
+	int i;
+
+	for (i = 0; i < 128; i ++) {
+		if (i < 16)
+			simd_tw16_v[i >> 3][i & 7] = alpha_tab[i * 8];
+		if (i < 32)
+			simd_tw32_v[i >> 3][i & 7] = alpha_tab[i * 4];
+		if (i < 64)
+			simd_tw64_v[i >> 3][i & 7] = alpha_tab[i * 2];
+		simd_tw128_v[i >> 3][i & 7] = alpha_tab[i];
+	}
+	for (i = 0; i < 256; i ++) {
+		yoff_b_n_v[i >> 3][i & 7] = yoff_b_n[i];
+		yoff_b_f_v[i >> 3][i & 7] = yoff_b_f[i];
+	}
+	simd_big_vec = 0;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & bit_SSE2))
+		return;
+	simd_big_vec = compress_big_sse2;
+	if (sph_cpu_avx2())
+		simd_big_vec = compress_big_avx2;
+}
+
+/* see sph_simd.h */
+int
+sph_simd_vector(int enable)
+{
+	simd_vector_detect();
+	if (enable <= 0)
+		simd_big_vec = 0;
+	else if (enable == 1 && simd_big_vec == compress_big_avx2)
+		simd_big_vec = compress_big_sse2;
+	if (simd_big_vec == compress_big_avx2)
+		return 2;
+	return simd_big_vec != 0;
+}
+
+#else
+
+/* see sph_simd.h */
+int
+sph_simd_vector(int enable)
+{
+	(void)enable;
+	return 0;
+}
+
+#endif
+
+static void
+simd_big_compress(sph_simd_big_context *sc, int last)
+{
+#if SPH_SIMD_VECTOR
+	if (simd_big_vec) {
+		simd_big_vec(sc, last);
+		return;
+	}
+#endif
+	compress_big(sc, last);
+}
+
 static const u32 IV224[] = {
 	C32(0x33586E9F), C32(0x12FFF033), C32(0xB2D9F64D), C32(0x6F8FEA53),
 	C32(0xDE943106), C32(0x2742E439), C32(0x4FBAB5AC), C32(0x62B9FF96),
@@ -1620,7 +1890,7 @@ update_big(void *cc, const void *data, size_t len)
 		data = (const unsigned char *)data + clen;
 		len -= clen;
 		if ((sc->ptr += clen) == sizeof sc->buf) {
-			compress_big(sc, 0);
+			simd_big_compress(sc, 0);
 			sc->ptr = 0;
 			sc->count_low = T32(sc->count_low + 1);
 			if (sc->count_low == 0)
@@ -1685,11 +1955,11 @@ finalize_big(void *cc, unsigned ub, unsigned n, void *dst, size_t dst_len)
 		memset(sc->buf + sc->ptr, 0,
 			(sizeof sc->buf) - sc->ptr);
 		sc->buf[sc->ptr] = ub & (0xFF << (8 - n));
-		compress_big(sc, 0);
+		simd_big_compress(sc, 0);
 	}
 	memset(sc->buf, 0, sizeof sc->buf);
 	encode_count_big(sc->buf, sc->count_low, sc->count_high, sc->ptr, n);
-	compress_big(sc, 1);
+	simd_big_compress(sc, 1);
 	d = dst;
 	for (d = dst, u = 0; u < dst_len; u ++)
 		sph_enc32le(d + (u << 2), sc->state[u]);
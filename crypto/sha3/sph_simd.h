@@ -258,6 +258,18 @@ void sph_simd384_close(void *cc, void *dst);
 void sph_simd384_addbits_and_close(
 	void *cc, unsigned ub, unsigned n, void *dst);
 
+/**
+ * Select the compression function code used by SIMD-384 and SIMD-512. By
+ * default the vector version is chosen at startup on x86 CPUs, using AVX2
+ * when the CPU and OS support it and SSE2 otherwise. Passing 0 forces the
+ * portable code, 1 allows at most SSE2 and 2 (or more) allows AVX2. This
+ * function is not thread-safe and is meant for tests and benchmarks.
+ *
+ * @param enable   the highest code path allowed
+ * @return  the code path now in use: 0 portable, 1 SSE2, 2 AVX2
+ */
+int sph_simd_vector(int enable);
+
 /**
  * Initialize an SIMD-512 context. This process performs no memory allocation.
  *
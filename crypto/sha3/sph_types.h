@@ -1971,6 +1971,31 @@ sph_dec64le_aligned(const void *src)
 
 #endif
 
+#if SPH_I386_GCC || SPH_AMD64_GCC
+
+#include <cpuid.h>
+
+/*
+ * Return non-zero if the CPU has AVX2 and the OS saves the AVX register
+ * state across context switches (OSXSAVE set, and XCR0 enabling both the
+ * SSE and AVX state), so that AVX2 code may be selected at runtime.
+ */
+static SPH_INLINE int
+sph_cpu_avx2(void)
+{
+	unsigned eax, ebx, ecx, edx, xcr0;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)
+		|| !(ecx & bit_OSXSAVE) || !(ecx & bit_AVX)
+		|| __get_cpuid_max(0, 0) < 7)
+		return 0;
+	__asm__ ("xgetbv" : "=a" (xcr0), "=d" (edx) : "c" (0));
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (xcr0 & 6) == 6 && (ebx & bit_AVX2) != 0;
+}
+
+#endif
+
 #endif /* Doxygen excluded block */
 
 #endif
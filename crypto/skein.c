@@ -50,3 +50,23 @@ void skein_hash(const char* input, char* output)
     SHA256_Update(&ctx_sha256, &temp, 64);
     SHA256_Final((unsigned char*) output, &ctx_sha256);
 }
+
+void skein_hash_batch(const char* input, char* output, size_t count)
+{
+    sph_skein512_context init_skein, ctx_skien;
+    SHA256_CTX ctx_sha256;
+    char temp[64];
+
+    // headers in a chain never share their first block, so only the initial state is reused
+    sph_skein512_init(&init_skein);
+
+    for (size_t i = 0; i < count; i++) {
+        ctx_skien = init_skein;
+        sph_skein512(&ctx_skien, input + i*80, 80);
+        sph_skein512_close(&ctx_skien, &temp);
+
+        SHA256_Init(&ctx_sha256);
+        SHA256_Update(&ctx_sha256, &temp, 64);
+        SHA256_Final((unsigned char*) output + i*32, &ctx_sha256);
+    }
+}
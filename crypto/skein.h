@@ -5,8 +5,13 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+
 void skein_hash(const char* input, char* output);
 
+// skein_hash() of count consecutive 80 byte headers, writing count consecutive 32 byte hashes to output
+void skein_hash_batch(const char* input, char* output, size_t count);
+
 #ifdef __cplusplus
 }
 #endif
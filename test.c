@@ -41,6 +41,11 @@
 #include "BRArray.h"
 #include "BRSet.h"
 #include "BRTransaction.h"
+#include "BRCoinSelection.h"
+#include "crypto/sha3/sph_echo.h"
+#include "crypto/sha3/sph_shavite.h"
+#include "crypto/sha3/sph_luffa.h"
+#include "crypto/sha3/sph_simd.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,6 +53,8 @@
 #include <errno.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include <arpa/inet.h>
 
 #define SKIP_BIP38 1
@@ -434,6 +441,49 @@ int BRHashTests()
     if (! UInt256Eq(*(UInt256 *)"\xca\x97\x81\x12\xca\x1b\xbd\xca\xfa\xc2\x31\xb3\x9a\x23\xdc\x4d\xa7\x86\xef\xf8"
                     "\x14\x7c\x4e\x72\xb9\x80\x77\x85\xaf\xee\x48\xbb", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256() test 6\n", __func__);
+    
+    // every sha-256 backend the cpu supports must match the portable code, also for batches of messages whose lengths
+    // cross block and padding boundaries
+    
+    uint8_t buf256[200], ref256[130*32], md256[130*32];
+    const void *data256[130];
+    size_t len256[130];
+    
+    for (size_t i = 0; i < sizeof(buf256); i++) buf256[i] = (uint8_t)(i*13 + 7);
+    for (size_t i = 0; i < 130; i++) data256[i] = &buf256[i % 7], len256[i] = i;
+    BRSHA256Impl(0);
+    for (size_t i = 0; i < 130; i++) BRSHA256_2(&ref256[i*32], data256[i], len256[i]);
+    
+    for (int impl = 0; impl < 4; impl++) {
+        if (BRSHA256Impl(impl) != impl) continue;
+        BRSHA256_2_Batch(md256, data256, len256, 130);
+        if (memcmp(md256, ref256, sizeof(ref256)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256_2_Batch() impl = %d test 1\n", __func__, impl);
+        
+        BRSHA256_2_Batch(md256, &data256[80], &len256[80], 3);
+        if (memcmp(md256, &ref256[80*32], 3*32) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256_2_Batch() impl = %d test 2\n", __func__, impl);
+        
+        for (size_t i = 0; i < 130; i++) BRSHA256_2(&md256[i*32], data256[i], len256[i]);
+        if (memcmp(md256, ref256, sizeof(ref256)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256_2() impl = %d test\n", __func__, impl);
+
+        for (size_t i = 0, j, n; i <= sizeof(buf256); i++) { // incremental hashing, fed in uneven pieces
+            BRSHA256Context ctx;
+
+            BRSHA256Init(&ctx);
+            for (j = 0; j < i; j += n) {
+                n = 1 + j*29 % 70;
+                if (n > i - j) n = i - j;
+                BRSHA256Update(&ctx, &buf256[j], n);
+            }
+
+            BRSHA256Final(md256, &ctx);
+            BRSHA256(&md256[32], buf256, i);
+            if (memcmp(md256, &md256[32], 32) != 0)
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRSHA256Update() impl = %d len = %zu\n", __func__, impl, i);
+        }
+    }
 
     // test sha512
     
@@ -580,6 +630,127 @@ int BRHashTests()
                     "\x82\x27\x3b\x7b\xfa\xd8\x04\x5d\x85\xa4\x70", *(UInt256 *)md))
         r = 0, fprintf(stderr, "***FAILED*** %s: Keccak-256() test 10\n", __func__);
     
+    // test scrypt(1024, 1, 1) header fast path
+    
+    uint8_t header[80*9] = "\x01", md9[32*9], md1[32];
+    
+    UInt256Set(&header[36], UInt256Reverse(uint256("72ddd9496b004221ed0557358846d9248ecd4c440ebd28ed901efc18757d0fad")));
+    UInt32SetLE(&header[68], 1389388394);
+    UInt32SetLE(&header[72], 0x1e0ffff0);
+    UInt32SetLE(&header[76], 2447652); // digibyte genesis block
+    BRScrypt_1024_1_1(md, header);
+    if (! UInt256Eq(UInt256Reverse(uint256("00000157e0eb799b685e4f679160afe11152840040e4dc23e3947989b7b6ec80")),
+                    *(UInt256 *)md)) r = 0, fprintf(stderr, "***FAILED*** %s: BRScrypt_1024_1_1() test 11\n", __func__);
+    
+    for (size_t i = 1; i < 9; i++) { // enough headers for a full set of simd lanes plus a remainder
+        memcpy(&header[80*i], header, 80);
+        UInt32SetLE(&header[80*i + 76], 2447652 + (uint32_t)i);
+    }
+    
+    BRScrypt_1024_1_1_Batch(md9, header, 9, NULL);
+    
+    for (size_t i = 0; i < 9; i++) {
+        BRScrypt(md1, sizeof(md1), &header[80*i], 80, &header[80*i], 80, 1024, 1, 1);
+        if (memcmp(&md9[32*i], md1, sizeof(md1)) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRScrypt_1024_1_1_Batch() test %zu\n", __func__, 12 + i);
+    }
+    
+    void *scratch = malloc(BR_SCRYPT_BATCH_SCRATCH_SIZE);
+    uint8_t md9s[32*9];
+    
+    BRScrypt_1024_1_1_Batch(md9s, header, 9, scratch); // a reused scratchpad must give the same digests
+    BRScrypt_1024_1_1_Batch(md9s, &header[80], 8, scratch);
+    if (memcmp(md9s, &md9[32], 32*8) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRScrypt_1024_1_1_Batch() scratch test\n", __func__);
+    free(scratch);
+    
+    // test echo-512 and shavite-512, both with the portable code and with aes-ni when the cpu has it
+    
+    uint8_t data[200];
+    sph_echo512_context echo;
+    sph_shavite512_context shavite;
+    
+    for (size_t i = 0; i < sizeof(data); i++) data[i] = (uint8_t)i;
+    
+    for (int aesni = 0; aesni < 2; aesni++) {
+        if (aesni && ! sph_echo_aesni(1)) continue;
+        sph_echo_aesni(aesni);
+        sph_echo512_init(&echo);
+        sph_echo512_close(&echo, md);
+        if (! UInt512Eq(*(UInt512 *)"\x15\x8f\x58\xcc\x79\xd3\x00\xa9\xaa\x29\x25\x15\x04\x92\x75\xd0\x51\xa2\x8a\xb9\x31"
+                        "\x72\x6d\x0e\xc4\x4b\xdd\x9f\xae\xf4\xa7\x02\xc3\x6d\xb9\xe7\x92\x2f\xff\x07\x74\x02\x23\x64\x65"
+                        "\x83\x3c\x5c\xc7\x6a\xf4\xef\xc3\x52\xb4\xb4\x4c\x7f\xa1\x5a\xa0\xef\x23\x4e", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_echo512() aesni = %d test 1\n", __func__, aesni);
+        
+        sph_echo512_init(&echo);
+        sph_echo512(&echo, data, sizeof(data));
+        sph_echo512_close(&echo, md);
+        if (! UInt512Eq(*(UInt512 *)"\x61\xc1\x02\x47\x23\x13\x39\xfe\x16\x49\x31\x90\x67\x99\x7f\x65\x6a\x1a\x90\xa0\x48"
+                        "\x27\x63\xa2\x27\x37\x8c\x96\xea\xf0\x7e\xb9\x84\x01\x8a\x89\x7d\x0e\xd4\x53\x72\x9c\xa7\x00\xd2"
+                        "\x17\x53\x43\x2c\x0c\xab\xef\x97\xea\x9b\x32\xfc\xbd\x61\x26\x8d\x0f\x7d\x11", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_echo512() aesni = %d test 2\n", __func__, aesni);
+    }
+    
+    for (int aesni = 0; aesni < 2; aesni++) {
+        if (aesni && ! sph_shavite_aesni(1)) continue;
+        sph_shavite_aesni(aesni);
+        sph_shavite512_init(&shavite);
+        sph_shavite512_close(&shavite, md);
+        if (! UInt512Eq(*(UInt512 *)"\xa4\x85\xc1\xb2\x57\x84\x59\xd1\xef\xc5\xdd\xdd\x84\x0b\xb0\xb4\xa6\x50\xac\x82\xfe"
+                        "\x68\xf5\x8c\x44\x42\xcc\xda\x74\x7d\xa0\x06\xb2\xd1\xdc\x6b\x4a\x4e\xb7\xd8\x4f\xf9\x1e\x1f\x46"
+                        "\x6f\xef\x42\x9d\x25\x9a\xcd\x99\x5d\xdd\xca\xd1\x6f\xa5\x45\xc7\xa6\xe5\xba", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_shavite512() aesni = %d test 1\n", __func__, aesni);
+        
+        sph_shavite512_init(&shavite);
+        sph_shavite512(&shavite, data, sizeof(data));
+        sph_shavite512_close(&shavite, md);
+        if (! UInt512Eq(*(UInt512 *)"\xc3\x12\xd2\x85\xcd\x9c\x59\x7d\x7d\xf9\x52\x51\x33\x15\x5f\x05\xaa\x94\xf2\x06\xb3"
+                        "\x1e\x2d\xef\x25\x58\x79\xb8\xbb\x27\xf2\x5c\xcf\xab\xa5\x16\x23\x8c\x5d\xe6\x79\x54\x5e\x7d\x0d"
+                        "\x88\xa5\xd0\xc0\xc9\x75\xaa\xe8\xa2\xe6\x23\x69\xfc\xde\xda\x4d\x02\xda\x42", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_shavite512() aesni = %d test 2\n", __func__, aesni);
+    }
+    
+    // test luffa-512 and simd-512 with the portable code, sse2 and avx2, as far as the cpu supports them
+    
+    sph_luffa512_context luffa;
+    sph_simd512_context simd;
+    
+    for (int path = 0; path < 3; path++) {
+        if (sph_luffa_simd(path) != path) continue;
+        sph_luffa512_init(&luffa);
+        sph_luffa512_close(&luffa, md);
+        if (! UInt512Eq(*(UInt512 *)"\x6e\x7d\xe4\x50\x11\x89\xb3\xca\x58\xf3\xac\x11\x49\x16\x65\x4b\xbc\xd4\x92\x20\x24"
+                        "\xb4\xcc\x1c\xd7\x64\xac\xfe\x8a\xb4\xb7\x80\x5d\xf1\x33\xea\xb3\x45\xff\xdb\x1c\x41\x45\x64\xc9"
+                        "\x24\xf4\x8e\x0a\x30\x18\x24\xe2\xac\x4c\x34\xbd\x4e\xfd\xe2\xe4\x3d\xa9\x0e", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_luffa512() path = %d test 1\n", __func__, path);
+        
+        sph_luffa512_init(&luffa);
+        sph_luffa512(&luffa, data, sizeof(data));
+        sph_luffa512_close(&luffa, md);
+        if (! UInt512Eq(*(UInt512 *)"\xbe\xf9\xb8\x7f\xf7\xe6\xd2\xa6\x71\xdc\x0d\x26\xfd\x36\x82\xc9\x60\xe6\x19\xc9\x28"
+                        "\x67\xe2\x0d\x0a\xac\xae\xe5\xdb\xe4\xa4\x04\x45\xf3\x68\x31\xe4\x26\x40\x16\x2d\x71\xed\xbc\x7b"
+                        "\x59\x70\x18\x67\x73\xb3\xd8\x3f\x30\xf4\xc0\x37\x98\x14\x06\xfc\xf1\x8a\x7f", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_luffa512() path = %d test 2\n", __func__, path);
+    }
+    
+    for (int path = 0; path < 3; path++) {
+        if (sph_simd_vector(path) != path) continue;
+        sph_simd512_init(&simd);
+        sph_simd512_close(&simd, md);
+        if (! UInt512Eq(*(UInt512 *)"\x51\xa5\xaf\x7e\x24\x3c\xd9\xa5\x98\x9f\x77\x92\xc8\x80\xc4\xc3\x16\x8c\x3d\x60\xc4"
+                        "\x51\x87\x25\xfe\x57\x57\xd1\xf7\xa6\x9c\x63\x66\x97\x7e\xab\xa7\x90\x5c\xe2\xda\x5d\x7c\xfd\x07"
+                        "\x77\x37\x25\xf0\x93\x5b\x55\xf3\xef\xb9\x54\x99\x66\x89\xa4\x9b\x6d\x29\xe0", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_simd512() path = %d test 1\n", __func__, path);
+        
+        sph_simd512_init(&simd);
+        sph_simd512(&simd, data, sizeof(data));
+        sph_simd512_close(&simd, md);
+        if (! UInt512Eq(*(UInt512 *)"\xb3\xc9\x99\x81\xeb\xea\xeb\x77\x3a\x6b\x48\x14\x6a\xf6\xf5\xf5\xff\x74\x0a\x6f\x0b"
+                        "\x6a\x7a\x32\x4f\x21\x52\x49\x85\xeb\xa9\xac\x62\x45\x73\xf1\x60\x41\x5c\x82\xf8\x36\x57\x0e\x52"
+                        "\x9a\xe4\x49\xff\x02\x25\xde\xd2\x53\x6c\xb9\xc8\xb1\xa2\x67\x8f\x13\x16\x0f", *(UInt512 *)md))
+            r = 0, fprintf(stderr, "***FAILED*** %s: sph_simd512() path = %d test 2\n", __func__, path);
+    }
+    
     return r;
 }
 
@@ -1604,6 +1775,21 @@ int BRBIP32SequenceTests()
                     uint256("7b6a7dd645507d775215a9035be06700e1ed8c541da9351b4bd14bd50ab61428")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKey() test\n", __func__);
 
+    BRMasterPubKey chainPubKey = BRBIP32ChainPubKey(mpk, SEQUENCE_INTERNAL_CHAIN);
+    BRECPoint pubKeys[100], pubKeys2[100];
+    
+    BRBIP32PubKeyRange(pubKeys, chainPubKey, 1000, 100, 0);
+    BRBIP32PubKeyRange(pubKeys2, chainPubKey, 1000, 100, 1);
+    
+    for (uint32_t i = 0; i < 100; i++) {
+        BRBIP32PubKey(pubKey, sizeof(pubKey), mpk, SEQUENCE_INTERNAL_CHAIN, 1000 + i);
+        
+        if (memcmp(pubKey, pubKeys[i].p, sizeof(pubKey)) != 0 || memcmp(pubKey, pubKeys2[i].p, sizeof(pubKey)) != 0) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRBIP32PubKeyRange() test\n", __func__);
+            break;
+        }
+    }
+
     UInt512 dk;
     BRAddress addr;
 
@@ -1766,8 +1952,72 @@ int BRTransactionTests()
     
     if (len4 != len5 || memcmp(buf4, buf5, len4) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRTransactionSerialize() test 2\n", __func__);
+
+    BRTransaction *etx = BRTransactionNew();
+    BRTxSizeEstimate est = BR_TX_SIZE_ESTIMATE_NONE;
+    uint8_t wscript[22] = { OP_0, 20 };
+    
+    for (size_t i = 0; i < 300; i++) { // mix signed, P2WPKH and P2PKH inputs until the counts need 3 byte varints
+        BRTxInput *in = &tx->inputs[i % tx->inCount];
+        
+        if (i % 3 == 0) {
+            BRTransactionAddInput(etx, inHash, 0, 1, NULL, 0, in->signature, in->sigLen, in->witness, in->witLen,
+                                  TXIN_SEQUENCE);
+            BRTxSizeEstimateAddInput(&est, NULL, 0, in->signature, in->sigLen, in->witness, in->witLen);
+        }
+        else if (i % 3 == 1) {
+            BRTransactionAddInput(etx, inHash, 0, 1, wscript, sizeof(wscript), NULL, 0, NULL, 0, TXIN_SEQUENCE);
+            BRTxSizeEstimateAddInput(&est, wscript, sizeof(wscript), NULL, 0, NULL, 0);
+        }
+        else {
+            BRTransactionAddInput(etx, inHash, 0, 1, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+            BRTxSizeEstimateAddInput(&est, script, scriptLen, NULL, 0, NULL, 0);
+        }
+        
+        BRTransactionAddOutput(etx, 1000000, script, scriptLen);
+        BRTxSizeEstimateAddOutput(&est, scriptLen);
+        
+        if (BRTxSizeEstimateSize(&est) != BRTransactionSize(etx) ||
+            BRTxSizeEstimateVSize(&est) != BRTransactionVSize(etx)) {
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRTxSizeEstimate() test 1\n", __func__);
+            break;
+        }
+    }
+    
+    BRTransactionFree(etx);
     BRTransactionFree(tx);
 
+    BRAddress waddr;
+    
+    BRKeySegwitAddress(&k[1], waddr.s, sizeof(waddr), OP_0);
+    
+    uint8_t wscript2[BRAddressScriptPubKey(NULL, 0, waddr.s)];
+    size_t wscript2Len = BRAddressScriptPubKey(wscript2, sizeof(wscript2), waddr.s);
+    BRTransaction *stx = BRTransactionNew(), *ptx;
+    
+    for (size_t i = 0; i < 50; i++) { // mix of P2PKH and P2WPKH inputs, spread over several workers
+        if (i % 2) BRTransactionAddInput(stx, inHash, (uint32_t)i, 1, script, scriptLen, NULL, 0, NULL, 0,
+                                         TXIN_SEQUENCE);
+        else BRTransactionAddInput(stx, inHash, (uint32_t)i, 1, wscript2, wscript2Len, NULL, 0, NULL, 0,
+                                   TXIN_SEQUENCE);
+    }
+    
+    BRTransactionAddOutput(stx, 1000000, script, scriptLen);
+    ptx = BRTransactionCopy(stx);
+    BRTransactionSign(stx, 0, k, 2);
+    BRTransactionSignBatch(ptx, 0, k, 2, 4);
+    
+    uint8_t sbuf[BRTransactionSerialize(stx, NULL, 0)], pbuf[BRTransactionSerialize(ptx, NULL, 0)];
+    size_t sLen = BRTransactionSerialize(stx, sbuf, sizeof(sbuf)),
+           pLen = BRTransactionSerialize(ptx, pbuf, sizeof(pbuf));
+    
+    if (! BRTransactionIsSigned(ptx) || sLen != pLen || memcmp(sbuf, pbuf, sLen) != 0 ||
+        ! UInt256Eq(stx->txHash, ptx->txHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRTransactionSignBatch() test\n", __func__);
+    
+    BRTransactionFree(ptx);
+    BRTransactionFree(stx);
+
     BRTransaction *src = BRTransactionNew ();
     BRTransactionAddInput(src, inHash, 0, 1, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
     BRTransactionAddInput(src, inHash, 0, 1, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
@@ -1903,6 +2153,20 @@ int BRWalletTests()
 
     if (BRWalletAllAddrs(w, NULL, 0) != SEQUENCE_GAP_LIMIT_EXTERNAL + SEQUENCE_GAP_LIMIT_INTERNAL + 1)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletAllAddrs() test\n", __func__);
+
+    BRWalletUnusedAddrs(w, NULL, 1000, 0, 0); // grow the external chain over several allocations
+    size_t addrsCount = BRWalletAllAddrs(w, NULL, 0);
+    BRAddress *addrs = malloc(addrsCount*sizeof(*addrs));
+    
+    addrsCount = BRWalletAllAddrs(w, addrs, addrsCount);
+    
+    for (size_t i = 0; i < addrsCount; i++) {
+        if (BRWalletContainsAddress(w, addrs[i].s)) continue;
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletContainsAddress() test\n", __func__);
+        break;
+    }
+    
+    free(addrs);
     
     UInt256 hash = tx->txHash;
 
@@ -1929,6 +2193,17 @@ int BRWalletTests()
     if (tx && BRWalletTransactionForHash(w, tx->txHash) != tx)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionForHash() test\n", __func__);
 
+    BRKey addrKey;
+    BRAddress keyAddr = BR_ADDRESS_NONE, keyAddrSegwit = BR_ADDRESS_NONE;
+
+    if (BRWalletGetAddressPrivateKey(w, &addrKey, recvAddr.s, strlen(recvAddr.s), "", 1)) {
+        BRKeyAddress(&addrKey, keyAddr.s, sizeof(keyAddr));
+        BRKeySegwitAddress(&addrKey, keyAddrSegwit.s, sizeof(keyAddrSegwit), OP_0);
+    }
+
+    if (! BRAddressEq(&keyAddr, &recvAddr) && ! BRAddressEq(&keyAddrSegwit, &recvAddr))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletGetAddressPrivateKey() test\n", __func__);
+
     if (tx && ! BRWalletTransactionIsValid(w, tx))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsValid() test\n", __func__);
 
@@ -1937,7 +2212,37 @@ int BRWalletTests()
 
     if (tx && BRWalletTransactionIsPending(w, tx))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletTransactionIsPending() test 2\n", __func__);
-    
+
+    uint64_t balance = BRWalletBalance(w);
+    BRTransaction *txs[2] = { (tx) ? BRTransactionCopy(tx) : NULL,
+                              BRTransactionCopy(BRWalletTransactionForHash(w, hash)) };
+    BRWallet *w2 = (tx) ? BRWalletNew(txs, 2, mpk) : NULL; // spend is passed in before the tx it spends
+
+    if (w2 && (BRWalletBalance(w2) != balance || BRWalletTransactions(w2, txs, 2) != 2 ||
+               ! UInt256Eq(txs[0]->txHash, hash)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() test 2\n", __func__);
+
+    if (w2) BRWalletFree(w2);
+    else BRTransactionFree(txs[1]);
+
+    // confirming the spend before its input reorders the history, which must leave the balance and utxos unchanged
+    if (tx) BRWalletUpdateTransactions(w, &tx->txHash, 1, 1001, 1);
+    BRWalletUpdateTransactions(w, &hash, 1, 1000, 1);
+    if (BRWalletBalance(w) != balance || BRWalletUTXOs(w, NULL, 0) != 1 ||
+        BRWalletBalanceAfterTx(w, BRWalletTransactionForHash(w, hash)) != SATOSHIS)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUpdateTransactions() balance test\n", __func__);
+
+    BRWalletSetTxUnconfirmedAfter(w, 999);
+    if (BRWalletBalance(w) != balance || BRWalletUTXOs(w, NULL, 0) != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletSetTxUnconfirmedAfter() balance test\n", __func__);
+
+    BRUTXOEntry entry;
+
+    if (BRWalletUTXOSnapshot(w, NULL, 0) != 1 || BRWalletUTXOSnapshot(w, &entry, 1) != 1 ||
+        (tx && ! UInt256Eq(entry.utxo.hash, tx->txHash)) || entry.amount != balance || entry.isAsset ||
+        entry.blockHeight != TX_UNCONFIRMED)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletUTXOSnapshot() test\n", __func__);
+
     BRWalletRemoveTransaction(w, hash); // removing first tx should recursively remove second, leaving none
     if (BRWalletTransactions(w, NULL, 0) != 0)
         r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletRemoveTransaction() test\n", __func__);
@@ -1951,6 +2256,46 @@ int BRWalletTests()
     printf("                                    ");
     BRWalletFree(w);
 
+    // loading txs with BRWalletNew() must give the same order as registering them one at a time: A, D and B are
+    // confirmed receives, X, C and P are unconfirmed change, and C spends P but has a lower change index than X
+    const char *loadNames = "ADBXCP", *loadOrder = "DBAPCX";
+    const size_t loadIdx[] = { 1, 2, 0, 2, 1, 0 };
+    const uint32_t loadHeight[] = { 100, 99, 100, TX_UNCONFIRMED, TX_UNCONFIRMED, TX_UNCONFIRMED };
+    BRAddress loadAddrs[2][3];
+    BRTransaction *loadTxs[6], *inserted[6], *loaded[6];
+    BRWallet *w1 = BRWalletNew(NULL, 0, mpk), *w3;
+
+    BRWalletUnusedAddrs(w1, loadAddrs[0], 3, 0, 0);
+    BRWalletUnusedAddrs(w1, loadAddrs[1], 3, 1, 0);
+
+    for (size_t i = 6; i > 0; i--) { // P is created first, so C can spend it
+        uint8_t script[BRAddressScriptPubKey(NULL, 0, loadAddrs[(i > 3)][loadIdx[i - 1]].s)];
+        size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), loadAddrs[(i > 3)][loadIdx[i - 1]].s);
+
+        loadTxs[i - 1] = BRTransactionNew();
+        BRTransactionAddInput(loadTxs[i - 1], (i == 5) ? loadTxs[5]->txHash : inHash, (i == 5) ? 0 : (uint32_t)i,
+                              1, inScript, inScriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+        BRTransactionAddOutput(loadTxs[i - 1], SATOSHIS, script, scriptLen);
+        BRTransactionSign(loadTxs[i - 1], 0, &k, 1);
+        loadTxs[i - 1]->blockHeight = loadHeight[i - 1];
+    }
+
+    for (size_t i = 0; i < 6; i++) loaded[i] = BRTransactionCopy(loadTxs[i]);
+    w3 = BRWalletNew(loaded, 6, mpk);
+    for (size_t i = 0; i < 6; i++) BRWalletRegisterTransaction(w1, loadTxs[i]);
+
+    if (! w3 || BRWalletTransactions(w1, inserted, 6) != 6 || BRWalletTransactions(w3, loaded, 6) != 6)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() load order test 0\n", __func__);
+
+    for (size_t i = 0; w3 && i < 6; i++) {
+        if (! UInt256Eq(loaded[i]->txHash, inserted[i]->txHash) ||
+            ! UInt256Eq(inserted[i]->txHash, loadTxs[strchr(loadNames, loadOrder[i]) - loadNames]->txHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRWalletNew() load order test %zu\n", __func__, i + 1);
+    }
+
+    BRWalletFree(w1);
+    if (w3) BRWalletFree(w3);
+
     int64_t amt;
     
     tx = BRTransactionNew();
@@ -1984,6 +2329,59 @@ int BRWalletTests()
     return r;
 }
 
+int BRCoinSelectionTests()
+{
+    int r = 1;
+    BRCoinCandidate c[] = { { 1000000, 100, 6, 0 }, { 2000000, 100, 6, 0 }, { 3000000, 100, 6, 0 },
+                            { 5000000, 100, 6, 0 } };
+    BRCoinSelectionParams p = { 4000000 - 300, 100, 34, 1000, 546, 100000, 0, 1 };
+    BRCoinSelection sel, sel2;
+    size_t selected[4], selected2[4];
+    int i;
+    
+    i = BRCoinSelectBranchAndBound(c, 4, &p, selected, &sel);
+    if (i != 1 || sel.count != 2 || sel.amount != 4000000 || sel.fee != 300 || sel.change != 0 || sel.vsize != 300 ||
+        selected[0] + selected[1] != 2 || selected[0]*selected[1] != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelectBranchAndBound() test 1\n", __func__);
+    
+    i = BRCoinSelectLargestFirst(c, 4, &p, selected, &sel);
+    if (i != 1 || sel.count != 1 || selected[0] != 3 || sel.change != 5000000 - sel.fee - p.amount ||
+        sel.vsize != 100 + 100 + 34)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelectLargestFirst() test 1\n", __func__);
+    
+    i = BRCoinSelect(c, 4, &p, selected, &sel);
+    if (i != 1 || sel.count != 2 || sel.change != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelect() test 1\n", __func__);
+    
+    p.amount = 6500000;
+    i = BRCoinSelectKnapsack(c, 4, &p, selected, &sel);
+    if (i != 1 || sel.amount != p.amount + sel.fee + sel.change)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelectKnapsack() test 1\n", __func__);
+    
+    i = BRCoinSelectKnapsack(c, 4, &p, selected2, &sel2);
+    if (i != 1 || sel2.count != sel.count || memcmp(selected, selected2, sel.count*sizeof(*selected)) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelectKnapsack() test 2\n", __func__);
+    
+    c[3].isAsset = 1; // digiasset outputs are never spent
+    c[2].depth = 0;
+    p.amount = 2500000, p.minDepth = 1;
+    i = BRCoinSelect(c, 4, &p, selected, &sel);
+    if (i != 1 || sel.amount != 3000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelect() test 2\n", __func__);
+    
+    p.amount = 3500000;
+    i = BRCoinSelect(c, 4, &p, selected, &sel);
+    if (i != 0) r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelect() test 3\n", __func__);
+    
+    c[3].isAsset = 0, c[2].depth = 6;
+    p.amount = 9000000, p.minDepth = 0, p.maxVSize = 350; // needs three inputs, but only two fit
+    i = BRCoinSelect(c, 4, &p, selected, &sel);
+    if (i != -1 || sel.count != 2 || sel.amount != 8000000)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRCoinSelect() test 4\n", __func__);
+    
+    return r;
+}
+
 int BRBloomFilterTests()
 {
     int r = 1;
@@ -2102,8 +2500,93 @@ int BRMerkleBlockTests()
                     UInt256Reverse(uint256("00000000000080b66c911bd5ba14a74260057311eaeb1982802f7010f1a9f090"))))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParse() test\n", __func__);
 
-    if (! BRMerkleBlockIsValid(b, (uint32_t)time(NULL)))
-        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParse() test\n", __func__);
+    // block 10001 is a bitcoin block, its version selects scrypt which the sha256d proof-of-work doesn't satisfy
+    if (BRMerkleBlockIsValid(b, (uint32_t)time(NULL)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockIsValid() test 0\n", __func__);
+    
+    char genesis[] = // digibyte genesis block header
+    "\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+    "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xad\x0f\x7d\x75\x18\xfc\x1e\x90\xed\x28\xbd\x0e\x44\x4c"
+    "\xcd\x8e\x24\xd9\x46\x88\x35\x57\x05\xed\x21\x42\x00\x6b\x49\xd9\xdd\x72\x6a\x62\xd0\x52\xf0\xff\x0f\x1e"
+    "\x24\x59\x25\x00";
+    BRMerkleBlock *g = BRMerkleBlockParse((uint8_t *)genesis, 80);
+    UInt256 powHash;
+    int gValid = 0;
+
+    if (! UInt256Eq(g->blockHash,
+                    UInt256Reverse(uint256("7497ea1b465eb39f1c8f507bc877078fe016d6fcb6dfad3a64c98dcc6e1e8496"))))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParse() genesis test\n", __func__);
+    
+    if (! BRMerkleBlockIsValid(g, (uint32_t)time(NULL)) || ! UInt256IsZero(g->powHash))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockIsValid() test 1\n", __func__);
+    
+    if (BRMerkleBlockVerifyPoWBatch(&g, &gValid, 1, (uint32_t)time(NULL), 1) != 1 || ! gValid ||
+        ! UInt256Eq(g->powHash,
+                    UInt256Reverse(uint256("00000157e0eb799b685e4f679160afe11152840040e4dc23e3947989b7b6ec80"))))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockVerifyPoWBatch() powHash test\n", __func__);
+    
+    g->nonce++;
+    g->powHash = UINT256_ZERO;
+    
+    if (BRMerkleBlockIsValid(g, (uint32_t)time(NULL)))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockIsValid() test 2\n", __func__);
+    
+    BRMerkleBlockFree(g);
+    
+    // the dispatch table must select the same hash as calling each algorithm directly
+    BRPoWHash(BLOCK_VERSION_SHA256D | 2, (uint8_t *)genesis, &powHash);
+    if (! UInt256Eq(powHash, UInt256Reverse(uint256("7497ea1b465eb39f1c8f507bc877078fe016d6fcb6dfad3a64c98dcc6e1e8496"))))
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWHash() sha256d test\n", __func__);
+    
+    UInt256 md;
+    
+    BRPoWHash(BLOCK_VERSION_QUBIT | 2, (uint8_t *)genesis, &powHash);
+    BRQubit(genesis, (char *)md.u8);
+    if (! UInt256Eq(powHash, md)) r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWHash() qubit test\n", __func__);
+    
+    BRPoWHash(BLOCK_VERSION_SKEIN | 2, (uint8_t *)genesis, &powHash);
+    BRSkein(genesis, (char *)md.u8);
+    if (! UInt256Eq(powHash, md)) r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWHash() skein test\n", __func__);
+    
+    BRPoWHash(BLOCK_VERSION_GROESTL | 2, (uint8_t *)genesis, &powHash);
+    BRGroestl(genesis, (char *)md.u8);
+    if (! UInt256Eq(powHash, md)) r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWHash() groestl test\n", __func__);
+    
+    BRPoWHash(BLOCK_VERSION_ODO | 2, (uint8_t *)genesis, &powHash);
+    BROdocrypt(genesis, 1389388394, md.u8);
+    if (! UInt256Eq(powHash, md)) r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWHash() odo test\n", __func__);
+    
+    if (BRPoWHash(10 << 8, (uint8_t *)genesis, &powHash) || BRPoWAlgoName(10 << 8) != NULL)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPoWHash() unknown algo test\n", __func__);
+    
+    // batch hashes must match hashing each header on its own, across qubit stage chunks
+    char powHeaders[80*20], batchMd[32*20];
+    
+    for (size_t i = 0; i < 20; i++) {
+        memcpy(&powHeaders[80*i], genesis, 80);
+        UInt32SetLE(&powHeaders[80*i + 76], (uint32_t)i);
+    }
+    
+    BRQubit_Batch(powHeaders, batchMd, 20);
+    for (size_t i = 0; i < 20; i++) {
+        BRQubit(&powHeaders[80*i], (char *)md.u8);
+        if (memcmp(&batchMd[32*i], md.u8, 32) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRQubit_Batch() test %zu\n", __func__, i);
+    }
+    
+    BRSkein_Batch(powHeaders, batchMd, 20);
+    for (size_t i = 0; i < 20; i++) {
+        BRSkein(&powHeaders[80*i], (char *)md.u8);
+        if (memcmp(&batchMd[32*i], md.u8, 32) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRSkein_Batch() test %zu\n", __func__, i);
+    }
+    
+    BRGroestl_Batch(powHeaders, batchMd, 20);
+    for (size_t i = 0; i < 20; i++) {
+        BRGroestl(&powHeaders[80*i], (char *)md.u8);
+        if (memcmp(&batchMd[32*i], md.u8, 32) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRGroestl_Batch() test %zu\n", __func__, i);
+    }
     
     if (BRMerkleBlockSerialize(b, block2, sizeof(block2)) != sizeof(block2) ||
         memcmp(block, block2, sizeof(block2)) != 0)
@@ -2131,6 +2614,43 @@ int BRMerkleBlockTests()
     if (! UInt256Eq(txHashes[3], uint256("c9ab658448c10b6921b7a4ce3021eb22ed6bb6a7fde1e5bcc4b1db6615c6abc5")))
         r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockTxHashes() test 4\n", __func__);
     
+    uint8_t headers[81*160];
+    BRMerkleBlock *batch[160];
+    int valid[160];
+    
+    for (size_t i = 0; i < 160; i++) { // enough for several threads, results must match serial parsing and keep order
+        memcpy(&headers[81*i], block, 80);
+        headers[81*i + 80] = 0;
+        UInt32SetLE(&headers[81*i + 76], (uint32_t)i);
+    }
+    
+    if (BRMerkleBlockParseBatch(batch, valid, headers, 81, 160, (uint32_t)time(NULL), 4) > 160)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseBatch() test 0\n", __func__);
+    
+    for (size_t i = 0; i < 160; i++) {
+        BRMerkleBlock *h = BRMerkleBlockParse(&headers[81*i], 81);
+        
+        if (! batch[i] || ! UInt256Eq(batch[i]->blockHash, h->blockHash) || batch[i]->nonce != i ||
+            valid[i] != BRMerkleBlockIsValid(h, (uint32_t)time(NULL)))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseBatch() test %zu\n", __func__, i + 1);
+        
+        BRMerkleBlockFree(h);
+        if (batch[i]) BRMerkleBlockFree(batch[i]);
+    }
+    
+    for (size_t i = 0; i < 160; i++) { // sha256d headers go through the batched double-sha-256
+        UInt32SetLE(&headers[81*i], (UInt32GetLE(&headers[81*i]) & ~BLOCK_VERSION_ALGO) | BLOCK_VERSION_SHA256D);
+    }
+    
+    BRMerkleBlockParseBatch(batch, valid, headers, 81, 160, (uint32_t)time(NULL), 2);
+    
+    for (size_t i = 0; i < 160; i++) {
+        BRPoWHash(BLOCK_VERSION_SHA256D, &headers[81*i], &powHash);
+        if (! batch[i] || ! UInt256Eq(batch[i]->powHash, powHash))
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRMerkleBlockParseBatch() sha256d test %zu\n", __func__, i + 1);
+        if (batch[i]) BRMerkleBlockFree(batch[i]);
+    }
+    
     // TODO: test a block with an odd number of tree rows both at the tx level and merkle node level
 
     // TODO: XXX test BRMerkleBlockVerifyDifficulty()
@@ -2164,9 +2684,9 @@ int TestOdo(uint32_t key, const char* in, char* out) {
     cipher[len] = 1;
     
     Odocrypt_Init(&odo, key);
-    OdoCrypt_Encrypt(&odo, cipher, cipher);
+    Odocrypt_Encrypt(&odo, cipher, cipher);
     
-    char cipher_hex[100] = { '\0' };
+    char cipher_hex[80*2 + 1] = { '\0' };
     for (int i = 0; i < 80; i++) {
         sprintf(&cipher_hex[i*2], "%02x", (uint8_t) cipher[i]);
     }
@@ -2229,6 +2749,23 @@ int BROdocryptTests()
             "a7dd19a7fcdf3b7c0a8da1765553d903ff42687fe2f36c3930b82d7a68e426a90f49f1fc4b06263d"
             "cf95d70a1b436337586955ef61c976f97785da2d2c8144b6767f824d53dd518c2cfdce1e9bd74fe1");
     
+    // cached and caller owned odo states must match a freshly keyed one, also when crossing shapechange intervals
+    BROdocryptContext *ctx = BROdocryptContextNew();
+    uint32_t times[] = { 0, 1563000000, 1563000000 + ODOCRYPT_CHAPECHANGE_INTERVAL, 1563000001 };
+    uint8_t h1[32], h2[32], h3[32];
+    OdoStruct odo;
+    
+    for (size_t i = 0; i < sizeof(times)/sizeof(*times); i++) {
+        BROdocrypt(&test1[i*80], times[i], h1);
+        BROdocryptContextHash(ctx, &test1[i*80], times[i], h2);
+        Odocrypt_Init(&odo, times[i] - times[i] % ODOCRYPT_CHAPECHANGE_INTERVAL);
+        Odocrypt_Hash(&odo, &test1[i*80], &test1[i*80 + 80], (char *)h3);
+        
+        if (memcmp(h1, h3, sizeof(h3)) != 0 || memcmp(h2, h3, sizeof(h3)) != 0)
+            r = 1, fprintf(stderr, "***FAILED*** %s: BROdocryptContextHash() test %zu\n", __func__, i);
+    }
+    
+    BROdocryptContextFree(ctx);
     free(test1);
     
     return !r;
@@ -2672,6 +3209,63 @@ int BRPaymentProtocolEncryptionTests()
 
 void BRPeerAcceptMessageTest(BRPeer *peer, const uint8_t *msg, size_t len, const char *type);
 
+static void BRPeerReactorTestDisconnected(void *info, int error)
+{
+    *(volatile int *)info = (error) ? error : -1;
+}
+
+static void BRPeerTestRelayedBlockHashes(void *info, const UInt256 blockHashes[], size_t blockCount)
+{
+    UInt256 *hashes = info;
+    
+    for (size_t i = 0; i < blockCount && i < 2; i++) hashes[i] = blockHashes[i];
+}
+
+static void BRPeerTestRelayedBlock(void *info, BRMerkleBlock *block)
+{
+    ((UInt256 *)info)[0] = block->blockHash;
+    BRMerkleBlockFree(block);
+}
+
+static void BRPeerTestRelayedHeaders(void *info, size_t headersCount)
+{
+    ((UInt256 *)info)[1].u8[0] = (uint8_t)headersCount;
+}
+
+void BRPeerSetSocketTest(BRPeer *peer, int socket);
+int BRPeerServiceTest(BRPeer *peer);
+
+// writes a message with the given type and payload to buf, returns its length
+static size_t BRPeerTestMessage(uint8_t *buf, const char *type, const uint8_t *payload, size_t len)
+{
+    uint8_t hash[32];
+    
+    UInt32SetLE(&buf[0], BR_CHAIN_PARAMS.magicNumber);
+    memset(&buf[4], 0, 12);
+    strncpy((char *)&buf[4], type, 12);
+    UInt32SetLE(&buf[16], (uint32_t)len);
+    BRSHA256_2(hash, payload, len);
+    memcpy(&buf[20], hash, sizeof(uint32_t));
+    memcpy(&buf[24], payload, len);
+    return 24 + len;
+}
+
+// writes msg to socket and services peer until len bytes it sent back have been read into reply, returns an errno.h
+// code if peer failed, or ETIMEDOUT if the exchange didn't finish
+static int BRPeerTestExchange(BRPeer *peer, int socket, const uint8_t *msg, size_t msgLen, uint8_t *reply, size_t len)
+{
+    ssize_t n;
+    int error = 0;
+    
+    for (int i = 0; i < 1000 && ! error && (i == 0 || msgLen > 0 || len > 0); i++) {
+        if (msgLen > 0 && (n = write(socket, msg, msgLen)) > 0) msg += n, msgLen -= n;
+        error = BRPeerServiceTest(peer);
+        while (len > 0 && (n = read(socket, reply, len)) > 0) reply += n, len -= n;
+    }
+    
+    return (error) ? error : (msgLen > 0 || len > 0) ? ETIMEDOUT : 0;
+}
+
 int BRPeerTests()
 {
     int r = 1;
@@ -2679,6 +3273,378 @@ int BRPeerTests()
     const char msg[] = "my message";
     
     BRPeerAcceptMessageTest(p, (const uint8_t *)msg, sizeof(msg) - 1, "inv");
+    BRPeerFree(p);
+    
+    uint8_t inv[1 + 2*36] = { 2 };
+    UInt256 hashes[2] = { UINT256_ZERO, UINT256_ZERO };
+    
+    for (int i = 0; i < 2; i++) { // inv with two block hashes
+        UInt32SetLE(&inv[1 + i*36], 2);
+        memset(&inv[1 + i*36 + 4], i + 1, sizeof(UInt256));
+    }
+    
+    p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+    BRPeerSetCallbacks(p, hashes, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+    BRPeerSetRelayedBlockHashes(p, BRPeerTestRelayedBlockHashes);
+    BRPeerSendFilterload(p, NULL, 0); // block hashes are only taken once a filter is loaded
+    BRPeerAcceptMessageTest(p, inv, sizeof(inv), "inv");
+    
+    if (hashes[0].u8[0] != 1 || hashes[1].u8[31] != 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSetRelayedBlockHashes() test\n", __func__);
+    
+    BRPeerFree(p);
+    
+    uint8_t headers[1 + 81] = { 1 }; // headers with just the digibyte genesis block header
+    
+    memcpy(&headers[1], "\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+           "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xad\x0f\x7d\x75"
+           "\x18\xfc\x1e\x90\xed\x28\xbd\x0e\x44\x4c\xcd\x8e\x24\xd9\x46\x88\x35\x57\x05\xed"
+           "\x21\x42\x00\x6b\x49\xd9\xdd\x72\x6a\x62\xd0\x52\xf0\xff\x0f\x1e\x24\x59\x25\x00", 80);
+    hashes[0] = hashes[1] = UINT256_ZERO;
+    p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+    BRPeerSetCallbacks(p, hashes, NULL, NULL, NULL, NULL, NULL, NULL, BRPeerTestRelayedBlock, NULL, NULL, NULL, NULL,
+                       NULL);
+    BRPeerSetRelayedHeaders(p, BRPeerTestRelayedHeaders); // fewer than 2000 old headers are then no protocol error
+    BRPeerAcceptMessageTest(p, headers, sizeof(headers), "headers");
+    
+    if (! UInt256Eq(hashes[0],
+                    UInt256Reverse(uint256("7497ea1b465eb39f1c8f507bc877078fe016d6fcb6dfad3a64c98dcc6e1e8496"))) ||
+        hashes[1].u8[0] != 1)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSetRelayedHeaders() test\n", __func__);
+    
+    BRPeerFree(p);
+    
+    BRPeerReactor *reactor = BRPeerReactorNew(1);
+    struct timespec ts = { 0, 1000000 };
+    volatile int error = 0;
+    
+    if (! reactor) r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerReactorNew() test\n", __func__);
+    
+    if (reactor) { // nothing listens on localhost port 1, so the event loop should report the connection refused
+        p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+        p->address = ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, 0x01 });
+        p->port = 1;
+        BRPeerSetCallbacks(p, (void *)&error, NULL, BRPeerReactorTestDisconnected, NULL, NULL, NULL, NULL, NULL, NULL,
+                           NULL, NULL, NULL, NULL);
+        BRPeerSetReactor(p, reactor);
+        BRPeerConnect(p);
+        for (int i = 0; i < 10000 && ! error; i++) nanosleep(&ts, NULL);
+        
+        if (error != ECONNREFUSED)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerReactorNew() connect test\n", __func__);
+        
+        BRPeerFree(p);
+    }
+    
+    int fds[2];
+    
+    // messages framed from a socket, the peer answers each ping it accepts with a pong echoing its payload
+    if (reactor && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        uint8_t *ping = malloc(0x11000), *msg = malloc(0x12000), *pong = malloc(0x12000), *reply = malloc(0x12000);
+        uint8_t magic[4];
+        size_t len = 0, pongLen;
+        
+        assert(ping != NULL && msg != NULL && pong != NULL && reply != NULL);
+        for (size_t i = 0; i < 0x11000; i++) ping[i] = (uint8_t)(i*7);
+        UInt32SetLE(magic, BR_CHAIN_PARAMS.magicNumber);
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+        BRPeerSetReactor(p, reactor); // the peer isn't attached to its event loop, so its sends never wait on the socket
+        BRPeerSetSocketTest(p, fds[0]);
+        
+        // garbage with a partial magic number match before a ping, and the first bytes of a magic number after it
+        memcpy(&msg[len], "xx", 2), len += 2;
+        memcpy(&msg[len], magic, 3), len += 3;
+        msg[len++] = 'y';
+        len += BRPeerTestMessage(&msg[len], MSG_PING, &ping[0], 8);
+        memcpy(&msg[len], magic, 2), len += 2;
+        pongLen = BRPeerTestMessage(pong, MSG_PONG, &ping[0], 8);
+        
+        if (BRPeerTestExchange(p, fds[1], msg, len, reply, pongLen) != 0 || memcmp(reply, pong, pongLen) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerServiceTest() garbage test\n", __func__);
+        
+        // a header split across reads
+        len = BRPeerTestMessage(msg, MSG_PING, &ping[8], 8);
+        pongLen = BRPeerTestMessage(pong, MSG_PONG, &ping[8], 8);
+        
+        if (BRPeerTestExchange(p, fds[1], msg, 10, reply, 0) != 0 || read(fds[1], reply, 1) >= 0 ||
+            BRPeerTestExchange(p, fds[1], &msg[10], len - 10, reply, pongLen) != 0 ||
+            memcmp(reply, pong, pongLen) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerServiceTest() split header test\n", __func__);
+        
+        // two messages in one read
+        len = BRPeerTestMessage(msg, MSG_PING, &ping[16], 8);
+        len += BRPeerTestMessage(&msg[len], MSG_PING, &ping[24], 8);
+        pongLen = BRPeerTestMessage(pong, MSG_PONG, &ping[16], 8);
+        pongLen += BRPeerTestMessage(&pong[pongLen], MSG_PONG, &ping[24], 8);
+        
+        if (BRPeerTestExchange(p, fds[1], msg, len, reply, pongLen) != 0 || memcmp(reply, pong, pongLen) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerServiceTest() two message test\n", __func__);
+        
+        // a payload larger than the 64k a framer starts with
+        len = BRPeerTestMessage(msg, MSG_PING, ping, 0x11000);
+        pongLen = BRPeerTestMessage(pong, MSG_PONG, ping, 0x11000);
+        
+        if (BRPeerTestExchange(p, fds[1], msg, len, reply, pongLen) != 0 || memcmp(reply, pong, pongLen) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerServiceTest() large payload test\n", __func__);
+        
+        // a bad checksum
+        len = BRPeerTestMessage(msg, MSG_PING, &ping[32], 8);
+        msg[20] ^= 0xff;
+        
+        if (BRPeerTestExchange(p, fds[1], msg, len, reply, 0) != EPROTO || read(fds[1], reply, 1) >= 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerServiceTest() checksum test\n", __func__);
+        
+        BRPeerFree(p);
+        close(fds[0]);
+        close(fds[1]);
+        free(ping);
+        free(msg);
+        free(pong);
+        free(reply);
+    }
+    
+    // messages sent to a peer whose socket is full wait in its queue, and go out intact and in order as it drains
+    if (reactor && socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0) {
+        uint8_t payload[0x900], *msg = malloc(0x10000), *reply;
+        size_t len = 0, filled = 0;
+        int size = 0x1000;
+        ssize_t n;
+        
+        assert(msg != NULL);
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+        fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+        memset(payload, 0, sizeof(payload));
+        while (filled < 0x1000000 && (n = write(fds[0], payload, sizeof(payload))) > 0) filled += n;
+        reply = malloc(filled + 0x10000);
+        assert(reply != NULL);
+        p = BRPeerNew(BR_CHAIN_PARAMS.magicNumber);
+        BRPeerSetReactor(p, reactor); // the peer isn't attached to its event loop, so its sends never wait on the socket
+        BRPeerSetSocketTest(p, fds[0]);
+        
+        for (size_t i = 0; i < 12; i++) { // small messages are coalesced while the peer is serviced, larger ones aren't
+            if (i == 8) { // make room in the socket while the first messages are still queued
+                if (BRPeerSendQueueSize(p) == 0)
+                    r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendQueueSize() full socket test\n", __func__);
+                
+                for (size_t j = 0; j < filled && (n = read(fds[1], reply, filled - j)) > 0; j += n);
+            }
+            
+            for (size_t j = 0; j < sizeof(payload); j++) payload[j] = (uint8_t)(i + j);
+            BRPeerSendMessage(p, payload, (i % 2) ? 0x800 + i : 0x10 + i, "test");
+            len += BRPeerTestMessage(&msg[len], "test", payload, (i % 2) ? 0x800 + i : 0x10 + i);
+        }
+        
+        if (BRPeerTestExchange(p, fds[1], NULL, 0, reply, len) != 0 || memcmp(reply, msg, len) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendMessage() send queue test\n", __func__);
+        
+        if (BRPeerSendQueueSize(p) != 0)
+            r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerSendQueueSize() drained test\n", __func__);
+        
+        BRPeerFree(p);
+        close(fds[0]);
+        close(fds[1]);
+        free(msg);
+        free(reply);
+    }
+    
+    if (reactor) BRPeerReactorFree(reactor);
+    return r;
+}
+
+void *BRPeerManagerAddPeerTest(BRPeerManager *manager, BRPeer *peer, uint32_t lastBlock);
+void BRPeerManagerRelayedBlockTest(void *info, BRMerkleBlock *block);
+void BRPeerManagerRelayedHeadersTest(void *info, size_t headersCount);
+void BRPeerManagerUpdateFilterTest(BRPeerManager *manager);
+void BRPeerManagerRequestBlocksTest(BRPeerManager *manager, time_t seconds);
+size_t BRPeerManagerDownloadsTest(BRPeerManager *manager, BRPeer *peers[], size_t peersCount);
+size_t BRPeerManagerHeaderChainTest(BRPeerManager *manager, size_t *start);
+void BRPeerSetConnectedTest(BRPeer *peer);
+void BRPeerAcceptPongTest(BRPeer *peer);
+
+static int BRPeerManagerTestVerifyDifficulty(const BRMerkleBlock *block, const BRMerkleBlock *previous,
+                                             uint32_t transitionTime)
+{
+    return 1;
+}
+
+static BRMerkleBlock *BRPeerManagerTestBlock(UInt256 prevBlock, uint32_t n, uint32_t timestamp)
+{
+    BRMerkleBlock *block = BRMerkleBlockNew();
+    
+    block->prevBlock = prevBlock;
+    block->blockHash.u32[0] = n;
+    block->blockHash.u32[7] = 0x5445535e;
+    block->timestamp = timestamp;
+    block->target = 0x1e0ffff0;
+    block->totalTx = 1;
+    return block;
+}
+
+#define PEER_MANAGER_TEST_BLOCKS 600 // fewer than the most blocks queued at a time
+
+int BRPeerManagerTests()
+{
+    int r = 1;
+    static BRChainParams params; // the manager keeps a pointer to its chain params
+    BRMasterPubKey mpk = BRBIP32MasterPubKey("", 1);
+    BRWallet *w = BRWalletNew(NULL, 0, mpk);
+    const size_t n = PEER_MANAGER_TEST_BLOCKS;
+    uint32_t height = 100000000, timestamp = (uint32_t)time(NULL) - 100000; // past the last checkpoint
+    BRMerkleBlock *start = BRPeerManagerTestBlock(UINT256_ZERO, 1, timestamp), *blocks[PEER_MANAGER_TEST_BLOCKS], *b;
+    BRPeer *peers[3], *queue[PEER_MANAGER_TEST_BLOCKS], *stalled;
+    void *infos[3];
+    size_t i, j, count, headerStart;
+    double progress = 0.0;
+    
+    params = BR_CHAIN_PARAMS;
+    params.verifyDifficulty = BRPeerManagerTestVerifyDifficulty;
+    start->height = height;
+    
+    for (i = 0, b = start; i < n; i++) { // the chain to sync, from just after start
+        blocks[i] = BRPeerManagerTestBlock(b->blockHash, (uint32_t)i + 2, timestamp + (uint32_t)i + 1);
+        b = blocks[i];
+    }
+    
+    BRPeerManager *manager = BRPeerManagerNewEx(&params, w, 0, NULL, 0, NULL, 0, start);
+    
+    BRPeerManagerSetParallelDownload(manager, 1);
+    
+    for (i = 0; i < 3; i++) { // the first peer is the download peer, the others download alongside it
+        peers[i] = BRPeerNew(params.magicNumber);
+        peers[i]->address = ((UInt128) { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0x7f, 0x00, 0x00, i + 1 });
+        peers[i]->port = params.standardPort;
+        BRPeerSetConnectedTest(peers[i]);
+        infos[i] = BRPeerManagerAddPeerTest(manager, peers[i], height + (uint32_t)n);
+    }
+    
+    if (BRPeerManagerSyncProgress(manager, 0) > 0.01)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerSyncProgress() test 1\n", __func__);
+    
+    for (i = 0; i < n; i++) { // headers
+        b = BRMerkleBlockCopy(blocks[i]);
+        b->totalTx = 0;
+        BRPeerManagerRelayedBlockTest(infos[0], b);
+    }
+    
+    BRPeerManagerRelayedHeadersTest(infos[0], n);
+    count = BRPeerManagerDownloadsTest(manager, queue, n);
+    
+    if (BRPeerManagerHeaderChainTest(manager, NULL) != n || count != n)
+        r = 0, fprintf(stderr, "***FAILED*** %s: header chain test\n", __func__);
+    
+    // the first blocks are handed out to the peers in consecutive ranges, one each
+    for (i = 0; i < 3*128 && count == n; i++) {
+        if (queue[i] == queue[i - i % 128]) continue;
+        r = 0, fprintf(stderr, "***FAILED*** %s: download ranges test\n", __func__);
+        break;
+    }
+    
+    if (count != n || ! queue[0] || ! queue[128] || ! queue[256] || queue[0] == queue[128] ||
+        queue[0] == queue[256] || queue[128] == queue[256] || queue[3*128])
+        r = 0, fprintf(stderr, "***FAILED*** %s: download peers test\n", __func__);
+    
+    // verified headers ahead of the chain count for a tenth of the sync
+    progress = BRPeerManagerSyncProgress(manager, 0);
+    
+    if (progress < 0.09 || progress > 0.11)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerSyncProgress() test 2\n", __func__);
+    
+    for (j = 0; j < 3 && peers[j] != queue[1]; j++);
+    if (j < 3) BRPeerManagerRelayedBlockTest(infos[j], BRMerkleBlockCopy(blocks[1]));
+    
+    if (BRPeerManagerLastBlockHeight(manager) != height)
+        r = 0, fprintf(stderr, "***FAILED*** %s: out of order block test 1\n", __func__);
+    
+    for (j = 0; j < 3 && peers[j] != queue[0]; j++);
+    if (j < 3) BRPeerManagerRelayedBlockTest(infos[j], BRMerkleBlockCopy(blocks[0]));
+    
+    if (BRPeerManagerLastBlockHeight(manager) != height + 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: out of order block test 2\n", __func__);
+    
+    // the oldest outstanding block taking too long is requested from another peer
+    BRPeerManagerDownloadsTest(manager, queue, n);
+    stalled = queue[0];
+    BRPeerManagerRequestBlocksTest(manager, 60);
+    BRPeerManagerDownloadsTest(manager, queue, n);
+    
+    if (! stalled || ! queue[0] || queue[0] == stalled)
+        r = 0, fprintf(stderr, "***FAILED*** %s: stalled download test\n", __func__);
+    
+    // a filter update drops the queue, and blocks requested before it are dropped when they arrive
+    BRPeerManagerUpdateFilterTest(manager);
+    
+    if (BRPeerManagerDownloadsTest(manager, queue, n) != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: filter update test 1\n", __func__);
+    
+    BRPeerManagerRelayedBlockTest(infos[1], BRMerkleBlockCopy(blocks[2]));
+    
+    if (BRPeerManagerLastBlockHeight(manager) != height + 2)
+        r = 0, fprintf(stderr, "***FAILED*** %s: filter update test 2\n", __func__);
+    
+    // once the peers have loaded the new filter, the missing blocks are queued again from the header chain
+    BRPeerAcceptPongTest(peers[0]);
+    for (i = 0; i < 3; i++) BRPeerAcceptPongTest(peers[i]);
+    count = BRPeerManagerDownloadsTest(manager, queue, n);
+    
+    if (count != n - 2 || ! queue[0])
+        r = 0, fprintf(stderr, "***FAILED*** %s: filter update test 3\n", __func__);
+    
+    // deliver each peer's blocks last to first, so they're held until the ones before them arrive
+    for (i = 0; i < 1000 && BRPeerManagerLastBlockHeight(manager) < height + n; i++) {
+        uint32_t last = BRPeerManagerLastBlockHeight(manager);
+        
+        count = BRPeerManagerDownloadsTest(manager, queue, n);
+        
+        if (progress < 0.5 && last >= height + n/2) { // filtered blocks count for the other nine tenths
+            double expected = 0.1 + 0.9*(last - height - 1)/(n - 1);
+            
+            progress = BRPeerManagerSyncProgress(manager, 0);
+            
+            if (progress < expected - 0.01 || progress > expected + 0.01)
+                r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerSyncProgress() test 3\n", __func__);
+        }
+        
+        while (count > 0) {
+            count--;
+            for (j = 0; j < 3 && (! queue[count] || peers[j] != queue[count]); j++);
+            if (j < 3) BRPeerManagerRelayedBlockTest(infos[j], BRMerkleBlockCopy(blocks[last - height + count]));
+        }
+    }
+    
+    if (BRPeerManagerLastBlockHeight(manager) != height + n)
+        r = 0, fprintf(stderr, "***FAILED*** %s: parallel download test\n", __func__);
+    
+    if (BRPeerManagerSyncProgress(manager, 0) < 1.0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: BRPeerManagerSyncProgress() test 4\n", __func__);
+    
+    // header hashes are dropped from the header chain once the blocks are in the chain
+    count = BRPeerManagerHeaderChainTest(manager, &headerStart);
+    
+    if (count >= n || headerStart != count)
+        r = 0, fprintf(stderr, "***FAILED*** %s: header chain trim test\n", __func__);
+    
+    // a header building on an earlier block than the header chain's tip starts the header chain over from there
+    b = BRPeerManagerTestBlock(blocks[n - 1]->blockHash, (uint32_t)n + 2, timestamp + (uint32_t)n + 1);
+    b->totalTx = 0;
+    BRPeerManagerRelayedBlockTest(infos[0], b);
+    b = BRPeerManagerTestBlock(b->blockHash, (uint32_t)n + 3, timestamp + (uint32_t)n + 2);
+    b->totalTx = 0;
+    BRPeerManagerRelayedBlockTest(infos[0], b);
+    count = BRPeerManagerHeaderChainTest(manager, &headerStart);
+    b = BRPeerManagerTestBlock(blocks[n - 2]->blockHash, (uint32_t)n + 4, timestamp + (uint32_t)n + 3);
+    b->totalTx = 0;
+    BRPeerManagerRelayedBlockTest(infos[0], b);
+    
+    if (count != headerStart + 2 || BRPeerManagerHeaderChainTest(manager, &headerStart) != 1 || headerStart != 0)
+        r = 0, fprintf(stderr, "***FAILED*** %s: header chain fork test\n", __func__);
+    
+    BRPeerManagerFree(manager);
+    for (i = 0; i < 3; i++) free(infos[i]);
+    for (i = 0; i < n; i++) BRMerkleBlockFree(blocks[i]);
+    BRWalletFree(w);
     return r;
 }
 
@@ -2724,10 +3690,14 @@ int BRRunTests()
     printf("%s\n", (BRTransactionTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRWalletTests...                    ");
     printf("%s\n", (BRWalletTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRCoinSelectionTests...             ");
+    printf("%s\n", (BRCoinSelectionTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRBloomFilterTests...               ");
     printf("%s\n", (BRBloomFilterTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRMerkleBlockTests...               ");
     printf("%s\n", (BRMerkleBlockTests()) ? "success" : (fail++, "***FAIL***"));
+    printf("BRPeerManagerTests...               ");
+    printf("%s\n", (BRPeerManagerTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolTests...           ");
     printf("%s\n", (BRPaymentProtocolTests()) ? "success" : (fail++, "***FAIL***"));
     printf("BRPaymentProtocolEncryptionTests... ");
@@ -2742,6 +3712,285 @@ int BRRunTests()
     return (fail == 0);
 }
 
+// headers/s for each proof-of-work algorithm on a single thread
+void BRPoWBenchmarks()
+{
+    uint8_t header[80];
+    UInt256 powHash;
+    
+    for (size_t i = 0; i < sizeof(header); i++) header[i] = (uint8_t)(i*7 + 1);
+    
+    for (uint32_t algo = 0; algo <= BLOCK_VERSION_ALGO; algo += (1 << 8)) {
+        if (! BRPoWAlgoName(algo)) continue;
+        
+        size_t count = 0;
+        clock_t start = clock(), elapsed;
+        
+        do { // run each algorithm for at least half a second
+            UInt32SetLE(&header[76], (uint32_t)count++);
+            BRPoWHash(algo, header, &powHash);
+            elapsed = clock() - start;
+        } while (elapsed < CLOCKS_PER_SEC/2);
+        
+        printf("%-8s %12.0f headers/s\n", BRPoWAlgoName(algo), (double)count*CLOCKS_PER_SEC/elapsed);
+    }
+}
+
+// headers/s for the skein, groestl and qubit batch hashes
+void BRPoWBatchBenchmarks()
+{
+    size_t count = 4096;
+    char *headers = malloc(count*80), *md = malloc(count*32);
+    void (*batch[])(const char *, char *, size_t) = { BRSkein_Batch, BRGroestl_Batch, BRQubit_Batch };
+    void (*single[])(const char *, char *) = { BRSkein, BRGroestl, BRQubit };
+    const char *names[] = { "skein", "groestl", "qubit" };
+    clock_t start, elapsed;
+    
+    for (size_t i = 0; i < count*80; i++) headers[i] = (char)(i % 80*7 + 1);
+    for (size_t i = 0; i < count; i++) UInt32SetLE(&headers[i*80 + 76], (uint32_t)i);
+    
+    for (size_t a = 0; a < sizeof(names)/sizeof(*names); a++) {
+        start = clock();
+        for (size_t i = 0; i < count; i++) single[a](&headers[i*80], &md[i*32]);
+        elapsed = clock() - start;
+        printf("%-8s %12.0f headers/s single", names[a], (double)count*CLOCKS_PER_SEC/elapsed);
+        start = clock();
+        batch[a](headers, md, count);
+        elapsed = clock() - start;
+        printf(", %12.0f headers/s batch\n", (double)count*CLOCKS_PER_SEC/elapsed);
+    }
+    
+    free(headers);
+    free(md);
+}
+
+// qubit headers/s with the portable echo/shavite code and with aes-ni
+void BRQubitBenchmarks()
+{
+    char header[80], md[32];
+    
+    for (size_t i = 0; i < sizeof(header); i++) header[i] = (char)(i*7 + 1);
+    
+    for (int aesni = 0; aesni < 2; aesni++) {
+        if (aesni && ! (sph_echo_aesni(1) && sph_shavite_aesni(1))) {
+            printf("qubit    aes-ni not supported\n");
+            break;
+        }
+        
+        sph_echo_aesni(aesni);
+        sph_shavite_aesni(aesni);
+        
+        size_t count = 0;
+        clock_t start = clock(), elapsed;
+        
+        do {
+            UInt32SetLE(&header[76], (uint32_t)count++);
+            BRQubit(header, md);
+            elapsed = clock() - start;
+        } while (elapsed < CLOCKS_PER_SEC/2);
+        
+        printf("qubit    %12.0f headers/s%s\n", (double)count*CLOCKS_PER_SEC/elapsed, (aesni) ? " aes-ni" : "");
+    }
+}
+
+// double-sha-256 headers/s, one at a time and batched, for each sha-256 backend the cpu supports
+void BRSHA256Benchmarks()
+{
+    static const char *impls[] = { "portable", "simd", "avx2", "sha-ni" };
+    size_t count = 4096;
+    uint8_t *headers = malloc(count*80), *md = malloc(count*32);
+    const void **data = malloc(count*sizeof(*data));
+    size_t *len = malloc(count*sizeof(*len));
+    clock_t start;
+    
+    for (size_t i = 0; i < count*80; i++) headers[i] = (uint8_t)(i*7 + 1);
+    for (size_t i = 0; i < count; i++) data[i] = &headers[i*80], len[i] = 80;
+    
+    for (int impl = 0; impl < 4; impl++) {
+        if (BRSHA256Impl(impl) != impl) continue;
+        start = clock();
+        for (size_t i = 0; i < count*16; i++) BRSHA256_2(md, &headers[(i % count)*80], 80);
+        printf("BRSHA256_2()       %-8s %10.0f headers/s\n", impls[impl],
+               (double)count*16*CLOCKS_PER_SEC/(clock() - start));
+        start = clock();
+        for (size_t i = 0; i < 16; i++) BRSHA256_2_Batch(md, data, len, count);
+        printf("BRSHA256_2_Batch() %-8s %10.0f headers/s\n", impls[impl],
+               (double)count*16*CLOCKS_PER_SEC/(clock() - start));
+    }
+    
+    free(headers);
+    free(md);
+    free(data);
+    free(len);
+}
+
+// hashes/s of 80 byte messages for luffa-512 and simd-512 with the portable code, sse2 and avx2
+void BRLuffaSimdBenchmarks()
+{
+    static const char *paths[] = { "portable", "sse2", "avx2" };
+    uint8_t msg[80], md[64];
+    
+    for (size_t i = 0; i < sizeof(msg); i++) msg[i] = (uint8_t)(i*7 + 1);
+    
+    for (int algo = 0; algo < 2; algo++) {
+        for (int path = 0; path < 3; path++) {
+            if ((algo == 0 ? sph_luffa_simd(path) : sph_simd_vector(path)) != path) continue;
+            
+            size_t count = 0;
+            clock_t start = clock(), elapsed;
+            
+            do {
+                if (algo == 0) {
+                    sph_luffa512_context luffa;
+                    
+                    sph_luffa512_init(&luffa);
+                    sph_luffa512(&luffa, msg, sizeof(msg));
+                    sph_luffa512_close(&luffa, md);
+                }
+                else {
+                    sph_simd512_context simd;
+                    
+                    sph_simd512_init(&simd);
+                    sph_simd512(&simd, msg, sizeof(msg));
+                    sph_simd512_close(&simd, md);
+                }
+                
+                msg[0] = md[0];
+                count++;
+                elapsed = clock() - start;
+            } while (elapsed < CLOCKS_PER_SEC/2);
+            
+            printf("%s %-8s %12.0f hashes/s\n", (algo == 0) ? "luffa512" : "simd512 ", paths[path],
+                   (double)count*CLOCKS_PER_SEC/elapsed);
+        }
+    }
+}
+
+// headers/s for the generic scrypt, the header fast path and the simd batch
+void BRScryptBenchmarks()
+{
+    size_t count = 256;
+    uint8_t *headers = malloc(count*80), *md = malloc(count*32);
+    clock_t start;
+    
+    for (size_t i = 0; i < count*80; i++) headers[i] = (uint8_t)(i*7 + 1);
+    start = clock();
+    
+    for (size_t i = 0; i < count; i++) {
+        BRScrypt(&md[i*32], 32, &headers[i*80], 80, &headers[i*80], 80, 1024, 1, 1);
+    }
+    
+    printf("BRScrypt()                %8.0f headers/s\n", (double)count*CLOCKS_PER_SEC/(clock() - start));
+    start = clock();
+    for (size_t i = 0; i < count; i++) BRScrypt_1024_1_1(&md[i*32], &headers[i*80]);
+    printf("BRScrypt_1024_1_1()       %8.0f headers/s\n", (double)count*CLOCKS_PER_SEC/(clock() - start));
+    start = clock();
+    BRScrypt_1024_1_1_Batch(md, headers, count, NULL);
+    printf("BRScrypt_1024_1_1_Batch() %8.0f headers/s\n", (double)count*CLOCKS_PER_SEC/(clock() - start));
+    free(headers);
+    free(md);
+}
+
+// inputs signed per second for a 500 input transaction, on one thread and on one per cpu
+void BRTransactionSignBenchmarks()
+{
+    UInt256 secret = uint256("0000000000000000000000000000000000000000000000000000000000000001"),
+            inHash = uint256("0000000000000000000000000000000000000000000000000000000000000001");
+    BRKey key;
+    BRAddress address;
+    size_t count = 500, threads[] = { 1, 0 };
+    
+    BRKeySetSecret(&key, &secret, 1);
+    BRKeyAddress(&key, address.s, sizeof(address));
+    
+    uint8_t script[BRAddressScriptPubKey(NULL, 0, address.s)];
+    size_t scriptLen = BRAddressScriptPubKey(script, sizeof(script), address.s);
+    
+    for (size_t t = 0; t < sizeof(threads)/sizeof(*threads); t++) {
+        BRTransaction *tx = BRTransactionNew();
+        struct timespec start, end;
+        
+        for (size_t i = 0; i < count; i++) {
+            BRTransactionAddInput(tx, inHash, (uint32_t)i, 1, script, scriptLen, NULL, 0, NULL, 0, TXIN_SEQUENCE);
+        }
+        
+        BRTransactionAddOutput(tx, 1000000, script, scriptLen);
+        clock_gettime(CLOCK_MONOTONIC, &start); // wall time, clock() would add up the cpu time of every thread
+        BRTransactionSignBatch(tx, 0, &key, 1, threads[t]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        printf("BRTransactionSignBatch() %s %8.0f inputs/s\n", (threads[t] == 1) ? "1 thread  " : "all cpus  ",
+               count/((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9));
+        BRTransactionFree(tx);
+    }
+}
+
+// time and result of each coin selection strategy on synthetic wallets of 10k and 100k outputs
+void BRCoinSelectionBenchmarks()
+{
+    static const char *names[] = { "largest first", "branch and bound", "knapsack", "BRCoinSelect()" };
+    int (*select[])(const BRCoinCandidate *, size_t, const BRCoinSelectionParams *, size_t *, BRCoinSelection *) =
+        { BRCoinSelectLargestFirst, BRCoinSelectBranchAndBound, BRCoinSelectKnapsack, BRCoinSelect };
+    static const uint64_t amounts[] = { 10000000, 123456789, 2500000000 };
+    size_t counts[] = { 10000, 100000 };
+    
+    for (size_t n = 0; n < 2; n++) {
+        BRCoinCandidate *c = malloc(counts[n]*sizeof(*c));
+        size_t *selected = malloc(counts[n]*sizeof(*selected));
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        
+        for (size_t i = 0; i < counts[n]; i++) {
+            seed ^= seed >> 12, seed ^= seed << 25, seed ^= seed >> 27;
+            c[i] = (BRCoinCandidate) { 10000 + (seed*0x2545f4914f6cdd1dULL) % 10000000, 148, 6, 0 };
+        }
+        
+        for (size_t a = 0; a < sizeof(amounts)/sizeof(*amounts); a++) {
+            BRCoinSelectionParams p = { amounts[a], 10 + 34, 34, 1000, 546, 100000, 0, 1 };
+            
+            for (int s = 0; s < 4; s++) {
+                BRCoinSelection sel = { 0, 0, 0, 0, 0 };
+                clock_t start = clock();
+                int i = select[s](c, counts[n], &p, selected, &sel);
+                
+                printf("%6zu outputs %11"PRIu64" %-16s %2d %5zu inputs fee %8"PRIu64" change %10"PRIu64" %8.3fs\n",
+                       counts[n], amounts[a], names[s], i, sel.count, sel.fee, sel.change,
+                       (double)(clock() - start)/CLOCKS_PER_SEC);
+            }
+        }
+        
+        free(c);
+        free(selected);
+    }
+}
+
+int BRRunBenchmarks()
+{
+    printf("BRPoWBenchmarks...\n");
+    BRPoWBenchmarks();
+    printf("\n");
+    printf("BRQubitBenchmarks...\n");
+    BRQubitBenchmarks();
+    printf("\n");
+    printf("BRSHA256Benchmarks...\n");
+    BRSHA256Benchmarks();
+    printf("\n");
+    printf("BRLuffaSimdBenchmarks...\n");
+    BRLuffaSimdBenchmarks();
+    printf("\n");
+    printf("BRPoWBatchBenchmarks...\n");
+    BRPoWBatchBenchmarks();
+    printf("\n");
+    printf("BRScryptBenchmarks...\n");
+    BRScryptBenchmarks();
+    printf("\n");
+    printf("BRTransactionSignBenchmarks...\n");
+    BRTransactionSignBenchmarks();
+    printf("\n");
+    printf("BRCoinSelectionBenchmarks...\n");
+    BRCoinSelectionBenchmarks();
+    printf("\n");
+    return 1;
+}
+
 #ifndef BITCOIN_TEST_NO_MAIN
 void syncStarted(void *info)
 {
@@ -2762,6 +4011,8 @@ int main(int argc, const char *argv[])
 {
     int r = BRRunTests();
     
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) BRRunBenchmarks();
+    
 //    int err = 0;
 //    UInt512 seed = UINT512_ZERO;
 //    BRMasterPubKey mpk = BR_MASTER_PUBKEY_NONE;